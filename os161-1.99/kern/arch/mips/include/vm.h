@@ -117,9 +117,12 @@ struct tlbshootdown {
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
-	vaddr_t ts_vaddr;
+	vaddr_t ts_vaddr;		/* or TS_VADDR_ALL */
 };
 
+/* ts_vaddr value asking for the whole TLB to be flushed. */
+#define TS_VADDR_ALL 0
+
 #define TLBSHOOTDOWN_MAX 16
 
 
@@ -31,11 +31,13 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 
 /*
@@ -81,6 +83,14 @@ syscall(struct trapframe *tf)
 {
 	int callno;
 	int32_t retval;
+	off_t retval64;
+	bool use64;
+	int whence;
+	off_t pos;
+	uint32_t cfrargs[2];
+#if OPT_A3
+	int fd;
+#endif
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -99,6 +109,7 @@ syscall(struct trapframe *tf)
 	 */
 
 	retval = 0;
+	use64 = false;
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -110,12 +121,164 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 #ifdef UW
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (size_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (size_t)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+	case SYS_pread:
+	  /* the 64-bit pos does not fit in a3 and goes on the stack */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_pread((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (size_t)tf->tf_a2,
+			  pos,
+			  (int *)(&retval));
+	  break;
+	case SYS_pwrite:
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_pwrite((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (size_t)tf->tf_a2,
+			   pos,
+			   (int *)(&retval));
+	  break;
+	case SYS_pipe:
+	  err = sys_pipe((userptr_t)tf->tf_a0, (int *)(&retval));
+	  break;
+	case SYS_copy_file_range:
+	  /* len and flags are the fifth and sixth words, on the stack */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &cfrargs,
+		       sizeof(cfrargs));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_copy_file_range((int)tf->tf_a0,
+				    (userptr_t)tf->tf_a1,
+				    (int)tf->tf_a2,
+				    (userptr_t)tf->tf_a3,
+				    (size_t)cfrargs[0],
+				    (unsigned)cfrargs[1],
+				    (int *)(&retval));
+	  break;
+	case SYS_ioctl:
+	  err = sys_ioctl((int)tf->tf_a0,
+			  (int)tf->tf_a1,
+			  (userptr_t)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
 			  (userptr_t)tf->tf_a1,
 			  (int)tf->tf_a2,
 			  (int *)(&retval));
 	  break;
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)(&retval));
+	  break;
+	case SYS_preadv:
+	  /* pos goes on the stack as for pread */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_preadv((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   pos,
+			   (int *)(&retval));
+	  break;
+	case SYS_pwritev:
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_pwritev((int)tf->tf_a0,
+			    (userptr_t)tf->tf_a1,
+			    (int)tf->tf_a2,
+			    pos,
+			    (int *)(&retval));
+	  break;
+	case SYS_getdirentry:
+	  err = sys_getdirentry((int)tf->tf_a0,
+				(userptr_t)tf->tf_a1,
+				(size_t)tf->tf_a2,
+				(int *)(&retval));
+	  break;
+	case SYS_getdents:
+	  err = sys_getdents((int)tf->tf_a0,
+			     (userptr_t)tf->tf_a1,
+			     (size_t)tf->tf_a2,
+			     (int *)(&retval));
+	  break;
+	case SYS_lseek:
+	  /* pos is aligned into a2/a3 (high word first); whence is on the stack */
+	  pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &whence, sizeof(whence));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)tf->tf_a0, pos, whence, &retval64);
+	  use64 = true;
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int *)(&retval));
+	  break;
+#if OPT_A3
+	case SYS_mmap:
+	  /* fd is at sp+16; the 64-bit offset is aligned to sp+24 */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	  if (err) {
+	    break;
+	  }
+	  err = copyin((const_userptr_t)(tf->tf_sp + 24), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_mmap((userptr_t)tf->tf_a0,
+			 (size_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int)tf->tf_a3,
+			 fd,
+			 pos,
+			 (vaddr_t *)(&retval));
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+	case SYS_msync:
+	  err = sys_msync((userptr_t)tf->tf_a0,
+			  (size_t)tf->tf_a1,
+			  (int)tf->tf_a2);
+	  break;
+#endif
 	case SYS__exit:
 	  sys__exit((int)tf->tf_a0);
 	  /* sys__exit does not return, execution should not get here */
@@ -159,7 +322,14 @@ syscall(struct trapframe *tf)
 	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		if (use64) {
+			/* 64-bit results come back in v0 (high) and v1 (low) */
+			tf->tf_v0 = (uint32_t)(retval64 >> 32);
+			tf->tf_v1 = (uint32_t)retval64;
+		}
+		else {
+			tf->tf_v0 = retval;
+		}
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -29,15 +29,24 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
+#include <vnode.h>
 #include <vm.h>
+#include <uio.h>
 #include <array.h>
+#include <thread.h>
+#include <synch.h>
+#include <uw-vmstats.h>
 #include "opt-A3.h"
 
 /*
@@ -59,6 +68,86 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 	paddr_t frame_offset = 0;
 	vaddr_t coremap;
 	unsigned int frames = 0; 
+
+	/*
+	 * Page table entry for a page that has never been written. It is
+	 * backed by the shared, read-only zero frame until the first write
+	 * fault gives it a frame of its own.
+	 */
+	#define PTE_ZERO (-1)
+	static int zero_frame;
+
+	/*
+	 * Pool of frames that have already been zeroed, so that a first
+	 * write fault does not have to zero a page itself. The zeroer
+	 * thread refills the pool up to ZEROPOOL_MAX whenever it drops
+	 * below ZEROPOOL_LOW. zeroer_idle is set while it is waiting to
+	 * be woken.
+	 */
+	#define ZEROPOOL_MAX 32
+	#define ZEROPOOL_LOW 8
+	static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+	static int zeropool[ZEROPOOL_MAX];
+	static unsigned zeropool_count = 0;
+	static bool zeroer_idle = false;
+	static struct semaphore *zeroer_sem;
+
+	/*
+	 * Reverse map: for each frame that belongs to a user page, the
+	 * page table entry that points at it, the address space that
+	 * owns it, and the virtual address it is mapped at. Kernel
+	 * frames, the zero frame, and zero pool frames have a NULL
+	 * rm_pte and cannot be moved by compaction. Protected by
+	 * coremap_lock.
+	 */
+	struct rmap_entry {
+		int *rm_pte;
+		struct addrspace *rm_as;
+		vaddr_t rm_vaddr;
+		unsigned rm_pins;	/* vm_pinpage holds; don't move */
+	};
+	static struct rmap_entry *coremap_rmap;
+
+	/*
+	 * For each CPU, the address space whose mappings its TLB may
+	 * hold: the one it last activated, since as_activate flushes the
+	 * TLB. Written only by the CPU itself, with interrupts off and
+	 * before the flush, so any other CPU that does not find an
+	 * address space here knows this TLB holds none of its mappings
+	 * and can gain new ones only through vm_fault.
+	 */
+	static struct addrspace *tlb_owner[MAXCPUS];
+
+	/*
+	 * Shared text cache. Each entry holds the frames of the loaded,
+	 * read-only code segment of one executable, keyed by its vnode.
+	 * Every address space running that executable maps the same
+	 * frames; the entry and its frames go away when the last one is
+	 * destroyed. Shared frames have no rmap entry, so compaction
+	 * leaves them alone. Writing to the executable takes the entry
+	 * off the list, so later execs load the new code; processes
+	 * already running keep the old. Protected by sharedtext_lock.
+	 */
+	struct sharedtext {
+		struct vnode *st_vnode;		/* executable (referenced) */
+		vaddr_t st_vbase;		/* base of the code segment */
+		size_t st_npages;		/* its size in pages */
+		int *st_frames;			/* frame indices, or PTE_ZERO */
+		unsigned st_refcount;		/* address spaces using it */
+		bool st_listed;			/* on sharedtext_list */
+		struct sharedtext *st_next;
+	};
+	static struct lock *sharedtext_lock;
+	static struct sharedtext *sharedtext_list = NULL;
+
+	/* File mappings; see as_mmap below. */
+	static struct lock *mmapobj_lock;
+
+	static paddr_t getppages(unsigned long npages);
+	static void zeroer_thread(void *unused1, unsigned long unused2);
+	static int mmap_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress);
+
+	#define COREMAP(i) (*(int *)(coremap + (i)*sizeof(int)))
 #endif
 
 void
@@ -69,18 +158,114 @@ vm_bootstrap(void)
 		paddr_t high;
 		ram_getsize(&low, &high);
 		frames = (high - low) / PAGE_SIZE;
-		int coremap_frames = ROUNDUP((frames*sizeof(int)) / PAGE_SIZE, 8);
+		size_t entry_size = sizeof(int) + sizeof(struct rmap_entry);
+		int coremap_frames = DIVROUNDUP(frames*entry_size, PAGE_SIZE);
 		frames = frames - coremap_frames; 
 		coremap = (vaddr_t)PADDR_TO_KVADDR(low);
+		coremap_rmap = (struct rmap_entry *)(coremap + frames*sizeof(int));
 		for (unsigned int i = 0; i < frames; i++) {
 			int *tmp = (int *)(coremap+i*sizeof(int));
 			*tmp = 0;
+			coremap_rmap[i].rm_pte = NULL;
+			coremap_rmap[i].rm_as = NULL;
+			coremap_rmap[i].rm_vaddr = 0;
+			coremap_rmap[i].rm_pins = 0;
 		}
-		frame_offset = ROUNDUP(low + frames*sizeof(int), PAGE_SIZE);
+		frame_offset = ROUNDUP(low + frames*entry_size, PAGE_SIZE);
 		coremap_ready = true;
+
+		vmstats_init();
+
+		paddr_t zpa = getppages(1);
+		if (zpa == 0) {
+			panic("dumbvm: no memory for the zero frame\n");
+		}
+		bzero((void *)PADDR_TO_KVADDR(zpa), PAGE_SIZE);
+		zero_frame = (zpa - frame_offset) / PAGE_SIZE;
+
+		sharedtext_lock = lock_create("sharedtext");
+		if (sharedtext_lock == NULL) {
+			panic("dumbvm: cannot create shared text lock\n");
+		}
+		mmapobj_lock = lock_create("mmapobj");
+		if (mmapobj_lock == NULL) {
+			panic("dumbvm: cannot create mmap object lock\n");
+		}
+
+		zeroer_sem = sem_create("zeroer", 0);
+		if (zeroer_sem == NULL) {
+			panic("dumbvm: cannot create zeroer semaphore\n");
+		}
+		if (thread_fork("zeroer", NULL, zeroer_thread, NULL, 0)) {
+			panic("dumbvm: cannot start zeroer thread\n");
+		}
 	#endif
 }
 
+#if OPT_A3
+/*
+ * Find and mark npages contiguous free coremap entries. Returns 0 if
+ * there is no such run.
+ */
+static
+paddr_t
+coremap_getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	spinlock_acquire(&coremap_lock);
+	addr = 0;
+	for (unsigned int i = 0; i < frames; i++) {
+		bool found = true;
+		for (unsigned int j = 0; j < npages && j < frames-i; j++) {
+			if (*((int *)(coremap+(i+j)*sizeof(int))) != 0) {
+				found = false;
+				int k = 0;
+				while (*((int *)(coremap+(i+j+k+1)*sizeof(int))) != 0) {
+					k++;
+				}
+				i = i+j+k;
+				break;
+			}
+		}
+		if (found) {
+			for (unsigned int j = 0; j < npages; j++) {
+				*((int *)(coremap+(i+j)*sizeof(int))) = j+1;
+			}
+			addr = frame_offset + i * PAGE_SIZE;
+			break;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	return addr;
+}
+
+/*
+ * Give every frame in the zero pool back to the coremap. Called when
+ * memory is short; returns the number of frames released.
+ */
+static
+unsigned
+zeropool_drain(void)
+{
+	int drained[ZEROPOOL_MAX];
+	unsigned n;
+
+	spinlock_acquire(&zeropool_lock);
+	n = zeropool_count;
+	for (unsigned i = 0; i < n; i++) {
+		drained[i] = zeropool[i];
+	}
+	zeropool_count = 0;
+	spinlock_release(&zeropool_lock);
+
+	for (unsigned i = 0; i < n; i++) {
+		free_kpages(PADDR_TO_KVADDR(frame_offset + drained[i] * PAGE_SIZE));
+	}
+	return n;
+}
+#endif
+
 static
 paddr_t
 getppages(unsigned long npages)
@@ -96,30 +281,10 @@ getppages(unsigned long npages)
 	#if OPT_A3
     	}
 		else {
-			spinlock_acquire(&coremap_lock);
-			addr = 0;
-			for (unsigned int i = 0; i < frames; i++) {
-				bool found = true;
-				for (unsigned int j = 0; j < npages && j < frames-i; j++) {
-					if (*((int *)(coremap+(i+j)*sizeof(int))) != 0) {
-						found = false;
-						int k = 0;
-						while (*((int *)(coremap+(i+j+k+1)*sizeof(int))) != 0) {
-							k++;
-						}
-						i = i+j+k;
-						break;
-					}
-				}
-				if (found) {
-					for (unsigned int j = 0; j < npages; j++) {
-						*((int *)(coremap+(i+j)*sizeof(int))) = j+1;
-					}
-					addr = frame_offset + i * PAGE_SIZE;
-					break;
-				}
+			addr = coremap_getppages(npages);
+			if (addr == 0 && zeropool_drain() > 0) {
+				addr = coremap_getppages(npages);
 			}
-			spinlock_release(&coremap_lock);
 		}
 	#endif
 		return addr;
@@ -148,6 +313,7 @@ free_kpages(vaddr_t addr)
 			int counter = 1;
 			while(*(int *)(coremap + index*sizeof(int)) == counter) {
 				*(int *)(coremap + index*sizeof(int)) = 0;
+				coremap_rmap[index].rm_pte = NULL;
 				index++;
 				counter++;
 			}
@@ -159,182 +325,1734 @@ free_kpages(vaddr_t addr)
 	#endif
 }
 
+#if OPT_A3
+/*
+ * Get a zero-filled frame for a user page, preferably one the zeroer
+ * has already prepared. Returns the frame index, or -1 if out of
+ * memory.
+ */
+static
+int
+getzeroedframe(void)
+{
+	int idx = -1;
+	bool wake = false;
+	paddr_t pa;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count > 0) {
+		idx = zeropool[--zeropool_count];
+	}
+	if (zeropool_count < ZEROPOOL_LOW && zeroer_idle) {
+		zeroer_idle = false;
+		wake = true;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (wake) {
+		V(zeroer_sem);
+	}
+
+	if (idx >= 0) {
+		vmstats_inc(VMSTAT_ZERO_POOL_HIT);
+		return idx;
+	}
+
+	pa = getppages(1);
+	if (pa == 0) {
+		return -1;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	vmstats_inc(VMSTAT_ZERO_POOL_MISS);
+	return (pa - frame_offset) / PAGE_SIZE;
+}
+
+/*
+ * Background thread that keeps the zero pool topped up. There are no
+ * thread priorities, so it yields after every page to let runnable
+ * threads go first, and sleeps whenever the pool is full or memory
+ * is short.
+ */
+static
+void
+zeroer_thread(void *unused1, unsigned long unused2)
+{
+	paddr_t pa;
+	bool full;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		spinlock_acquire(&zeropool_lock);
+		full = zeropool_count >= ZEROPOOL_MAX;
+		if (full) {
+			zeroer_idle = true;
+		}
+		spinlock_release(&zeropool_lock);
+		if (full) {
+			P(zeroer_sem);
+			continue;
+		}
+
+		pa = coremap_getppages(1);
+		if (pa == 0) {
+			/* don't hoard frames when memory is tight */
+			spinlock_acquire(&zeropool_lock);
+			zeroer_idle = true;
+			spinlock_release(&zeropool_lock);
+			P(zeroer_sem);
+			continue;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+		spinlock_acquire(&zeropool_lock);
+		full = zeropool_count >= ZEROPOOL_MAX;
+		if (!full) {
+			zeropool[zeropool_count++] = (pa - frame_offset) / PAGE_SIZE;
+		}
+		spinlock_release(&zeropool_lock);
+		if (full) {
+			free_kpages(PADDR_TO_KVADDR(pa));
+		}
+
+		thread_yield();
+	}
+}
+#endif
+
+#if OPT_A3
+/*
+ * Invalidate the whole TLB of this CPU.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Drop the TLB entry for VADDR on this CPU, if there is one. Must be
+ * called with interrupts off.
+ */
+static
+void
+tlb_invalidate_vaddr(vaddr_t vaddr)
+{
+	int i;
+
+	i = tlb_probe(vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	/*
+	 * Not as_activate: a kernel thread has no address space, but
+	 * the TLB may still hold the last user process's mappings.
+	 */
+	tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	if (ts->ts_vaddr == TS_VADDR_ALL) {
+		vm_tlbshootdown_all();
+		return;
+	}
+	spl = splhigh();
+	tlb_invalidate_vaddr(ts->ts_vaddr);
+	splx(spl);
+}
+#else
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+#endif
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	paddr_t paddr;
+	int i;
+	uint32_t ehi, elo;
+	struct addrspace *as;
+	int spl;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault %d: 0x%x\n", faulttype, faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+			#if OPT_A3
+				/* may be a first write to a zero-frame page */
+				break;
+			#endif
+		    /* We always create pages read-write, so we can't get this */
+		    panic("dumbvm: got VM_FAULT_READONLY\n");
+			case VM_FAULT_READ:
+			case VM_FAULT_WRITE:
+			break;
+			default:
+			return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+	#if OPT_A3
+		KASSERT(as->as_vbase1 != 0);
+		KASSERT(as->as_pbase1 != NULL);
+		KASSERT(as->as_npages1 != 0);
+		KASSERT(as->as_vbase2 != 0);
+		KASSERT(as->as_pbase2 != NULL);
+		KASSERT(as->as_npages2 != 0);
+		KASSERT(as->as_stackpbase != NULL);
+		KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+		KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+	#else
+		KASSERT(as->as_vbase1 != 0);
+		KASSERT(as->as_pbase1 != 0);
+		KASSERT(as->as_npages1 != 0);
+		KASSERT(as->as_vbase2 != 0);
+		KASSERT(as->as_pbase2 != 0);
+		KASSERT(as->as_npages2 != 0);
+		KASSERT(as->as_stackpbase != 0);
+		KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+		KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
+		KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+		KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+		KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+	#endif 
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	stacktop = USERSTACK;
+
+	#if OPT_A3
+		bool code_seg = false;
+		int *pte;
+		if (faultaddress >= vbase1 && faultaddress < vtop1) {
+			pte = &as->as_pbase1->pages[(faultaddress - vbase1) / PAGE_SIZE];
+			code_seg = true;
+		}
+		else if (faultaddress >= vbase2 && faultaddress < vtop2) {
+			pte = &as->as_pbase2->pages[(faultaddress - vbase2) / PAGE_SIZE];
+		}
+		else if (faultaddress >= stackbase && faultaddress < stacktop) {
+			pte = &as->as_stackpbase->pages[(faultaddress - stackbase) / PAGE_SIZE];
+		}
+		else return mmap_fault(as, faulttype, faultaddress);
+
+		bool readonly = code_seg && as->loaded;
+		int newframe = PTE_ZERO;
+		if (*pte == PTE_ZERO && faulttype != VM_FAULT_READ && !readonly) {
+			/* first write: get it a frame of its own */
+			newframe = getzeroedframe();
+			if (newframe < 0) {
+				return ENOMEM;
+			}
+		}
+
+		/*
+		 * Hold the coremap lock from reading the page table entry
+		 * until the TLB is loaded, so that compaction cannot move
+		 * the frame in between. (This also disables interrupts.)
+		 */
+		spinlock_acquire(&coremap_lock);
+		if (newframe != PTE_ZERO) {
+			KASSERT(*pte == PTE_ZERO);
+			*pte = newframe;
+			coremap_rmap[newframe].rm_pte = pte;
+			coremap_rmap[newframe].rm_as = as;
+			coremap_rmap[newframe].rm_vaddr = faultaddress;
+		}
+		if (*pte == PTE_ZERO) {
+			/* untouched page: share the zero frame */
+			paddr = frame_offset + zero_frame * PAGE_SIZE;
+			readonly = true;
+			vmstats_inc(VMSTAT_ZERO_FRAME_MAP);
+		}
+		else if (faulttype == VM_FAULT_READONLY && newframe == PTE_ZERO) {
+			/* write to a read-only segment */
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+		else {
+			paddr = frame_offset + *pte * PAGE_SIZE;
+		}
+	#else
+	if (faultaddress >= vbase1 && faultaddress < vtop1) {
+		paddr = (faultaddress - vbase1) + as->as_pbase1;
+	}
+	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
+		paddr = (faultaddress - vbase2) + as->as_pbase2;
+	}
+	else if (faultaddress >= stackbase && faultaddress < stacktop) {
+		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	}
+	else {
+		return EFAULT;
+	}
+	#endif
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	#if OPT_A3
+		uint32_t newelo = paddr | TLBLO_VALID;
+		if (!readonly) newelo |= TLBLO_DIRTY;
+
+		/* Replace the existing entry, if any (e.g. a zero-frame mapping) */
+		i = tlb_probe(faultaddress, 0);
+		if (i >= 0) {
+			tlb_write(faultaddress, newelo, i);
+			splx(spl);
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	#endif
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_VALID) continue;
+		ehi = faultaddress;
+	#if OPT_A3
+		elo = newelo;
+	#else
+		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	#endif
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		tlb_write(ehi, elo, i);
+		splx(spl);
+	#if OPT_A3
+		spinlock_release(&coremap_lock);
+	#endif
+		return 0;
+	}
+
+	#if OPT_A3
+		tlb_random(faultaddress, newelo);
+		splx(spl);
+		spinlock_release(&coremap_lock);
+		return 0;
+	#else
+		kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+		splx(spl);
+		return EFAULT;
+	#endif
+}
+
+#if OPT_A3
+/*
+ * Print a histogram of the lengths of runs of free frames in the
+ * coremap. Large kmalloc requests need a run of npages contiguous
+ * free frames, so lots of short runs means fragmentation.
+ */
+#define FRAG_BUCKETS 10
+
+void
+vm_printfrag(void)
+{
+	unsigned counts[FRAG_BUCKETS];
+	unsigned nfree, nruns, largest, run, b, i;
+
+	for (b = 0; b < FRAG_BUCKETS; b++) {
+		counts[b] = 0;
+	}
+	nfree = nruns = largest = run = 0;
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i <= frames; i++) {
+		if (i < frames && COREMAP(i) == 0) {
+			run++;
+			continue;
+		}
+		if (run > 0) {
+			for (b = 0; b < FRAG_BUCKETS-1 && (2U << b) <= run; b++) {
+				/* nothing */
+			}
+			counts[b]++;
+			nfree += run;
+			nruns++;
+			if (run > largest) {
+				largest = run;
+			}
+			run = 0;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames, %u free in %u runs, largest run %u\n",
+		frames, nfree, nruns, largest);
+	for (b = 0; b < FRAG_BUCKETS; b++) {
+		if (b == FRAG_BUCKETS-1) {
+			kprintf("  runs of %4u+      : %u\n", 1U << b, counts[b]);
+		}
+		else {
+			kprintf("  runs of %4u-%-4u  : %u\n",
+				1U << b, (2U << b) - 1, counts[b]);
+		}
+	}
+}
+
+/*
+ * Return true if AS may have mappings in the TLB of a CPU other than
+ * this one. Shooting those down would mean waiting for the other CPU
+ * to answer, which cannot be done while holding coremap_lock: the
+ * other CPU may be spinning for it with interrupts off.
+ */
+static
+bool
+as_active_elsewhere(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		if (i != curcpu->c_number && tlb_owner[i] == as) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Move the user page in frame FROM to the free frame TO, fixing its
+ * page table entry and dropping any TLB mapping of it on this CPU.
+ * Called with coremap_lock held, so no fault can load the old mapping
+ * while the page is in flight, and only for pages whose address space
+ * is not active on another CPU, so no other TLB can map the old frame.
+ */
+static
+void
+compact_move(unsigned from, unsigned to)
+{
+	KASSERT(COREMAP(to) == 0);
+	KASSERT(COREMAP(from) == 1);
+	KASSERT(coremap_rmap[from].rm_pte != NULL);
+	KASSERT(*coremap_rmap[from].rm_pte == (int)from);
+	KASSERT(!as_active_elsewhere(coremap_rmap[from].rm_as));
+
+	memmove((void *)PADDR_TO_KVADDR(frame_offset + to * PAGE_SIZE),
+		(const void *)PADDR_TO_KVADDR(frame_offset + from * PAGE_SIZE),
+		PAGE_SIZE);
+
+	COREMAP(to) = 1;
+	coremap_rmap[to] = coremap_rmap[from];
+	*coremap_rmap[to].rm_pte = to;
+
+	COREMAP(from) = 0;
+	coremap_rmap[from].rm_pte = NULL;
+
+	tlb_invalidate_vaddr(coremap_rmap[to].rm_vaddr);
+}
+
+/*
+ * Compact physical memory: move movable (user) frames from the top of
+ * the coremap into free frames at the bottom, so that the free space
+ * collects into one large run at the top. Kernel frames, the zero
+ * frame, and the pages of processes running on other CPUs stay put.
+ * The zero pool is emptied first, since its frames would otherwise be
+ * stuck wherever they are.
+ *
+ * The lock is dropped between moves so the rest of the system can
+ * make progress. Returns the number of frames moved.
+ */
+unsigned
+vm_compact(void)
+{
+	unsigned lo, hi, moved;
+
+	zeropool_drain();
+
+	moved = 0;
+	lo = 0;
+	hi = frames;
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		while (lo < hi && COREMAP(lo) != 0) {
+			lo++;
+		}
+		while (hi > lo &&
+		       (COREMAP(hi-1) != 1 || coremap_rmap[hi-1].rm_pte == NULL ||
+			coremap_rmap[hi-1].rm_pins > 0 ||
+			as_active_elsewhere(coremap_rmap[hi-1].rm_as))) {
+			hi--;
+		}
+		if (lo + 1 >= hi) {
+			spinlock_release(&coremap_lock);
+			break;
+		}
+		hi--;
+		compact_move(hi, lo);
+		lo++;
+		moved++;
+		spinlock_release(&coremap_lock);
+	}
+	return moved;
+}
+
+/*
+ * Pin the frame behind user address VADDR in the current address
+ * space so that compaction leaves it where it is, and return its
+ * physical address. Only the code, data and stack segments can be
+ * pinned; anything else (file mappings, bad addresses) fails with
+ * EFAULT and the caller should fall back to copyin. A page that has
+ * never been written is backed by the zero frame, which is returned
+ * as is: the pin is for reading.
+ *
+ * The caller must keep the page from being unmapped until it calls
+ * vm_unpinpage, which in practice means pinning only its own pages
+ * and unpinning before it returns to user mode.
+ */
+int
+vm_pinpage(vaddr_t vaddr, paddr_t *ret)
+{
+	struct addrspace *as;
+	vaddr_t stackbase;
+	int *pte;
+	int frame;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	vaddr &= PAGE_FRAME;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	if (vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		pte = &as->as_pbase1->pages[(vaddr - as->as_vbase1) / PAGE_SIZE];
+	}
+	else if (vaddr >= as->as_vbase2 &&
+		 vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		pte = &as->as_pbase2->pages[(vaddr - as->as_vbase2) / PAGE_SIZE];
+	}
+	else if (vaddr >= stackbase && vaddr < USERSTACK) {
+		pte = &as->as_stackpbase->pages[(vaddr - stackbase) / PAGE_SIZE];
+	}
+	else {
+		return EFAULT;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	frame = *pte == PTE_ZERO ? zero_frame : *pte;
+	coremap_rmap[frame].rm_pins++;
+	spinlock_release(&coremap_lock);
+
+	*ret = frame_offset + frame * PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Release a pin taken by vm_pinpage.
+ */
+void
+vm_unpinpage(paddr_t paddr)
+{
+	unsigned frame;
+
+	frame = (paddr - frame_offset) / PAGE_SIZE;
+	KASSERT(frame < frames);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap_rmap[frame].rm_pins > 0);
+	coremap_rmap[frame].rm_pins--;
+	spinlock_release(&coremap_lock);
+}
+#endif
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	#if OPT_A3
+		as->as_vbase1 = 0;
+		as->as_pbase1 = NULL;
+		as->as_npages1 = 0;
+		as->as_vbase2 = 0;
+		as->as_pbase2 = NULL;
+		as->as_npages2 = 0;
+		as->as_stackpbase = NULL;
+		as->as_text = NULL;
+		as->as_mmaps = NULL;
+		as->loaded = false;
+	#else
+		as->as_vbase1 = 0;
+		as->as_pbase1 = 0;
+		as->as_npages1 = 0;
+		as->as_vbase2 = 0;
+		as->as_pbase2 = 0;
+		as->as_npages2 = 0;
+		as->as_stackpbase = 0;
+	#endif
+	return as;
+}
+
+#if OPT_A3
+/* Free the frames of a page table, skipping pages still on the zero frame. */
+static
+void
+pt_free_frames(pagetable *pt, unsigned int npages)
+{
+	for (unsigned int i = 0; i < npages; i++) {
+		if (pt->pages[i] != PTE_ZERO) {
+			free_kpages(PADDR_TO_KVADDR(frame_offset + pt->pages[i] * PAGE_SIZE));
+		}
+	}
+}
+#endif
+
+#if OPT_A3
+/*
+ * Map the shared text for executable V into AS's code segment, if it
+ * is cached and lines up with the segment AS defined. Returns true if
+ * it did, in which case the caller must not load the code segment.
+ * Called after as_prepare_load.
+ */
+bool
+as_text_attach(struct addrspace *as, struct vnode *v)
+{
+	struct sharedtext *st;
+
+	KASSERT(as->as_text == NULL);
+
+	lock_acquire(sharedtext_lock);
+	for (st = sharedtext_list; st != NULL; st = st->st_next) {
+		if (st->st_vnode == v) {
+			break;
+		}
+	}
+	if (st == NULL || st->st_vbase != as->as_vbase1 ||
+	    st->st_npages != as->as_npages1) {
+		lock_release(sharedtext_lock);
+		return false;
+	}
+	st->st_refcount++;
+	memcpy(as->as_pbase1->pages, st->st_frames,
+	       st->st_npages * sizeof(int));
+	as->as_text = st;
+	lock_release(sharedtext_lock);
+
+	vmstats_inc(VMSTAT_TEXT_SHARED);
+	return true;
+}
+
+/*
+ * Offer AS's freshly loaded code segment, read from executable V, to
+ * the shared text cache. If another process got there first, AS just
+ * keeps its private copy. Failure to allocate is not an error.
+ */
+void
+as_text_publish(struct addrspace *as, struct vnode *v)
+{
+	struct sharedtext *st;
+	unsigned i;
+	int frame;
+
+	KASSERT(as->as_text == NULL);
+
+	st = kmalloc(sizeof(struct sharedtext));
+	if (st == NULL) {
+		return;
+	}
+	st->st_frames = kmalloc(as->as_npages1 * sizeof(int));
+	if (st->st_frames == NULL) {
+		kfree(st);
+		return;
+	}
+	st->st_vnode = v;
+	st->st_vbase = as->as_vbase1;
+	st->st_npages = as->as_npages1;
+	st->st_refcount = 1;
+	st->st_listed = true;
+
+	lock_acquire(sharedtext_lock);
+	for (struct sharedtext *t = sharedtext_list; t != NULL; t = t->st_next) {
+		if (t->st_vnode == v) {
+			lock_release(sharedtext_lock);
+			kfree(st->st_frames);
+			kfree(st);
+			return;
+		}
+	}
+	VOP_INCREF(v);
+
+	/*
+	 * The frames are shared now; pin them against compaction. Take
+	 * the frame numbers under the same lock, or compaction could move
+	 * a frame after we copied its number.
+	 */
+	spinlock_acquire(&coremap_lock);
+	memcpy(st->st_frames, as->as_pbase1->pages, st->st_npages * sizeof(int));
+	for (i = 0; i < st->st_npages; i++) {
+		frame = st->st_frames[i];
+		if (frame != PTE_ZERO) {
+			coremap_rmap[frame].rm_pte = NULL;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	st->st_next = sharedtext_list;
+	sharedtext_list = st;
+	as->as_text = st;
+	lock_release(sharedtext_lock);
+}
+
+/*
+ * Drop AS's reference to its shared text, freeing the frames and the
+ * cache entry on the last one.
+ */
+static
+void
+as_text_release(struct addrspace *as)
+{
+	struct sharedtext *st = as->as_text;
+	struct sharedtext **pp;
+
+	as->as_text = NULL;
+
+	lock_acquire(sharedtext_lock);
+	KASSERT(st->st_refcount > 0);
+	st->st_refcount--;
+	if (st->st_refcount > 0) {
+		lock_release(sharedtext_lock);
+		return;
+	}
+	if (st->st_listed) {
+		for (pp = &sharedtext_list; *pp != st; pp = &(*pp)->st_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = st->st_next;
+	}
+	lock_release(sharedtext_lock);
+
+	for (unsigned i = 0; i < st->st_npages; i++) {
+		if (st->st_frames[i] != PTE_ZERO) {
+			free_kpages(PADDR_TO_KVADDR(frame_offset + st->st_frames[i] * PAGE_SIZE));
+		}
+	}
+	VOP_DECREF(st->st_vnode);
+	kfree(st->st_frames);
+	kfree(st);
+}
+
+/*
+ * Executable V has been written to or truncated: take its shared
+ * text, if any, off the list so that nobody else attaches to the old
+ * code. The entry lives on until its current users are done with it.
+ */
+static
+void
+as_text_forget(struct vnode *v)
+{
+	struct sharedtext *st, **pp;
+
+	lock_acquire(sharedtext_lock);
+	for (pp = &sharedtext_list; (st = *pp) != NULL; pp = &st->st_next) {
+		if (st->st_vnode == v) {
+			*pp = st->st_next;
+			st->st_next = NULL;
+			st->st_listed = false;
+			break;
+		}
+	}
+	lock_release(sharedtext_lock);
+}
+#endif
+
+#if OPT_A3
+/*
+ * File mappings.
+ *
+ * The resident pages of a mapped file are kept in an mmapobj, one
+ * per vnode, shared by every mapping of that file in every address
+ * space; the object and its frames go away with the last mapping.
+ * There is no unified page cache: read() and write() go through the
+ * buffer cache, and the object is filled from it with VOP_READ when
+ * a page is first touched and written back to it with VOP_WRITE. A
+ * write() or truncation of a mapped file updates whatever pages of
+ * the object are resident (see vm_filewrite), so a mapping sees it
+ * at once; read() sees stores through a shared mapping once msync()
+ * or munmap() has written them back.
+ *
+ * A MAP_SHARED region maps the object's frames directly. A page is
+ * mapped read-only until the first store to it, which marks it dirty
+ * and maps it writable; writeback cleans it and write-protects it
+ * again everywhere, so the next store is noticed.
+ *
+ * A MAP_PRIVATE region maps the object's frames read-only as well,
+ * and the first store to a page copies it into a frame of the
+ * region's own (copy on write). mr_pages holds that frame, or
+ * PTE_FILE while the page still reads through to the file.
+ *
+ * None of these frames have rmap entries, so compaction leaves them
+ * alone.
+ *
+ * Page-in and writeback call into the file system without holding
+ * mo_lock, so faults on other pages of the object are not held up.
+ * Since page-in calls into the file system, file I/O to or from a
+ * mapping brings the mapped pages in first (vm_prefault), so the
+ * transfer itself never faults into a file system.
+ */
+#define PTE_FILE (-2)
+
+#define MO_ABSENT   (-1)	/* mo_frames: page not resident */
+
+#define MO_CLEAN    0		/* mo_state values */
+#define MO_DIRTY    1
+#define MO_WRITING  2		/* being written back; still clean */
+
+struct mmapobj {
+	struct vnode *mo_vnode;		/* mapped file (referenced) */
+	struct lock *mo_lock;		/* protects the arrays */
+	unsigned mo_npages;		/* size of the arrays */
+	int *mo_frames;			/* frame per file page, or MO_ABSENT */
+	unsigned char *mo_state;	/* MO_CLEAN/MO_DIRTY/MO_WRITING */
+	unsigned mo_refcount;		/* regions mapping it */
+	struct mmapobj *mo_next;
+};
+
+struct mmapregion {
+	vaddr_t mr_vbase;		/* first page */
+	size_t mr_npages;		/* length in pages */
+	struct mmapobj *mr_obj;		/* the file */
+	unsigned mr_firstpage;		/* file page mapped at mr_vbase */
+	int mr_prot;			/* PROT_* */
+	bool mr_shared;			/* MAP_SHARED */
+	int *mr_pages;			/* private frames; NULL if shared */
+	struct mmapregion *mr_next;	/* next lower region */
+};
+
+/* Protects mmapobj_list and the refcounts. (Declared above.) */
+static struct mmapobj *mmapobj_list = NULL;
+
+/*
+ * Flush every TLB in the system, and wait until the other CPUs have
+ * done so. Used when pages are write-protected again for writeback,
+ * since we don't know which address spaces (or where in them) have
+ * the pages mapped; a CPU still holding a writable entry could store
+ * to a page after it has been written back and marked clean.
+ */
+static
+void
+mmap_tlbflush_all(void)
+{
+	struct tlbshootdown ts;
+
+	ts.ts_addrspace = NULL;
+	ts.ts_vaddr = TS_VADDR_ALL;
+	ipi_tlbshootdown_sync(&ts);
+}
+
+/*
+ * Load a TLB entry for VADDR on FRAME, replacing any existing one.
+ */
+static
+void
+mmap_tlbload(vaddr_t vaddr, int frame, bool writable)
+{
+	uint32_t ehi, elo, newelo;
+	int i, spl;
+
+	newelo = (frame_offset + frame * PAGE_SIZE) | TLBLO_VALID;
+	if (writable) {
+		newelo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+	i = tlb_probe(vaddr, 0);
+	if (i < 0) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if (!(elo & TLBLO_VALID)) {
+				break;
+			}
+		}
+	}
+	if (i < NUM_TLB) {
+		tlb_write(vaddr, newelo, i);
+	}
+	else {
+		tlb_random(vaddr, newelo);
+	}
+	splx(spl);
+}
+
+/*
+ * Find the object for V, creating it if need be, and add a reference.
+ */
+static
+struct mmapobj *
+mmapobj_get(struct vnode *v)
+{
+	struct mmapobj *mo;
+
+	lock_acquire(mmapobj_lock);
+	for (mo = mmapobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vnode == v) {
+			mo->mo_refcount++;
+			lock_release(mmapobj_lock);
+			return mo;
+		}
+	}
+
+	mo = kmalloc(sizeof(struct mmapobj));
+	if (mo == NULL) {
+		lock_release(mmapobj_lock);
+		return NULL;
+	}
+	mo->mo_lock = lock_create("mmapobj");
+	if (mo->mo_lock == NULL) {
+		kfree(mo);
+		lock_release(mmapobj_lock);
+		return NULL;
+	}
+	VOP_INCREF(v);
+	mo->mo_vnode = v;
+	mo->mo_npages = 0;
+	mo->mo_frames = NULL;
+	mo->mo_state = NULL;
+	mo->mo_refcount = 1;
+	mo->mo_next = mmapobj_list;
+	mmapobj_list = mo;
+	lock_release(mmapobj_lock);
+	return mo;
+}
+
+/*
+ * Find the object for V, if there is one, and add a reference.
+ */
+static
+struct mmapobj *
+mmapobj_lookup(struct vnode *v)
+{
+	struct mmapobj *mo;
+
+	lock_acquire(mmapobj_lock);
+	for (mo = mmapobj_list; mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vnode == v) {
+			mo->mo_refcount++;
+			break;
+		}
+	}
+	lock_release(mmapobj_lock);
+	return mo;
+}
+
+/*
+ * Drop a reference to MO. On the last one, free its frames and the
+ * object. Every region writes back its own range when it goes away,
+ * so anything still dirty here is a page whose writeback failed.
+ */
+static
+void
+mmapobj_put(struct mmapobj *mo)
+{
+	struct mmapobj **pp;
+	unsigned i;
+
+	lock_acquire(mmapobj_lock);
+	KASSERT(mo->mo_refcount > 0);
+	mo->mo_refcount--;
+	if (mo->mo_refcount > 0) {
+		lock_release(mmapobj_lock);
+		return;
+	}
+	for (pp = &mmapobj_list; *pp != mo; pp = &(*pp)->mo_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = mo->mo_next;
+	lock_release(mmapobj_lock);
+
+	for (i = 0; i < mo->mo_npages; i++) {
+		if (mo->mo_frames[i] != MO_ABSENT) {
+			free_kpages(PADDR_TO_KVADDR(frame_offset + mo->mo_frames[i] * PAGE_SIZE));
+		}
+	}
+	VOP_DECREF(mo->mo_vnode);
+	lock_destroy(mo->mo_lock);
+	kfree(mo->mo_frames);
+	kfree(mo->mo_state);
+	kfree(mo);
+}
+
+/*
+ * Make room in MO's arrays for file pages below NPAGES.
+ */
+static
+int
+mmapobj_reserve(struct mmapobj *mo, unsigned npages)
+{
+	int *frames;
+	unsigned char *state;
+	unsigned i;
+
+	lock_acquire(mo->mo_lock);
+	if (npages <= mo->mo_npages) {
+		lock_release(mo->mo_lock);
+		return 0;
+	}
+	frames = kmalloc(npages * sizeof(int));
+	state = kmalloc(npages);
+	if (frames == NULL || state == NULL) {
+		kfree(frames);
+		kfree(state);
+		lock_release(mo->mo_lock);
+		return ENOMEM;
+	}
+	for (i = 0; i < npages; i++) {
+		frames[i] = i < mo->mo_npages ? mo->mo_frames[i] : MO_ABSENT;
+		state[i] = i < mo->mo_npages ? mo->mo_state[i] : MO_CLEAN;
+	}
+	kfree(mo->mo_frames);
+	kfree(mo->mo_state);
+	mo->mo_frames = frames;
+	mo->mo_state = state;
+	mo->mo_npages = npages;
+	lock_release(mo->mo_lock);
+	return 0;
+}
+
+/*
+ * Get file page PAGE of MO into memory and return its frame. The
+ * read happens without mo_lock; if someone else reads the same page
+ * meanwhile, the loser frees its copy.
+ */
+static
+int
+mmapobj_pagein(struct mmapobj *mo, unsigned page, int *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa;
+	void *kva;
+	int result;
+
+	lock_acquire(mo->mo_lock);
+	KASSERT(page < mo->mo_npages);
+	if (mo->mo_frames[page] != MO_ABSENT) {
+		*ret = mo->mo_frames[page];
+		lock_release(mo->mo_lock);
+		return 0;
+	}
+	lock_release(mo->mo_lock);
+
+	pa = getppages(1);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	kva = (void *)PADDR_TO_KVADDR(pa);
+	uio_kinit(&iov, &ku, kva, PAGE_SIZE, (off_t)page * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(mo->mo_vnode, &ku);
+	if (result) {
+		free_kpages((vaddr_t)kva);
+		return result;
+	}
+	/* past EOF reads as zeros */
+	bzero((char *)kva + (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+	/* not a Page Fault (Disk): those are ELF and swap file reads */
+	vmstats_inc(VMSTAT_MMAP_FILE_READ);
+
+	lock_acquire(mo->mo_lock);
+	if (mo->mo_frames[page] == MO_ABSENT) {
+		mo->mo_frames[page] = (pa - frame_offset) / PAGE_SIZE;
+		kva = NULL;
+	}
+	*ret = mo->mo_frames[page];
+	lock_release(mo->mo_lock);
+
+	if (kva != NULL) {
+		free_kpages((vaddr_t)kva);
+	}
+	return 0;
+}
+
+/*
+ * Write back the dirty pages among file pages FIRST..FIRST+NPAGES-1
+ * of MO. Never extends the file: the part of a page past EOF is not
+ * written.
+ *
+ * Dirty pages are marked MO_WRITING and write-protected everywhere
+ * before any data is written, so a store that lands during the write
+ * faults, marks the page dirty again, and is picked up next time.
+ */
+static
+int
+mmapobj_writeback(struct mmapobj *mo, unsigned first, unsigned npages)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	unsigned i, end, nwriting;
+	int state, frame;
+	off_t pos;
+	size_t len;
+	int result, err;
+
+	lock_acquire(mo->mo_lock);
+	end = first + npages;
+	if (end > mo->mo_npages) {
+		end = mo->mo_npages;
+	}
+	nwriting = 0;
+	for (i = first; i < end; i++) {
+		if (mo->mo_state[i] == MO_DIRTY) {
+			mo->mo_state[i] = MO_WRITING;
+			nwriting++;
+		}
+	}
+	lock_release(mo->mo_lock);
+
+	if (nwriting == 0) {
+		return 0;
+	}
+	as_text_forget(mo->mo_vnode);
+	mmap_tlbflush_all();
+
+	err = VOP_STAT(mo->mo_vnode, &st);
+	for (i = first; i < end; i++) {
+		lock_acquire(mo->mo_lock);
+		state = mo->mo_state[i];
+		frame = mo->mo_frames[i];
+		lock_release(mo->mo_lock);
+		if (state == MO_CLEAN) {
+			continue;
+		}
+
+		pos = (off_t)i * PAGE_SIZE;
+		result = 0;
+		if (err == 0 && pos < st.st_size) {
+			len = PAGE_SIZE;
+			if (st.st_size - pos < PAGE_SIZE) {
+				len = st.st_size - pos;
+			}
+			/* the frame can't go away: our caller's region maps it */
+			uio_kinit(&iov, &ku,
+				  (void *)PADDR_TO_KVADDR(frame_offset + frame * PAGE_SIZE),
+				  len, pos, UIO_WRITE);
+			result = VOP_WRITE(mo->mo_vnode, &ku);
+		}
+
+		lock_acquire(mo->mo_lock);
+		if (mo->mo_state[i] == MO_WRITING) {
+			mo->mo_state[i] = (err || result) ? MO_DIRTY : MO_CLEAN;
+		}
+		lock_release(mo->mo_lock);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/*
+ * Bring the resident pages of V's object, if it has one, up to date
+ * after LEN bytes at POS were written to V with VOP_WRITE, by reading
+ * the written range back into them. Only the written bytes are
+ * replaced; stores through a shared mapping to the rest of a dirty
+ * page are kept. If V is a cached executable, its shared text is
+ * dropped.
+ *
+ * The frames cannot go away while we hold a reference to the object.
+ */
+void
+vm_filewrite(struct vnode *v, off_t pos, size_t len)
+{
+	struct mmapobj *mo;
+	struct iovec iov;
+	struct uio ku;
+	unsigned page;
+	off_t start, end, pagepos;
+	int frame;
+
+	if (len > 0) {
+		as_text_forget(v);
+	}
+	if (mmapobj_list == NULL || len == 0) {
+		/* nothing is mapped; not worth the lock */
+		return;
+	}
+	mo = mmapobj_lookup(v);
+	if (mo == NULL) {
+		return;
+	}
+
+	for (page = pos / PAGE_SIZE; (off_t)page * PAGE_SIZE < pos + (off_t)len;
+	     page++) {
+		lock_acquire(mo->mo_lock);
+		frame = page < mo->mo_npages ? mo->mo_frames[page] : MO_ABSENT;
+		lock_release(mo->mo_lock);
+		if (frame == MO_ABSENT) {
+			continue;
+		}
+		pagepos = (off_t)page * PAGE_SIZE;
+		start = pos > pagepos ? pos : pagepos;
+		end = pos + (off_t)len < pagepos + PAGE_SIZE ?
+			pos + (off_t)len : pagepos + PAGE_SIZE;
+		uio_kinit(&iov, &ku,
+			  (char *)PADDR_TO_KVADDR(frame_offset + frame * PAGE_SIZE)
+			  + (start - pagepos),
+			  end - start, start, UIO_READ);
+		/* on failure the page keeps its old contents; not much else to do */
+		(void)VOP_READ(v, &ku);
+	}
+	mmapobj_put(mo);
+}
+
+/*
+ * Zero the part past LEN of the resident pages of V's object, if it
+ * has one, after V was truncated to LEN bytes. Mappings read zeros
+ * past EOF, as if the pages had been read in after the truncation.
+ * As for a write, shared text from V is dropped.
+ */
+void
+vm_filetruncate(struct vnode *v, off_t len)
+{
+	struct mmapobj *mo;
+	unsigned page;
+	off_t pagepos, skip;
+	int frame;
+
+	as_text_forget(v);
+	if (mmapobj_list == NULL) {
+		return;
+	}
+	mo = mmapobj_lookup(v);
+	if (mo == NULL) {
+		return;
+	}
+
+	lock_acquire(mo->mo_lock);
+	for (page = len / PAGE_SIZE; page < mo->mo_npages; page++) {
+		frame = mo->mo_frames[page];
+		if (frame == MO_ABSENT) {
+			continue;
+		}
+		pagepos = (off_t)page * PAGE_SIZE;
+		skip = len > pagepos ? len - pagepos : 0;
+		bzero((char *)PADDR_TO_KVADDR(frame_offset + frame * PAGE_SIZE)
+		      + skip, PAGE_SIZE - skip);
+	}
+	lock_release(mo->mo_lock);
+	mmapobj_put(mo);
+}
+
+/*
+ * Bring in every page of a file mapping that the user buffers of U
+ * cover, before U is handed to a file system. A fault on a mapped
+ * page that is not resident reads it in with VOP_READ; if that
+ * happened during the uiomove of a read() or write(), it would be
+ * inside the file system, which may hold the lock of the file being
+ * read or written. For a mapping of that same file, that would be
+ * a lock acquired twice, and for two files in two processes, a
+ * deadlock. Resident pages of an object stay until its last mapping
+ * goes, and our process has just the one thread, so the pages stay
+ * in for the transfer, and faults on them don't leave the VM system.
+ */
+int
+vm_prefault(struct uio *u)
+{
+	struct mmapregion *mr;
+	vaddr_t base, lo, hi, va;
+	size_t len;
+	unsigned i, idx;
+	int frame, result;
+
+	if (u->uio_segflg == UIO_SYSSPACE || u->uio_space == NULL ||
+	    u->uio_space->as_mmaps == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < u->uio_iovcnt; i++) {
+		base = (vaddr_t)u->uio_iov[i].iov_ubase;
+		len = u->uio_iov[i].iov_len;
+		if (len == 0 || base >= USERSPACETOP) {
+			/* nothing to do, or uiomove will fail anyway */
+			continue;
+		}
+		if (len > USERSPACETOP - base) {
+			len = USERSPACETOP - base;
+		}
+
+		for (mr = u->uio_space->as_mmaps; mr != NULL;
+		     mr = mr->mr_next) {
+			lo = base > mr->mr_vbase ? base : mr->mr_vbase;
+			hi = mr->mr_vbase + mr->mr_npages * PAGE_SIZE;
+			if (base + len < hi) {
+				hi = base + len;
+			}
+			if (lo >= hi || mr->mr_prot == PROT_NONE) {
+				continue;
+			}
+			for (va = lo & PAGE_FRAME; va < hi; va += PAGE_SIZE) {
+				idx = (va - mr->mr_vbase) / PAGE_SIZE;
+				if (!mr->mr_shared &&
+				    mr->mr_pages[idx] != PTE_FILE) {
+					/* has its own copy */
+					continue;
+				}
+				result = mmapobj_pagein(mr->mr_obj,
+						       mr->mr_firstpage + idx,
+						       &frame);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tear down region MR, which has been unlinked from its address
+ * space: write back its shared pages, free its private ones, and
+ * drop its TLB entries on this CPU. (Other CPUs don't hold entries
+ * for this address space; as_activate flushes on every switch.)
+ */
+static
+int
+mmap_release(struct mmapregion *mr)
+{
+	unsigned i;
+	int result = 0;
+	int spl;
+
+	if (mr->mr_shared) {
+		result = mmapobj_writeback(mr->mr_obj, mr->mr_firstpage,
+					   mr->mr_npages);
+	}
+	else {
+		for (i = 0; i < mr->mr_npages; i++) {
+			if (mr->mr_pages[i] != PTE_FILE) {
+				free_kpages(PADDR_TO_KVADDR(frame_offset + mr->mr_pages[i] * PAGE_SIZE));
+			}
+		}
+		kfree(mr->mr_pages);
+	}
+
+	spl = splhigh();
+	for (i = 0; i < mr->mr_npages; i++) {
+		tlb_invalidate_vaddr(mr->mr_vbase + i * PAGE_SIZE);
+	}
+	splx(spl);
+
+	mmapobj_put(mr->mr_obj);
+	kfree(mr);
+	return result;
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+/*
+ * Split MR at page IDX. MR keeps the upper part; the lower part
+ * becomes a new region linked in after it.
+ */
+static
+int
+mmap_split(struct mmapregion *mr, unsigned idx)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	struct mmapregion *lo;
+	int *hipages = NULL;
+
+	KASSERT(idx > 0 && idx < mr->mr_npages);
+
+	lo = kmalloc(sizeof(struct mmapregion));
+	if (lo == NULL) {
+		return ENOMEM;
+	}
+	*lo = *mr;
+	lo->mr_npages = idx;
+	if (!mr->mr_shared) {
+		hipages = kmalloc((mr->mr_npages - idx) * sizeof(int));
+		if (hipages == NULL) {
+			kfree(lo);
+			return ENOMEM;
+		}
+		memcpy(hipages, mr->mr_pages + idx,
+		       (mr->mr_npages - idx) * sizeof(int));
+		/* lo keeps the old array; only its first idx entries matter */
+	}
+
+	lock_acquire(mmapobj_lock);
+	mr->mr_obj->mo_refcount++;
+	lock_release(mmapobj_lock);
+
+	mr->mr_vbase += idx * PAGE_SIZE;
+	mr->mr_npages -= idx;
+	mr->mr_firstpage += idx;
+	mr->mr_pages = hipages;
+	mr->mr_next = lo;
+	return 0;
 }
 
+/*
+ * Handle a fault at FAULTADDRESS, which is not in any segment, by
+ * looking for a file mapping that covers it.
+ */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+mmap_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
+	struct mmapregion *mr;
+	struct mmapobj *mo;
+	unsigned idx, page;
+	int frame, newframe, result;
+	bool write, writable;
+	paddr_t pa;
 
-	faultaddress &= PAGE_FRAME;
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (faultaddress >= mr->mr_vbase &&
+		    faultaddress < mr->mr_vbase + mr->mr_npages * PAGE_SIZE) {
+			break;
+		}
+	}
+	if (mr == NULL || mr->mr_prot == PROT_NONE) {
+		return EFAULT;
+	}
+	write = faulttype != VM_FAULT_READ;
+	if (write && !(mr->mr_prot & PROT_WRITE)) {
+		return EFAULT;
+	}
 
-	DEBUG(DB_VM, "dumbvm: fault %d: 0x%x\n", faulttype, faultaddress);
+	idx = (faultaddress - mr->mr_vbase) / PAGE_SIZE;
+	mo = mr->mr_obj;
+	page = mr->mr_firstpage + idx;
 
-	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-			#if OPT_A3
-					return 0;
-			#endif
-		    /* We always create pages read-write, so we can't get this */
-		    panic("dumbvm: got VM_FAULT_READONLY\n");
-			case VM_FAULT_READ:
-			case VM_FAULT_WRITE:
-			break;
-			default:
-			return EINVAL;
+	if (!mr->mr_shared && mr->mr_pages[idx] != PTE_FILE) {
+		/* already has its own copy */
+		mmap_tlbload(faultaddress, mr->mr_pages[idx],
+			     (mr->mr_prot & PROT_WRITE) != 0);
+		return 0;
 	}
 
-	if (curproc == NULL) {
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
+	result = mmapobj_pagein(mo, page, &frame);
+	if (result) {
+		return result;
 	}
 
-	as = curproc_getas();
-	if (as == NULL) {
+	if (mr->mr_shared) {
 		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
+		 * Load the entry before letting go of mo_lock, so that a
+		 * writeback that write-protects the page after we looked
+		 * at its state also flushes what we load.
 		 */
-		return EFAULT;
+		lock_acquire(mo->mo_lock);
+		if (write) {
+			mo->mo_state[page] = MO_DIRTY;
+		}
+		writable = mo->mo_state[page] == MO_DIRTY &&
+			(mr->mr_prot & PROT_WRITE);
+		mmap_tlbload(faultaddress, frame, writable);
+		lock_release(mo->mo_lock);
+		return 0;
+	}
+	else if (write) {
+		/* copy on write */
+		pa = getppages(1);
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		memcpy((void *)PADDR_TO_KVADDR(pa),
+		       (const void *)PADDR_TO_KVADDR(frame_offset + frame * PAGE_SIZE),
+		       PAGE_SIZE);
+		newframe = (pa - frame_offset) / PAGE_SIZE;
+		mr->mr_pages[idx] = newframe;
+		frame = newframe;
+		writable = true;
+	}
+	else {
+		writable = false;
 	}
-	#if OPT_A3
-		KASSERT(as->as_vbase1 != 0);
-		KASSERT(as->as_pbase1 != NULL);
-		KASSERT(as->as_npages1 != 0);
-		KASSERT(as->as_vbase2 != 0);
-		KASSERT(as->as_pbase2 != NULL);
-		KASSERT(as->as_npages2 != 0);
-		KASSERT(as->as_stackpbase != NULL);
-		KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-		KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	#else
-		KASSERT(as->as_vbase1 != 0);
-		KASSERT(as->as_pbase1 != 0);
-		KASSERT(as->as_npages1 != 0);
-		KASSERT(as->as_vbase2 != 0);
-		KASSERT(as->as_pbase2 != 0);
-		KASSERT(as->as_npages2 != 0);
-		KASSERT(as->as_stackpbase != 0);
-		KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-		KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-		KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-		KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-		KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-	#endif 
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
 
-	#if OPT_A3
-		bool code_seg = false;
-	#endif
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-        int page_num = (faultaddress - vbase1) / PAGE_SIZE;
-    	paddr = frame_offset + as->as_pbase1->pages[page_num] * PAGE_SIZE;
-	#if OPT_A3
-		code_seg = true;
-	#endif
+	mmap_tlbload(faultaddress, frame, writable);
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, off_t offset,
+	int prot, bool shared, vaddr_t *ret)
+{
+	struct mmapregion *mr, **pp;
+	size_t npages, i;
+	vaddr_t hi, bottom, size;
+	int result;
+
+	KASSERT(len > 0);
+	KASSERT(offset >= 0 && offset % PAGE_SIZE == 0);
+
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+	if (npages > USERSTACK / PAGE_SIZE ||
+	    offset / PAGE_SIZE + npages > 0x7fffffff) {
+		return ENOMEM;
 	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-        int page_num = (faultaddress - vbase2) / PAGE_SIZE;
-		paddr = frame_offset + as->as_pbase2->pages[page_num] * PAGE_SIZE;
+	size = npages * PAGE_SIZE;
+
+	/*
+	 * Place it as high as it fits: first-fit going down from just
+	 * below the stack (leaving a guard page) to the top of the data
+	 * segment.
+	 */
+	hi = USERSTACK - (DUMBVM_STACKPAGES + 1) * PAGE_SIZE;
+	bottom = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	for (pp = &as->as_mmaps; *pp != NULL; pp = &(*pp)->mr_next) {
+		mr = *pp;
+		if (hi - (mr->mr_vbase + mr->mr_npages * PAGE_SIZE) >= size) {
+			break;
+		}
+		hi = mr->mr_vbase;
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-        int page_num = (faultaddress - stackbase) / PAGE_SIZE;
-		paddr = frame_offset + as->as_stackpbase->pages[page_num] * PAGE_SIZE;
+	if (*pp == NULL && (hi < bottom || hi - bottom < size)) {
+		return ENOMEM;
 	}
-	else return EFAULT;
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+	mr = kmalloc(sizeof(struct mmapregion));
+	if (mr == NULL) {
+		return ENOMEM;
+	}
+	mr->mr_pages = NULL;
+	if (!shared) {
+		mr->mr_pages = kmalloc(npages * sizeof(int));
+		if (mr->mr_pages == NULL) {
+			kfree(mr);
+			return ENOMEM;
+		}
+		for (i = 0; i < npages; i++) {
+			mr->mr_pages[i] = PTE_FILE;
+		}
+	}
+	mr->mr_obj = mmapobj_get(v);
+	if (mr->mr_obj == NULL) {
+		kfree(mr->mr_pages);
+		kfree(mr);
+		return ENOMEM;
+	}
+	mr->mr_firstpage = offset / PAGE_SIZE;
+	result = mmapobj_reserve(mr->mr_obj, mr->mr_firstpage + npages);
+	if (result) {
+		mmapobj_put(mr->mr_obj);
+		kfree(mr->mr_pages);
+		kfree(mr);
+		return result;
+	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	mr->mr_vbase = hi - size;
+	mr->mr_npages = npages;
+	mr->mr_prot = prot;
+	mr->mr_shared = shared;
+	mr->mr_next = *pp;
+	*pp = mr;
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) continue;
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	#if OPT_A3
-        if (code_seg && as->loaded) elo &= ~TLBLO_DIRTY;
-	#endif
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
+	*ret = mr->mr_vbase;
+	return 0;
+}
 
-	#if OPT_A3
-		tlb_random(faultaddress, paddr | TLBLO_DIRTY | TLBLO_VALID);
-		splx(spl);
-		return 0;
-	#else
-		kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-		splx(spl);
-		return EFAULT;
-	#endif
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct mmapregion *mr, **pp;
+	vaddr_t end, mrend;
+	int result, err;
+
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	end = vaddr + ROUNDUP(len, PAGE_SIZE);
+	err = 0;
+	pp = &as->as_mmaps;
+	while ((mr = *pp) != NULL) {
+		mrend = mr->mr_vbase + mr->mr_npages * PAGE_SIZE;
+		if (mrend <= vaddr || mr->mr_vbase >= end) {
+			pp = &mr->mr_next;
+			continue;
+		}
+		if (mr->mr_vbase < vaddr) {
+			/* keep the part below the range as its own region */
+			result = mmap_split(mr, (vaddr - mr->mr_vbase) / PAGE_SIZE);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+		if (mrend > end) {
+			/* and likewise the part above it */
+			result = mmap_split(mr, (end - mr->mr_vbase) / PAGE_SIZE);
+			if (result) {
+				return result;
+			}
+			pp = &mr->mr_next;
+			continue;
+		}
+		*pp = mr->mr_next;
+		result = mmap_release(mr);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
 }
 
-struct addrspace *
-as_create(void)
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
-	if (as==NULL) {
-		return NULL;
+	struct mmapregion *mr;
+	vaddr_t end, lo, hi;
+	bool found;
+	int result, err;
+
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	end = vaddr + ROUNDUP(len, PAGE_SIZE);
+	found = false;
+	err = 0;
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		lo = mr->mr_vbase;
+		hi = lo + mr->mr_npages * PAGE_SIZE;
+		if (hi <= vaddr || lo >= end) {
+			continue;
+		}
+		found = true;
+		if (!mr->mr_shared) {
+			continue;
+		}
+		if (lo < vaddr) {
+			lo = vaddr;
+		}
+		if (hi > end) {
+			hi = end;
+		}
+		result = mmapobj_writeback(mr->mr_obj,
+			mr->mr_firstpage + (lo - mr->mr_vbase) / PAGE_SIZE,
+			(hi - lo) / PAGE_SIZE);
+		if (result && err == 0) {
+			err = result;
+		}
 	}
+	return found ? err : ENOMEM;
+}
 
-	#if OPT_A3
-		as->as_vbase1 = 0;
-		as->as_pbase1 = NULL;
-		as->as_npages1 = 0;
-		as->as_vbase2 = 0;
-		as->as_pbase2 = NULL;
-		as->as_npages2 = 0;
-		as->as_stackpbase = NULL;
-		as->loaded = false;
-	#else
-		as->as_vbase1 = 0;
-		as->as_pbase1 = 0;
-		as->as_npages1 = 0;
-		as->as_vbase2 = 0;
-		as->as_pbase2 = 0;
-		as->as_npages2 = 0;
-		as->as_stackpbase = 0;
-	#endif
-	return as;
+/*
+ * Give NEW a copy of OLD's file mappings, for fork. Shared regions
+ * map the same object; private ones get copies of their private
+ * pages and share the rest with the parent through the object.
+ */
+static
+int
+mmap_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct mmapregion *omr, *mr, **tail;
+	paddr_t pa;
+	unsigned i;
+
+	tail = &new->as_mmaps;
+	for (omr = old->as_mmaps; omr != NULL; omr = omr->mr_next) {
+		mr = kmalloc(sizeof(struct mmapregion));
+		if (mr == NULL) {
+			return ENOMEM;
+		}
+		*mr = *omr;
+		mr->mr_next = NULL;
+		if (!omr->mr_shared) {
+			mr->mr_pages = kmalloc(mr->mr_npages * sizeof(int));
+			if (mr->mr_pages == NULL) {
+				kfree(mr);
+				return ENOMEM;
+			}
+			for (i = 0; i < mr->mr_npages; i++) {
+				mr->mr_pages[i] = PTE_FILE;
+			}
+		}
+		lock_acquire(mmapobj_lock);
+		mr->mr_obj->mo_refcount++;
+		lock_release(mmapobj_lock);
+		/* linked in now, so as_destroy cleans up after a failure */
+		*tail = mr;
+		tail = &mr->mr_next;
+
+		if (omr->mr_shared) {
+			continue;
+		}
+		for (i = 0; i < mr->mr_npages; i++) {
+			if (omr->mr_pages[i] == PTE_FILE) {
+				continue;
+			}
+			pa = getppages(1);
+			if (pa == 0) {
+				return ENOMEM;
+			}
+			memcpy((void *)PADDR_TO_KVADDR(pa),
+			       (const void *)PADDR_TO_KVADDR(frame_offset + omr->mr_pages[i] * PAGE_SIZE),
+			       PAGE_SIZE);
+			mr->mr_pages[i] = (pa - frame_offset) / PAGE_SIZE;
+		}
+	}
+	return 0;
 }
+#endif
 
 void
 as_destroy(struct addrspace *as)
 {
 	#if OPT_A3
-		for (unsigned int i = 0; i < as->as_npages1; i++) free_kpages(PADDR_TO_KVADDR(frame_offset + as->as_pbase1->pages[i] * PAGE_SIZE));
-		for (unsigned int i = 0; i < as->as_npages2; i++) free_kpages(PADDR_TO_KVADDR(frame_offset + as->as_pbase2->pages[i] * PAGE_SIZE));
-		for (unsigned int i = 0; i < DUMBVM_STACKPAGES; i++) free_kpages(PADDR_TO_KVADDR(frame_offset + as->as_stackpbase->pages[i] * PAGE_SIZE));
+		struct mmapregion *mr;
+
+		while ((mr = as->as_mmaps) != NULL) {
+			as->as_mmaps = mr->mr_next;
+			/* nobody to report a writeback error to */
+			mmap_release(mr);
+		}
+		if (as->as_text != NULL) {
+			as_text_release(as);
+		}
+		else {
+			pt_free_frames(as->as_pbase1, as->as_npages1);
+		}
+		pt_free_frames(as->as_pbase2, as->as_npages2);
+		pt_free_frames(as->as_stackpbase, DUMBVM_STACKPAGES);
 		kfree(as->as_pbase1->pages);
 		kfree(as->as_pbase2->pages);
 		kfree(as->as_stackpbase->pages);
@@ -361,6 +2079,9 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+		tlb_owner[curcpu->c_number] = as;
+	#endif
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
@@ -448,20 +2169,19 @@ as_prepare_load(struct addrspace *as)
 			return ENOMEM;
 		}
 		as->as_stackpbase->size = DUMBVM_STACKPAGES;
+		/*
+		 * No frames are allocated (or zeroed) here. Every page starts
+		 * out on the shared zero frame and gets a frame of its own on
+		 * its first write fault, either from load_elf or the program.
+		 */
 		for (unsigned int i = 0; i < as->as_npages1; i++) {
-			paddr_t tmp = getppages(1);
-			if (tmp == 0) return ENOMEM;
-			as->as_pbase1->pages[i] = (tmp - frame_offset) / PAGE_SIZE;
+			as->as_pbase1->pages[i] = PTE_ZERO;
 		}
 		for (unsigned int i = 0; i < as->as_npages2; i++) {
-			paddr_t tmp = getppages(1);
-			if (tmp == 0) return ENOMEM;
-			as->as_pbase2->pages[i] = (tmp - frame_offset) / PAGE_SIZE;
+			as->as_pbase2->pages[i] = PTE_ZERO;
 		}
 		for (int i = 0; i < DUMBVM_STACKPAGES; i++) {
-			paddr_t tmp = getppages(1);
-			if (tmp == 0) return ENOMEM;
-			as->as_stackpbase->pages[i] = (tmp - frame_offset) / PAGE_SIZE;
+			as->as_stackpbase->pages[i] = PTE_ZERO;
 		}
 	#else
 		KASSERT(as->as_pbase1 == 0);
@@ -503,6 +2223,36 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Give every written page of OLD a copy in NEW. Pages still on the
+ * zero frame stay there in the copy too.
+ */
+static
+int
+pt_copy_frames(struct addrspace *as, pagetable *old, pagetable *new,
+	       unsigned int npages, vaddr_t vbase)
+{
+	for (unsigned int i = 0; i < npages; i++) {
+		if (old->pages[i] == PTE_ZERO) {
+			continue;
+		}
+		paddr_t tmp = getppages(1);
+		if (tmp == 0) return ENOMEM;
+		int idx = (tmp - frame_offset) / PAGE_SIZE;
+		/* the lock keeps compaction from moving the source frame */
+		spinlock_acquire(&coremap_lock);
+		memmove((void *)PADDR_TO_KVADDR(tmp), (const void *)PADDR_TO_KVADDR(frame_offset + old->pages[i] * PAGE_SIZE), PAGE_SIZE);
+		new->pages[i] = idx;
+		coremap_rmap[idx].rm_pte = &new->pages[i];
+		coremap_rmap[idx].rm_as = as;
+		coremap_rmap[idx].rm_vaddr = vbase + i * PAGE_SIZE;
+		spinlock_release(&coremap_lock);
+	}
+	return 0;
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -524,14 +2274,27 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 	#if OPT_A3
-		for (unsigned int i = 0; i < old->as_npages1; i++) {
-			memmove((void *)PADDR_TO_KVADDR(frame_offset + new->as_pbase1->pages[i] * PAGE_SIZE), (const void *)PADDR_TO_KVADDR(frame_offset + old->as_pbase1->pages[i] * PAGE_SIZE), PAGE_SIZE);
+		new->loaded = old->loaded;
+		if (old->as_text != NULL) {
+			/* the child maps the same shared text */
+			lock_acquire(sharedtext_lock);
+			old->as_text->st_refcount++;
+			lock_release(sharedtext_lock);
+			new->as_text = old->as_text;
+			memcpy(new->as_pbase1->pages, old->as_pbase1->pages,
+			       old->as_npages1 * sizeof(int));
 		}
-		for (unsigned int i = 0; i < old->as_npages2; i++) {
-			memmove((void *)PADDR_TO_KVADDR(frame_offset + new->as_pbase2->pages[i] * PAGE_SIZE), (const void *)PADDR_TO_KVADDR(frame_offset + old->as_pbase2->pages[i] * PAGE_SIZE), PAGE_SIZE);
-		}
-		for (unsigned int i = 0; i < DUMBVM_STACKPAGES; i++) {
-			memmove((void *)PADDR_TO_KVADDR(frame_offset + new->as_stackpbase->pages[i] * PAGE_SIZE), (const void *)PADDR_TO_KVADDR(frame_offset + old->as_stackpbase->pages[i] * PAGE_SIZE), PAGE_SIZE);
+		if ((new->as_text == NULL &&
+		     pt_copy_frames(new, old->as_pbase1, new->as_pbase1,
+				    old->as_npages1, old->as_vbase1)) ||
+		    pt_copy_frames(new, old->as_pbase2, new->as_pbase2,
+				   old->as_npages2, old->as_vbase2) ||
+		    pt_copy_frames(new, old->as_stackpbase, new->as_stackpbase,
+				   DUMBVM_STACKPAGES,
+				   USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE) ||
+		    mmap_copy(old, new)) {
+			as_destroy(new);
+			return ENOMEM;
 		}
 	#else
 		KASSERT(new->as_pbase1 != 0);
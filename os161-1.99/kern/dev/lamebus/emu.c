@@ -43,14 +43,18 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/dirent.h>
 #include <stat.h>
 #include <lib.h>
+#include <limits.h>
 #include <array.h>
 #include <uio.h>
 #include <synch.h>
+#include <vm.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <mainbus.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -389,6 +393,541 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Page cache
+//
+// Functions that take an emufs_vnode are called with its ev_lock
+// held; the ones whose names end in "_locked" also want ef_pagelock.
+//
+
+/*
+ * Find out the file size from the host, if we don't know it yet.
+ * After that the cache keeps track of it.
+ */
+static
+int
+emufs_knowsize(struct emufs_vnode *ev)
+{
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (ev->ev_size >= 0) {
+		return 0;
+	}
+	return emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+}
+
+/*
+ * Set up a uio for one device transfer covering the N pages in RUN,
+ * which are adjacent in the file, from byte START of the first page
+ * to byte END of the last.
+ */
+static
+void
+emufs_runinit(struct iovec *iov, struct uio *u, struct emufs_page **run,
+	      unsigned n, unsigned start, unsigned end, enum uio_rw rw)
+{
+	unsigned i;
+
+	KASSERT(n > 0 && n <= EMUFS_CLUSTER);
+
+	uio_kinit(&iov[0], u, run[0]->ep_data + start, PAGE_SIZE - start,
+		  run[0]->ep_pos + start, rw);
+	for (i=1; i<n; i++) {
+		iov[i].iov_kbase = run[i]->ep_data;
+		iov[i].iov_len = PAGE_SIZE;
+		u->uio_resid += PAGE_SIZE;
+	}
+	iov[n-1].iov_len -= PAGE_SIZE - end;
+	u->uio_resid -= PAGE_SIZE - end;
+	u->uio_iovcnt = n;
+}
+
+static
+unsigned
+emufs_pagehash(struct emufs_vnode *ev, off_t pos)
+{
+	return (ev->ev_handle * 31 + (unsigned)(pos / PAGE_SIZE))
+		% EMUFS_PAGEHASHSIZE;
+}
+
+static
+void
+emufs_lru_remove_locked(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	if (ep->ep_lruprev != NULL) {
+		ep->ep_lruprev->ep_lrunext = ep->ep_lrunext;
+	}
+	else {
+		ef->ef_lruhead = ep->ep_lrunext;
+	}
+	if (ep->ep_lrunext != NULL) {
+		ep->ep_lrunext->ep_lruprev = ep->ep_lruprev;
+	}
+	else {
+		ef->ef_lrutail = ep->ep_lruprev;
+	}
+	ep->ep_lruprev = ep->ep_lrunext = NULL;
+}
+
+/*
+ * Put a page that is no longer busy on the LRU list: at the end if
+ * it holds part of a file, or at the front, to be reused first, if
+ * it holds nothing.
+ */
+static
+void
+emufs_lru_insert_locked(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	if (ep->ep_owner == NULL) {
+		ep->ep_lruprev = NULL;
+		ep->ep_lrunext = ef->ef_lruhead;
+		if (ef->ef_lruhead != NULL) {
+			ef->ef_lruhead->ep_lruprev = ep;
+		}
+		else {
+			ef->ef_lrutail = ep;
+		}
+		ef->ef_lruhead = ep;
+	}
+	else {
+		ep->ep_lrunext = NULL;
+		ep->ep_lruprev = ef->ef_lrutail;
+		if (ef->ef_lrutail != NULL) {
+			ef->ef_lrutail->ep_lrunext = ep;
+		}
+		else {
+			ef->ef_lruhead = ep;
+		}
+		ef->ef_lrutail = ep;
+	}
+}
+
+/*
+ * Find the cached page at file offset POS, or NULL.
+ */
+static
+struct emufs_page *
+emufs_findpage_locked(struct emufs_fs *ef, struct emufs_vnode *ev,
+		      off_t pos)
+{
+	struct emufs_page *ep;
+
+	KASSERT(lock_do_i_hold(ef->ef_pagelock));
+
+	for (ep = ef->ef_pagehash[emufs_pagehash(ev, pos)]; ep != NULL;
+	     ep = ep->ep_hashnext) {
+		if (ep->ep_owner == ev && ep->ep_pos == pos) {
+			return ep;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make a page hold file offset POS of EV.
+ */
+static
+void
+emufs_hashpage_locked(struct emufs_fs *ef, struct emufs_page *ep,
+		      struct emufs_vnode *ev, off_t pos)
+{
+	unsigned h;
+
+	KASSERT(ep->ep_owner == NULL);
+
+	h = emufs_pagehash(ev, pos);
+	ep->ep_owner = ev;
+	ep->ep_pos = pos;
+	ep->ep_dirtystart = ep->ep_dirtyend = 0;
+	ep->ep_hashnext = ef->ef_pagehash[h];
+	ef->ef_pagehash[h] = ep;
+	ev->ev_npages++;
+}
+
+/*
+ * Make a page hold nothing, forgetting whatever dirty bytes it has.
+ */
+static
+void
+emufs_unhashpage_locked(struct emufs_fs *ef, struct emufs_page *ep)
+{
+	struct emufs_page **epp;
+
+	KASSERT(ep->ep_owner != NULL);
+
+	epp = &ef->ef_pagehash[emufs_pagehash(ep->ep_owner, ep->ep_pos)];
+	while (*epp != ep) {
+		KASSERT(*epp != NULL);
+		epp = &(*epp)->ep_hashnext;
+	}
+	*epp = ep->ep_hashnext;
+	ep->ep_hashnext = NULL;
+
+	KASSERT(ep->ep_owner->ev_npages > 0);
+	ep->ep_owner->ev_npages--;
+	ep->ep_owner = NULL;
+	ep->ep_pos = EMUFS_NOPAGE;
+	ep->ep_dirtystart = ep->ep_dirtyend = 0;
+}
+
+/*
+ * Check whether file offset POS is cached.
+ */
+static
+bool
+emufs_iscached(struct emufs_vnode *ev, off_t pos)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	bool ret;
+
+	lock_acquire(ef->ef_pagelock);
+	ret = emufs_findpage_locked(ef, ev, pos) != NULL;
+	lock_release(ef->ef_pagelock);
+	return ret;
+}
+
+/*
+ * Get the cached page at file offset POS, busy, or NULL if it is not
+ * cached. Give it back with emufs_putpage.
+ */
+static
+struct emufs_page *
+emufs_getpage(struct emufs_vnode *ev, off_t pos)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	struct emufs_page *ep;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	lock_acquire(ef->ef_pagelock);
+	ep = emufs_findpage_locked(ef, ev, pos);
+	if (ep != NULL) {
+		/* Only the ev_lock holder busies the file's pages */
+		KASSERT(!ep->ep_busy);
+		emufs_lru_remove_locked(ef, ep);
+		ep->ep_busy = true;
+	}
+	lock_release(ef->ef_pagelock);
+	return ep;
+}
+
+/*
+ * Give back a busy page.
+ */
+static
+void
+emufs_putpage(struct emufs_vnode *ev, struct emufs_page *ep)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+
+	lock_acquire(ef->ef_pagelock);
+	KASSERT(ep->ep_busy);
+	KASSERT(ep->ep_owner == ev);
+	ep->ep_busy = false;
+	emufs_lru_insert_locked(ef, ep);
+	lock_release(ef->ef_pagelock);
+}
+
+/*
+ * Give back a busy page whose contents are no good.
+ */
+static
+void
+emufs_droppage(struct emufs_vnode *ev, struct emufs_page *ep)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+
+	lock_acquire(ef->ef_pagelock);
+	KASSERT(ep->ep_busy);
+	KASSERT(ep->ep_owner == ev);
+	emufs_unhashpage_locked(ef, ep);
+	ep->ep_busy = false;
+	emufs_lru_insert_locked(ef, ep);
+	lock_release(ef->ef_pagelock);
+}
+
+/*
+ * Write N busy pages, which are adjacent in the file, to the host in
+ * one transfer: from the start of the first page's dirty bytes to the
+ * end of the last page's. On success they are clean.
+ */
+static
+int
+emufs_writerun(struct emufs_vnode *ev, struct emufs_page **run, unsigned n)
+{
+	struct iovec iov[EMUFS_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	emufs_runinit(iov, &ku, run, n, run[0]->ep_dirtystart,
+		      run[n-1]->ep_dirtyend, UIO_WRITE);
+	result = emu_write(ev->ev_emu, ev->ev_handle, ku.uio_resid, &ku);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<n; i++) {
+		run[i]->ep_dirtystart = run[i]->ep_dirtyend = 0;
+	}
+	return 0;
+}
+
+/*
+ * Write all the file's dirty pages back to the host. A run of pages
+ * that are adjacent in the file, and dirty all the way across the
+ * boundaries between them, goes in one transfer.
+ */
+static
+int
+emufs_flush(struct emufs_vnode *ev)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	struct emufs_page *run[EMUFS_CLUSTER], *ep;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	while (1) {
+		lock_acquire(ef->ef_pagelock);
+
+		/* Start with the lowest dirty page */
+		run[0] = NULL;
+		for (i=0; i<ef->ef_npages; i++) {
+			ep = &ef->ef_pages[i];
+			if (ep->ep_owner == ev &&
+			    ep->ep_dirtystart < ep->ep_dirtyend &&
+			    (run[0] == NULL || ep->ep_pos < run[0]->ep_pos)) {
+				run[0] = ep;
+			}
+		}
+		if (run[0] == NULL) {
+			lock_release(ef->ef_pagelock);
+			return 0;
+		}
+
+		/* Add following pages while the dirty bytes are contiguous */
+		for (n=1; n<EMUFS_CLUSTER; n++) {
+			if (run[n-1]->ep_dirtyend < PAGE_SIZE) {
+				break;
+			}
+			ep = emufs_findpage_locked(ef, ev,
+						   run[n-1]->ep_pos + PAGE_SIZE);
+			if (ep == NULL || ep->ep_dirtystart != 0 ||
+			    ep->ep_dirtyend == 0) {
+				break;
+			}
+			run[n] = ep;
+		}
+
+		/* Dirty pages are never left busy by their own file */
+		for (i=0; i<n; i++) {
+			KASSERT(!run[i]->ep_busy);
+			emufs_lru_remove_locked(ef, run[i]);
+			run[i]->ep_busy = true;
+		}
+		lock_release(ef->ef_pagelock);
+
+		result = emufs_writerun(ev, run, n);
+
+		for (i=0; i<n; i++) {
+			emufs_putpage(ev, run[i]);
+		}
+		if (result) {
+			return result;
+		}
+	}
+}
+
+/*
+ * Get a page, busy, to cache file offset POS in, which must not be
+ * cached already. Take an empty page if there is one, or allocate
+ * one if the pool is not full yet, or else reuse the least recently
+ * used page that is clean or belongs to this file, writing back this
+ * file's dirty pages first if need be. If there is nothing to be
+ * had, hand back NULL; the caller then goes to the device directly.
+ *
+ * The page's contents are left as they were.
+ */
+static
+int
+emufs_newpage(struct emufs_vnode *ev, off_t pos, struct emufs_page **ret)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	struct emufs_page *ep;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+ again:
+	lock_acquire(ef->ef_pagelock);
+	KASSERT(emufs_findpage_locked(ef, ev, pos) == NULL);
+
+	ep = ef->ef_lruhead;
+	if ((ep == NULL || ep->ep_owner != NULL) &&
+	    ef->ef_npages < ef->ef_maxpages) {
+		data = kmalloc(PAGE_SIZE);
+		if (data != NULL) {
+			ep = &ef->ef_pages[ef->ef_npages++];
+			ep->ep_data = data;
+			ep->ep_busy = true;
+			emufs_hashpage_locked(ef, ep, ev, pos);
+			lock_release(ef->ef_pagelock);
+			*ret = ep;
+			return 0;
+		}
+	}
+
+	while (ep != NULL && ep->ep_owner != NULL && ep->ep_owner != ev &&
+	       ep->ep_dirtystart < ep->ep_dirtyend) {
+		/* Another file's unwritten data; leave it to that file */
+		ep = ep->ep_lrunext;
+	}
+	if (ep == NULL) {
+		lock_release(ef->ef_pagelock);
+		*ret = NULL;
+		return 0;
+	}
+
+	if (ep->ep_dirtystart < ep->ep_dirtyend) {
+		KASSERT(ep->ep_owner == ev);
+		lock_release(ef->ef_pagelock);
+		result = emufs_flush(ev);
+		if (result) {
+			return result;
+		}
+		goto again;
+	}
+
+	emufs_lru_remove_locked(ef, ep);
+	if (ep->ep_owner != NULL) {
+		emufs_unhashpage_locked(ef, ep);
+	}
+	ep->ep_busy = true;
+	emufs_hashpage_locked(ef, ep, ev, pos);
+	lock_release(ef->ef_pagelock);
+
+	*ret = ep;
+	return 0;
+}
+
+/*
+ * Read the page at file offset POS, which must be below EOF and not
+ * cached, from the host along with up to NPAGES-1 pages after it,
+ * in one transfer. Stops early at EOF or at a page that is already
+ * cached. Hands back the page for POS, busy, or NULL as for
+ * emufs_newpage.
+ */
+static
+int
+emufs_fill(struct emufs_vnode *ev, off_t pos, unsigned npages,
+	   struct emufs_page **ret)
+{
+	struct emufs_page *run[EMUFS_CLUSTER];
+	struct iovec iov[EMUFS_CLUSTER];
+	struct uio ku;
+	unsigned i, n, start;
+	size_t oldresid, got;
+	int result;
+
+	KASSERT(pos < ev->ev_size);
+	KASSERT(npages > 0 && npages <= EMUFS_CLUSTER);
+
+	for (n=0; n<npages; n++) {
+		off_t pagepos = pos + n * PAGE_SIZE;
+
+		if (n > 0 && (pagepos >= ev->ev_size ||
+			      emufs_iscached(ev, pagepos))) {
+			break;
+		}
+		result = emufs_newpage(ev, pagepos, &run[n]);
+		if (result == 0 && run[n] == NULL && n > 0) {
+			break;
+		}
+		if (result || run[n] == NULL) {
+			for (i=0; i<n; i++) {
+				emufs_droppage(ev, run[i]);
+			}
+			*ret = NULL;
+			return result;
+		}
+	}
+
+	emufs_runinit(iov, &ku, run, n, 0, PAGE_SIZE, UIO_READ);
+	while (ku.uio_resid > 0) {
+		oldresid = ku.uio_resid;
+		result = emu_read(ev->ev_emu, ev->ev_handle, ku.uio_resid,
+				  &ku);
+		if (result) {
+			for (i=0; i<n; i++) {
+				emufs_droppage(ev, run[i]);
+			}
+			*ret = NULL;
+			return result;
+		}
+		if (ku.uio_resid == oldresid) {
+			/* EOF */
+			break;
+		}
+	}
+
+	/* Anything past EOF reads as zeros */
+	got = n * PAGE_SIZE - ku.uio_resid;
+	for (i=got / PAGE_SIZE; i<n; i++) {
+		start = i == got / PAGE_SIZE ? got % PAGE_SIZE : 0;
+		bzero(run[i]->ep_data + start, PAGE_SIZE - start);
+	}
+
+	for (i=1; i<n; i++) {
+		emufs_putpage(ev, run[i]);
+	}
+	*ret = run[0];
+	return 0;
+}
+
+/*
+ * Drop cached data at or past LEN, after the file is truncated to
+ * LEN; the page LEN falls in keeps its bytes before LEN. With LEN 0
+ * this forgets the whole file.
+ */
+static
+void
+emufs_truncpages(struct emufs_vnode *ev, off_t len)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	struct emufs_page *ep;
+	unsigned i, keep;
+
+	lock_acquire(ef->ef_pagelock);
+	for (i=0; i<ef->ef_npages && ev->ev_npages > 0; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_owner != ev || ep->ep_pos + PAGE_SIZE <= len) {
+			continue;
+		}
+		KASSERT(!ep->ep_busy);
+		if (ep->ep_pos >= len) {
+			emufs_unhashpage_locked(ef, ep);
+			emufs_lru_remove_locked(ef, ep);
+			emufs_lru_insert_locked(ef, ep);
+			continue;
+		}
+		keep = len - ep->ep_pos;
+		bzero(ep->ep_data + keep, PAGE_SIZE - keep);
+		if (ep->ep_dirtyend > keep) {
+			ep->ep_dirtyend = keep;
+		}
+		if (ep->ep_dirtystart > keep) {
+			ep->ep_dirtystart = keep;
+		}
+	}
+	lock_release(ef->ef_pagelock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////
 //
 // vnode functions 
@@ -448,19 +987,153 @@ emufs_opendir(struct vnode *v, int openflags)
 
 /*
  * VOP_CLOSE
+ *
+ * Write back cached data, so that once a file is closed the host
+ * sees what was written.
  */
 static
 int
 emufs_close(struct vnode *v)
 {
-	(void)v;
+	struct emufs_vnode *ev = v->vn_data;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_flush(ev);
+	lock_release(ev->ev_lock);
+	return result;
+}
+
+/*
+ * Get rid of a vnode nobody holds any more: write back its pages and
+ * forget them, close the host file, and free it. Called with
+ * vfs_biglock held, which protects the vnode table and the
+ * reference count. Nobody else can be using the vnode, so taking
+ * its lock won't wait.
+ */
+static
+int
+emufs_destroy(struct emufs_vnode *ev)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	struct emufs_vnode **evp;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(ev->ev_v.vn_refcount == 1);
+	KASSERT(!ev->ev_kept);
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_flush(ev);
+	if (result == 0) {
+		emufs_truncpages(ev, 0);
+	}
+	lock_release(ev->ev_lock);
+	if (result) {
+		return result;
+	}
+
+	/* emu_close retries on I/O error */
+	result = emu_close(ev->ev_emu, ev->ev_handle);
+	if (result) {
+		return result;
+	}
+
+	evp = &ef->ef_vnhash[ev->ev_handle % EMUFS_VNHASHSIZE];
+	while (*evp != ev) {
+		if (*evp == NULL) {
+			panic("emu%d: reclaim vnode %u not in vnode pool\n",
+			      ef->ef_emu->e_unit, ev->ev_handle);
+		}
+		evp = &(*evp)->ev_hashnext;
+	}
+	*evp = ev->ev_hashnext;
+
+	KASSERT(ev->ev_npages == 0);
+	VOP_CLEANUP(&ev->ev_v);
+	lock_destroy(ev->ev_lock);
+	kfree(ev);
 	return 0;
 }
 
+/*
+ * Take entry I off the list of kept vnodes, and drop the reference
+ * the list held. If nobody else has the vnode, that is the end of it.
+ */
+static
+void
+emufs_unkeep(struct emufs_fs *ef, unsigned i)
+{
+	struct emufs_vnode *ev;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(i < ef->ef_nkeep);
+
+	ev = ef->ef_keep[i];
+	ef->ef_nkeep--;
+	for (; i < ef->ef_nkeep; i++) {
+		ef->ef_keep[i] = ef->ef_keep[i+1];
+	}
+	KASSERT(ev->ev_kept);
+	ev->ev_kept = false;
+
+	if (ev->ev_v.vn_refcount > 1) {
+		ev->ev_v.vn_refcount--;
+		return;
+	}
+	result = emufs_destroy(ev);
+	if (result) {
+		/* As in vnode_decref; the vnode stays around unused. */
+		kprintf("emu%d: Warning: dropping cached file: %s\n",
+			ef->ef_emu->e_unit, strerror(result));
+	}
+}
+
+/*
+ * A vnode with pages cached is being released. Keep it loaded, and
+ * put it at the end of the list of kept vnodes, making room if need
+ * be by letting go of one that has had all its pages reused, or
+ * failing that the one released longest ago. Returns false if the
+ * vnode has nothing cached and isn't worth keeping.
+ */
+static
+bool
+emufs_keep(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	unsigned i, npages;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(!ev->ev_kept);
+
+	lock_acquire(ef->ef_pagelock);
+	npages = ev->ev_npages;
+	for (i=0; i<ef->ef_nkeep; i++) {
+		if (ef->ef_keep[i]->ev_npages == 0) {
+			break;
+		}
+	}
+	lock_release(ef->ef_pagelock);
+
+	if (npages == 0) {
+		return false;
+	}
+	if (ef->ef_nkeep == EMUFS_KEEPVNODES) {
+		emufs_unkeep(ef, i < ef->ef_nkeep ? i : 0);
+	}
+	ef->ef_keep[ef->ef_nkeep++] = ev;
+	ev->ev_kept = true;
+	return true;
+}
+
 /*
  * VOP_RECLAIM
  *
  * Reclaim should make an effort to returning errors other than EBUSY.
+ *
+ * A file with pages cached is kept instead (see emufs.h); the list
+ * of kept vnodes takes over the last reference, so we leave the
+ * count alone and say EBUSY.
  */
 static
 int
@@ -468,91 +1141,122 @@ emufs_reclaim(struct vnode *v)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	struct emufs_fs *ef = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
-	 */
-
 	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
 
 	if (ev->ev_v.vn_refcount != 1) {
-		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
 
-	/* emu_close retries on I/O error */
-	result = emu_close(ev->ev_emu, ev->ev_handle);
+	/* The list's reference is never dropped through here */
+	KASSERT(!ev->ev_kept);
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_flush(ev);
+	lock_release(ev->ev_lock);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return result;
 	}
 
-	num = vnodearray_num(ef->ef_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *vx;
-
-		vx = vnodearray_get(ef->ef_vnodes, i);
-		if (vx == v) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("emu%d: reclaim vnode %u not in vnode pool\n",
-		      ef->ef_emu->e_unit, ev->ev_handle);
+	if (emufs_keep(ef, ev)) {
+		vfs_biglock_release();
+		return EBUSY;
 	}
 
-	vnodearray_remove(ef->ef_vnodes, ix);
-	VOP_CLEANUP(&ev->ev_v);
-
-	lock_release(ef->ef_emu->e_lock);
+	result = emufs_destroy(ev);
 	vfs_biglock_release();
-
-	kfree(ev);
-	return 0;
+	return result;
 }
 
 /*
  * VOP_READ
+ *
+ * Reads come out of the cache. A miss fills a cluster of pages in
+ * one transfer if the read continues the previous one or is that
+ * big itself, or just the page needed otherwise. If no page can be
+ * had, read straight from the host.
  */
 static
 int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_page *ep;
+	off_t pos;
 	uint32_t amt;
-	size_t oldresid;
+	size_t oldresid, off, len;
+	unsigned npages;
+	bool seq;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+	lock_acquire(ev->ev_lock);
+
+	result = emufs_knowsize(ev);
+	if (result) {
+		goto out;
+	}
+	seq = uio->uio_offset == ev->ev_ranext;
+
+	while (uio->uio_resid > 0 && uio->uio_offset < ev->ev_size) {
+		off = uio->uio_offset % PAGE_SIZE;
+		pos = uio->uio_offset - off;
+		ep = emufs_getpage(ev, pos);
+		if (ep == NULL) {
+			npages = seq ? EMUFS_CLUSTER :
+				DIVROUNDUP(off + uio->uio_resid, PAGE_SIZE);
+			if (npages > EMUFS_CLUSTER) {
+				npages = EMUFS_CLUSTER;
+			}
+			result = emufs_fill(ev, pos, npages, &ep);
+			if (result) {
+				goto out;
+			}
 		}
 
-		oldresid = uio->uio_resid;
+		if (ep == NULL) {
+			/*
+			 * No cache space; go to the host, for this page
+			 * only, as later ones may be cached.
+			 */
+			amt = PAGE_SIZE - off;
+			if (amt > uio->uio_resid) {
+				amt = uio->uio_resid;
+			}
+			oldresid = uio->uio_resid;
+			result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
+			if (result) {
+				goto out;
+			}
+			if (uio->uio_resid == oldresid) {
+				/* nothing read - EOF */
+				break;
+			}
+			continue;
+		}
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		len = PAGE_SIZE - off;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
 		}
-		
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
-			break;
+		if (len > ev->ev_size - uio->uio_offset) {
+			len = ev->ev_size - uio->uio_offset;
+		}
+		result = uiomove(ep->ep_data + off, len, uio);
+		emufs_putpage(ev, ep);
+		if (result) {
+			goto out;
 		}
 	}
+	ev->ev_ranext = uio->uio_offset;
 
-	return 0;
+ out:
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -575,40 +1279,186 @@ emufs_getdirentry(struct vnode *v, struct uio *uio)
 	return emu_readdir(ev->ev_emu, ev->ev_handle, amt, uio);
 }
 
+/*
+ * VOP_GETDIRENTRIES
+ *
+ * The host hands out one name per request, so this is a loop over
+ * emu_readdir. The seek position is the host's cookie; if a name
+ * doesn't fit, the position is left before it so the next call
+ * fetches it again. The host doesn't tell us inode numbers or types.
+ */
+static
+int
+emufs_getdirentries(struct vnode *v, struct uio *uio)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	struct dirent *rec;
+	struct iovec iov;
+	struct uio ku;
+	size_t namlen, reclen;
+	off_t pos;
+	int count, result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	rec = kmalloc(DIRENT_RECLEN(NAME_MAX));
+	if (rec == NULL) {
+		return ENOMEM;
+	}
+
+	pos = uio->uio_offset;
+	count = 0;
+	while (1) {
+		bzero(rec, DIRENT_RECLEN(NAME_MAX));
+		uio_kinit(&iov, &ku, rec->d_name, NAME_MAX, pos, UIO_READ);
+		result = emu_readdir(ev->ev_emu, ev->ev_handle, NAME_MAX, &ku);
+		if (result) {
+			break;
+		}
+		namlen = NAME_MAX - ku.uio_resid;
+		if (namlen == 0) {
+			/* end of directory */
+			break;
+		}
+
+		reclen = DIRENT_RECLEN(namlen);
+		if (reclen > uio->uio_resid) {
+			if (count == 0) {
+				result = EINVAL;
+			}
+			break;
+		}
+		rec->d_ino = 0;
+		rec->d_reclen = reclen;
+		rec->d_type = DT_UNKNOWN;
+		rec->d_namlen = namlen;
+
+		result = uiomove(rec, reclen, uio);
+		if (result) {
+			break;
+		}
+		pos = ku.uio_offset;
+		count++;
+	}
+	uio->uio_offset = pos;
+
+	kfree(rec);
+	return result;
+}
+
 /*
  * VOP_WRITE
+ *
+ * Writes go into the cache and are written back later (see
+ * emufs_flush). A page only partly overwritten is read in first,
+ * unless the rest of it is past EOF. If no page can be had, write
+ * straight to the host.
  */
 static
 int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_page *ep;
+	off_t pos;
 	uint32_t amt;
-	size_t oldresid;
+	size_t oldresid, off, len;
+	bool unfilled;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	lock_acquire(ev->ev_lock);
+
+	result = emufs_knowsize(ev);
+	if (result) {
+		goto out;
+	}
+
 	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		off = uio->uio_offset % PAGE_SIZE;
+		pos = uio->uio_offset - off;
+		len = PAGE_SIZE - off;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
 		}
 
-		oldresid = uio->uio_resid;
+		unfilled = false;
+		ep = emufs_getpage(ev, pos);
+		if (ep == NULL) {
+			if ((off > 0 || off + len < PAGE_SIZE) &&
+			    pos < ev->ev_size) {
+				result = emufs_fill(ev, pos, 1, &ep);
+			}
+			else {
+				result = emufs_newpage(ev, pos, &ep);
+				if (result == 0 && ep != NULL) {
+					bzero(ep->ep_data, PAGE_SIZE);
+					unfilled = pos < ev->ev_size;
+				}
+			}
+			if (result) {
+				goto out;
+			}
+		}
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		if (ep == NULL) {
+			/*
+			 * No cache space; go to the host, for this page
+			 * only, as later ones may be cached.
+			 */
+			amt = len;
+			oldresid = uio->uio_resid;
+			result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
+			if (result) {
+				goto out;
+			}
+			if (uio->uio_offset > ev->ev_size) {
+				ev->ev_size = uio->uio_offset;
+			}
+			if (uio->uio_resid == oldresid) {
+				/* nothing written...? */
+				break;
+			}
+			continue;
 		}
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
-			break;
+		result = uiomove(ep->ep_data + off, len, uio);
+
+		/* If uiomove failed partway, keep what it did copy. */
+		len = uio->uio_offset - (pos + off);
+		if (len > 0 && ep->ep_dirtystart == ep->ep_dirtyend) {
+			ep->ep_dirtystart = off;
+			ep->ep_dirtyend = off + len;
+		}
+		else if (len > 0) {
+			if (off < ep->ep_dirtystart) {
+				ep->ep_dirtystart = off;
+			}
+			if (off + len > ep->ep_dirtyend) {
+				ep->ep_dirtyend = off + len;
+			}
+		}
+		if (uio->uio_offset > ev->ev_size) {
+			ev->ev_size = uio->uio_offset;
+		}
+		if (result && unfilled) {
+			/* The rest of the page isn't really zeros */
+			if (ep->ep_dirtystart < ep->ep_dirtyend) {
+				emufs_writerun(ev, &ep, 1);
+			}
+			emufs_droppage(ev, ep);
+			goto out;
+		}
+		emufs_putpage(ev, ep);
+		if (result) {
+			goto out;
 		}
 	}
 
-	return 0;
+ out:
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -641,7 +1491,11 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	/* The cache may know of writes the host hasn't seen yet */
+	lock_acquire(ev->ev_lock);
+	result = emufs_knowsize(ev);
+	statbuf->st_size = ev->ev_size;
+	lock_release(ev->ev_lock);
 	if (result) {
 		return result;
 	}
@@ -705,8 +1559,13 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	struct emufs_vnode *ev = v->vn_data;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_flush(ev);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -717,7 +1576,19 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_flush(ev);
+	if (result == 0) {
+		result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	}
+	if (result == 0) {
+		emufs_truncpages(ev, len);
+		ev->ev_size = len;
+	}
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -1083,6 +1954,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_read,
 	emufs_readlink_notlink,
 	emufs_uio_op_notdir, /* getdirentry */
+	emufs_uio_op_notdir, /* getdirentries */
 	emufs_write,
 	emufs_ioctl,
 	emufs_stat,
@@ -1118,6 +1990,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_uio_op_isdir,   /* read */
 	emufs_uio_op_isdir,   /* readlink */
 	emufs_getdirentry,
+	emufs_getdirentries,
 	emufs_uio_op_isdir,   /* write */
 	emufs_ioctl,
 	emufs_stat,
@@ -1148,24 +2021,30 @@ int
 emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		struct emufs_vnode **ret)
 {
-	struct vnode *v;
 	struct emufs_vnode *ev;
-	unsigned i, num;
+	unsigned i;
 	int result;
 
 	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
 
-	num = vnodearray_num(ef->ef_vnodes);
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(ef->ef_vnodes, i);
-		ev = v->vn_data;
+	for (ev = ef->ef_vnhash[handle % EMUFS_VNHASHSIZE]; ev != NULL;
+	     ev = ev->ev_hashnext) {
 		if (ev->ev_handle == handle) {
 			/* Found */
 
+			if (ev->ev_kept) {
+				/* In use again; move it to the end */
+				for (i=0; ef->ef_keep[i] != ev; i++) {
+					KASSERT(i+1 < ef->ef_nkeep);
+				}
+				for (; i+1 < ef->ef_nkeep; i++) {
+					ef->ef_keep[i] = ef->ef_keep[i+1];
+				}
+				ef->ef_keep[i] = ev;
+			}
+
 			VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
 			vfs_biglock_release();
 			*ret = ev;
 			return 0;
@@ -1176,33 +2055,35 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev = kmalloc(sizeof(struct emufs_vnode));
 	if (ev==NULL) {
-		lock_release(ef->ef_emu->e_lock);
+		vfs_biglock_release();
 		return ENOMEM;
 	}
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
-
-	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
-			   &ef->ef_fs, ev);
-	if (result) {
-		lock_release(ef->ef_emu->e_lock);
+	ev->ev_kept = false;
+	ev->ev_npages = 0;
+	ev->ev_lock = lock_create("emufs-vnode");
+	if (ev->ev_lock == NULL) {
 		vfs_biglock_release();
 		kfree(ev);
-		return result;
+		return ENOMEM;
 	}
+	ev->ev_size = -1;
+	ev->ev_ranext = 0;
 
-	result = vnodearray_add(ef->ef_vnodes, &ev->ev_v, NULL);
+	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
+			   &ef->ef_fs, ev);
 	if (result) {
-		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
-		VOP_CLEANUP(&ev->ev_v);
-		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
 
-	lock_release(ef->ef_emu->e_lock);
+	ev->ev_hashnext = ef->ef_vnhash[handle % EMUFS_VNHASHSIZE];
+	ef->ef_vnhash[handle % EMUFS_VNHASHSIZE] = ev;
+
 	vfs_biglock_release();
 
 	*ret = ev;
@@ -1219,13 +2100,32 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 /*
  * FSOP_SYNC
+ *
+ * Write back every file's cached data. vfs_biglock keeps the vnodes
+ * from going away.
  */
 static
 int
 emufs_sync(struct fs *fs)
 {
-	(void)fs;
-	return 0;
+	struct emufs_fs *ef = fs->fs_data;
+	struct emufs_vnode *ev;
+	unsigned i;
+	int result, ret = 0;
+
+	vfs_biglock_acquire();
+	for (i=0; i<EMUFS_VNHASHSIZE; i++) {
+		for (ev = ef->ef_vnhash[i]; ev != NULL; ev = ev->ev_hashnext) {
+			lock_acquire(ev->ev_lock);
+			result = emufs_flush(ev);
+			lock_release(ev->ev_lock);
+			if (result && ret == 0) {
+				ret = result;
+			}
+		}
+	}
+	vfs_biglock_release();
+	return ret;
 }
 
 /*
@@ -1284,6 +2184,7 @@ int
 emufs_addtovfs(struct emu_softc *sc, const char *devname)
 {
 	struct emufs_fs *ef;
+	unsigned i;
 	int result;
 
 	ef = kmalloc(sizeof(struct emufs_fs));
@@ -1299,14 +2200,51 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
-	ef->ef_vnodes = vnodearray_create();
-	if (ef->ef_vnodes == NULL) {
+	for (i=0; i<EMUFS_VNHASHSIZE; i++) {
+		ef->ef_vnhash[i] = NULL;
+	}
+	ef->ef_nkeep = 0;
+
+	/* Size the page pool from the amount of RAM */
+	ef->ef_maxpages = mainbus_ramsize() / EMUFS_RAMSHARE / PAGE_SIZE;
+	if (ef->ef_maxpages < EMUFS_MINPAGES) {
+		ef->ef_maxpages = EMUFS_MINPAGES;
+	}
+	if (ef->ef_maxpages > EMUFS_MAXPAGES) {
+		ef->ef_maxpages = EMUFS_MAXPAGES;
+	}
+	ef->ef_pages = kmalloc(ef->ef_maxpages * sizeof(struct emufs_page));
+	if (ef->ef_pages == NULL) {
+		kfree(ef);
+		return ENOMEM;
+	}
+	for (i=0; i<ef->ef_maxpages; i++) {
+		ef->ef_pages[i].ep_owner = NULL;
+		ef->ef_pages[i].ep_pos = EMUFS_NOPAGE;
+		ef->ef_pages[i].ep_data = NULL;
+		ef->ef_pages[i].ep_dirtystart = 0;
+		ef->ef_pages[i].ep_dirtyend = 0;
+		ef->ef_pages[i].ep_busy = false;
+		ef->ef_pages[i].ep_hashnext = NULL;
+		ef->ef_pages[i].ep_lruprev = NULL;
+		ef->ef_pages[i].ep_lrunext = NULL;
+	}
+	ef->ef_npages = 0;
+	for (i=0; i<EMUFS_PAGEHASHSIZE; i++) {
+		ef->ef_pagehash[i] = NULL;
+	}
+	ef->ef_lruhead = ef->ef_lrutail = NULL;
+	ef->ef_pagelock = lock_create("emufs-pages");
+	if (ef->ef_pagelock == NULL) {
+		kfree(ef->ef_pages);
 		kfree(ef);
 		return ENOMEM;
 	}
 
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
+		lock_destroy(ef->ef_pagelock);
+		kfree(ef->ef_pages);
 		kfree(ef);
 		return result;
 	}
@@ -1316,6 +2254,8 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	result = vfs_addfs(devname, &ef->ef_fs);
 	if (result) {
 		VOP_DECREF(&ef->ef_root->ev_v);
+		lock_destroy(ef->ef_pagelock);
+		kfree(ef->ef_pages);
 		kfree(ef);
 	}
 	return result;
@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,41 +96,317 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * Requests are queued by lhd_submit and run from the interrupt
+ * handler: when a sector finishes, the handler starts the next one
+ * of the active request, or picks the next request and starts that,
+ * so the disk stays busy without any thread having to wake up in
+ * between. All of this is protected by lh_lock.
+ *
+ * lh_queue is kept sorted by starting sector and the next request is
+ * chosen C-LOOK style: the first one at or after the position the
+ * head was left at, wrapping around to the lowest sector when there
+ * are none above. To keep a stream of requests in one part of the
+ * disk from starving the rest, a request that has been passed over
+ * for LHD_DEADLINE dispatches goes next regardless of position.
+ *
+ * A request that starts where a queued (or the active) request of
+ * the same direction ends is merged with it: it is chained on
+ * br_merged and runs straight after it, without going back through
+ * the scheduler, up to LHD_MAXMERGE sectors per chain.
+ */
+
+#define LHD_DEADLINE    16	/* dispatches a request may be passed over */
+#define LHD_MAXMERGE    64	/* sectors in one chain of merged requests */
+#define LHD_MAXBOUNCE   8192	/* bounce buffer size for lhd_io */
+
+/*
+ * Sector just past the end of a chain of merged requests, and the
+ * number of sectors in it.
+ */
+static
+uint32_t
+lhd_chain_end(struct blkreq *r, unsigned *nsectp)
+{
+	unsigned nsect = 0;
+
+	while (1) {
+		nsect += r->br_nblocks;
+		if (r->br_merged == NULL) {
+			break;
+		}
+		r = r->br_merged;
+	}
+	*nsectp = nsect;
+	return r->br_block + r->br_nblocks;
+}
+
+/*
+ * Try to merge NEW onto the end of the chain starting at R.
+ */
+static
+bool
+lhd_merge_after(struct blkreq *r, struct blkreq *new)
+{
+	unsigned nsect;
+
+	if (r->br_write != new->br_write ||
+	    lhd_chain_end(r, &nsect) != new->br_block ||
+	    nsect + new->br_nblocks > LHD_MAXMERGE) {
+		return false;
+	}
+	while (r->br_merged != NULL) {
+		r = r->br_merged;
+	}
+	r->br_merged = new;
+	return true;
+}
+
+/*
+ * Put a request (chain) into lh_queue in sector order.
+ */
+static
+void
+lhd_queue_insert(struct lhd_softc *lh, struct blkreq *r)
+{
+	struct blkreq **pp;
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->br_next) {
+		if ((*pp)->br_block > r->br_block) {
+			break;
+		}
+	}
+	r->br_next = *pp;
+	*pp = r;
+}
+
+/*
+ * Add a new request to the queue, merging it with a neighbor if
+ * possible.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct blkreq *new)
+{
+	struct blkreq **pp, *r;
+	unsigned nsect;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	/* Sequential I/O: extend what the disk is doing right now. */
+	if (lh->lh_active != NULL && lhd_merge_after(lh->lh_active, new)) {
+		return;
+	}
+
+	for (pp = &lh->lh_queue; (r = *pp) != NULL; pp = &r->br_next) {
+		if (lhd_merge_after(r, new)) {
+			return;
+		}
+		if (r->br_write == new->br_write &&
+		    new->br_block + new->br_nblocks == r->br_block) {
+			lhd_chain_end(r, &nsect);
+			if (nsect + new->br_nblocks <= LHD_MAXMERGE) {
+				/* NEW goes in front and inherits R's age. */
+				*pp = r->br_next;
+				new->br_merged = r;
+				new->br_seq = r->br_seq;
+				lhd_queue_insert(lh, new);
+				return;
+			}
+		}
+	}
+	lhd_queue_insert(lh, new);
+}
+
+/*
+ * Start the next sector of the active request.
+ */
+static
+void
+lhd_start_sector(struct lhd_softc *lh)
+{
+	struct blkreq *r = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(r != NULL && r->br_done < r->br_nblocks);
+
+	if (r->br_write) {
+		memcpy(lh->lh_buf,
+		       (char *)r->br_data + r->br_done * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT, r->br_block + r->br_done);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Pick the next request off the queue and make it active.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	struct blkreq **pp, **pick, **oldest;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	if (lh->lh_queue == NULL) {
+		return;
+	}
+
+	pick = oldest = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->br_next) {
+		if (pick == NULL && (*pp)->br_block >= lh->lh_headpos) {
+			pick = pp;
+		}
+		if (oldest == NULL ||
+		    lh->lh_seq - (*pp)->br_seq > lh->lh_seq - (*oldest)->br_seq) {
+			oldest = pp;
+		}
+	}
+	if (lh->lh_seq - (*oldest)->br_seq >= LHD_DEADLINE) {
+		pick = oldest;
+	}
+	else if (pick == NULL) {
+		/* nothing ahead of the head; go back to the start */
+		pick = &lh->lh_queue;
+	}
+
+	lh->lh_active = *pick;
+	*pick = lh->lh_active->br_next;
+	lh->lh_active->br_next = NULL;
+	lh->lh_seq++;
+}
+
+/*
+ * Finish a request: record the result and tell whoever is waiting.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_complete(struct lhd_softc *lh, struct blkreq *r, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	r->br_result = err;
+	r->br_merged = NULL;
+	r->br_complete = true;
+	if (r->br_callback != NULL) {
+		r->br_callback(r);
+	}
+	wchan_wakeall(lh->lh_wchan);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish off the sector, and start the next one.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct blkreq *r;
 	uint32_t val;
+	int err;
 	
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		/* still idle or working */
+		return;
+	}
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	err = lhd_code_to_errno(lh, val);
+
+	spinlock_acquire(&lh->lh_lock);
+	r = lh->lh_active;
+	if (r == NULL) {
+		/* Not ours (we never started anything). */
+		spinlock_release(&lh->lh_lock);
+		return;
 	}
+
+	lh->lh_headpos = r->br_block + r->br_done + 1;
+	if (err == 0) {
+		if (!r->br_write) {
+			memcpy((char *)r->br_data + r->br_done * LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		r->br_done++;
+	}
+
+	if (err != 0 || r->br_done == r->br_nblocks) {
+		/* Go on to the next request in the chain, if any. */
+		lh->lh_active = r->br_merged;
+		lhd_complete(lh, r, err);
+		if (lh->lh_active == NULL) {
+			lhd_dispatch(lh);
+		}
+	}
+	if (lh->lh_active != NULL) {
+		lhd_start_sector(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Queue an asynchronous request.
+ */
+static
+int
+lhd_submit(struct device *d, struct blkreq *r)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (r->br_nblocks == 0 ||
+	    r->br_block + r->br_nblocks > lh->lh_dev.d_blocks ||
+	    r->br_block + r->br_nblocks < r->br_block) {
+		return EINVAL;
+	}
+
+	r->br_result = 0;
+	r->br_complete = false;
+	r->br_next = NULL;
+	r->br_merged = NULL;
+	r->br_done = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	r->br_seq = lh->lh_seq;
+	lhd_enqueue(lh, r);
+	if (lh->lh_active == NULL) {
+		lhd_dispatch(lh);
+		lhd_start_sector(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Wait for a request to complete.
+ */
+static
+int
+lhd_wait(struct device *d, struct blkreq *r)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	wchan_lock(lh->lh_wchan);
+	while (!r->br_complete) {
+		wchan_sleep(lh->lh_wchan);
+		wchan_lock(lh->lh_wchan);
+	}
+	wchan_unlock(lh->lh_wchan);
+	return r->br_result;
 }
 
 /*
@@ -195,20 +472,25 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * This is a synchronous wrapper around lhd_submit. The data goes
+ * through a kernel bounce buffer, since the interrupt handler can't
+ * touch user memory; large transfers are done LHD_MAXBOUNCE bytes at
+ * a time.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct blkreq req;
+	char *buf;
+	size_t bufsize, len;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -216,63 +498,55 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector + uio->uio_resid / LHD_SECTSIZE > lh->lh_dev.d_blocks) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+	bufsize = uio->uio_resid < LHD_MAXBOUNCE ?
+		uio->uio_resid : LHD_MAXBOUNCE;
+	buf = kmalloc(bufsize);
+	if (buf == NULL) {
+		return ENOMEM;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < bufsize ? uio->uio_resid : bufsize;
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+		req.br_block = uio->uio_offset / LHD_SECTSIZE;
+		req.br_nblocks = len / LHD_SECTSIZE;
+		req.br_data = buf;
+		req.br_write = (uio->uio_rw == UIO_WRITE);
+		req.br_callback = NULL;
+		req.br_arg = NULL;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (req.br_write) {
+			result = uiomove(buf, len, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_submit(d, &req);
+		if (result == 0) {
+			result = lhd_wait(d, &req);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (!req.br_write) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(buf);
+	return result;
 }
 
 /*
@@ -289,23 +563,25 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_seq = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
+	lh->lh_dev.d_wait = lhd_wait;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
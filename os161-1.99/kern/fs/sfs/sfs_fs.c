@@ -36,11 +36,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -49,8 +50,8 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap at once; writes (sfs_mapsync) only the
+ * sectors marked SFS_GROUP_DIRTY.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -63,6 +64,10 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Writes are done with sfs_bitlock held, so they see a consistent
+ * bitmap. On a volume with a journal, they are done only at a
+ * checkpoint, once every change to the bitmap is in the journal.
  */
 
 static
@@ -85,6 +90,12 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 		/* Get a pointer to its data */
 		void *ptr = bitdata + j*SFS_BLOCKSIZE;
 
+		/* Writes skip the sectors that haven't changed. */
+		if (rw == UIO_WRITE &&
+		    (sfs->sfs_groupflags[j] & SFS_GROUP_DIRTY) == 0) {
+			continue;
+		}
+
 		/* and read or write it. The bitmap starts at sector 2. */ 
 		if (rw == UIO_READ) {
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
@@ -97,6 +108,68 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 		if (result) {
 			return result;
 		}
+		if (rw == UIO_WRITE) {
+			sfs->sfs_groupflags[j] &= ~SFS_GROUP_DIRTY;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the modified parts of the free block bitmap to the buffer
+ * cache. The caller holds sfs_bitlock.
+ */
+int
+sfs_mapsync(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_bitlock));
+
+	if (!sfs->sfs_freemapdirty) {
+		return 0;
+	}
+	result = sfs_mapio(sfs, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_freemapdirty = false;
+	return 0;
+}
+
+/*
+ * Count the free blocks in each group of SFS_BLOCKBITS blocks (the
+ * blocks covered by one bitmap block), for the allocator, and set up
+ * the group flags. Blocks past the end of the volume are marked in
+ * use, so they don't count.
+ */
+static
+int
+sfs_countfree(struct sfs_fs *sfs)
+{
+	uint32_t group, block, end, nblocks;
+
+	sfs->sfs_ngroups = SFS_FS_BITBLOCKS(sfs);
+	sfs->sfs_groupfree = kmalloc(sfs->sfs_ngroups * sizeof(uint32_t));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_groupflags = kmalloc(sfs->sfs_ngroups);
+	if (sfs->sfs_groupflags == NULL) {
+		kfree(sfs->sfs_groupfree);
+		return ENOMEM;
+	}
+
+	nblocks = sfs->sfs_super.sp_nblocks;
+	for (group=0; group<sfs->sfs_ngroups; group++) {
+		sfs->sfs_groupflags[group] = 0;
+		block = group * SFS_BLOCKBITS;
+		end = block + SFS_BLOCKBITS;
+		if (end > nblocks) {
+			end = nblocks;
+		}
+		sfs->sfs_groupfree[group] = (end - block) -
+			bitmap_count(sfs->sfs_freemap, block, end);
 	}
 	return 0;
 }
@@ -111,7 +184,6 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -148,21 +220,56 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
+	/*
+	 * Go over the loaded vnodes whose inodes are dirty, putting the
+	 * inodes in the buffer cache as we go; sfs_sync_inode takes each
+	 * off the dirty list. (Not VOP_FSYNC; that would write each
+	 * file's blocks separately, and we write them all below.)
+	 *
+	 * The vnode lock comes before sfs_vnlock, so we can't hold the
+	 * latter while taking the former; the vnode can't go away in
+	 * between, because reclaiming it needs vfs_biglock. A vnode
+	 * may be cleaned (or redirtied) before we get its lock, which
+	 * is harmless. Copying an inode into the cache changes
+	 * metadata, so it needs a journal handle.
+	 */
+	while (1) {
+		struct sfs_vnode *sv;
+
+		lock_acquire(sfs->sfs_vnlock);
+		sv = sfs->sfs_dirtyvnodes;
+		lock_release(sfs->sfs_vnlock);
+		if (sv == NULL) {
+			break;
+		}
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+		sfs_jnl_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		if (result) {
 			vfs_biglock_release();
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
+	}
+
+	if (sfs->sfs_jnl != NULL) {
+		/*
+		 * Commit what's in the journal and write it all in
+		 * place, including the free block map.
+		 */
+		result = sfs_jnl_checkpoint(sfs);
+	}
+	else {
+		/* If the free block map needs to be written, write it. */
+		lock_acquire(sfs->sfs_bitlock);
+		result = sfs_mapsync(sfs);
+		lock_release(sfs->sfs_bitlock);
+	}
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
@@ -175,6 +282,13 @@ sfs_sync(struct fs *fs)
 		sfs->sfs_superdirty = false;
 	}
 
+	/* Everything above only went as far as the buffer cache. */
+	result = buffer_sync_device(sfs->sfs_device);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -208,11 +322,12 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	if (sfs->sfs_nvnodes > 0) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -221,9 +336,20 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Get rid of our cached blocks. */
+	result = buffer_drop_device(sfs->sfs_device);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_jnl_unmount(sfs);
+	kfree(sfs->sfs_groupflags);
+	kfree(sfs->sfs_groupfree);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_bitlock);
+	lock_destroy(sfs->sfs_vnlock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -255,6 +381,7 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
 	vfs_biglock_acquire();
@@ -289,21 +416,31 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+	/* Set up the vnode table */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_dirtyvnodes = NULL;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
 
+	/*
+	 * Forget anything cached for the device from before (e.g. a
+	 * failed mount); it may have been rewritten through the raw
+	 * device since. Nothing is mounted on it, so nothing is dirty.
+	 */
+	result = buffer_drop_device(dev);
+	if (result) {
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,7 +453,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
@@ -330,21 +466,37 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/* Recover from the journal; this may change the bitmap */
+	result = sfs_jnl_mount(sfs);
+	if (result) {
+		goto fail;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail_jnl;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+		goto fail_freemap;
+	}
+	result = sfs_countfree(sfs);
+	if (result) {
+		goto fail_freemap;
+	}
+
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		result = ENOMEM;
+		goto fail_groups;
+	}
+	sfs->sfs_bitlock = lock_create("sfs_bitlock");
+	if (sfs->sfs_bitlock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		result = ENOMEM;
+		goto fail_groups;
 	}
 
 	/* Set up abstract fs calls */
@@ -363,6 +515,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	vfs_biglock_release();
 	return 0;
+
+ fail_groups:
+	kfree(sfs->sfs_groupflags);
+	kfree(sfs->sfs_groupfree);
+ fail_freemap:
+	bitmap_destroy(sfs->sfs_freemap);
+ fail_jnl:
+	sfs_jnl_unmount(sfs);
+ fail:
+	kfree(sfs);
+	vfs_biglock_release();
+	return result;
 }
 
 /*
@@ -33,6 +33,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 ////////////////////////////////////////////////////////////
@@ -43,6 +44,9 @@
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
+//
+// sfs_rblock and sfs_wblock go through the buffer cache;
+// sfs_rwblock talks to the device directly.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +54,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -89,19 +91,52 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(b), SFS_BLOCKSIZE);
+	buffer_release(b);
+	return 0;
 }
 
 int
 sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(b), data, SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Get a buffer cache handle for a block, reading it in unless it is
+ * cached. The caller works on the block in place through buffer_map,
+ * calls buffer_mark_dirty if it changes it, and buffer_release when
+ * done.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct buf **ret)
+{
+	return buffer_read(sfs->sfs_device, block, ret);
+}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+/*
+ * Likewise, but for a block the caller is about to overwrite entirely,
+ * so there is no need to read it in.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct buf **ret)
+{
+	return buffer_get(sfs->sfs_device, block, ret);
 }
@@ -0,0 +1,967 @@
+/*
+ * SFS metadata journal.
+ *
+ * See kern/sfs.h for the on-disk format. Here we keep one running
+ * transaction in memory. Operations that change metadata bracket
+ * themselves with sfs_jnl_begin and sfs_jnl_end, and hand each
+ * metadata block they change to sfs_jnl_dirty, which pins it in the
+ * buffer cache and adds it to the transaction. Blocks of the freemap
+ * are tracked by the SFS_GROUP_LOGGED flags instead, since the
+ * freemap lives in memory; bitmap images are taken at commit time.
+ *
+ * A transaction commits when it fills up (the next sfs_jnl_begin
+ * does it), on fsync, and on sync. Commit waits for the operations
+ * in progress to end, so every transaction holds only whole
+ * operations, and lets no new ones start until it is done. It then
+ * writes the descriptor and the block images to the log in one go,
+ * writes the commit block, and unpins the blocks, which the buffer
+ * cache then writes in place whenever it likes.
+ *
+ * When the log runs low on space, and on sync, a checkpoint writes
+ * every block logged since the last one in place and empties the
+ * log. Checkpoints only happen right after a commit, when nothing is
+ * pinned.
+ *
+ * A freed block must not be reused until the transaction that freed
+ * it has committed: until then, after a crash, the old contents are
+ * still wanted. So sfs_jnl_free only notes the block, and commit
+ * clears it in the freemap (logging the result in the same
+ * transaction). If the block had been logged since the last
+ * checkpoint, a revoke entry keeps recovery from writing its old
+ * image over whatever it is used for next.
+ *
+ * Locking: j_lock covers all of struct sfs_jnl, except that the
+ * pending frees (j_freed, j_nfreed) are covered by sfs_bitlock along
+ * with the freemap. A thread with a handle (between begin and end)
+ * may take vnode locks, sfs_bitlock, buffers, and (briefly, from
+ * sfs_jnl_dirty and sfs_jnl_free) j_lock. Commit holds j_lock and
+ * takes sfs_bitlock and buffers, but only runs when no handles are
+ * open. Nobody may call sfs_jnl_begin while holding a handle,
+ * a vnode lock, or a buffer.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+
+/*
+ * Size limits. A transaction may have up to SFS_JNL_TXBLOCKS entries
+ * for blocks in the buffer cache (and revokes), plus one entry per
+ * freemap block. Each operation reserves SFS_JNL_OPBLOCKS (see
+ * sfs.h) entries when it begins.
+ */
+#define SFS_JNL_TXBLOCKS  32
+
+struct sfs_jnl {
+	struct lock *j_lock;
+	struct cv *j_cv;		/* for begin and commit to wait on */
+	uint32_t j_start;		/* 1st journal block (the header) */
+	uint32_t j_nblocks;		/* # blocks in the journal */
+	uint32_t j_txmax;		/* log blocks a transaction may need */
+	uint32_t j_seq;			/* seq # of the running transaction */
+	uint32_t j_pos;			/* log block it will be written at */
+	unsigned j_active;		/* operations with handles open */
+	unsigned j_committers;		/* threads waiting to commit */
+
+	/* The running transaction */
+	uint32_t j_entries[SFS_JDESC_MAX];	/* its descriptor entries */
+	unsigned j_nentries;
+	struct bitmap *j_freed;		/* blocks it freed (sfs_bitlock) */
+	unsigned j_nfreed;		/* how many (sfs_bitlock) */
+
+	/* Blocks logged since the last checkpoint */
+	uint32_t *j_logged;
+	unsigned j_nlogged;
+
+	/* Space for commit */
+	struct sfs_jdesc *j_desc;
+	struct sfs_jcommit *j_commit;
+	struct buf **j_bufs;		/* buffers of the blocks logged */
+	void **j_data;			/* log blocks to write */
+	struct blkreq *j_reqs;
+};
+
+////////////////////////////////////////////////////////////
+//
+// Log I/O
+
+/*
+ * Update a checksum with one block. Words are taken as they are in
+ * memory, which is the volume's byte order.
+ */
+static
+uint32_t
+sfs_jnl_sum(uint32_t sum, const void *data)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) + words[i];
+	}
+	return sum;
+}
+
+/*
+ * Read or write one block of the log, bypassing the buffer cache:
+ * log blocks are written once and only read back during recovery.
+ */
+static
+int
+sfs_jnl_rwlog(struct sfs_fs *sfs, uint32_t pos, void *data, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(&iov, &ku, data, sfs->sfs_jnl->j_start + pos, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write N consecutive log blocks starting at POS, from j_data[]. On
+ * devices with d_submit, they are all queued before waiting for any,
+ * so the disk can merge them into one transfer.
+ */
+static
+int
+sfs_jnl_writelog(struct sfs_fs *sfs, uint32_t pos, unsigned n)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	struct device *dev = sfs->sfs_device;
+	struct blkreq *req;
+	unsigned i;
+	int result, ret = 0;
+
+	if (dev->d_submit == NULL) {
+		for (i=0; i<n; i++) {
+			result = sfs_jnl_rwlog(sfs, pos + i, j->j_data[i],
+					       UIO_WRITE);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		req = &j->j_reqs[i];
+		req->br_block = j->j_start + pos + i;
+		req->br_nblocks = 1;
+		req->br_data = j->j_data[i];
+		req->br_write = true;
+		req->br_callback = NULL;
+		req->br_arg = NULL;
+		result = dev->d_submit(dev, req);
+		if (result) {
+			req->br_result = result;
+			req->br_complete = true;
+		}
+	}
+	for (i=0; i<n; i++) {
+		req = &j->j_reqs[i];
+		result = req->br_complete ? req->br_result :
+			dev->d_wait(dev, req);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Write a header that makes the log empty, with the next transaction
+ * numbered SEQ.
+ */
+static
+int
+sfs_jnl_writeheader(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh;
+
+	/* j_commit is free whenever this is called */
+	jh = (struct sfs_jheader *)sfs->sfs_jnl->j_commit;
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JNL_MAGIC;
+	jh->jh_seq = seq;
+	return sfs_jnl_rwlog(sfs, 0, jh, UIO_WRITE);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Recovery
+
+/*
+ * Read the transaction that should be at POS with sequence number SEQ
+ * and check it. If it is there and complete, leaves its descriptor in
+ * j_desc and sets *NBLOCKS to the number of log blocks it takes up;
+ * otherwise sets *NBLOCKS to 0. SCRATCH is a block of space.
+ */
+static
+int
+sfs_jnl_readtx(struct sfs_fs *sfs, uint32_t pos, uint32_t seq,
+	       void *scratch, uint32_t *nblocks)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	struct sfs_jdesc *jd = j->j_desc;
+	struct sfs_jcommit *jc = j->j_commit;
+	uint32_t sum, n, i;
+	int result;
+
+	*nblocks = 0;
+	if (pos + 2 > j->j_nblocks) {
+		return 0;
+	}
+	result = sfs_jnl_rwlog(sfs, pos, jd, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jd->jd_magic != SFS_JDESC_MAGIC || jd->jd_seq != seq ||
+	    jd->jd_nentries > SFS_JDESC_MAX) {
+		return 0;
+	}
+	n = 0;
+	for (i=0; i<jd->jd_nentries; i++) {
+		if ((jd->jd_entries[i] & SFS_JNL_REVOKE) == 0) {
+			n++;
+		}
+	}
+	if (pos + n + 2 > j->j_nblocks) {
+		return 0;
+	}
+
+	sum = sfs_jnl_sum(0, jd);
+	for (i=0; i<n; i++) {
+		result = sfs_jnl_rwlog(sfs, pos + 1 + i, scratch, UIO_READ);
+		if (result) {
+			return result;
+		}
+		sum = sfs_jnl_sum(sum, scratch);
+	}
+	result = sfs_jnl_rwlog(sfs, pos + 1 + n, jc, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jc->jc_magic != SFS_JCOMMIT_MAGIC || jc->jc_seq != seq ||
+	    jc->jc_sum != sum) {
+		return 0;
+	}
+	*nblocks = n + 2;
+	return 0;
+}
+
+/*
+ * Find whether BLOCK was revoked by transaction SEQ or a later one.
+ */
+static
+bool
+sfs_jnl_revoked(const uint32_t *revokes, unsigned nrevokes,
+		uint32_t block, uint32_t seq)
+{
+	unsigned i;
+
+	for (i=0; i<nrevokes; i++) {
+		if (revokes[2*i] == block && revokes[2*i+1] >= seq) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Replay the log: copy the images of the complete transactions in it
+ * to their homes, then empty it. This is done in three passes over
+ * the log: find the complete transactions and count their revokes,
+ * collect the revokes, and copy the images.
+ */
+static
+int
+sfs_jnl_replay(struct sfs_fs *sfs, uint32_t firstseq)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	struct sfs_jdesc *jd = j->j_desc;
+	uint32_t *revokes = NULL;
+	unsigned ntx, nrevokes, nreplayed, t, i, k;
+	uint32_t pos, seq, n, block;
+	void *scratch;
+	int result;
+
+	scratch = kmalloc(SFS_BLOCKSIZE);
+	if (scratch == NULL) {
+		return ENOMEM;
+	}
+
+	/* Pass 1 */
+	ntx = nrevokes = 0;
+	pos = 1;
+	seq = firstseq;
+	while (1) {
+		result = sfs_jnl_readtx(sfs, pos, seq, scratch, &n);
+		if (result) {
+			goto out;
+		}
+		if (n == 0) {
+			break;
+		}
+		for (i=0; i<jd->jd_nentries; i++) {
+			if (jd->jd_entries[i] & SFS_JNL_REVOKE) {
+				nrevokes++;
+			}
+		}
+		ntx++;
+		pos += n;
+		seq++;
+	}
+
+	if (ntx == 0) {
+		goto out;
+	}
+	kprintf("sfs: %s: replaying %u journal transaction%s\n",
+		sfs->sfs_super.sp_volname, ntx, ntx == 1 ? "" : "s");
+
+	/* Pass 2: revokes[] holds (block, seq) pairs */
+	if (nrevokes > 0) {
+		revokes = kmalloc(nrevokes * 2 * sizeof(uint32_t));
+		if (revokes == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+	}
+	k = 0;
+	pos = 1;
+	for (t=0; t<ntx; t++) {
+		result = sfs_jnl_rwlog(sfs, pos, jd, UIO_READ);
+		if (result) {
+			goto out;
+		}
+		n = 0;
+		for (i=0; i<jd->jd_nentries; i++) {
+			if (jd->jd_entries[i] & SFS_JNL_REVOKE) {
+				revokes[2*k] = jd->jd_entries[i] &
+					~SFS_JNL_REVOKE;
+				revokes[2*k+1] = jd->jd_seq;
+				k++;
+			}
+			else {
+				n++;
+			}
+		}
+		pos += n + 2;
+	}
+	KASSERT(k == nrevokes);
+
+	/* Pass 3 */
+	nreplayed = 0;
+	pos = 1;
+	for (t=0; t<ntx; t++) {
+		result = sfs_jnl_rwlog(sfs, pos, jd, UIO_READ);
+		if (result) {
+			goto out;
+		}
+		n = 0;
+		for (i=0; i<jd->jd_nentries; i++) {
+			block = jd->jd_entries[i];
+			if (block & SFS_JNL_REVOKE) {
+				continue;
+			}
+			n++;
+			if (block >= sfs->sfs_super.sp_nblocks ||
+			    sfs_jnl_revoked(revokes, nrevokes,
+					    block, jd->jd_seq)) {
+				continue;
+			}
+			result = sfs_jnl_rwlog(sfs, pos + n, scratch,
+					       UIO_READ);
+			if (result) {
+				goto out;
+			}
+			result = sfs_wblock(sfs, scratch, block);
+			if (result) {
+				goto out;
+			}
+			nreplayed++;
+		}
+		pos += n + 2;
+	}
+
+	/* The log may only be emptied once the images are in place */
+	result = buffer_sync_device(sfs->sfs_device);
+	if (result) {
+		goto out;
+	}
+	kprintf("sfs: %s: %u blocks restored from the journal\n",
+		sfs->sfs_super.sp_volname, nreplayed);
+
+ out:
+	j->j_seq = firstseq + ntx;
+	if (result == 0 && ntx > 0) {
+		result = sfs_jnl_writeheader(sfs, j->j_seq);
+	}
+	if (revokes != NULL) {
+		kfree(revokes);
+	}
+	kfree(scratch);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit and checkpoint
+
+/*
+ * Find BLOCK among the running transaction's entries, with or without
+ * the revoke flag. Returns the index, or -1.
+ */
+static
+int
+sfs_jnl_findentry(struct sfs_jnl *j, uint32_t block)
+{
+	unsigned i;
+
+	for (i=0; i<j->j_nentries; i++) {
+		if ((j->j_entries[i] & ~SFS_JNL_REVOKE) == block) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Note that BLOCK has been logged, for the next checkpoint.
+ */
+static
+void
+sfs_jnl_addlogged(struct sfs_jnl *j, uint32_t block)
+{
+	unsigned i;
+
+	for (i=0; i<j->j_nlogged; i++) {
+		if (j->j_logged[i] == block) {
+			return;
+		}
+	}
+	/* Each entry took a log block, so they can't outnumber those */
+	KASSERT(j->j_nlogged < j->j_nblocks);
+	j->j_logged[j->j_nlogged++] = block;
+}
+
+static int sfs_jnl_checkpoint_locked(struct sfs_fs *sfs);
+
+/*
+ * Commit the running transaction. Called with j_lock held and no
+ * handles open.
+ */
+static
+int
+sfs_jnl_commit_locked(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	struct sfs_jdesc *jd = j->j_desc;
+	struct sfs_jcommit *jc = j->j_commit;
+	char *bitdata;
+	unsigned nbufentries, nbufs, nimages, i;
+	uint32_t block, group, sum;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_active == 0);
+
+	nbufentries = j->j_nentries;
+
+	/*
+	 * Free the blocks the transaction freed, and add the freemap
+	 * blocks it changed.
+	 */
+	lock_acquire(sfs->sfs_bitlock);
+	if (j->j_nfreed > 0) {
+		block = 0;
+		while (bitmap_findset(j->j_freed, block,
+				      sfs->sfs_super.sp_nblocks, &block) == 0) {
+			bitmap_unmark(j->j_freed, block);
+			sfs_bunmark(sfs, block);
+		}
+		j->j_nfreed = 0;
+	}
+	for (group=0; group<sfs->sfs_ngroups; group++) {
+		if (sfs->sfs_groupflags[group] & SFS_GROUP_LOGGED) {
+			KASSERT(j->j_nentries < SFS_JDESC_MAX);
+			j->j_entries[j->j_nentries++] =
+				SFS_MAP_LOCATION + group;
+		}
+	}
+	lock_release(sfs->sfs_bitlock);
+
+	if (j->j_nentries == 0) {
+		return 0;
+	}
+
+	/*
+	 * Gather the images. Pinned buffers can't have been evicted,
+	 * so these are cache hits. The freemap can't change while no
+	 * handles are open, so its blocks can be written straight
+	 * from memory.
+	 */
+	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	nbufs = nimages = 0;
+	j->j_data[nimages++] = jd;
+	for (i=0; i<j->j_nentries; i++) {
+		block = j->j_entries[i];
+		if (block & SFS_JNL_REVOKE) {
+			continue;
+		}
+		if (i < nbufentries) {
+			result = sfs_bread(sfs, block, &j->j_bufs[nbufs]);
+			if (result) {
+				goto fail;
+			}
+			j->j_data[nimages++] = buffer_map(j->j_bufs[nbufs]);
+			nbufs++;
+		}
+		else {
+			j->j_data[nimages++] = bitdata +
+				(block - SFS_MAP_LOCATION) * SFS_BLOCKSIZE;
+		}
+	}
+	KASSERT(j->j_pos + nimages + 1 <= j->j_nblocks);
+
+	bzero(jd, sizeof(*jd));
+	jd->jd_magic = SFS_JDESC_MAGIC;
+	jd->jd_seq = j->j_seq;
+	jd->jd_nentries = j->j_nentries;
+	memcpy(jd->jd_entries, j->j_entries,
+	       j->j_nentries * sizeof(uint32_t));
+
+	sum = 0;
+	for (i=0; i<nimages; i++) {
+		sum = sfs_jnl_sum(sum, j->j_data[i]);
+	}
+	bzero(jc, sizeof(*jc));
+	jc->jc_magic = SFS_JCOMMIT_MAGIC;
+	jc->jc_seq = j->j_seq;
+	jc->jc_sum = sum;
+
+	/* The commit block goes last, once the rest is on disk */
+	result = sfs_jnl_writelog(sfs, j->j_pos, nimages);
+	if (result) {
+		goto fail;
+	}
+	j->j_data[0] = jc;
+	result = sfs_jnl_writelog(sfs, j->j_pos + nimages, 1);
+	if (result) {
+		goto fail;
+	}
+
+	/* Committed. The blocks may go home now. */
+	for (i=0; i<nbufs; i++) {
+		buffer_unpin(j->j_bufs[i]);
+		buffer_release(j->j_bufs[i]);
+	}
+	for (i=0; i<nbufentries; i++) {
+		if ((j->j_entries[i] & SFS_JNL_REVOKE) == 0) {
+			sfs_jnl_addlogged(j, j->j_entries[i]);
+		}
+	}
+	lock_acquire(sfs->sfs_bitlock);
+	for (group=0; group<sfs->sfs_ngroups; group++) {
+		sfs->sfs_groupflags[group] &= ~SFS_GROUP_LOGGED;
+	}
+	lock_release(sfs->sfs_bitlock);
+
+	j->j_pos += nimages + 1;
+	j->j_seq++;
+	j->j_nentries = 0;
+
+	if (j->j_pos + j->j_txmax > j->j_nblocks) {
+		return sfs_jnl_checkpoint_locked(sfs);
+	}
+	return 0;
+
+ fail:
+	/* Leave the transaction as it was, to be tried again */
+	for (i=0; i<nbufs; i++) {
+		buffer_release(j->j_bufs[i]);
+	}
+	j->j_nentries = nbufentries;
+	return result;
+}
+
+/*
+ * Write everything logged since the last checkpoint in place, then
+ * empty the log. Called with j_lock held, right after a commit.
+ */
+static
+int
+sfs_jnl_checkpoint_locked(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_active == 0 && j->j_nentries == 0);
+
+	if (j->j_pos == 1) {
+		return 0;
+	}
+
+	for (i=0; i<j->j_nlogged; i++) {
+		result = buffer_sync_block(sfs->sfs_device, j->j_logged[i]);
+		if (result) {
+			return result;
+		}
+	}
+
+	lock_acquire(sfs->sfs_bitlock);
+	result = sfs_mapsync(sfs);
+	lock_release(sfs->sfs_bitlock);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		result = buffer_sync_block(sfs->sfs_device,
+					   SFS_MAP_LOCATION + i);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = sfs_jnl_writeheader(sfs, j->j_seq);
+	if (result) {
+		return result;
+	}
+	j->j_pos = 1;
+	j->j_nlogged = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Start an operation that will change metadata. If the running
+ * transaction doesn't have room for it, commit it first (or wait for
+ * the operations in it to finish so it can be committed).
+ */
+void
+sfs_jnl_begin(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	int result;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_committers > 0 || j->j_nentries +
+	       (j->j_active + 1) * SFS_JNL_OPBLOCKS > SFS_JNL_TXBLOCKS) {
+		if (j->j_committers == 0 && j->j_active == 0) {
+			result = sfs_jnl_commit_locked(sfs);
+			if (result) {
+				panic("sfs: %s: journal commit failed: %s\n",
+				      sfs->sfs_super.sp_volname,
+				      strerror(result));
+			}
+			continue;
+		}
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Finish an operation started with sfs_jnl_begin. Its changes will
+ * be in the running transaction; they are on disk once it commits.
+ */
+void
+sfs_jnl_end(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	j->j_active--;
+	if (j->j_active == 0) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Mark a metadata block modified: the buffer B, for BLOCK, which the
+ * caller has busy. Without a journal, this is just buffer_mark_dirty.
+ */
+void
+sfs_jnl_dirty(struct sfs_fs *sfs, struct buf *b, uint32_t block)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	int i;
+
+	if (j == NULL) {
+		buffer_mark_dirty(b);
+		return;
+	}
+
+	buffer_pin(b);
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	i = sfs_jnl_findentry(j, block);
+	if (i >= 0) {
+		/* If it was freed and reused, the new image wins */
+		j->j_entries[i] = block;
+	}
+	else {
+		KASSERT(j->j_nentries < SFS_JNL_TXBLOCKS);
+		j->j_entries[j->j_nentries++] = block;
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Free a block, once the running transaction commits. The caller has
+ * already dropped it from the buffer cache. Returns the number of
+ * entries (0 or 1) this added to the transaction.
+ */
+unsigned
+sfs_jnl_free(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	unsigned i, added = 0;
+	int k;
+
+	KASSERT(j != NULL);
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	k = sfs_jnl_findentry(j, block);
+	if (k >= 0) {
+		/* No need to log it after all */
+		j->j_entries[k] = block | SFS_JNL_REVOKE;
+	}
+	else {
+		for (i=0; i<j->j_nlogged; i++) {
+			if (j->j_logged[i] == block) {
+				KASSERT(j->j_nentries < SFS_JNL_TXBLOCKS);
+				j->j_entries[j->j_nentries++] =
+					block | SFS_JNL_REVOKE;
+				added = 1;
+				break;
+			}
+		}
+	}
+	lock_release(j->j_lock);
+
+	lock_acquire(sfs->sfs_bitlock);
+	KASSERT(!bitmap_isset(j->j_freed, block));
+	bitmap_mark(j->j_freed, block);
+	j->j_nfreed++;
+	lock_release(sfs->sfs_bitlock);
+
+	return added;
+}
+
+/*
+ * Commit the running transaction now, for fsync. The caller must not
+ * have a handle open.
+ */
+int
+sfs_jnl_commit(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	j->j_committers++;
+	while (j->j_active > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	result = sfs_jnl_commit_locked(sfs);
+	j->j_committers--;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Commit, and then write everything in place and empty the log, for
+ * sync and unmount. The caller must not have a handle open.
+ */
+int
+sfs_jnl_checkpoint(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+	int result;
+
+	KASSERT(j != NULL);
+
+	lock_acquire(j->j_lock);
+	j->j_committers++;
+	while (j->j_active > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	result = sfs_jnl_commit_locked(sfs);
+	if (result == 0) {
+		result = sfs_jnl_checkpoint_locked(sfs);
+	}
+	j->j_committers--;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+static
+void
+sfs_jnl_destroy(struct sfs_jnl *j)
+{
+	if (j->j_reqs != NULL) {
+		kfree(j->j_reqs);
+	}
+	if (j->j_data != NULL) {
+		kfree(j->j_data);
+	}
+	if (j->j_bufs != NULL) {
+		kfree(j->j_bufs);
+	}
+	if (j->j_commit != NULL) {
+		kfree(j->j_commit);
+	}
+	if (j->j_desc != NULL) {
+		kfree(j->j_desc);
+	}
+	if (j->j_logged != NULL) {
+		kfree(j->j_logged);
+	}
+	if (j->j_freed != NULL) {
+		bitmap_destroy(j->j_freed);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+}
+
+/*
+ * Set up the journal at mount time, if the volume has one, and
+ * replay it. This comes before the freemap is loaded, since replay
+ * may change it. If the journal is too small for this volume (too
+ * many freemap blocks to fit in one transaction) it is replayed and
+ * then left unused.
+ */
+int
+sfs_jnl_mount(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_jheader *jh;
+	struct sfs_jnl *j;
+	uint32_t ngroups;
+	int result;
+
+	sfs->sfs_jnl = NULL;
+	if (sp->sp_jblocks == 0) {
+		return 0;
+	}
+
+	ngroups = SFS_BITBLOCKS(sp->sp_nblocks);
+	if (sp->sp_jstart < SFS_MAP_LOCATION + ngroups ||
+	    sp->sp_jblocks < 3 || sp->sp_jstart >= sp->sp_nblocks ||
+	    sp->sp_jblocks > sp->sp_nblocks - sp->sp_jstart) {
+		kprintf("sfs: %s: bad journal location %u+%u\n",
+			sp->sp_volname, sp->sp_jstart, sp->sp_jblocks);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(struct sfs_jnl));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	bzero(j, sizeof(*j));
+	j->j_start = sp->sp_jstart;
+	j->j_nblocks = sp->sp_jblocks;
+	j->j_txmax = SFS_JNL_TXBLOCKS + ngroups + 2;
+	j->j_pos = 1;
+
+	j->j_lock = lock_create("sfs_jnl");
+	j->j_cv = cv_create("sfs_jnl");
+	j->j_freed = bitmap_create(SFS_BITMAPSIZE(sp->sp_nblocks));
+	j->j_logged = kmalloc(j->j_nblocks * sizeof(uint32_t));
+	j->j_desc = kmalloc(sizeof(struct sfs_jdesc));
+	j->j_commit = kmalloc(sizeof(struct sfs_jcommit));
+	j->j_bufs = kmalloc(SFS_JDESC_MAX * sizeof(struct buf *));
+	j->j_data = kmalloc((SFS_JDESC_MAX + 1) * sizeof(void *));
+	j->j_reqs = kmalloc((SFS_JDESC_MAX + 1) * sizeof(struct blkreq));
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_freed == NULL ||
+	    j->j_logged == NULL || j->j_desc == NULL ||
+	    j->j_commit == NULL || j->j_bufs == NULL ||
+	    j->j_data == NULL || j->j_reqs == NULL) {
+		sfs_jnl_destroy(j);
+		return ENOMEM;
+	}
+	sfs->sfs_jnl = j;
+
+	/* Read the header */
+	jh = (struct sfs_jheader *)j->j_commit;
+	result = sfs_jnl_rwlog(sfs, 0, jh, UIO_READ);
+	if (result) {
+		goto fail;
+	}
+	if (jh->jh_magic != SFS_JNL_MAGIC) {
+		kprintf("sfs: %s: bad journal header\n", sp->sp_volname);
+		result = EINVAL;
+		goto fail;
+	}
+
+	result = sfs_jnl_replay(sfs, jh->jh_seq);
+	if (result) {
+		goto fail;
+	}
+
+	if (ngroups + SFS_JNL_TXBLOCKS > SFS_JDESC_MAX ||
+	    j->j_nblocks < 1 + 2 * j->j_txmax) {
+		kprintf("sfs: %s: journal too small for this volume; "
+			"not using it\n", sp->sp_volname);
+		sfs_jnl_destroy(j);
+		sfs->sfs_jnl = NULL;
+	}
+	return 0;
+
+ fail:
+	sfs_jnl_destroy(j);
+	sfs->sfs_jnl = NULL;
+	return result;
+}
+
+/*
+ * Tear the journal down at unmount, after the final checkpoint.
+ */
+void
+sfs_jnl_unmount(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *j = sfs->sfs_jnl;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_active == 0 && j->j_nentries == 0 && j->j_pos == 1);
+	sfs_jnl_destroy(j);
+	sfs->sfs_jnl = NULL;
+}
@@ -35,14 +35,15 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/dirent.h>
 #include <stat.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* At bottom of file */
@@ -58,23 +59,103 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Mark a block of a file, which the caller has busy, modified.
+ * Directory blocks are metadata and go through the journal; file
+ * data doesn't.
+ */
 static
+void
+sfs_dirty_block(struct sfs_vnode *sv, struct buf *b, uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_jnl_dirty(sfs, b, diskblock);
+	}
+	else {
+		buffer_mark_dirty(b);
+	}
+}
+
+/*
+ * Note that a vnode's inode has been modified, putting the vnode on
+ * its filesystem's dirty list if it isn't there already. The caller
+ * holds the vnode's lock.
+ */
+static
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirty) {
+		return;
+	}
+	sv->sv_dirty = true;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyvnodes;
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyvnodes = sv;
+	lock_release(sfs->sfs_vnlock);
+}
+
+/*
+ * Write an on-disk inode structure back out to disk. (Well, to the
+ * buffer cache, which takes it from there; see sfs_fsync.) The
+ * caller holds the vnode's lock, and a journal handle.
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct buf *b;
+		int result;
+
+		result = sfs_bget(sfs, sv->sv_ino, &b);
 		if (result) {
 			return result;
 		}
+		memcpy(buffer_map(b), &sv->sv_i, SFS_BLOCKSIZE);
+		sfs_jnl_dirty(sfs, b, sv->sv_ino);
+		buffer_release(b);
 		sv->sv_dirty = false;
+
+		/* Take it off the dirty list */
+		lock_acquire(sfs->sfs_vnlock);
+		if (sv->sv_dirtyprev != NULL) {
+			sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+		}
+		else {
+			sfs->sfs_dirtyvnodes = sv->sv_dirtynext;
+		}
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+		}
+		sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+		lock_release(sfs->sfs_vnlock);
 	}
 	return 0;
 }
@@ -84,19 +165,112 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocation is goal-directed. The caller names the block it would
+ * most like to get, normally the one after the file's previous
+ * block, and gets the first free block at or after it, wrapping
+ * around at the end of the volume. To find free space quickly,
+ * sfs_groupfree counts the free blocks in each group of
+ * SFS_BLOCKBITS blocks (the blocks covered by one bitmap block).
+ * Groups with no free blocks are skipped without looking at their
+ * bits.
+ *
+ * A file written sequentially also gets up to SFS_PREALLOC free
+ * blocks directly after each block it allocates set aside for it,
+ * so files written at the same time don't interleave. Its next
+ * blocks come from there; the device can then read the file back
+ * in large merged transfers.
+ *
+ * Preallocated blocks are marked in use in the bitmap. Unused ones
+ * are given back on truncate, last close, and reclaim, or when the
+ * file stops writing sequentially. After a crash, sfsck finds them
+ * allocated but unreferenced and frees them.
+ *
+ * On a volume with a journal, freed blocks stay marked in use until
+ * the transaction that freed them commits; see sfs_jnl.c.
+ */
+#define SFS_PREALLOC  8
+
+/*
+ * Mark a block in use or free in the bitmap and the group counts.
+ * The caller holds sfs_bitlock.
+ */
+static
+void
+sfs_bmark(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(sfs->sfs_groupfree[block / SFS_BLOCKBITS] > 0);
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs->sfs_groupfree[block / SFS_BLOCKBITS]--;
+	sfs->sfs_groupflags[block / SFS_BLOCKBITS] |=
+		SFS_GROUP_DIRTY | SFS_GROUP_LOGGED;
+	sfs->sfs_freemapdirty = true;
+}
+
+void
+sfs_bunmark(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_bitlock));
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_groupfree[block / SFS_BLOCKBITS]++;
+	sfs->sfs_groupflags[block / SFS_BLOCKBITS] |=
+		SFS_GROUP_DIRTY | SFS_GROUP_LOGGED;
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Find the first free block at or after GOAL, wrapping around. The
+ * caller holds sfs_bitlock.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_bfind(struct sfs_fs *sfs, uint32_t goal, uint32_t *ret)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t group, block, end;
+	unsigned i, found;
+
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+	group = goal / SFS_BLOCKBITS;
+	block = goal;
+
+	/* The goal's group is visited twice: from GOAL, and from its start */
+	for (i=0; i<=sfs->sfs_ngroups; i++) {
+		if (sfs->sfs_groupfree[group] > 0) {
+			end = (group + 1) * SFS_BLOCKBITS;
+			if (end > nblocks) {
+				end = nblocks;
+			}
+			if (bitmap_findclear(sfs->sfs_freemap, block, end,
+					     &found) == 0) {
+				*ret = found;
+				return 0;
+			}
+		}
+		group = (group + 1) % sfs->sfs_ngroups;
+		block = group * SFS_BLOCKBITS;
+	}
+	return ENOSPC;
+}
+
+/*
+ * Allocate a block, as close after GOAL as possible.
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_bitlock);
+	result = sfs_bfind(sfs, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_bitlock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_bmark(sfs, *diskblock);
+	lock_release(sfs->sfs_bitlock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -107,14 +281,102 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Free a block. Returns the number of journal entries that used up
+ * (see sfs_jnl_free).
  */
 static
-void
+unsigned
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	/* No point ever writing back what was in it */
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	if (sfs->sfs_jnl != NULL) {
+		return sfs_jnl_free(sfs, diskblock);
+	}
+	lock_acquire(sfs->sfs_bitlock);
+	sfs_bunmark(sfs, diskblock);
+	lock_release(sfs->sfs_bitlock);
+	return 0;
+}
+
+/*
+ * Give back a file's unused preallocated blocks. They were never
+ * written, so there's nothing in the buffer cache to drop.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_npreallocs == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_bitlock);
+	for (i=0; i<sv->sv_npreallocs; i++) {
+		sfs_bunmark(sfs, sv->sv_prealloc + i);
+	}
+	lock_release(sfs->sfs_bitlock);
+	sv->sv_npreallocs = 0;
+}
+
+/*
+ * Allocate the disk block for block FILEBLOCK of a file. PREV is the
+ * disk block of the file block before it, or 0 if there isn't one.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, uint32_t fileblock, uint32_t prev,
+		uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	bool sequential = (fileblock == sv->sv_allocnext);
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t block;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sequential && sv->sv_npreallocs > 0) {
+		/* Take the next preallocated block */
+		*diskblock = sv->sv_prealloc++;
+		sv->sv_npreallocs--;
+		result = sfs_clearblock(sfs, *diskblock);
+		if (result) {
+			return result;
+		}
+		sv->sv_allocnext = fileblock + 1;
+		return 0;
+	}
+
+	/* Any preallocation we had isn't going to be used */
+	sfs_prealloc_release(sv);
+
+	result = sfs_balloc(sfs, prev != 0 ? prev + 1 : sv->sv_ino + 1,
+			    diskblock);
+	if (result) {
+		return result;
+	}
+	sv->sv_allocnext = fileblock + 1;
+
+	if (sequential) {
+		/* Set aside the free run after it, if there is one */
+		lock_acquire(sfs->sfs_bitlock);
+		block = *diskblock + 1;
+		while (sv->sv_npreallocs < SFS_PREALLOC && block < nblocks &&
+		       !bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs_bmark(sfs, block);
+			sv->sv_npreallocs++;
+			block++;
+		}
+		lock_release(sfs->sfs_bitlock);
+		sv->sv_prealloc = *diskblock + 1;
+	}
+	return 0;
 }
 
 /*
@@ -124,17 +386,164 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_bitlock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_bitlock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Sizes in the block map (see kern/sfs.h), in file blocks:
+ * sfs_idspans[L] is what an indirect block L levels above the data
+ * covers, so sfs_idspans[L-1] is what each of its entries covers.
+ */
+static const uint32_t sfs_idspans[4] = {
+	1,
+	SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB,
+};
+
+/* The largest file, in blocks */
+#define SFS_MAXFILEBLOCKS (SFS_NDIRECT + SFS_DBPERIDB + \
+	SFS_DBPERIDB * SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+
+/*
+ * Return the inode field holding the top block of the tree with
+ * LEVELS levels of indirection (1 to 3), and hand back the first
+ * file block that tree covers.
+ */
+static
+uint32_t *
+sfs_idroot(struct sfs_vnode *sv, unsigned levels, uint32_t *first)
+{
+	switch (levels) {
+	    case 1:
+		*first = SFS_NDIRECT;
+		return &sv->sv_i.sfi_indirect;
+	    case 2:
+		*first = SFS_NDIRECT + sfs_idspans[1];
+		return &sv->sv_i.sfi_dindirect;
+	    case 3:
+		*first = SFS_NDIRECT + sfs_idspans[1] + sfs_idspans[2];
+		return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: idroot: %u levels of indirection\n", levels);
+	return NULL;
+}
+
+/*
+ * Find the indirect block that lists the disk block of file block
+ * FILEBLOCK (which is past the direct blocks), allocating it and
+ * any indirect blocks above it if DOALLOC is set. Hands back its
+ * disk block, or 0 if there isn't one, and the first file block it
+ * lists.
+ *
+ * The vnode remembers the last one found, so sequential I/O only
+ * walks down the tree once every SFS_DBPERIDB blocks. sfs_truncate
+ * forgets it when it frees indirect blocks.
+ */
+static
+int
+sfs_bmap_leaf(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	      uint32_t *leafblock, uint32_t *leaffirst)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *pbuf = NULL;
+	uint32_t *slot, *pdata;
+	uint32_t first, idblock, pblock = 0, goal, index;
+	unsigned levels;
+	int result = 0;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+
+	if (sv->sv_idblock != 0 &&
+	    fileblock >= sv->sv_idfirst &&
+	    fileblock - sv->sv_idfirst < SFS_DBPERIDB) {
+		*leafblock = sv->sv_idblock;
+		*leaffirst = sv->sv_idfirst;
+		return 0;
+	}
+
+	if (fileblock >= SFS_MAXFILEBLOCKS) {
+		return EFBIG;
+	}
+	levels = 1;
+	slot = sfs_idroot(sv, levels, &first);
+	while (fileblock - first >= sfs_idspans[levels]) {
+		levels++;
+		slot = sfs_idroot(sv, levels, &first);
+	}
+
+	goal = sv->sv_i.sfi_direct[SFS_NDIRECT-1] != 0 ?
+		sv->sv_i.sfi_direct[SFS_NDIRECT-1] + 1 : sv->sv_ino + 1;
+
+	/*
+	 * Walk down the tree. SLOT points at the entry for the next
+	 * block down, in the inode or in the block held in PBUF.
+	 */
+	for (;;) {
+		idblock = *slot;
+		if (idblock == 0 && doalloc) {
+			result = sfs_balloc(sfs, goal, &idblock);
+			if (result) {
+				break;
+			}
+			*slot = idblock;
+			if (pbuf == NULL) {
+				sfs_dirty_inode(sv);
+			}
+			else {
+				sfs_jnl_dirty(sfs, pbuf, pblock);
+			}
+			/* (sfs_balloc left it zeroed in the buffer cache) */
+		}
+		if (pbuf != NULL) {
+			buffer_release(pbuf);
+			pbuf = NULL;
+		}
+		if (idblock == 0 || levels == 1) {
+			break;
+		}
+
+		result = sfs_bread(sfs, idblock, &pbuf);
+		if (result) {
+			break;
+		}
+		pblock = idblock;
+		pdata = buffer_map(pbuf);
+		levels--;
+		index = (fileblock - first) / sfs_idspans[levels];
+		first += index * sfs_idspans[levels];
+		slot = &pdata[index];
+		goal = idblock + 1;
+	}
+	if (pbuf != NULL) {
+		buffer_release(pbuf);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (idblock != 0) {
+		sv->sv_idblock = idblock;
+		sv->sv_idfirst = first;
+	}
+	*leafblock = idblock;
+	*leaffirst = first;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +555,14 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idblock, idfirst, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT((sv->sv_i.sfi_flags & SFS_IF_INLINE) == 0);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,14 +577,16 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, fileblock,
+				fileblock > 0 ? sv->sv_i.sfi_direct[fileblock-1] : 0,
+				&block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -198,87 +601,51 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; find the indirect block that
+	 * lists it.
 	 */
-	if (idnum > 0) {
-		return EFBIG;
+	result = sfs_bmap_leaf(sv, fileblock, doalloc, &idblock, &idfirst);
+	if (result) {
+		return result;
 	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	if (idblock == 0) {
 		/*
 		 * There's no indirect block allocated. We weren't
 		 * asked to allocate anything, so pretend the indirect
 		 * block was filled with all zeros.
 		 */
+		KASSERT(!doalloc);
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	idoff = fileblock - idfirst;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	/* Get the indirect block from the buffer cache. */
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = buffer_map(idbuf);
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	block = iddata[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc_file(sv, fileblock,
+			idoff > 0 ? iddata[idoff-1] : idblock, &block);
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_jnl_dirty(sfs, idbuf, idblock);
 	}
+	buffer_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -293,6 +660,80 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 //
 // File-level I/O
 
+/*
+ * Do I/O to a file whose data is inline (see kern/sfs.h). A write
+ * must end within SFS_INLINESIZE.
+ */
+static
+int
+sfs_inline_io(struct sfs_vnode *sv, struct uio *uio)
+{
+	off_t size = sv->sv_i.sfi_size;
+	size_t len;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_INLINE);
+
+	if (uio->uio_rw == UIO_READ) {
+		if (uio->uio_offset >= size) {
+			return 0;
+		}
+		len = size - uio->uio_offset;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		return uiomove(sv->sv_i.sfi_data + uio->uio_offset, len, uio);
+	}
+
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE);
+	result = uiomove(sv->sv_i.sfi_data + uio->uio_offset,
+			 uio->uio_resid, uio);
+	if (uio->uio_offset > size) {
+		sv->sv_i.sfi_size = uio->uio_offset;
+	}
+	sfs_dirty_inode(sv);
+	return result;
+}
+
+/*
+ * Move an inline file's data out to a block of its own, so it can
+ * grow past SFS_INLINESIZE.
+ */
+static
+int
+sfs_uninline(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
+	uint32_t diskblock;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_INLINE);
+
+	sv->sv_i.sfi_flags &= ~SFS_IF_INLINE;
+	if (sv->sv_i.sfi_size > 0) {
+		result = sfs_bmap(sv, 0, 1, &diskblock);
+		if (result) {
+			sv->sv_i.sfi_flags |= SFS_IF_INLINE;
+			return result;
+		}
+		result = sfs_bget(sfs, diskblock, &b);
+		if (result) {
+			sv->sv_i.sfi_direct[0] = 0;
+			sfs_bfree(sfs, diskblock);
+			sv->sv_i.sfi_flags |= SFS_IF_INLINE;
+			return result;
+		}
+		bzero(buffer_map(b), SFS_BLOCKSIZE);
+		memcpy(buffer_map(b), sv->sv_i.sfi_data, sv->sv_i.sfi_size);
+		sfs_dirty_block(sv, b, diskblock);
+		buffer_release(b);
+	}
+	bzero(sv->sv_i.sfi_data, SFS_INLINESIZE);
+	sfs_dirty_inode(sv);
+	return 0;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -308,16 +749,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +772,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is dirty, even if the uiomove
+	 * only got part way.
 	 */
+	result = uiomove((char *)buffer_map(iobuf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirty_block(sv, iobuf, diskblock);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +808,12 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	size_t startres, done;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,33 +836,105 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. A write covers the whole block,
+	 * so there's no need to read the old contents first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_bget(sfs, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	startres = uio->uio_resid;
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		if (result) {
+			/*
+			 * Partial copy: the rest of the buffer may hold
+			 * anything (even another block); zero it.
+			 */
+			done = startres - uio->uio_resid;
+			bzero((char *)buffer_map(iobuf) + done,
+			      SFS_BLOCKSIZE - done);
+		}
+		sfs_dirty_block(sv, iobuf, diskblock);
+	}
+	buffer_release(iobuf);
 
 	return result;
 }
 
+/*
+ * Read-ahead.
+ *
+ * Each vnode remembers where the last read ended. A read that picks
+ * up there (or in the block it ended in, for reads smaller than a
+ * block) is sequential: the read-ahead window opens at SFS_RAMIN
+ * blocks and doubles with each further sequential read, up to
+ * SFS_RAMAX. Any other read closes it. Blocks within the window past
+ * the end of the current read, as well as the blocks of the current
+ * read after the first, are handed to buffer_prefetch, which queues
+ * them with the disk while we go on with the read.
+ */
+
+#define SFS_RAMIN   2
+#define SFS_RAMAX   16
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, last, end, fileblock, diskblock, fileblocks;
+
+	KASSERT(uio->uio_rw == UIO_READ && uio->uio_resid > 0);
+
+	first = uio->uio_offset / SFS_BLOCKSIZE;
+	last = (uio->uio_offset + uio->uio_resid - 1) / SFS_BLOCKSIZE;
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	end = last + 1 + sv->sv_rawindow;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+
+	fileblock = first + 1;
+	if (fileblock < sv->sv_raend) {
+		/* already started these */
+		fileblock = sv->sv_raend;
+	}
+	for (; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_prefetch(sfs->sfs_device, diskblock);
+		}
+	}
+	if (end > sv->sv_raend) {
+		sv->sv_raend = end;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -452,6 +947,23 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * Inline files need no block I/O, until a write makes one too
+	 * big to stay inline.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+			return sfs_inline_io(sv, uio);
+		}
+		result = sfs_uninline(sv);
+		if (result) {
+			return result;
+		}
+	}
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -471,6 +983,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio);
+		}
 	}
 
 	/*
@@ -531,7 +1047,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -636,24 +1152,41 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+/* Linear directories are hashed once they fill this many slots. */
+#define SFS_DIR_HASHMIN  64
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Hash a name for a hashed directory (32-bit FNV-1a; see kern/sfs.h).
  */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h = SFS_FNV_BASIS;
 
+	for (; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= SFS_FNV_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Search slots FIRST through LAST-1 of a directory for a name. If it
+ * is found, set *FOUND and hand back its inode number and slot. Also
+ * hand back the first empty slot seen, unless *EMPTYSLOT already
+ * holds one from an earlier scan.
+ */
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_scan(struct sfs_vnode *sv, const char *name, int first, int last,
+	     uint32_t *ino, int *slot, int *emptyslot, int *found)
 {
 	struct sfs_dir tsd;
-	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
 	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	for (i=first; i<last; i++) {
 
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, &tsd, i);
@@ -662,7 +1195,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 		if (tsd.sfd_ino == SFS_NOINO) {
 			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
+			if (emptyslot != NULL && *emptyslot < 0) {
 				*emptyslot = i;
 			}
 		}
@@ -672,9 +1205,9 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 			if (!strcmp(tsd.sfd_name, name)) {
 
 				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+				KASSERT(*found==0);
 
-				found = 1;
+				*found = 1;
 				if (slot != NULL) {
 					*slot = i;
 				}
@@ -685,9 +1218,97 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
+	return 0;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * In a hashed directory only the name's bucket and the linear part
+ * need to be searched, and the bucket is searched first: a name that
+ * exists is usually found there with a single block read. Empty slots
+ * are likewise offered from the bucket first.
+ */
+
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	int found = 0;
+	int nentries = sfs_dir_nentries(sv);
+	uint32_t nbuckets = sv->sv_i.sfi_dirbuckets;
+	int hstart, hend, bstart;
+	int result;
+
+	if (emptyslot != NULL) {
+		*emptyslot = -1;
+	}
+
+	if (nbuckets == 0) {
+		result = sfs_dir_scan(sv, name, 0, nentries,
+				      ino, slot, emptyslot, &found);
+		if (result) {
+			return result;
+		}
+		return found ? 0 : ENOENT;
+	}
+
+	hstart = sv->sv_i.sfi_dirbase * SFS_DIRPERBLOCK;
+	hend = hstart + nbuckets * SFS_DIRPERBLOCK;
+	bstart = hstart + (sfs_dir_hash(name) % nbuckets) * SFS_DIRPERBLOCK;
+	KASSERT(hend <= nentries);
+
+	/* The bucket... */
+	result = sfs_dir_scan(sv, name, bstart, bstart + SFS_DIRPERBLOCK,
+			      ino, slot, emptyslot, &found);
+	/* ...then the linear part before the buckets... */
+	if (result == 0 && !found) {
+		result = sfs_dir_scan(sv, name, 0, hstart,
+				      ino, slot, emptyslot, &found);
+	}
+	/* ...and after them. */
+	if (result == 0 && !found) {
+		result = sfs_dir_scan(sv, name, hend, nentries,
+				      ino, slot, emptyslot, &found);
+	}
+	if (result) {
+		return result;
+	}
+
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Turn a linear directory into a hashed one. The existing entries
+ * stay where they are and become the linear part; the buckets are
+ * added after them as holes. Only the inode changes, so this is
+ * safe against crashes.
+ *
+ * Does nothing if the buckets wouldn't fit in the largest file SFS
+ * can represent; the directory just stays linear.
+ */
+static
+void
+sfs_dir_makehashed(struct sfs_vnode *sv)
+{
+	uint32_t base;
+
+	KASSERT(sv->sv_i.sfi_dirbuckets == 0);
+
+	base = DIVROUNDUP(sfs_dir_nentries(sv), SFS_DIRPERBLOCK);
+	if (base + SFS_DIR_NBUCKETS > SFS_MAXFILEBLOCKS) {
+		return;
+	}
+
+	sv->sv_i.sfi_dirbase = base;
+	sv->sv_i.sfi_dirbuckets = SFS_DIR_NBUCKETS;
+	sv->sv_i.sfi_size = (base + SFS_DIR_NBUCKETS) * SFS_BLOCKSIZE;
+	sfs_dirty_inode(sv);
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -713,7 +1334,22 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot, a linear directory that has
+	 * grown large enough gets hashed, which gives us a bucket to use.
+	 * Otherwise add the entry at the end.
+	 */
+	if (emptyslot < 0 && sv->sv_i.sfi_dirbuckets == 0 &&
+	    sfs_dir_nentries(sv) >= SFS_DIR_HASHMIN) {
+		sfs_dir_makehashed(sv);
+		if (sv->sv_i.sfi_dirbuckets != 0) {
+			result = sfs_dir_findname(sv, name, NULL, NULL,
+						  &emptyslot);
+			if (result!=0 && result!=ENOENT) {
+				return result;
+			}
+		}
+	}
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
@@ -787,11 +1423,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. The inode
+ * goes as close after block GOAL as possible.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, uint32_t goal, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -801,7 +1439,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1513,22 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * Hand the inode to the buffer cache. Unlike fsync, don't wait
+	 * for the disk; the syncer will get to it.
+	 */
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	sfs_prealloc_release(sv);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+
+	return result;
 }
 
 /*
@@ -890,15 +1542,16 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **svp;
 	int result;
 
 	vfs_biglock_acquire();
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. (sfs_loadvnode also runs
+	 * under vfs_biglock, so it can't hand out a new reference while
+	 * we're in here.)
 	 */
 	if (v->vn_refcount != 1) {
 
@@ -920,8 +1573,13 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Sync the inode to disk */
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	sfs_prealloc_release(sv);
 	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
 	if (result) {
+		sfs_jnl_end(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -930,29 +1588,29 @@ sfs_reclaim(struct vnode *v)
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
+	sfs_jnl_end(sfs);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	KASSERT(!sv->sv_dirty);
+	lock_acquire(sfs->sfs_vnlock);
+	svp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	while (*svp != sv) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
+		svp = &(*svp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*svp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+	lock_release(sfs->sfs_vnlock);
 
 	VOP_CLEANUP(&sv->sv_v);
 
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -964,36 +1622,259 @@ sfs_reclaim(struct vnode *v)
  */
 static
 int
-sfs_read(struct vnode *v, struct uio *uio)
+sfs_read(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_io(sv, uio);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Called for write(). sfs_io() does the work.
+ *
+ * On a volume with a journal, a long write is done SFS_WRITECHUNK
+ * bytes at a time, each piece a separate operation. A piece that
+ * size allocates at most five indirect blocks (two at the bottom of
+ * the tree, two above them, and the triple indirect block), so with
+ * the inode it fits in SFS_JNL_OPBLOCKS.
+ */
+#define SFS_WRITECHUNK  (SFS_DBPERIDB * SFS_BLOCKSIZE)
+
+static
+int
+sfs_write(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t extraresid;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_WRITE);
+
+	do {
+		extraresid = 0;
+		if (sfs->sfs_jnl != NULL && uio->uio_resid > SFS_WRITECHUNK) {
+			extraresid = uio->uio_resid - SFS_WRITECHUNK;
+			uio->uio_resid = SFS_WRITECHUNK;
+		}
+
+		sfs_jnl_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		if (result == 0) {
+			/* Put the new size/blocks in the delayed writes */
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
+
+		uio->uio_resid += extraresid;
+	} while (result == 0 && extraresid > 0);
+
+	return result;
+}
+
+/*
+ * Called for getdirentry(). The seek position is a slot number, not
+ * a byte offset; empty slots are skipped and the position is left at
+ * the slot after the one returned.
+ */
+static
+int
+sfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_dir sd;
+	int slot, nentries, result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+
+	nentries = sfs_dir_nentries(sv);
+	for (slot = uio->uio_offset; slot < nentries; slot++) {
+		result = sfs_readdir(sv, &sd, slot);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		if (sd.sfd_ino != SFS_NOINO) {
+			break;
+		}
+	}
+
+	if (slot < nentries) {
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		result = uiomove(sd.sfd_name, strlen(sd.sfd_name), uio);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		slot++;
+	}
+	uio->uio_offset = slot;
+
+	lock_release(sv->sv_lock);
+	return 0;
+}
+
+/*
+ * Get the type of inode INO for getdirentries(), as a DT_* value.
+ * If the vnode is loaded its inode is in memory; otherwise look at
+ * the inode block, which is probably cached if anyone has used the
+ * file lately. The type never changes, so this needs no lock on the
+ * inode.
+ */
+static
+int
+sfs_inotype(struct sfs_fs *sfs, uint32_t ino, uint8_t *ret)
+{
+	struct sfs_vnode *sv;
+	struct buf *b;
+	uint16_t type = SFS_TYPE_INVAL;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			type = sv->sv_i.sfi_type;
+			break;
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	if (type == SFS_TYPE_INVAL && ino < sfs->sfs_super.sp_nblocks) {
+		result = sfs_bread(sfs, ino, &b);
+		if (result) {
+			return result;
+		}
+		type = ((struct sfs_inode *)buffer_map(b))->sfi_type;
+		buffer_release(b);
+	}
+
+	switch (type) {
+	    case SFS_TYPE_FILE:
+		*ret = DT_REG;
+		break;
+	    case SFS_TYPE_DIR:
+		*ret = DT_DIR;
+		break;
+	    default:
+		*ret = DT_UNKNOWN;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Called for getdirentries(). Like sfs_getdirentry, but reads the
+ * directory a block at a time and returns as many entries as fit.
+ */
+static
+int
+sfs_getdirentries(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_dir *sds;
+	union {
+		struct dirent d;
+		char buf[DIRENT_RECLEN(SFS_NAMELEN)];
+	} rec;
+	struct iovec iov;
+	struct uio ku;
+	size_t namlen, reclen;
+	int slot, nentries, i, n, count, result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
 
-	return result;
-}
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		return ENOMEM;
+	}
 
-/*
- * Called for write(). sfs_io() does the work.
- */
-static
-int
-sfs_write(struct vnode *v, struct uio *uio)
-{
-	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	lock_acquire(sv->sv_lock);
 
-	KASSERT(uio->uio_rw==UIO_WRITE);
+	nentries = sfs_dir_nentries(sv);
+	slot = uio->uio_offset;
+	i = n = 0;
+	count = 0;
+	result = 0;
+	while (slot < nentries) {
+		if (i == n) {
+			/* Read up to the end of the block SLOT is in. */
+			n = SFS_DIRPERBLOCK - slot % SFS_DIRPERBLOCK;
+			if (n > nentries - slot) {
+				n = nentries - slot;
+			}
+			uio_kinit(&iov, &ku, sds, n * sizeof(struct sfs_dir),
+				  slot * sizeof(struct sfs_dir), UIO_READ);
+			result = sfs_io(sv, &ku);
+			if (result) {
+				break;
+			}
+			if (ku.uio_resid > 0) {
+				panic("sfs: getdirentries: Short entry "
+				      "(inode %u)\n", sv->sv_ino);
+			}
+			i = 0;
+		}
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+		if (sds[i].sfd_ino == SFS_NOINO) {
+			slot++;
+			i++;
+			continue;
+		}
+
+		sds[i].sfd_name[sizeof(sds[i].sfd_name)-1] = 0;
+		namlen = strlen(sds[i].sfd_name);
+		reclen = DIRENT_RECLEN(namlen);
+		if (reclen > uio->uio_resid) {
+			if (count == 0) {
+				result = EINVAL;
+			}
+			break;
+		}
+
+		bzero(&rec, reclen);
+		rec.d.d_ino = sds[i].sfd_ino;
+		rec.d.d_reclen = reclen;
+		rec.d.d_namlen = namlen;
+		result = sfs_inotype(sfs, sds[i].sfd_ino, &rec.d.d_type);
+		if (result) {
+			break;
+		}
+		memcpy(rec.d.d_name, sds[i].sfd_name, namlen);
+
+		result = uiomove(&rec, reclen, uio);
+		if (result) {
+			break;
+		}
+		count++;
+		slot++;
+		i++;
+	}
+	/* uiomove moved the offset by bytes; it counts slots. */
+	uio->uio_offset = slot;
 
+	lock_release(sv->sv_lock);
+	kfree(sds);
 	return result;
 }
 
@@ -1033,7 +1914,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1936,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so this needs no lock */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1092,136 +1972,348 @@ sfs_tryseek(struct vnode *v, off_t pos)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Write out an indirect block LEVELS levels above the data, and the
+ * indirect blocks below it. For fsync.
+ */
+static
+int
+sfs_sync_indirect(struct sfs_fs *sfs, uint32_t idblock, unsigned levels)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	unsigned i;
+	int result = 0;
+
+	if (levels > 1) {
+		result = sfs_bread(sfs, idblock, &idbuf);
+		if (result) {
+			return result;
+		}
+		iddata = buffer_map(idbuf);
+		for (i=0; i<SFS_DBPERIDB && result == 0; i++) {
+			if (iddata[i] != 0) {
+				result = sfs_sync_indirect(sfs, iddata[i],
+							   levels - 1);
+			}
+		}
+		buffer_release(idbuf);
+		if (result) {
+			return result;
+		}
+	}
+	return buffer_sync_block(sfs->sfs_device, idblock);
+}
+
+/*
+ * Called for fsync(). Writes are normally left in the buffer cache
+ * for the syncer; this pushes the file's inode, indirect blocks, and
+ * data blocks all the way to disk now. With a journal, the data
+ * blocks are written and then the running transaction is committed,
+ * which takes care of the inode and indirect blocks (and of every
+ * other file's metadata changes since the last commit).
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t i, nblocks, diskblock, *slot, first;
+	unsigned levels;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result) {
+		goto out;
+	}
+
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		/* The data is in the inode */
+		nblocks = 0;
+	}
+	for (i=0; i<nblocks; i++) {
+		result = sfs_bmap(sv, i, 0, &diskblock);
+		if (result) {
+			goto out;
+		}
+		if (diskblock != 0) {
+			result = buffer_sync_block(sfs->sfs_device, diskblock);
+			if (result) {
+				goto out;
+			}
+		}
+	}
+
+	if (sfs->sfs_jnl != NULL) {
+		goto out;
+	}
 
+	for (levels=1; levels<=3; levels++) {
+		slot = sfs_idroot(sv, levels, &first);
+		if (*slot != 0) {
+			result = sfs_sync_indirect(sfs, *slot, levels);
+			if (result) {
+				goto out;
+			}
+		}
+	}
+
+	result = buffer_sync_block(sfs->sfs_device, sv->sv_ino);
+
+ out:
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+	if (result == 0) {
+		result = sfs_jnl_commit(sfs);
+	}
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can be mapped; the VM system
+ * pages them through sfs_read and sfs_write. (Directories use
+ * sfs_dirops, where this is ISDIR.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncation frees blocks from the end of the file backwards, in
+ * passes. On a volume with a journal each pass is one operation, and
+ * stops before it could use more than SFS_JNL_OPBLOCKS entries of
+ * the transaction: one for the inode, one for each indirect block it
+ * goes into (which it either changes or frees), and whatever freeing
+ * data blocks takes (see sfs_jnl_free). The file is cut back to
+ * where each pass got to, so it is consistent in between.
+ */
+struct sfs_trunc {
+	uint32_t st_keep;	/* file blocks below this stay */
+	uint32_t st_frontier;	/* no blocks from here on are left */
+	unsigned st_budget;	/* journal entries the pass may still use */
+	bool st_stopped;	/* pass ran out of budget */
+};
+
+/*
+ * Free the blocks from st_keep on in the tree under indirect block
+ * IDBLOCK, which is LEVELS levels above the data and covers file
+ * blocks from FIRST. Sets *EMPTY if nothing is left in IDBLOCK, in
+ * which case the caller frees it.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_trunc_tree(struct sfs_vnode *sv, struct sfs_trunc *st,
+	       uint32_t idblock, unsigned levels, uint32_t first,
+	       bool *empty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
-	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span = sfs_idspans[levels-1];
+	uint32_t i, cfirst;
+	bool changed = false, childempty;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	*empty = false;
 
-	vfs_biglock_acquire();
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
 
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+	for (i=SFS_DBPERIDB; i-- > 0; ) {
+		cfirst = first + i*span;
+		if (cfirst + span <= st->st_keep) {
+			/* This entry and the ones before it stay */
+			break;
+		}
+		if (iddata[i] != 0) {
+			if (st->st_budget == 0) {
+				st->st_stopped = true;
+				break;
+			}
+			if (levels == 1) {
+				st->st_budget -= sfs_bfree(sfs, iddata[i]);
+				iddata[i] = 0;
+				changed = true;
+			}
+			else {
+				st->st_budget--;
+				result = sfs_trunc_tree(sv, st, iddata[i],
+							levels-1, cfirst,
+							&childempty);
+				if (result || st->st_stopped) {
+					break;
+				}
+				if (childempty) {
+					/* (already paid for, above) */
+					sfs_bfree(sfs, iddata[i]);
+					iddata[i] = 0;
+					changed = true;
+				}
+			}
 		}
+		st->st_frontier = cfirst > st->st_keep ? cfirst : st->st_keep;
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	if (result == 0 && !st->st_stopped) {
+		*empty = true;
+		for (i=0; i<SFS_DBPERIDB; i++) {
+			if (iddata[i] != 0) {
+				*empty = false;
+				break;
+			}
+		}
+	}
+	if (changed && !*empty) {
+		sfs_jnl_dirty(sfs, idbuf, idblock);
+	}
+	buffer_release(idbuf);
+	return result;
+}
 
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+/*
+ * One pass of truncation to LEN bytes. Sets *DONE if it got all the
+ * way.
+ */
+static
+int
+sfs_trunc_pass(struct sfs_vnode *sv, off_t len, bool *done)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_trunc st;
+	uint32_t *slot, first, i;
+	unsigned levels;
+	bool empty;
+	int result = 0;
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	/* Preallocated blocks past the old EOF are no use now */
+	sfs_prealloc_release(sv);
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (len > SFS_INLINESIZE) {
+			result = sfs_uninline(sv);
+			if (result) {
+				return result;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+		}
+		else {
+			/* Keep the bytes past EOF zero */
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_data + len,
+				      sv->sv_i.sfi_size - len);
 			}
+			sv->sv_i.sfi_size = len;
+			sfs_dirty_inode(sv);
+			*done = true;
+			return 0;
 		}
+	}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+	st.st_keep = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	st.st_frontier = SFS_MAXFILEBLOCKS;
+	/* (Without a journal, the budget is more than any file needs) */
+	st.st_budget = sfs->sfs_jnl != NULL ?
+		SFS_JNL_OPBLOCKS - 1 : SFS_MAXFILEBLOCKS;
+	st.st_stopped = false;
+
+	/* The indirect block the vnode remembers may go */
+	sv->sv_idblock = 0;
+
+	/* The trees of indirect blocks, last first */
+	for (levels=3; levels>0; levels--) {
+		slot = sfs_idroot(sv, levels, &first);
+		if (*slot != 0 && first + sfs_idspans[levels] > st.st_keep) {
+			if (st.st_budget == 0) {
+				st.st_stopped = true;
+				break;
+			}
+			st.st_budget--;
+			result = sfs_trunc_tree(sv, &st, *slot, levels, first,
+						&empty);
+			if (result || st.st_stopped) {
+				break;
+			}
+			if (empty) {
+				sfs_bfree(sfs, *slot);
+				*slot = 0;
+				sfs_dirty_inode(sv);
+			}
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
+		st.st_frontier = first > st.st_keep ? first : st.st_keep;
+	}
+
+	/* Then the direct blocks */
+	for (i=SFS_NDIRECT; result == 0 && !st.st_stopped &&
+		     i-- > st.st_keep; ) {
+		if (sv->sv_i.sfi_direct[i] != 0) {
+			if (st.st_budget == 0) {
+				st.st_stopped = true;
+				break;
 			}
+			st.st_budget -= sfs_bfree(sfs, sv->sv_i.sfi_direct[i]);
+			sv->sv_i.sfi_direct[i] = 0;
+			sfs_dirty_inode(sv);
+		}
+		st.st_frontier = i;
+	}
+
+	/* Set the file size, to LEN or as far as we got */
+	if (result == 0 && !st.st_stopped) {
+		sv->sv_i.sfi_size = len;
+		*done = true;
+	}
+	else {
+		if ((off_t)st.st_frontier * SFS_BLOCKSIZE <
+		    sv->sv_i.sfi_size) {
+			sv->sv_i.sfi_size = st.st_frontier * SFS_BLOCKSIZE;
 		}
+		*done = false;
 	}
+	sfs_dirty_inode(sv);
+	return result;
+}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+/*
+ * Called for ftruncate() and from sfs_reclaim.
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	bool done;
+	int result;
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
 
-	vfs_biglock_release();
-	return 0;
+	do {
+		sfs_jnl_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_trunc_pass(sv, len, &done);
+		if (result == 0) {
+			/* Queue the inode for writing */
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
+	} while (result == 0 && !done);
+
+	return result;
 }
 
 /*
@@ -1255,42 +2347,40 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 {
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_vnode *newguy;
+	struct sfs_vnode *newguy, *drop = NULL;
 	uint32_t ino;
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
-		return EEXIST;
+		result = EEXIST;
+		goto out;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			goto out;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
-		return 0;
+		goto out;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv->sv_ino, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
 	/* We don't currently support file permissions; ignore MODE */
@@ -1299,21 +2389,37 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
-		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
-		return result;
+		/* Reclaiming it needs a journal handle of its own */
+		drop = newguy;
+		goto out;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	result = sfs_sync_inode(newguy);
+	lock_release(newguy->sv_lock);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	if (result) {
+		drop = newguy;
+		goto out;
+	}
 
 	*ret = &newguy->sv_v;
-	
+
+ out:
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+	if (drop != NULL) {
+		VOP_DECREF(&drop->sv_v);
+	}
 	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1325,6 +2431,7 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
@@ -1332,20 +2439,30 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	KASSERT(file->vn_fs == dir->vn_fs);
 
 	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	result = sfs_sync_inode(f);
+	lock_release(f->sv_lock);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
 
+ out:
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1355,30 +2472,55 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
+	/*
+	 * Directories (the only one being the root, possibly found via
+	 * a `.' entry) go through rmdir, not here.
+	 */
+	if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
+		VOP_DECREF(&victim->sv_v);
+		vfs_biglock_release();
+		return EISDIR;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		result = sfs_sync_inode(victim);
+		lock_release(victim->sv_lock);
 	}
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 
-	/* Discard the reference that sfs_lookonce got us */
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the file, which takes a journal handle of its own.
+	 */
 	VOP_DECREF(&victim->sv_v);
 
 	vfs_biglock_release();
@@ -1396,6 +2538,7 @@ int
 sfs_rename(struct vnode *d1, const char *n1, 
 	   struct vnode *d2, const char *n2)
 {
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
@@ -1406,9 +2549,14 @@ sfs_rename(struct vnode *d1, const char *n1,
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	sfs_jnl_begin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jnl_end(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -1430,8 +2578,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,15 +2593,24 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	result = sfs_sync_inode(g1);
+	lock_release(g1->sv_lock);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
 	vfs_biglock_release();
-	return 0;
+	return result;
 
  puke_harder:
 	/*
@@ -1464,8 +2623,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
+	sfs_jnl_end(sfs);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 	vfs_biglock_release();
@@ -1527,7 +2691,9 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
 		vfs_biglock_release();
 		return result;
@@ -1585,6 +2751,7 @@ static const struct vnode_ops sfs_fileops = {
 	sfs_read,
 	NOTDIR,  /* readlink */
 	NOTDIR,  /* getdirentry */
+	NOTDIR,  /* getdirentries */
 	sfs_write,
 	sfs_ioctl,
 	sfs_stat,
@@ -1619,12 +2786,13 @@ static const struct vnode_ops sfs_dirops = {
 	
 	ISDIR,   /* read */
 	ISDIR,   /* readlink */
-	UNIMP,   /* getdirentry */
+	sfs_getdirentry,
+	sfs_getdirentries,
 	ISDIR,   /* write */
 	sfs_ioctl,
 	sfs_stat,
 	sfs_gettype,
-	UNIMP,   /* tryseek */
+	sfs_tryseek,
 	sfs_fsync,
 	ISDIR,   /* mmap */
 	ISDIR,   /* truncate */
@@ -1645,43 +2813,45 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * Called with vfs_biglock held, which keeps anyone else from loading
+ * or reclaiming vnodes between our search of the table and our
+ * addition to it.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	KASSERT(vfs_biglock_do_i_hold());
 
+	/* Look in the vnodes table */
+	lock_acquire(sfs->sfs_vnlock);
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE]; sv != NULL;
+	     sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* Didn't have it loaded; load it */
 
@@ -1703,18 +2873,42 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		return result;
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
+
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No read-ahead until it's read sequentially */
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+
+	/* Nor any preallocation until it's written sequentially */
+	sv->sv_allocnext = 0;
+	sv->sv_prealloc = 0;
+	sv->sv_npreallocs = 0;
+
+	/* No indirect block looked up yet */
+	sv->sv_idfirst = 0;
+	sv->sv_idblock = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
-	 * recorded there will be SFS_TYPE_INVAL.
+	 * recorded there will be SFS_TYPE_INVAL. New regular files
+	 * start out inline.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		if (forcetype == SFS_TYPE_FILE) {
+			sv->sv_i.sfi_flags = SFS_IF_INLINE;
+		}
+		/* (marked dirty below, once it's a vnode) */
 	}
 
 	/*
@@ -1736,20 +2930,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	if (forcetype != SFS_TYPE_INVAL) {
+		lock_acquire(sv->sv_lock);
+		sfs_dirty_inode(sv);
+		lock_release(sv->sv_lock);
+	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_hashnext = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE];
+	sfs->sfs_vnhash[ino % SFS_VNHASHSIZE] = sv;
+	sfs->sfs_nvnodes++;
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
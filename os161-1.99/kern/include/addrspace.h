@@ -39,6 +39,8 @@
 #include "opt-A3.h"
 
 struct vnode;
+struct sharedtext;
+struct mmapregion;
 typedef struct {
   int * pages;
   int size;
@@ -61,6 +63,8 @@ struct addrspace {
   pagetable * as_pbase1;
   pagetable * as_pbase2;
   pagetable * as_stackpbase;
+  struct sharedtext * as_text;   /* shared code segment, or NULL */
+  struct mmapregion * as_mmaps;  /* file mappings, highest first */
 #else
   paddr_t as_pbase1;
   paddr_t as_pbase2;
@@ -119,6 +123,28 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if OPT_A3
+/*
+ * Shared text: as_text_attach maps an already-loaded code segment of
+ * the given executable into the address space (returning false if
+ * there isn't one); as_text_publish shares a freshly loaded one.
+ */
+bool              as_text_attach(struct addrspace *as, struct vnode *v);
+void              as_text_publish(struct addrspace *as, struct vnode *v);
+
+/*
+ * File mappings, for mmap(), munmap() and msync(). as_mmap maps LEN
+ * bytes of V starting at page-aligned OFFSET somewhere below the
+ * stack and hands back the address; as_munmap and as_msync take a
+ * page-aligned address and a length.
+ */
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          size_t len, off_t offset, int prot, bool shared,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
+
 
 /*
  * Functions in loadelf.c
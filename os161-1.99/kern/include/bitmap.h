@@ -38,6 +38,13 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      Searches start after the last bit allocated.
+ *     bitmap_alloc_range - locate N consecutive cleared bits, set them,
+ *                      and return the index of the first.
+ *     bitmap_findclear - return the index of the first cleared bit from
+ *                      START to END-1, or ENOSPC if there is none.
+ *     bitmap_findset - same, for a set bit.
+ *     bitmap_count   - return the number of set bits from START to END-1.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -50,6 +57,12 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned n, unsigned *index);
+int            bitmap_findclear(struct bitmap *, unsigned start, unsigned end,
+                                unsigned *index);
+int            bitmap_findset(struct bitmap *, unsigned start, unsigned end,
+                              unsigned *index);
+unsigned       bitmap_count(struct bitmap *, unsigned start, unsigned end);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
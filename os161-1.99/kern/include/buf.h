@@ -0,0 +1,71 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches disk blocks in memory, keyed by (device, block number). One
+ * buffer holds one device block. Buffers are handed out as
+ * reference-counted handles; a handle gives its holder exclusive use
+ * of the buffer until it is released, and other threads asking for
+ * the same block wait. Unreferenced buffers sit on an LRU list and
+ * are reused, oldest first, once the cache reaches its size budget
+ * (BUFFER_MAXMEM). Writes are delayed: dirty buffers are written back
+ * by a syncer thread once they get old or too many pile up, when they
+ * are evicted, or when the device or block is synced. Blocks can
+ * also be read ahead: buffer_prefetch starts reading a block into the
+ * cache and returns without waiting for it.
+ *
+ * Functions:
+ *     buffer_bootstrap    - set up the cache; call once at boot.
+ *     buffer_read         - get a handle for a block, reading it from
+ *                           disk unless it is already cached.
+ *     buffer_get          - get a handle for a block without reading
+ *                           it. The caller must fill the whole block
+ *                           and then mark it valid or dirty.
+ *     buffer_prefetch     - start reading a block into the cache in
+ *                           the background, if it isn't cached.
+ *     buffer_map          - return a pointer to the buffer's data.
+ *     buffer_mark_valid   - mark the buffer's contents as valid.
+ *     buffer_mark_dirty   - mark the buffer modified (and valid).
+ *     buffer_pin          - mark the buffer dirty, but don't write
+ *                           it back until it is unpinned. For
+ *                           write-ahead logging.
+ *     buffer_unpin        - let a pinned buffer be written back.
+ *     buffer_release      - release a handle.
+ *     buffer_drop         - forget the contents of a block, e.g. one
+ *                           the filesystem has just freed. Only
+ *                           affects buffers nobody holds.
+ *     buffer_sync_device  - write back every dirty buffer of a device.
+ *     buffer_sync_block   - write back one block now if it is dirty.
+ *     buffer_drop_device  - write back and discard every buffer of a
+ *                           device; for unmount.
+ *     buffer_printstats   - print hit/miss and I/O counts.
+ */
+
+struct device;
+struct buf;
+
+/* Upper bound on the memory used by cached blocks. */
+#define BUFFER_MAXMEM   (32*1024)
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void buffer_prefetch(struct device *dev, daddr_t block);
+void *buffer_map(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_pin(struct buf *b);
+void buffer_unpin(struct buf *b);
+void buffer_release(struct buf *b);
+
+void buffer_drop(struct device *dev, daddr_t block);
+int buffer_sync_device(struct device *dev);
+int buffer_sync_block(struct device *dev, daddr_t block);
+int buffer_drop_device(struct device *dev);
+
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
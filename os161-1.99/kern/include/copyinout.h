@@ -59,15 +59,36 @@
  * The const qualifiers and types will help protect against mistakes
  * in this regard but are obviously not foolproof.
  *
+ * copyinargv copies a NULL-terminated array of user string pointers
+ * (an execv argument vector) at USERARGV into the kernel buffer KBUF
+ * of BUFLEN bytes, packing the strings back to back. The number of
+ * strings is returned in ARGC and the bytes used in GOT. Fails with
+ * E2BIG if the strings do not fit.
+ *
+ * copyoutargv is the inverse for a new process: it copies ARGC packed
+ * strings (LEN bytes) from KBUF onto the user stack below *STACKPTR,
+ * builds the NULL-terminated argv pointer array beneath them, and
+ * updates *STACKPTR to point at that array.
+ *
+ * copyuio moves data between a kernel buffer and the user-space
+ * buffers of a uio. It is the back end of uiomove for user uios and
+ * behaves as uiomove describes.
+ *
  * These functions are machine-dependent; however, a common version
  * that can be used by a number of machine types is found in
  * vm/copyinout.c.
  */
 
+struct uio;	/* from <uio.h> */
+
 int copyin(const_userptr_t usersrc, void *dest, size_t len);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
+int copyinargv(const_userptr_t userargv, char *kbuf, size_t buflen,
+	       int *argc, size_t *got);
+int copyoutargv(const char *kbuf, size_t len, int argc, vaddr_t *stackptr);
+int copyuio(void *ptr, size_t n, struct uio *uio);
 
 
 #endif /* _COPYINOUT_H_ */
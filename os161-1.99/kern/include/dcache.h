@@ -0,0 +1,49 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Remembers the results of looking up single path components:
+ * (directory vnode, name) -> vnode, or "doesn't exist" (a negative
+ * entry). It lives in the VFS layer and works for any filesystem;
+ * vfs_lookup consults it before calling VOP_LOOKUP, and the name
+ * operations in vfspath.c invalidate the names they touch. Names
+ * with slashes in them, and names longer than DCACHE_NAMELEN, are
+ * not cached.
+ *
+ * Each entry holds a reference to its directory and (for positive
+ * entries) to the vnode the name maps to, so cached vnodes stay
+ * loaded; that is also why the cache is small, since an SFS vnode
+ * carries its whole inode. The least recently used entry is recycled when the cache
+ * is full, and vfs_unmount purges a filesystem's entries before
+ * unmounting it.
+ *
+ * Functions:
+ *     dcache_bootstrap   - set up the cache; call once at boot.
+ *     dcache_lookup      - look up NAME in DIR. Returns true if the
+ *                          answer is cached, handing back a new
+ *                          reference to the vnode in *RET, or NULL
+ *                          if the name is known not to exist.
+ *     dcache_enter       - record the result of a lookup; VN is NULL
+ *                          for a name that doesn't exist.
+ *     dcache_invalidate  - forget NAME in DIR; for anything that
+ *                          creates, removes or renames it.
+ *     dcache_purge_fs    - forget everything on filesystem FS.
+ *     dcache_printstats  - print hit/miss counts.
+ */
+
+struct fs;
+struct vnode;
+
+#define DCACHE_SIZE     64	/* number of entries */
+#define DCACHE_NAMELEN  32	/* longest name cached, with the NUL */
+
+void dcache_bootstrap(void);
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_purge_fs(struct fs *fs);
+void dcache_printstats(void);
+
+#endif /* _DCACHE_H_ */
@@ -37,15 +37,53 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block I/O request.
+ *
+ * The caller fills in the first group of fields and passes the
+ * request to d_submit, which queues it and returns at once. When the
+ * transfer is finished the device sets br_result, marks the request
+ * complete, calls br_callback (if not NULL), and wakes up anyone in
+ * d_wait on it. The callback runs in the device's interrupt handler,
+ * so it must not sleep or submit more I/O. The request structure and
+ * the buffer belong to the device until the request completes.
+ */
+struct blkreq {
+	daddr_t br_block;		/* first block */
+	unsigned br_nblocks;		/* number of blocks */
+	void *br_data;			/* kernel buffer */
+	bool br_write;			/* write (true) or read (false) */
+	void (*br_callback)(struct blkreq *);	/* completion callback */
+	void *br_arg;			/* for the callback's use */
+
+	/* Set by the device. */
+	int br_result;			/* 0 or errno */
+	volatile bool br_complete;	/* finished */
+
+	/* Private to the device. */
+	struct blkreq *br_next;		/* queue link */
+	struct blkreq *br_merged;	/* adjacent requests run with us */
+	unsigned br_done;		/* blocks transferred so far */
+	unsigned br_seq;		/* for the deadline check */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ *
+ * Block devices may also provide d_submit and d_wait for asynchronous
+ * I/O on kernel buffers (see struct blkreq above); devices that don't
+ * set them to NULL. d_submit fails only for requests that are out of
+ * range, and returns without blocking. d_wait sleeps until the
+ * request completes and returns its result.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct blkreq *);
+	int (*d_wait)(struct device *, struct blkreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -39,19 +39,91 @@
 
 /*
  * Our structures
+ *
+ * All files on the filesystem share a pool of ef_maxpages cached
+ * pages, 1/EMUFS_RAMSHARE of RAM within the bounds below, and when
+ * the pool is used up the least recently used clean page of any file
+ * is reused. Pages are filled EMUFS_CLUSTER at a time (one device
+ * transfer) when reads are sequential, and writes sit in the cache
+ * until the page is reused, or the file is closed, fsynced,
+ * truncated or synced, when adjacent dirty pages go to the host in
+ * as few transfers as possible. Bytes cached past ev_size are always
+ * zero.
+ *
+ * A file's pages go when its vnode does. So that a program run over
+ * and over stays cached, the last EMUFS_KEEPVNODES files released
+ * with pages cached are kept loaded, and open on the host: reclaim
+ * hands their last reference to ef_keep instead of dropping it.
+ *
+ * ef_pagelock covers the pool: the page hash and LRU list, the file
+ * and offset each page holds, ev_npages, and the dirty range of
+ * pages on the LRU list. A page off the list is busy: it is being
+ * used by the holder of its file's ev_lock, and nobody else touches
+ * it. Other files only take clean pages, so dirty pages are always
+ * written back by their own file.
+ *
+ * ev_lock covers ev_size and the rest of the vnode, and comes before
+ * ef_pagelock. Neither ef_pagelock nor the device lock e_lock is
+ * held for long; e_lock for one transfer and ef_pagelock never
+ * across one, so reads that hit in the cache wait neither for the
+ * device nor for other files.
+ *
+ * The vnode table and ef_keep are protected by vfs_biglock, as are
+ * the vnode reference counts they are checked against.
  */
 
+#define EMUFS_RAMSHARE    8	/* cache up to 1/8 of RAM... */
+#define EMUFS_MINPAGES    16	/* ...but at least this many pages */
+#define EMUFS_MAXPAGES    256	/* ...and at most this many */
+#define EMUFS_KEEPVNODES  16	/* released files kept cached */
+#define EMUFS_CLUSTER     (EMU_MAXIO / PAGE_SIZE)  /* pages per transfer */
+#define EMUFS_VNHASHSIZE  32	/* buckets in the vnode table */
+#define EMUFS_PAGEHASHSIZE 64	/* buckets in the page hash */
+
+#define EMUFS_NOPAGE      ((off_t)-1)
+
+struct emufs_vnode;
+
+struct emufs_page {
+	struct emufs_vnode *ep_owner;	/* file cached, or NULL */
+	off_t ep_pos;			/* offset in it, or EMUFS_NOPAGE */
+	char *ep_data;			/* PAGE_SIZE bytes */
+	unsigned ep_dirtystart;		/* dirty bytes: [start, end) */
+	unsigned ep_dirtyend;
+	bool ep_busy;			/* in use, and off the LRU list */
+	struct emufs_page *ep_hashnext;	/* next in page hash chain */
+	struct emufs_page *ep_lruprev;	/* LRU list links, valid only */
+	struct emufs_page *ep_lrunext;	/*   while not busy */
+};
+
 struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	struct emufs_vnode *ev_hashnext; /* next in vnode table bucket */
+	bool ev_kept;			/* on ef_keep */
+	unsigned ev_npages;		/* pages cached */
+
+	struct lock *ev_lock;		/* protects the rest */
+	off_t ev_size;			/* file size, or -1 if unknown */
+	off_t ev_ranext;		/* where a sequential read would go */
 };
 
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
-	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct emufs_vnode *ef_vnhash[EMUFS_VNHASHSIZE]; /* loaded vnodes */
+	struct emufs_vnode *ef_keep[EMUFS_KEEPVNODES]; /* oldest first */
+	unsigned ef_nkeep;		/* entries in ef_keep */
+
+	struct lock *ef_pagelock;	/* protects the page pool */
+	struct emufs_page *ef_pages;	/* the pool */
+	unsigned ef_maxpages;		/* size of the pool */
+	unsigned ef_npages;		/* pages with ep_data allocated */
+	struct emufs_page *ef_pagehash[EMUFS_PAGEHASHSIZE];
+	struct emufs_page *ef_lruhead;	/* pages not busy, least */
+	struct emufs_page *ef_lrutail;	/*   recently used first */
 };
 
 
@@ -0,0 +1,96 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what a file descriptor refers to: a vnode plus the
+ * state that open() creates and that dup2() and fork() share, namely
+ * the access mode, the O_APPEND flag, and the seek position. It is
+ * reference-counted; the last close releases the vnode.
+ *
+ * The seek position is protected by of_offsetlock, which read(),
+ * write() and lseek() hold across the whole operation so that two
+ * processes sharing an openfile after fork() see each other's I/O
+ * atomically. pread() and pwrite() do not touch the seek position
+ * and do not take the lock. Objects that cannot seek (the console)
+ * have no meaningful position and are not serialized here either;
+ * a blocking console read must not hold up writers.
+ *
+ * A filetable maps file descriptors to openfiles. Lookup is a plain
+ * array index. The table itself has no lock: user processes in this
+ * system have exactly one thread, and only that thread (or the
+ * thread building the process, before it runs) touches the table.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;		/* the underlying object */
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_append;			/* O_APPEND: writes go at EOF */
+	bool of_seekable;		/* has a seek position */
+
+	struct lock *of_offsetlock;	/* protects of_offset */
+	off_t of_offset;		/* current seek position */
+
+	struct spinlock of_countlock;	/* protects of_refcount */
+	unsigned of_refcount;		/* number of descriptors */
+};
+
+/*
+ * openfile_open   - vfs_open PATH and wrap it in a new openfile with
+ *                   one reference. PATH may be destroyed.
+ * openfile_fromvnode - Wrap VN, which must already be open (as from
+ *                   vfs_open), in a new openfile with one reference.
+ *                   Takes over the caller's reference to VN, but only
+ *                   on success.
+ * openfile_incref - Add a reference.
+ * openfile_decref - Drop a reference; the last one closes the vnode.
+ */
+int openfile_open(char *path, int openflags, mode_t mode,
+		  struct openfile **ret);
+int openfile_fromvnode(struct vnode *vn, int openflags,
+		       struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+	int ft_lowfree;			/* no free slot below this */
+};
+
+/*
+ * filetable_create  - Create an empty table.
+ * filetable_destroy - Close everything in the table and free it.
+ * filetable_copy    - Create a table sharing all of SRC's openfiles,
+ *                     for fork().
+ *
+ * filetable_get     - Look up FD. Fails with EBADF if FD is out of
+ *                     range or not open. No reference is added.
+ * filetable_place   - Install OF at the lowest free descriptor and
+ *                     return it in FD. Fails with EMFILE. Takes over
+ *                     the caller's reference to OF.
+ * filetable_placeat - Install OF at FD, which must be in range, and
+ *                     return whatever was there before (or NULL) in
+ *                     OLDFILE for the caller to release. Takes over
+ *                     the caller's reference to OF.
+ * filetable_close   - Remove FD from the table and drop its reference.
+ *                     Fails with EBADF.
+ */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+void filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		       struct openfile **oldfile);
+int filetable_close(struct filetable *ft, int fd);
+
+
+#endif /* _FILE_H_ */
@@ -0,0 +1,32 @@
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Directory entries, as returned by getdents(). One call fills the
+ * buffer with as many of these as fit, packed one after another;
+ * d_reclen is the distance from one to the next. d_name is
+ * null-terminated and padded so that every record starts on a 4-byte
+ * boundary.
+ */
+struct dirent {
+	__u32 d_ino;		/* inode number, or 0 if not known */
+	__u16 d_reclen;		/* length of this record */
+	__u8 d_type;		/* DT_* below */
+	__u8 d_namlen;		/* length of d_name, not counting the null */
+	char d_name[];		/* the name */
+};
+
+/* Size of the record for a name NAMLEN characters long. */
+#define DIRENT_RECLEN(namlen) \
+	((sizeof(struct dirent) + (namlen) + 1 + 3) & ~(size_t)3)
+
+/* Values for d_type */
+#define DT_UNKNOWN	0	/* the file system doesn't say */
+#define DT_REG		1	/* regular file */
+#define DT_DIR		2	/* directory */
+#define DT_LNK		3	/* symbolic link */
+#define DT_FIFO		4	/* pipe or named pipe */
+#define DT_CHR		5	/* character device */
+#define DT_BLK		6	/* block device */
+
+#endif /* _KERN_DIRENT_H_ */
@@ -34,6 +34,7 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/* Turn non-blocking I/O on or off; DATA points to an int flag */
+#define FIONBIO		1
 
 #endif /* _KERN_IOCTL_H_*/
@@ -0,0 +1,25 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap(), and msync().
+ */
+
+
+/* Protections for mmap(). */
+#define PROT_NONE      0	/* No access. */
+#define PROT_READ      1	/* Pages may be read. */
+#define PROT_WRITE     2	/* Pages may be written. */
+#define PROT_EXEC      4	/* Pages may be executed. */
+
+/* Flags for mmap(). Exactly one of MAP_SHARED and MAP_PRIVATE. */
+#define MAP_SHARED     1	/* Stores go to the file. */
+#define MAP_PRIVATE    2	/* Stores go to a private copy. */
+
+/* Flags for msync(). */
+#define MS_ASYNC       1	/* Start writing (here, same as MS_SYNC). */
+#define MS_SYNC        2	/* Write back and wait. */
+#define MS_INVALIDATE  4	/* Accepted and ignored. */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -41,6 +41,7 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_INLINESIZE    420           /* max bytes of data in an inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
@@ -71,7 +72,9 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_jstart;			/* 1st block of journal, or 0 */
+	uint32_t sp_jblocks;			/* # blocks in journal, or 0 */
+	uint32_t reserved[116];
 };
 
 /*
@@ -83,9 +86,35 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirbase;			/* Hashed dir: 1st bucket block */
+	uint32_t sfi_dirbuckets;		/* Hashed dir: # buckets, or 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* below */
+	char sfi_data[SFS_INLINESIZE];		/* Inline data, else 0 */
 };
 
+/*
+ * Block mapping. Block N of a file is sfi_direct[N] for the first
+ * SFS_NDIRECT blocks. The next SFS_DBPERIDB blocks are listed in the
+ * indirect block; the next SFS_DBPERIDB^2 in the indirect blocks
+ * listed in the double indirect block; and the next SFS_DBPERIDB^3
+ * two levels below the triple indirect block. A zero anywhere is a
+ * hole. (Tools test these to see which levels the inode has.)
+ */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
+/*
+ * Inline data. A file with SFS_IF_INLINE set in sfi_flags has no
+ * blocks: its contents are the first sfi_size bytes of sfi_data, and
+ * the rest of sfi_data is zero. Such a file is moved out to a block
+ * once it grows past SFS_INLINESIZE bytes. Only regular files are
+ * ever inline. Inodes with sfi_flags == 0 (all inodes on older
+ * volumes) use blocks.
+ */
+#define SFS_IF_INLINE     1             /* data is in sfi_data */
+
 /*
  * On-disk directory entry
  */
@@ -94,5 +123,84 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/* Number of directory entries per block */
+#define SFS_DIRPERBLOCK  (SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
+/*
+ * Hashed directories.
+ *
+ * A directory whose sfi_dirbuckets is nonzero has that many bucket
+ * blocks, starting at block sfi_dirbase of the directory. An entry
+ * whose name falls in bucket B is kept in block sfi_dirbase+B if
+ * that block has room. Entries that don't fit in their bucket, and
+ * entries that were there before the directory was hashed, live in
+ * the "linear part": any slot outside the bucket blocks. A lookup
+ * checks the name's bucket and then searches the linear part, so
+ * entries must never be in a bucket other than their own. Bucket
+ * blocks that have never been used are holes.
+ *
+ * A name's bucket is its 32-bit FNV-1a hash modulo sfi_dirbuckets.
+ * Directories with sfi_dirbuckets == 0 (all directories on older
+ * volumes) are purely linear.
+ */
+#define SFS_DIR_NBUCKETS   64           /* buckets in a hashed dir */
+#define SFS_FNV_BASIS      2166136261U  /* FNV-1a offset basis */
+#define SFS_FNV_PRIME      16777619U    /* FNV-1a prime */
+
+/*
+ * Metadata journal.
+ *
+ * A volume with sp_jblocks != 0 has a journal in blocks sp_jstart up
+ * to sp_jstart+sp_jblocks, which are marked in use in the freemap.
+ * Changes to metadata blocks (inodes, directories, indirect blocks,
+ * and the freemap) are written to the journal in transactions before
+ * they are written in place. Data blocks are not journaled.
+ *
+ * The first journal block is a header. Transactions follow it back to
+ * back, starting in the next block. Each is a descriptor block, then
+ * images of the blocks it lists, then a commit block. A descriptor
+ * entry is a block number, whose image follows, or a block number
+ * with SFS_JNL_REVOKE set, which has no image and means the block was
+ * freed: images of it from this or earlier transactions must not be
+ * replayed.
+ *
+ * Transactions carry consecutive sequence numbers starting from the
+ * header's jh_seq. To recover, read transactions from the start until
+ * one is missing, out of sequence, or fails its checksum, then copy
+ * the images of the complete ones to their homes, except revoked
+ * ones. Once every journaled change is known to be in place, the
+ * journal is emptied by writing a header with the next sequence
+ * number, which makes whatever was in it look stale.
+ *
+ * The checksum covers the descriptor and the images: starting from
+ * 0, for each 32-bit word w, sum = ((sum << 1) | (sum >> 31)) + w.
+ */
+#define SFS_JNL_MAGIC      0x4a4e4c31   /* journal header */
+#define SFS_JDESC_MAGIC    0x4a444553   /* transaction descriptor */
+#define SFS_JCOMMIT_MAGIC  0x4a434d54   /* transaction commit */
+#define SFS_JNL_REVOKE     0x80000000   /* descriptor entry: block freed */
+#define SFS_JDESC_MAX      125          /* entries per descriptor */
+#define SFS_JNL_DEFBLOCKS  128          /* default journal size */
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JNL_MAGIC */
+	uint32_t jh_seq;			/* seq of 1st transaction */
+	uint32_t reserved[126];
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t jd_seq;			/* transaction sequence # */
+	uint32_t jd_nentries;			/* entries used */
+	uint32_t jd_entries[SFS_JDESC_MAX];	/* blocks, or revokes */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t jc_seq;			/* same as the descriptor's */
+	uint32_t jc_sum;			/* checksum */
+	uint32_t reserved[125];
+};
+
 
 #endif /* _KERN_SFS_H_ */
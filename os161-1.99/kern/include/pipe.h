@@ -0,0 +1,27 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a pair of vnodes, a read end and a write end, sharing a
+ * ring buffer. Both come back already open (as if from vfs_open) with
+ * one reference each, ready to be wrapped in openfiles; closing the
+ * last reference to an end closes it for good.
+ *
+ * Reads block until there is data, and return 0 once the buffer is
+ * empty and the write end is closed. Writes of at most PIPE_BUF bytes
+ * are atomic. A write to a pipe whose read end is closed fails with
+ * EPIPE. Either end can be made non-blocking with the FIONBIO ioctl,
+ * in which case an operation that would block fails with EAGAIN
+ * instead (or returns a short count if it got anywhere).
+ *
+ * pipe_create - Make a new pipe. Fails with ENOMEM.
+ */
+
+struct vnode;
+
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+
+#endif /* _PIPE_H_ */
@@ -44,6 +44,7 @@ struct addrspace;
 struct vnode;
 #ifdef UW
 struct semaphore;
+struct filetable;
 #endif // UW
 
 /*
@@ -61,12 +62,7 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 
 #ifdef UW
-  /* a vnode to refer to the console device */
-  /* this is a quick-and-dirty way to get console writes working */
-  /* you will probably need to change this when implementing file-related
-     system calls, since each process will need to keep track of all files
-     it has opened, not just the console. */
-  struct vnode *console;                /* a vnode for the console device */
+	struct filetable *p_filetable;	/* open file descriptors */
 #endif
 
 	/* add more material here as needed */
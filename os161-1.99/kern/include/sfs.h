@@ -48,23 +48,88 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each vnode has a sleep lock, sv_lock, covering its inode (sv_i,
+ * sv_dirty), its data and directory blocks, and its read-ahead
+ * state. File I/O, truncate, fsync, stat, and close run under only
+ * this lock, so operations on different files proceed in parallel.
+ * sv_ino and the inode type never change and need no lock.
+ *
+ * Per filesystem, sfs_vnlock covers the vnode table (sfs_vnhash,
+ * sfs_nvnodes) and the dirty vnode list, and sfs_bitlock covers the
+ * free block bitmap (sfs_freemap, sfs_freemapdirty, sfs_groupfree,
+ * sfs_groupflags).
+ *
+ * Operations on names (lookup, creat, link, remove, rename),
+ * reclaim, sync, mount and unmount still run under vfs_biglock,
+ * which also covers the VFS vnode reference counts and the name
+ * cache. Reclaim therefore never races with a lookup reloading the
+ * vnode.
+ *
+ * On a volume with a journal (see sfs_jnl.c), every operation that
+ * changes metadata holds a journal handle (sfs_jnl_begin/end) while
+ * it does, and before it ends copies the inodes it changed to the
+ * buffer cache with sfs_sync_inode. A handle is taken like a lock,
+ * after vfs_biglock and before any vnode lock.
+ *
+ * Lock ordering:
+ *     vfs_biglock
+ *       -> journal handle
+ *       -> sv_lock of a directory
+ *       -> sv_lock of a file in it
+ *       -> sfs_vnlock
+ *       -> sfs_bitlock
+ *       -> buffer cache
+ * The buffer cache locks internally and never calls back into SFS.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	struct lock *sv_lock;           /* protects sv_i and up to sv_hashnext */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* next block if reads are sequential */
+	uint32_t sv_rawindow;           /* read-ahead window (blocks) */
+	uint32_t sv_raend;              /* read ahead up to here */
+	uint32_t sv_allocnext;          /* next block if writes are sequential */
+	uint32_t sv_prealloc;           /* first preallocated disk block */
+	uint32_t sv_npreallocs;         /* # blocks preallocated from there */
+	uint32_t sv_idfirst;            /* 1st file block listed in... */
+	uint32_t sv_idblock;            /*   last indirect block used, or 0 */
+	struct sfs_vnode *sv_hashnext;  /* vnode hash chain (sfs_vnlock) */
+	struct sfs_vnode *sv_dirtyprev; /* dirty vnode list links (sfs_vnlock), */
+	struct sfs_vnode *sv_dirtynext; /*   valid while sv_dirty is set */
 };
 
+/* Number of chains in the resident vnode hash table */
+#define SFS_VNHASHSIZE  32
+
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes, by ino */
+	unsigned sfs_nvnodes;           /* number of loaded vnodes */
+	struct sfs_vnode *sfs_dirtyvnodes; /* vnodes with sv_dirty set */
+	struct lock *sfs_bitlock;       /* protects the free block bitmap */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	bool sfs_freemapdirty;          /* true if any group is dirty */
+	uint32_t *sfs_groupfree;        /* free blocks per bitmap block */
+	uint8_t *sfs_groupflags;        /* SFS_GROUP_* per bitmap block */
+	unsigned sfs_ngroups;           /* number of bitmap blocks */
+	struct sfs_jnl *sfs_jnl;        /* journal, or NULL */
 };
 
+/* sfs_groupflags */
+#define SFS_GROUP_DIRTY   1     /* bitmap block modified */
+#define SFS_GROUP_LOGGED  2     /* ...in the running transaction */
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -84,8 +149,36 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Buffer cache access to blocks (see buf.h) */
+struct buf;
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct buf **ret);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct buf **ret);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Copy a vnode's inode, if modified, to its block in the buffer cache */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
+/* Free block bitmap (caller holds sfs_bitlock) */
+void sfs_bunmark(struct sfs_fs *sfs, uint32_t block);
+int sfs_mapsync(struct sfs_fs *sfs);
+
+/*
+ * Metadata journal. Each operation may add up to SFS_JNL_OPBLOCKS
+ * blocks and revokes to the running transaction, not counting
+ * freemap blocks; longer operations must be split up.
+ */
+#define SFS_JNL_OPBLOCKS  8
+
+int sfs_jnl_mount(struct sfs_fs *sfs);
+void sfs_jnl_unmount(struct sfs_fs *sfs);
+void sfs_jnl_begin(struct sfs_fs *sfs);
+void sfs_jnl_end(struct sfs_fs *sfs);
+void sfs_jnl_dirty(struct sfs_fs *sfs, struct buf *b, uint32_t block);
+unsigned sfs_jnl_free(struct sfs_fs *sfs, uint32_t block);
+int sfs_jnl_commit(struct sfs_fs *sfs);
+int sfs_jnl_checkpoint(struct sfs_fs *sfs);
+
 
 #endif /* _SFS_H_ */
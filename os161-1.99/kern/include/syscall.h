@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -61,7 +62,30 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
-int sys_write(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval);
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_read(int fd, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_write(int fd, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_pread(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_pipe(userptr_t fds, int *retval);
+int sys_copy_file_range(int infd, userptr_t inpos, int outfd, userptr_t outpos,
+			size_t len, unsigned flags, int *retval);
+int sys_ioctl(int fd, int code, userptr_t data, int *retval);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fd, userptr_t iov, int iovcnt, off_t pos, int *retval);
+int sys_pwritev(int fd, userptr_t iov, int iovcnt, off_t pos, int *retval);
+int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval);
+int sys_getdents(int fd, userptr_t buf, size_t buflen, int *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_close(int fd);
+int sys_dup2(int oldfd, int newfd, int *retval);
+#if OPT_A3
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+#endif
 #if OPT_A2
 int sys_fork(struct trapframe *tf, int *retval);
 int sys_execv(const_userptr_t program, userptr_t *args);
@@ -75,6 +75,7 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int diskbench(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
@@ -36,7 +36,12 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_ZERO_FRAME_MAP        (10)
+#define VMSTAT_ZERO_POOL_HIT         (11)
+#define VMSTAT_ZERO_POOL_MISS        (12)
+#define VMSTAT_TEXT_SHARED           (13)
+#define VMSTAT_MMAP_FILE_READ        (14)
+#define VMSTAT_COUNT                 (15)
 
 /* ----------------------------------------------------------------------- */
 
@@ -44,6 +49,9 @@
 void vmstats_init(void);                     /* uses locking */
 void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
 
+/* Zero the statistics again, e.g. before a test: the lock is left alone */
+void vmstats_reset(void);                    /* uses locking */
+
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
@@ -39,6 +39,9 @@
 
 #include <machine/vm.h>
 
+struct vnode;	/* from <vnode.h> */
+struct uio;	/* from <uio.h> */
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -59,5 +62,20 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Physical memory fragmentation report and compaction (A3 dumbvm) */
+void vm_printfrag(void);
+unsigned vm_compact(void);
+
+/* Keep a user page's frame in place, e.g. while it is loaned (A3 dumbvm) */
+int vm_pinpage(vaddr_t vaddr, paddr_t *ret);
+void vm_unpinpage(paddr_t paddr);
+
+/* Tell the VM system a file was written or truncated (A3 dumbvm) */
+void vm_filewrite(struct vnode *v, off_t pos, size_t len);
+void vm_filetruncate(struct vnode *v, off_t len);
+
+/* Bring in the mapped file pages a user uio covers (A3 dumbvm) */
+int vm_prefault(struct uio *u);
+
 
 #endif /* _VM_H_ */
@@ -34,24 +34,95 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <endian.h>
 #include <bitmap.h>
 
 /*
- * It would be a lot more efficient on most platforms to use uint32_t
- * or unsigned long as the base type for holding bits. But we don't,
- * because if one uses any data type more than a single byte wide,
- * bitmap data saved on disk becomes endian-dependent, which is a
- * severe nuisance.
+ * Bits are held 32 to a word, so that searching and counting can
+ * skip over full (or empty) words at a time. The bitmap data saved
+ * on disk must not become endian-dependent, though, so bit I of the
+ * map is always bit I%8 of byte I/8 of the data. On a little-endian
+ * machine that is bit I%32 of word I/32; on a big-endian one the
+ * bytes of the word are the other way around, which XORing 24 into
+ * the bit number takes care of. WORD_LOGICAL swaps a word between
+ * that layout and one where the word's first bit in the map is its
+ * low bit (it is its own inverse).
  */
-#define BITS_PER_WORD   (CHAR_BIT)
-#define WORD_TYPE       unsigned char
-#define WORD_ALLBITS    (0xff)
+#define BITS_PER_WORD   32
+#define WORD_TYPE       uint32_t
+#define WORD_ALLBITS    (0xffffffff)
+
+#if _BYTE_ORDER == _LITTLE_ENDIAN
+#define WORD_BITSWAP    0
+#define WORD_LOGICAL(w) (w)
+#else
+#define WORD_BITSWAP    24
+#define WORD_LOGICAL(w) bswap32(w)
+#endif
 
 struct bitmap {
         unsigned nbits;
+        unsigned hint;          /* bitmap_alloc starts looking here */
         WORD_TYPE *v;
 };
 
+/*
+ * Number of trailing zeros in X, which must not be zero. The
+ * System/161 processor has no count-leading- or trailing-zeros
+ * instruction, so isolate the lowest set bit and identify it with
+ * a de Bruijn sequence.
+ */
+static
+inline
+unsigned
+bitmap_ctz(uint32_t x)
+{
+        static const unsigned char debruijn[32] = {
+                0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+                31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+        };
+
+        KASSERT(x != 0);
+        return debruijn[((x & -x) * 0x077cb531U) >> 27];
+}
+
+/*
+ * Number of bits set in X.
+ */
+static
+inline
+unsigned
+bitmap_popcount(uint32_t x)
+{
+        x = x - ((x >> 1) & 0x55555555);
+        x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+        x = (x + (x >> 4)) & 0x0f0f0f0f;
+        return (x * 0x01010101) >> 24;
+}
+
+/*
+ * For going over bits START to END-1 a word at a time: the number of
+ * those bits in START's word, and a mask of them (in logical order).
+ */
+static
+inline
+unsigned
+bitmap_span(unsigned start, unsigned end, WORD_TYPE *mask)
+{
+        unsigned off = start % BITS_PER_WORD;
+        unsigned nb = BITS_PER_WORD - off;
+
+        if (nb > end - start) {
+                nb = end - start;
+        }
+        if (nb == BITS_PER_WORD) {
+                *mask = WORD_ALLBITS;
+        }
+        else {
+                *mask = (((WORD_TYPE)1 << nb) - 1) << off;
+        }
+        return nb;
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
@@ -72,6 +143,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -82,7 +154,7 @@ bitmap_create(unsigned nbits)
                 KASSERT(overbits > 0 && overbits < BITS_PER_WORD);
                 
                 for (j=overbits; j<BITS_PER_WORD; j++) {
-                        b->v[ix] |= ((WORD_TYPE)1 << j);
+                        b->v[ix] |= ((WORD_TYPE)1 << (j ^ WORD_BITSWAP));
                 }
         }
 
@@ -95,31 +167,142 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first bit from START to END-1 that is set (if SET) or
+ * clear (if not).
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_scan(struct bitmap *b, unsigned start, unsigned end, bool set,
+            unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned ix, bit;
+        WORD_TYPE w;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        KASSERT(end <= b->nbits);
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
+        ix = start / BITS_PER_WORD;
+        while (start < end) {
+                w = set ? b->v[ix] : ~b->v[ix];
+                if (w != 0) {
+                        w = WORD_LOGICAL(w) &
+                                (WORD_ALLBITS << (start % BITS_PER_WORD));
+                        if (w != 0) {
+                                bit = ix*BITS_PER_WORD + bitmap_ctz(w);
+                                if (bit >= end) {
+                                        break;
                                 }
+                                *index = bit;
+                                return 0;
                         }
-                        KASSERT(0);
                 }
+                ix++;
+                start = ix*BITS_PER_WORD;
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_findclear(struct bitmap *b, unsigned start, unsigned end,
+                 unsigned *index)
+{
+        return bitmap_scan(b, start, end, false, index);
+}
+
+int
+bitmap_findset(struct bitmap *b, unsigned start, unsigned end,
+               unsigned *index)
+{
+        return bitmap_scan(b, start, end, true, index);
+}
+
+/*
+ * Find a run of N clear bits between START and END-1.
+ */
+static
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned end, unsigned n,
+               unsigned *index)
+{
+        unsigned first, used;
+
+        while (bitmap_findclear(b, start, end, &first) == 0) {
+                if (end - first < n) {
+                        break;
+                }
+                if (bitmap_findset(b, first, first + n, &used) != 0) {
+                        *index = first;
+                        return 0;
+                }
+                start = used + 1;
         }
         return ENOSPC;
 }
 
+/*
+ * Allocation is next-fit: each search starts where the last one
+ * left off, wrapping around, so that a nearly full map is not
+ * rescanned from the start every time.
+ */
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        if (bitmap_findclear(b, b->hint, b->nbits, index) &&
+            bitmap_findclear(b, 0, b->hint, index)) {
+                return ENOSPC;
+        }
+        bitmap_mark(b, *index);
+        b->hint = *index + 1 < b->nbits ? *index + 1 : 0;
+        return 0;
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned n, unsigned *index)
+{
+        unsigned start, end, nb;
+        WORD_TYPE mask;
+
+        KASSERT(n > 0);
+        if (n > b->nbits) {
+                return ENOSPC;
+        }
+
+        /* A run that wraps around is no good, but one across the hint is */
+        end = b->hint + n - 1 < b->nbits ? b->hint + n - 1 : b->nbits;
+        if (bitmap_findrun(b, b->hint, b->nbits, n, index) &&
+            bitmap_findrun(b, 0, end, n, index)) {
+                return ENOSPC;
+        }
+
+        for (start = *index; start < *index + n; start += nb) {
+                nb = bitmap_span(start, *index + n, &mask);
+                mask = WORD_LOGICAL(mask);
+                KASSERT((b->v[start / BITS_PER_WORD] & mask)==0);
+                b->v[start / BITS_PER_WORD] |= mask;
+        }
+        b->hint = *index + n < b->nbits ? *index + n : 0;
+        return 0;
+}
+
+unsigned
+bitmap_count(struct bitmap *b, unsigned start, unsigned end)
+{
+        unsigned count = 0, nb;
+        WORD_TYPE w, mask;
+
+        KASSERT(start <= end && end <= b->nbits);
+
+        for (; start < end; start += nb) {
+                nb = bitmap_span(start, end, &mask);
+                w = b->v[start / BITS_PER_WORD];
+                if (mask != WORD_ALLBITS) {
+                        w = WORD_LOGICAL(w) & mask;
+                }
+                count += bitmap_popcount(w);
+        }
+        return count;
+}
+
 static
 inline
 void
@@ -128,7 +311,7 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         unsigned offset;
         *ix = bitno / BITS_PER_WORD;
         offset = bitno % BITS_PER_WORD;
-        *mask = ((WORD_TYPE)1) << offset;
+        *mask = ((WORD_TYPE)1) << (offset ^ WORD_BITSWAP);
 }
 
 void
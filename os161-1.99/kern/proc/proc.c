@@ -50,7 +50,9 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>
+#include <kern/unistd.h>
 #include <array.h>
+#include <file.h>
 #include "opt-A2.h"
 
 /*
@@ -106,7 +108,7 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 #ifdef UW
-	proc->console = NULL;
+	proc->p_filetable = NULL;
 #endif // UW
 
 #if OPT_A2
@@ -176,8 +178,10 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 #ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
+	/* normally already closed by sys__exit */
+	if (proc->p_filetable) {
+	  filetable_destroy(proc->p_filetable);
+	  proc->p_filetable = NULL;
 	}
 #endif // UW
 
@@ -234,6 +238,29 @@ proc_bootstrap(void)
 #endif
 }
 
+#ifdef UW
+/*
+ * Open the console with FLAGS for a new process's standard descriptors.
+ */
+static
+struct openfile *
+proc_openconsole(int flags)
+{
+	struct openfile *of;
+	char *console_path;
+
+	console_path = kstrdup("con:");
+	if (console_path == NULL) {
+	  panic("unable to copy console path name during process creation\n");
+	}
+	if (openfile_open(console_path,flags,0,&of)) {
+	  panic("unable to open the console during process creation\n");
+	}
+	kfree(console_path);
+	return of;
+}
+#endif // UW
+
 /*
  * Create a fresh proc for use by runprogram.
  *
@@ -244,7 +271,9 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
-	char *console_path;
+#ifdef UW
+	struct openfile *of, *oldfile;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
@@ -252,15 +281,21 @@ proc_create_runprogram(const char *name)
 	}
 
 #ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
+	/* open the console as stdin, stdout and stderr - this should always succeed */
+	proc->p_filetable = filetable_create();
+	if (proc->p_filetable == NULL) {
+	  panic("unable to create file table during process creation\n");
 	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
-	}
-	kfree(console_path);
+	of = proc_openconsole(O_RDONLY);
+	filetable_placeat(proc->p_filetable, of, STDIN_FILENO, &oldfile);
+	KASSERT(oldfile == NULL);
+	/* stdout and stderr share one open file, as if by dup2 */
+	of = proc_openconsole(O_WRONLY);
+	filetable_placeat(proc->p_filetable, of, STDOUT_FILENO, &oldfile);
+	KASSERT(oldfile == NULL);
+	openfile_incref(of);
+	filetable_placeat(proc->p_filetable, of, STDERR_FILENO, &oldfile);
+	KASSERT(oldfile == NULL);
 #endif // UW
 	  
 	/* VM fields */
@@ -45,11 +45,14 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
 
 
 /*
@@ -123,6 +126,7 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	buffer_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
@@ -151,6 +155,10 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	thread_shutdown();
 
 	splhigh();
@@ -39,13 +39,17 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -408,6 +412,73 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing buffer cache stats.
+ */
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing name cache stats.
+ */
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	dcache_printstats();
+
+	return 0;
+}
+
+#if OPT_A3
+/*
+ * Command for printing the physical memory fragmentation report.
+ */
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printfrag();
+
+	return 0;
+}
+
+/*
+ * Command for compacting physical memory.
+ */
+static
+int
+cmd_compact(int nargs, char **args)
+{
+	unsigned moved;
+
+	(void)nargs;
+	(void)args;
+
+	vm_printfrag();
+	moved = vm_compact();
+	kprintf("Compaction moved %u frames\n", moved);
+	vm_printfrag();
+
+	return 0;
+}
+#endif /* OPT_A3 */
+
 /*
  * Command to enable output of debugging messages of type DB_THREADS
  */
@@ -502,6 +573,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[db]  Raw disk throughput           ",
 	NULL
 };
 
@@ -533,6 +605,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[dc] Name cache stats               ",
+#if OPT_A3
+	"[cm] Coremap fragmentation          ",
+	"[cc] Compact physical memory        ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -590,6 +668,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",		cmd_bufstats },
+	{ "dc",		cmd_dcachestats },
+#if OPT_A3
+	{ "cm",		cmd_coremapstats },
+	{ "cc",		cmd_compact },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -618,6 +702,7 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "db",		diskbench },
 
 	{ NULL, NULL }
 };
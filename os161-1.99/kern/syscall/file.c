@@ -0,0 +1,205 @@
+/*
+ * Open files and file tables. See file.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <file.h>
+
+////////////////////////////////////////////////////////////
+// openfile
+
+int
+openfile_open(char *path, int openflags, mode_t mode, struct openfile **ret)
+{
+	struct vnode *vn;
+	int result;
+
+	result = vfs_open(path, openflags, mode, &vn);
+	if (result) {
+		return result;
+	}
+	result = openfile_fromvnode(vn, openflags, ret);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	return 0;
+}
+
+int
+openfile_fromvnode(struct vnode *vn, int openflags, struct openfile **ret)
+{
+	struct openfile *of;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_offsetlock = lock_create("openfile");
+	if (of->of_offsetlock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	of->of_vnode = vn;
+	of->of_accmode = openflags & O_ACCMODE;
+	of->of_append = (openflags & O_APPEND) != 0;
+	/* Devices that cannot seek refuse even position 0. */
+	of->of_seekable = VOP_TRYSEEK(vn, 0) == 0;
+	of->of_offset = 0;
+	spinlock_init(&of->of_countlock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_countlock);
+	of->of_refcount++;
+	spinlock_release(&of->of_countlock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_countlock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = of->of_refcount == 0;
+	spinlock_release(&of->of_countlock);
+
+	if (!last) {
+		return;
+	}
+
+	vfs_close(of->of_vnode);
+	lock_destroy(of->of_offsetlock);
+	spinlock_cleanup(&of->of_countlock);
+	kfree(of);
+}
+
+////////////////////////////////////////////////////////////
+// filetable
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	int i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	ft->ft_lowfree = 0;
+	return ft;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	int i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+			ft->ft_files[i] = NULL;
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	int i;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		if (src->ft_files[i] != NULL) {
+			openfile_incref(src->ft_files[i]);
+			ft->ft_files[i] = src->ft_files[i];
+		}
+	}
+	ft->ft_lowfree = src->ft_lowfree;
+
+	*ret = ft;
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	int i;
+
+	for (i=ft->ft_lowfree; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			ft->ft_lowfree = i + 1;
+			*fd = i;
+			return 0;
+		}
+	}
+	ft->ft_lowfree = OPEN_MAX;
+	return EMFILE;
+}
+
+void
+filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		  struct openfile **oldfile)
+{
+	KASSERT(fd >= 0 && fd < OPEN_MAX);
+
+	*oldfile = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+	/* Filling the lowest free slot moves the hint; nothing else does. */
+	if (fd == ft->ft_lowfree) {
+		ft->ft_lowfree++;
+	}
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(ft, fd, &of);
+	if (result) {
+		return result;
+	}
+	ft->ft_files[fd] = NULL;
+	if (fd < ft->ft_lowfree) {
+		ft->ft_lowfree = fd;
+	}
+	openfile_decref(of);
+	return 0;
+}
@@ -1,60 +1,888 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
+#include <stat.h>
 #include <lib.h>
+#include <limits.h>
 #include <uio.h>
+#include <synch.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <copyinout.h>
 #include <current.h>
 #include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <file.h>
+#include <pipe.h>
+#include "opt-A3.h"
 
-/* handler for write() system call                  */
-/*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
- *
- * You will need to improve this implementation
- */
-
-int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
-{
-  struct iovec iov;
-  struct uio u;
-  int res;
-
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
-  }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
-
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
-  iov.iov_ubase = ubuf;
-  iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
-
-  res = VOP_WRITE(curproc->console,&u);
-  if (res) {
-    return res;
-  }
-
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
-  KASSERT(*retval >= 0);
-  return 0;
+/*
+ * File-related system calls. The descriptor table and the open-file
+ * objects behind it live in file.c; this is the user-facing glue.
+ */
+
+/*
+ * Set up a uio for a transfer to or from the current process's
+ * buffer UBUF.
+ */
+static
+void
+file_uio_uinit(struct iovec *iov, struct uio *u,
+	       userptr_t ubuf, size_t len, off_t pos, enum uio_rw rw)
+{
+	iov->iov_ubase = ubuf;
+	iov->iov_len = len;
+	u->uio_iov = iov;
+	u->uio_iovcnt = 1;
+	u->uio_offset = pos;
+	u->uio_resid = len;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = curproc_getas();
+}
+
+/*
+ * Fetch the openfile for FD and check that it permits RW.
+ */
+static
+int
+file_getrw(int fd, enum uio_rw rw, struct openfile **ret)
+{
+	struct openfile *of;
+	int result;
+
+	KASSERT(curproc->p_filetable != NULL);
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (rw == UIO_READ && of->of_accmode == O_WRONLY) {
+		return EBADF;
+	}
+	if (rw == UIO_WRITE && of->of_accmode == O_RDONLY) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+/*
+ * Copy in the user iovec array UIOV of IOVCNT entries with a single
+ * copyin and set up U to transfer through it. Small arrays go in
+ * SMALL (of FILE_SMALLIOV entries); larger ones are allocated, and
+ * the caller frees *IOVP if it is not SMALL.
+ */
+#define FILE_SMALLIOV 8
+
+static
+int
+file_uio_vinit(userptr_t uiov, int iovcnt, enum uio_rw rw,
+	       struct iovec *small, struct iovec **iovp, struct uio *u)
+{
+	struct iovec *iov;
+	size_t total;
+	int i, result;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+	if (iovcnt <= FILE_SMALLIOV) {
+		iov = small;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(struct iovec));
+		if (iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+	if (result) {
+		goto fail;
+	}
+	/* the total must fit in the return value */
+	total = 0;
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if (total < iov[i].iov_len || (ssize_t)total < 0) {
+			result = EINVAL;
+			goto fail;
+		}
+	}
+
+	u->uio_iov = iov;
+	u->uio_iovcnt = iovcnt;
+	u->uio_offset = 0;
+	u->uio_resid = total;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = curproc_getas();
+	*iovp = iov;
+	return 0;
+
+ fail:
+	if (iov != small) {
+		kfree(iov);
+	}
+	return result;
+}
+
+/*
+ * Do the transfer U, already set up, with VOP_READ or VOP_WRITE.
+ * Under A3, mapped file pages in the user buffers are brought in
+ * first, so that the transfer doesn't fault into a file system from
+ * inside one (see vm_prefault).
+ */
+static
+int
+file_vop(struct openfile *of, struct uio *u)
+{
+#if OPT_A3
+	off_t pos = u->uio_offset;
+	size_t len = u->uio_resid;
+	int result;
+
+	result = vm_prefault(u);
+	if (result) {
+		return result;
+	}
+#endif
+
+	if (u->uio_rw == UIO_READ) {
+		return VOP_READ(of->of_vnode, u);
+	}
+#if OPT_A3
+	result = VOP_WRITE(of->of_vnode, u);
+	vm_filewrite(of->of_vnode, pos, len - u->uio_resid);
+	return result;
+#else
+	return VOP_WRITE(of->of_vnode, u);
+#endif
+}
+
+/*
+ * Common code for read(), write(), readv() and writev(): do the
+ * transfer U at the seek position and advance it. For seekable
+ * objects the offset lock is held for the whole transfer so that
+ * I/O through a shared openfile is atomic with respect to the
+ * position.
+ */
+static
+int
+file_rw(int fd, struct uio *u, int *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	size_t len = u->uio_resid;
+	int result;
+
+	result = file_getrw(fd, u->uio_rw, &of);
+	if (result) {
+		return result;
+	}
+
+	if (!of->of_seekable) {
+		u->uio_offset = 0;
+		result = file_vop(of, u);
+		if (result) {
+			return result;
+		}
+		*retval = len - u->uio_resid;
+		return 0;
+	}
+
+	lock_acquire(of->of_offsetlock);
+	if (u->uio_rw == UIO_WRITE && of->of_append) {
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_offsetlock);
+			return result;
+		}
+		of->of_offset = st.st_size;
+	}
+	u->uio_offset = of->of_offset;
+	result = file_vop(of, u);
+	if (result) {
+		lock_release(of->of_offsetlock);
+		return result;
+	}
+	of->of_offset = u->uio_offset;
+	lock_release(of->of_offsetlock);
+
+	*retval = len - u->uio_resid;
+	return 0;
+}
+
+/*
+ * Common code for pread(), pwrite(), preadv() and pwritev(): do the
+ * transfer U at POS without touching the seek position, and so
+ * without the offset lock.
+ */
+static
+int
+file_prw(int fd, struct uio *u, off_t pos, int *retval)
+{
+	struct openfile *of;
+	size_t len = u->uio_resid;
+	int result;
+
+	result = file_getrw(fd, u->uio_rw, &of);
+	if (result) {
+		return result;
+	}
+	if (!of->of_seekable) {
+		return ESPIPE;
+	}
+	if (pos < 0) {
+		return EINVAL;
+	}
+
+	u->uio_offset = pos;
+	result = file_vop(of, u);
+	if (result) {
+		return result;
+	}
+	*retval = len - u->uio_resid;
+	return 0;
+}
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC |
+		O_APPEND | O_NOCTTY;
+	struct openfile *of;
+	char *path;
+	int fd, result;
+
+	if ((flags & allflags) != flags || (flags & O_ACCMODE) == O_ACCMODE) {
+		return EINVAL;
+	}
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	DEBUG(DB_SYSCALL, "Syscall: open(%s,%d)\n", path, flags);
+
+	/* vfs_open may destroy the path, but we are done with it after. */
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_place(curproc->p_filetable, of, &fd);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	*retval = fd;
+	return 0;
+}
+
+int
+sys_read(int fd, userptr_t ubuf, size_t nbytes, int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+
+	DEBUG(DB_SYSCALL, "Syscall: read(%d,%x,%d)\n", fd,
+	      (unsigned int)ubuf, nbytes);
+	file_uio_uinit(&iov, &u, ubuf, nbytes, 0, UIO_READ);
+	return file_rw(fd, &u, retval);
+}
+
+int
+sys_write(int fd, userptr_t ubuf, size_t nbytes, int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+
+	DEBUG(DB_SYSCALL, "Syscall: write(%d,%x,%d)\n", fd,
+	      (unsigned int)ubuf, nbytes);
+	file_uio_uinit(&iov, &u, ubuf, nbytes, 0, UIO_WRITE);
+	return file_rw(fd, &u, retval);
+}
+
+int
+sys_pread(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+
+	file_uio_uinit(&iov, &u, ubuf, nbytes, pos, UIO_READ);
+	return file_prw(fd, &u, pos, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+
+	file_uio_uinit(&iov, &u, ubuf, nbytes, pos, UIO_WRITE);
+	return file_prw(fd, &u, pos, retval);
+}
+
+/*
+ * Common code for readv(), writev(), preadv() and pwritev(). POS is
+ * used only if USEPOS is set.
+ */
+static
+int
+file_vector(int fd, userptr_t uiov, int iovcnt, off_t pos, bool usepos,
+	    enum uio_rw rw, int *retval)
+{
+	struct iovec small[FILE_SMALLIOV];
+	struct iovec *iov;
+	struct uio u;
+	int result;
+
+	result = file_uio_vinit(uiov, iovcnt, rw, small, &iov, &u);
+	if (result) {
+		return result;
+	}
+	if (usepos) {
+		result = file_prw(fd, &u, pos, retval);
+	}
+	else {
+		result = file_rw(fd, &u, retval);
+	}
+	if (iov != small) {
+		kfree(iov);
+	}
+	return result;
+}
+
+int
+sys_readv(int fd, userptr_t iov, int iovcnt, int *retval)
+{
+	return file_vector(fd, iov, iovcnt, 0, false, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, userptr_t iov, int iovcnt, int *retval)
+{
+	return file_vector(fd, iov, iovcnt, 0, false, UIO_WRITE, retval);
+}
+
+int
+sys_preadv(int fd, userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+	return file_vector(fd, iov, iovcnt, pos, true, UIO_READ, retval);
+}
+
+int
+sys_pwritev(int fd, userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+	return file_vector(fd, iov, iovcnt, pos, true, UIO_WRITE, retval);
+}
+
+/*
+ * Common code for getdirentry() and getdents(): read names from the
+ * directory FD at its seek position into BUF, one with
+ * VOP_GETDIRENTRY or as many as fit with VOP_GETDIRENTRIES. The
+ * position is whatever the filesystem makes of it (for SFS a slot
+ * number), so it is kept even for directories that refuse lseek.
+ */
+static
+int
+file_getdirentries(int fd, userptr_t buf, size_t buflen, bool many,
+		   int *retval)
+{
+	struct openfile *of;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	result = file_getrw(fd, UIO_READ, &of);
+	if (result) {
+		return result;
+	}
+
+	file_uio_uinit(&iov, &u, buf, buflen, 0, UIO_READ);
+#if OPT_A3
+	result = vm_prefault(&u);
+	if (result) {
+		return result;
+	}
+#endif
+	lock_acquire(of->of_offsetlock);
+	u.uio_offset = of->of_offset;
+	if (many) {
+		result = VOP_GETDIRENTRIES(of->of_vnode, &u);
+	}
+	else {
+		result = VOP_GETDIRENTRY(of->of_vnode, &u);
+	}
+	if (result) {
+		lock_release(of->of_offsetlock);
+		return result;
+	}
+	of->of_offset = u.uio_offset;
+	lock_release(of->of_offsetlock);
+
+	*retval = buflen - u.uio_resid;
+	return 0;
+}
+
+int
+sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
+{
+	return file_getdirentries(fd, buf, buflen, false, retval);
+}
+
+int
+sys_getdents(int fd, userptr_t buf, size_t buflen, int *retval)
+{
+	return file_getdirentries(fd, buf, buflen, true, retval);
+}
+
+/*
+ * Buffer size for copy_file_range. If that much contiguous memory
+ * isn't to be had, a single page will do.
+ */
+#define FILE_COPYBUF (16 * PAGE_SIZE)
+
+/*
+ * Get the position copy_file_range should use for OF: from UPOS if
+ * that is not NULL, otherwise the seek position, in which case the
+ * caller must hold the offset lock.
+ */
+static
+int
+file_copypos(struct openfile *of, userptr_t upos, off_t *ret)
+{
+	int result;
+
+	if (upos == NULL) {
+		*ret = of->of_offset;
+		return 0;
+	}
+	result = copyin(upos, ret, sizeof(*ret));
+	if (result) {
+		return result;
+	}
+	if (*ret < 0) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Copy LEN bytes from IN at INPOS to OUT at OUTPOS through a kernel
+ * buffer, in large chunks. Stops early at end of file. Returns the
+ * number of bytes copied in *DONE, which may be nonzero even if an
+ * error is returned.
+ */
+static
+int
+file_copydata(struct vnode *in, off_t inpos, struct vnode *out, off_t outpos,
+	      size_t len, size_t *done)
+{
+	struct iovec iov;
+	struct uio u;
+	char *buf;
+	size_t bufsize, chunk, got;
+	int result;
+
+	*done = 0;
+	bufsize = FILE_COPYBUF;
+	buf = kmalloc(bufsize);
+	if (buf == NULL) {
+		bufsize = PAGE_SIZE;
+		buf = kmalloc(bufsize);
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = 0;
+	while (*done < len) {
+		chunk = len - *done < bufsize ? len - *done : bufsize;
+		uio_kinit(&iov, &u, buf, chunk, inpos + *done, UIO_READ);
+		result = VOP_READ(in, &u);
+		if (result) {
+			break;
+		}
+		got = chunk - u.uio_resid;
+		if (got == 0) {
+			/* EOF */
+			break;
+		}
+
+		uio_kinit(&iov, &u, buf, got, outpos + *done, UIO_WRITE);
+		result = VOP_WRITE(out, &u);
+#if OPT_A3
+		vm_filewrite(out, outpos + *done, got - u.uio_resid);
+#endif
+		*done += got - u.uio_resid;
+		if (result) {
+			break;
+		}
+		if (u.uio_resid > 0) {
+			/* short write; e.g. the disk is full */
+			break;
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
+/*
+ * copy_file_range: copy up to LEN bytes from INFD to OUTFD without
+ * passing them through user space. Each side uses the position that
+ * UINPOS/UOUTPOS point to, and updates it, if the pointer is not NULL;
+ * otherwise it uses and updates the seek position. Both must be
+ * regular files. SFS has no way to share blocks between files, so
+ * the data is always copied, but in large chunks and with a single
+ * trap.
+ */
+int
+sys_copy_file_range(int infd, userptr_t uinpos, int outfd, userptr_t uoutpos,
+		    size_t len, unsigned flags, int *retval)
+{
+	struct openfile *in, *out;
+	struct lock *first, *second;
+	mode_t intype, outtype;
+	off_t inpos, outpos;
+	size_t done;
+	int result, result2;
+
+	if (flags != 0) {
+		return EINVAL;
+	}
+	result = file_getrw(infd, UIO_READ, &in);
+	if (result) {
+		return result;
+	}
+	result = file_getrw(outfd, UIO_WRITE, &out);
+	if (result) {
+		return result;
+	}
+	if (out->of_append) {
+		return EBADF;
+	}
+	result = VOP_GETTYPE(in->of_vnode, &intype);
+	if (result) {
+		return result;
+	}
+	result = VOP_GETTYPE(out->of_vnode, &outtype);
+	if (result) {
+		return result;
+	}
+	if (intype != S_IFREG || outtype != S_IFREG) {
+		return EINVAL;
+	}
+	/* the count must fit in the return value */
+	if ((ssize_t)len < 0) {
+		len = (size_t)-1 >> 1;
+	}
+
+	/*
+	 * Take the offset locks we need, in address order in case
+	 * another process is doing the same between the same two
+	 * openfiles the other way round.
+	 */
+	first = uinpos == NULL ? in->of_offsetlock : NULL;
+	second = uoutpos == NULL ? out->of_offsetlock : NULL;
+	if (first == second) {
+		second = NULL;
+	}
+	else if (first != NULL && second != NULL && second < first) {
+		first = out->of_offsetlock;
+		second = in->of_offsetlock;
+	}
+	else if (first == NULL) {
+		first = second;
+		second = NULL;
+	}
+	if (first != NULL) {
+		lock_acquire(first);
+	}
+	if (second != NULL) {
+		lock_acquire(second);
+	}
+
+	result = file_copypos(in, uinpos, &inpos);
+	if (result) {
+		goto out;
+	}
+	result = file_copypos(out, uoutpos, &outpos);
+	if (result) {
+		goto out;
+	}
+	if (in->of_vnode == out->of_vnode &&
+	    inpos < outpos + (off_t)len && outpos < inpos + (off_t)len) {
+		/* overlapping ranges of one file */
+		result = EINVAL;
+		goto out;
+	}
+
+	result = file_copydata(in->of_vnode, inpos, out->of_vnode, outpos,
+			       len, &done);
+	if (done == 0 && result) {
+		goto out;
+	}
+	/* a partial copy is a short count, as for write */
+	result = 0;
+	inpos += done;
+	outpos += done;
+
+	if (uinpos == NULL) {
+		in->of_offset = inpos;
+	}
+	else {
+		result = copyout(&inpos, uinpos, sizeof(inpos));
+	}
+	if (uoutpos == NULL) {
+		out->of_offset = outpos;
+	}
+	else {
+		result2 = copyout(&outpos, uoutpos, sizeof(outpos));
+		if (result == 0) {
+			result = result2;
+		}
+	}
+	*retval = done;
+
+ out:
+	if (second != NULL) {
+		lock_release(second);
+	}
+	if (first != NULL) {
+		lock_release(first);
+	}
+	return result;
+}
+
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (!of->of_seekable) {
+		return ESPIPE;
+	}
+
+	lock_acquire(of->of_offsetlock);
+	switch (whence) {
+	    case SEEK_SET:
+		newpos = pos;
+		break;
+	    case SEEK_CUR:
+		newpos = of->of_offset + pos;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_offsetlock);
+			return result;
+		}
+		newpos = st.st_size + pos;
+		break;
+	    default:
+		lock_release(of->of_offsetlock);
+		return EINVAL;
+	}
+
+	result = VOP_TRYSEEK(of->of_vnode, newpos);
+	if (result) {
+		lock_release(of->of_offsetlock);
+		return result;
+	}
+	of->of_offset = newpos;
+	lock_release(of->of_offsetlock);
+
+	*retval = newpos;
+	return 0;
+}
+
+int
+sys_close(int fd)
+{
+	DEBUG(DB_SYSCALL, "Syscall: close(%d)\n", fd);
+	return filetable_close(curproc->p_filetable, fd);
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+	struct openfile *of, *oldfile;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, oldfd, &of);
+	if (result) {
+		return result;
+	}
+	if (newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	if (oldfd != newfd) {
+		openfile_incref(of);
+		filetable_placeat(curproc->p_filetable, of, newfd, &oldfile);
+		if (oldfile != NULL) {
+			openfile_decref(oldfile);
+		}
+	}
+	*retval = newfd;
+	return 0;
+}
+
+int
+sys_pipe(userptr_t ufds, int *retval)
+{
+	struct filetable *ft = curproc->p_filetable;
+	struct vnode *rvn, *wvn;
+	struct openfile *rof, *wof;
+	int fds[2];
+	int result;
+
+	result = pipe_create(&rvn, &wvn);
+	if (result) {
+		return result;
+	}
+	result = openfile_fromvnode(rvn, O_RDONLY, &rof);
+	if (result) {
+		vfs_close(rvn);
+		vfs_close(wvn);
+		return result;
+	}
+	result = openfile_fromvnode(wvn, O_WRONLY, &wof);
+	if (result) {
+		openfile_decref(rof);
+		vfs_close(wvn);
+		return result;
+	}
+
+	result = filetable_place(ft, rof, &fds[0]);
+	if (result) {
+		openfile_decref(rof);
+		openfile_decref(wof);
+		return result;
+	}
+	result = filetable_place(ft, wof, &fds[1]);
+	if (result) {
+		filetable_close(ft, fds[0]);
+		openfile_decref(wof);
+		return result;
+	}
+	result = copyout(fds, ufds, sizeof(fds));
+	if (result) {
+		filetable_close(ft, fds[0]);
+		filetable_close(ft, fds[1]);
+		return result;
+	}
+	*retval = 0;
+	return 0;
+}
+
+int
+sys_ioctl(int fd, int code, userptr_t data, int *retval)
+{
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = VOP_IOCTL(of->of_vnode, code, data);
+	if (result) {
+		return result;
+	}
+	*retval = 0;
+	return 0;
+}
+
+#if OPT_A3
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct openfile *of;
+	vaddr_t va;
+	int result;
+
+	/* we choose the address ourselves; ADDR is only a hint */
+	(void)addr;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (of->of_accmode == O_WRONLY) {
+		return EACCES;
+	}
+	if (flags == MAP_SHARED && (prot & PROT_WRITE) &&
+	    of->of_accmode != O_RDWR) {
+		return EACCES;
+	}
+	result = VOP_MMAP(of->of_vnode);
+	if (result) {
+		return result;
+	}
+
+	result = as_mmap(curproc_getas(), of->of_vnode, len, offset, prot,
+			 flags == MAP_SHARED, &va);
+	if (result) {
+		return result;
+	}
+	*retval = va;
+	return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+	return as_munmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	return as_msync(curproc_getas(), (vaddr_t)addr, len);
 }
+#endif
@@ -160,6 +160,10 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
+#if OPT_A3
+	int nload = 0;
+	bool shareable = false, textshared = false;
+#endif
 
 	as = curproc_getas();
 
@@ -244,6 +248,13 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		/* The first segment becomes region 1, the code segment. */
+		if (nload++ == 0) {
+			shareable = (ph.p_flags & PF_X) && !(ph.p_flags & PF_W);
+		}
+#endif
+
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
@@ -259,6 +270,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_A3
+	/* If another process has this program's code loaded, share it. */
+	if (shareable) {
+		textshared = as_text_attach(as, v);
+	}
+	nload = 0;
+#endif
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -289,6 +308,12 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		if (nload++ == 0 && textshared) {
+			continue;
+		}
+#endif
+
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
@@ -304,6 +329,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 	*entrypoint = eh.e_entry;
 	#if OPT_A3
+    	if (shareable && !textshared) {
+    		as_text_publish(as, v);
+    	}
     	as->loaded = true;
     	as_activate();
 	#endif
@@ -15,6 +15,8 @@
 #include <machine/trapframe.h>
 #include <kern/fcntl.h>
 #include <vfs.h>
+#include <limits.h>
+#include <file.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
 /* this implementation of sys__exit does not do anything with the exit code */
@@ -64,6 +66,10 @@ void sys__exit(int exitcode)
   as = curproc_setas(NULL);
   as_destroy(as);
 
+  /* close files now rather than when the parent reaps us */
+  filetable_destroy(p->p_filetable);
+  p->p_filetable = NULL;
+
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
@@ -190,6 +196,17 @@ int sys_fork(struct trapframe *tf, int *retval)
     return status;
   }
   spinlock_release(&childProc->p_lock);
+  /* the child shares the parent's open files, not fresh console ones */
+  struct filetable *ft;
+  status = filetable_copy(curproc->p_filetable, &ft);
+  if (status)
+  {
+    as_destroy(childProc->p_addrspace);
+    proc_destroy(childProc);
+    return status;
+  }
+  filetable_destroy(childProc->p_filetable);
+  childProc->p_filetable = ft;
   lock_acquire(globalPidLock);
   childProc->pid = globalPid;
   lock_release(globalPidLock);
@@ -248,57 +265,58 @@ int sys_fork(struct trapframe *tf, int *retval)
 int sys_execv(const_userptr_t program, userptr_t *args)
 {
   int result;
+  int argc;
+  size_t progname_len, args_len;
   if (program == NULL)
   {
     return ENOENT;
   }
-  int progname_len = strlen((char *)program) + 1;
-  char *progname = kmalloc(progname_len * sizeof(char));
-  result = copyin(program, (void *)progname, progname_len);
+  /*
+   * The program name and the argument strings are packed back to
+   * back into a single buffer: the name first (it becomes argv[0]),
+   * then the whole user argv, moved in one copyinargv call.
+   */
+  char *argbuf = kmalloc(ARG_MAX);
+  if (argbuf == NULL)
+  {
+    return ENOMEM;
+  }
+  result = copyinstr(program, argbuf, PATH_MAX, &progname_len);
   if (result)
   {
+    kfree(argbuf);
     return result;
   }
-  int argc = 0;
-  while (args[argc] != NULL)
+  result = copyinargv((const_userptr_t)args, argbuf + progname_len,
+                      ARG_MAX - progname_len, &argc, &args_len);
+  if (result)
   {
-    argc++;
+    kfree(argbuf);
+    return result;
   }
   argc++;
-  char **argv = kmalloc(argc * sizeof(char *));
-  argv[0] = progname;
-  for (int i = 0; i < argc - 1; i++)
+  /* vfs_open may destroy the name it is given, so hand it a copy */
+  char *progname = kstrdup(argbuf);
+  if (progname == NULL)
   {
-    int arg_size = strlen((char *)args[i]) + 1;
-    argv[i + 1] = kmalloc(arg_size * sizeof(char));
-    result = copyinstr(args[i], argv[i + 1], arg_size, NULL);
-    if (result)
-    {
-      return result;
-    }
+    kfree(argbuf);
+    return ENOMEM;
   }
   struct addrspace *as;
   struct vnode *v;
   vaddr_t entrypoint, stackptr;
   result = vfs_open(progname, O_RDONLY, 0, &v);
+  kfree(progname);
   if (result)
   {
-    for (int i = 0; i < argc; i++)
-    {
-      kfree(argv[i]);
-    }
-    kfree(argv);
+    kfree(argbuf);
     return result;
   }
   as = as_create();
   if (as == NULL)
   {
     vfs_close(v);
-    for (int i = 0; i < argc; i++)
-    {
-      kfree(argv[i]);
-    }
-    kfree(argv);
+    kfree(argbuf);
     return ENOMEM;
   }
   curproc_setas(NULL);
@@ -309,63 +327,22 @@ int sys_execv(const_userptr_t program, userptr_t *args)
   if (result)
   {
     vfs_close(v);
-    for (int i = 0; i < argc; i++)
-    {
-      kfree(argv[i]);
-    }
-    kfree(argv);
+    kfree(argbuf);
     return result;
   }
   vfs_close(v);
   result = as_define_stack(as, &stackptr);
   if (result)
   {
-    for (int i = 0; i < argc; i++)
-    {
-      kfree(argv[i]);
-    }
-    kfree(argv);
+    kfree(argbuf);
     return result;
   }
-  vaddr_t argv_ptr[argc + 1];
-  for (int i = argc - 1; i >= 0; i--)
-  {
-    stackptr -= strlen(argv[i]) + 1;
-    result = copyoutstr(argv[i], (userptr_t)stackptr, strlen(argv[i]) + 1, NULL);
-    if (result)
-    {
-      for (int i = 0; i < argc; i++)
-      {
-        kfree(argv[i]);
-      }
-      kfree(argv);
-      return result;
-    }
-    argv_ptr[i] = stackptr;
-  }
-  argv_ptr[argc] = 0;
-  stackptr = ROUNDUP(stackptr - 8, 8);
-  stackptr -= ROUNDUP((argc + 1) * sizeof(char *), 8);
-  vaddr_t argvptr = stackptr;
-  for (int i = 0; i <= argc; i++)
-  {
-    result = copyout(&argv_ptr[i], (userptr_t)argvptr, sizeof(vaddr_t));
-    if (result)
-    {
-      for (int i = 0; i < argc; i++)
-      {
-        kfree(argv[i]);
-      }
-      kfree(argv);
-      return result;
-    }
-    argvptr += sizeof(char *);
-  }
-  for (int i = 0; i < argc; i++)
+  result = copyoutargv(argbuf, progname_len + args_len, argc, &stackptr);
+  kfree(argbuf);
+  if (result)
   {
-    kfree(argv[i]);
+    return result;
   }
-  kfree(argv);
   enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
   panic("Enter new process returned");
   return EINVAL;
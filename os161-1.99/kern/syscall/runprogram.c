@@ -91,26 +91,22 @@ runprogram(char *progname, char **args)
 	result = as_define_stack(as, &stackptr);
 	if (result) return result;
 
-    vaddr_t args_ptr[argc + 1];
-    for (int i = argc - 1; i >= 0; i--) {
-        stackptr -= strlen(args[i]) + 1;
-        result = copyoutstr(args[i], (userptr_t)stackptr, strlen(args[i]) + 1, NULL);
-        if(result) {
-            return result;
-        }
-        args_ptr[i] = stackptr;
+    /* Pack the strings back to back and lay them out in one go. */
+    size_t args_len = 0;
+    for (int i = 0; i < argc; i++) {
+        args_len += strlen(args[i]) + 1;
     }
-    args_ptr[argc] = 0;
-
-    stackptr = ROUNDUP(stackptr - 8, 8);
-    stackptr -= ROUNDUP((argc + 1)*sizeof(char *), 8);
-    vaddr_t argvptr = stackptr;
-    for (int i = 0; i <= argc; i++) {
-        result = copyout(&args_ptr[i], (userptr_t)argvptr, sizeof(vaddr_t));
-        if(result) {
-            return result;
-        }
-        argvptr += sizeof(char *);
+    char *argbuf = kmalloc(args_len);
+    if (argbuf == NULL) return ENOMEM;
+    size_t off = 0;
+    for (int i = 0; i < argc; i++) {
+        strcpy(argbuf + off, args[i]);
+        off += strlen(args[i]) + 1;
+    }
+    result = copyoutargv(argbuf, args_len, argc, &stackptr);
+    kfree(argbuf);
+    if (result) {
+        return result;
     }
 	enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
 
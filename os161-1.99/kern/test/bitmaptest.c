@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -40,7 +41,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, count;
 
 	(void)nargs;
 	(void)args;
@@ -89,6 +90,20 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	count = 0;
+	for (i=0; i<TESTSIZE; i++) {
+		if (data[i]) {
+			count++;
+		}
+	}
+	KASSERT(bitmap_count(b, 0, TESTSIZE) == (unsigned)(TESTSIZE - count));
+	if (bitmap_findclear(b, 0, TESTSIZE, &x) == 0) {
+		for (i=0; i<(int)x; i++) {
+			KASSERT(data[i]==0);
+		}
+		KASSERT(data[x]==1);
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -101,6 +116,32 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	bitmap_destroy(b);
+
+	/* Runs: fill a fresh map with runs of every length up to 40 */
+	b = bitmap_create(TESTSIZE);
+	KASSERT(b != NULL);
+	count = 0;
+	for (i=1; bitmap_alloc_range(b, i % 40 + 1, &x)==0; i++) {
+		KASSERT(x == (uint32_t)count);
+		count += i % 40 + 1;
+		KASSERT(bitmap_count(b, 0, TESTSIZE) == (unsigned)count);
+	}
+	KASSERT(count + i % 40 + 1 > TESTSIZE);
+	while (bitmap_alloc(b, &x)==0) {
+		KASSERT(x >= (uint32_t)count);
+	}
+
+	/* Free a run in the middle; only a run that fits gets it */
+	for (x=100; x<110; x++) {
+		bitmap_unmark(b, x);
+	}
+	KASSERT(bitmap_findset(b, 100, 110, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_range(b, 11, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_range(b, 10, &x) == 0 && x == 100);
+	KASSERT(bitmap_findclear(b, 0, TESTSIZE, &x) == ENOSPC);
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,138 @@
+/*
+ * diskbench - raw disk throughput benchmark
+ *
+ * Reads (and optionally rewrites) the start of a raw disk device in
+ * transfers of various sizes and reports the throughput of each.
+ * Writes put back exactly the data that was read, so the benchmark
+ * doesn't damage whatever is on the disk; still, don't run it with
+ * "write" on a device that has a filesystem mounted.
+ *
+ * Usage: db [device [write]]     (default device lhd0raw:)
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DB_TOTAL     (256*1024)	/* bytes transferred per size */
+#define DB_MAXXFER   (32*1024)
+
+static const size_t db_sizes[] = { 512, 4096, 16384, DB_MAXXFER };
+#define DB_NSIZES (sizeof(db_sizes) / sizeof(db_sizes[0]))
+
+/*
+ * Transfer DB_TOTAL bytes at the start of the device, XFER bytes at a
+ * time. For writes, each chunk is read first (untimed) and written
+ * back as is. Returns the elapsed time for the timed transfers.
+ */
+static
+int
+db_run(struct vnode *vn, char *buf, size_t xfer, bool dowrite,
+       time_t *rsecs, uint32_t *rnsecs)
+{
+	struct iovec iov;
+	struct uio ku;
+	time_t s1, s2, secs = 0;
+	uint32_t ns1, ns2, nsecs = 0;
+	time_t isecs;
+	uint32_t insecs;
+	off_t pos;
+	int result;
+
+	for (pos = 0; pos < DB_TOTAL; pos += xfer) {
+		if (dowrite) {
+			uio_kinit(&iov, &ku, buf, xfer, pos, UIO_READ);
+			result = VOP_READ(vn, &ku);
+			if (result) {
+				return result;
+			}
+		}
+
+		uio_kinit(&iov, &ku, buf, xfer, pos,
+			  dowrite ? UIO_WRITE : UIO_READ);
+		gettime(&s1, &ns1);
+		result = dowrite ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+		gettime(&s2, &ns2);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			return EIO;
+		}
+
+		getinterval(s1, ns1, s2, ns2, &isecs, &insecs);
+		secs += isecs;
+		nsecs += insecs;
+		if (nsecs >= 1000000000) {
+			nsecs -= 1000000000;
+			secs++;
+		}
+	}
+	*rsecs = secs;
+	*rnsecs = nsecs;
+	return 0;
+}
+
+int
+diskbench(int nargs, char **args)
+{
+	const char *devname;
+	char path[32];
+	struct vnode *vn;
+	char *buf;
+	bool dowrite;
+	time_t secs;
+	uint32_t nsecs, ms;
+	unsigned i;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: db [device [write]]\n");
+		return EINVAL;
+	}
+	devname = nargs > 1 ? args[1] : "lhd0raw:";
+	if (strlen(devname) >= sizeof(path)) {
+		return ENAMETOOLONG;
+	}
+	dowrite = nargs > 2 && !strcmp(args[2], "write");
+
+	buf = kmalloc(DB_MAXXFER);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	/* vfs_open may modify the path; give it a copy */
+	strcpy(path, devname);
+	result = vfs_open(path, dowrite ? O_RDWR : O_RDONLY, 0, &vn);
+	if (result) {
+		kprintf("diskbench: %s: %s\n", devname, strerror(result));
+		kfree(buf);
+		return result;
+	}
+
+	kprintf("diskbench: %s %u KB per transfer size\n",
+		dowrite ? "rewriting" : "reading", DB_TOTAL / 1024);
+	for (i=0; i<DB_NSIZES; i++) {
+		result = db_run(vn, buf, db_sizes[i], dowrite, &secs, &nsecs);
+		if (result) {
+			kprintf("diskbench: %u-byte transfers: %s\n",
+				db_sizes[i], strerror(result));
+			break;
+		}
+		ms = secs * 1000 + nsecs / 1000000;
+		kprintf("  %5u-byte transfers: %lu.%03lu s, %u KB/s\n",
+			db_sizes[i], (unsigned long)secs,
+			(unsigned long)(nsecs / 1000000),
+			ms ? (DB_TOTAL / 1024) * 1000 / ms : 0);
+	}
+
+	vfs_close(vn);
+	kfree(buf);
+	return result;
+}
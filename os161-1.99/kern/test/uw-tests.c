@@ -243,6 +243,14 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          case VMSTAT_ZERO_FRAME_MAP:
+          case VMSTAT_ZERO_POOL_HIT:
+          case VMSTAT_ZERO_POOL_MISS:
+          case VMSTAT_TEXT_SHARED:
+          case VMSTAT_MMAP_FILE_READ:
+            vmstats_inc(j);
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
@@ -266,8 +274,8 @@ uwvmstatstest(int nargs, char **args)
 	inititems();
 	kprintf("Starting uwvmstatstest...\n");
 
-  kprintf("Initializing vmstats\n");
-  vmstats_init();
+  kprintf("Resetting vmstats\n");
+  vmstats_reset();
 
 	for (i=0; i<NTESTTHREADS; i++) {
     snprintf(name, NAME_LEN, "vmstatsthread %d", i);
@@ -187,6 +187,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -1140,9 +1141,17 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue MAPPING on TARGET and return the value c_shootdowns_done will
+ * reach once it has been processed. The handler holds c_ipi_lock for
+ * the whole time it works through the queue, so the next pass that
+ * finishes after this one releases the lock includes MAPPING.
+ */
+static
+unsigned
+ipi_tlbshootdown_queue(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
@@ -1158,8 +1167,69 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
+	ticket = target->c_shootdowns_done + 1;
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	ipi_tlbshootdown_queue(target, mapping);
+}
+
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
+void
+ipi_tlbshootdown_sync(const struct tlbshootdown *mapping)
+{
+	unsigned i, ticket, done;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	/*
+	 * One cpu at a time, so there is nowhere to keep more than one
+	 * ticket; there are few cpus and the wait is short. We may come
+	 * back from thread_yield on a different cpu, so decide whether
+	 * each one is local or remote with interrupts off.
+	 */
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spl = splhigh();
+		if (c == curcpu->c_self) {
+			vm_tlbshootdown(mapping);
+			splx(spl);
+			continue;
+		}
+		ticket = ipi_tlbshootdown_queue(c, mapping);
+		splx(spl);
+
+		while (1) {
+			spinlock_acquire(&c->c_ipi_lock);
+			done = c->c_shootdowns_done;
+			spinlock_release(&c->c_ipi_lock);
+			/* (counter wraparound is harmless) */
+			if ((int)(done - ticket) >= 0) {
+				break;
+			}
+			thread_yield();
+		}
+	}
 }
 
 void
@@ -1202,6 +1272,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done++;
 	}
 
 	curcpu->c_ipi_pending = 0;
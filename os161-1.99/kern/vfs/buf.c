@@ -0,0 +1,1030 @@
+/*
+ * Buffer cache. See buf.h for the interface.
+ *
+ * All cache state (the hash table, the LRU list, the counters, and
+ * each buffer's flags and reference count) is protected by
+ * buffer_lock. A buffer's data belongs to whoever has it busy.
+ *
+ * Reads done on behalf of buffer_read happen with buffer_lock
+ * released; the buffer is busy meanwhile, so anyone else after the
+ * same block waits on buffer_cv. Write-backs by the syncer and by
+ * buffer_sync_device work the same way, and are queued with the
+ * device several at a time (on devices that have d_submit) so the
+ * disk scheduler can sort and merge them. Write-backs during eviction
+ * are done with buffer_lock held, which keeps the bookkeeping simple
+ * at the cost of stalling other cache users for one write.
+ *
+ * Read-ahead buffers (buffer_prefetch) are hashed and hold a
+ * reference of their own while the read is in flight, which keeps
+ * them off the LRU list. Nothing runs when the read completes; the
+ * next lookup of the block, or the next buffer_reap, finishes it off.
+ *
+ * Writes are delayed. Dirty buffers go on a dirty list in the order
+ * they were first dirtied, and the syncer thread writes them back
+ * once they are BUFFER_DIRTYAGE seconds old, or sooner if more than
+ * BUFFER_DIRTYHIGH of them pile up. Every BUFFER_SYNCINTERVAL seconds
+ * it also does a full vfs_sync, which picks up whatever filesystems
+ * keep outside the cache (in-memory inodes, free maps).
+ *
+ * A pinned buffer (buffer_pin) is dirty but may not be written back
+ * yet: a journaling filesystem pins metadata blocks until their
+ * transaction is safely in the log. The syncer, eviction, and
+ * buffer_sync_device all pass pinned buffers by.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+
+struct buf {
+	struct buf *b_hashnext;		/* next in hash chain */
+	struct buf *b_lruprev;		/* LRU list links, valid only */
+	struct buf *b_lrunext;		/*   while b_refcount is 0 */
+	struct buf *b_dirtyprev;	/* dirty list links, valid only */
+	struct buf *b_dirtynext;	/*   while b_dirty is set */
+	time_t b_dirtytime;		/* when it was first dirtied */
+	struct device *b_dev;		/* device the block is on */
+	daddr_t b_block;		/* block number on the device */
+	size_t b_size;			/* block size (bytes) */
+	void *b_data;			/* the cached block */
+	unsigned b_refcount;		/* holders, plus threads waiting */
+	bool b_busy;			/* handed out to someone */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data newer than the disk */
+	bool b_pinned;			/* dirty, but not to be written yet */
+	bool b_inflight;		/* read-ahead in progress */
+	bool b_prefetched;		/* read ahead and not yet used */
+	struct blkreq b_req;		/* the read-ahead */
+	struct buf *b_inflightnext;	/* in-flight list link */
+};
+
+#define BUFFER_HASHSIZE  64
+#define BUFFER_RETRIES   10
+#define BUFFER_BATCH     8	/* write-backs queued at once */
+#define BUFFER_MAXPREFETCH(max) ((max)/4)	/* read-aheads in flight */
+
+/* Syncer tuning; times are in seconds. */
+#define BUFFER_DIRTYAGE      5	/* write back blocks this old */
+#define BUFFER_DIRTYHIGH(max) ((max)/2)	/* write back early above this */
+#define BUFFER_DIRTYLOW(max)  ((max)/4)	/* ...until down to this */
+#define BUFFER_SYNCINTERVAL 30	/* full vfs_sync this often */
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+
+/* Unreferenced buffers, least recently used first. */
+static struct buf *buffer_lruhead, *buffer_lrutail;
+
+/* Dirty buffers, oldest first. */
+static struct buf *buffer_dirtyhead, *buffer_dirtytail;
+static unsigned buffer_ndirty;
+
+/* Buffers with a read-ahead in progress. */
+static struct buf *buffer_inflight;
+static unsigned buffer_ninflight;
+
+/* Number of buffers in existence, and the budget for it. */
+static unsigned buffer_count, buffer_max;
+
+static struct {
+	unsigned hits;		/* lookups that found the block cached */
+	unsigned misses;	/* lookups that did not */
+	unsigned reads;		/* blocks read from disk */
+	unsigned writes;	/* blocks written to disk */
+	unsigned evictions;	/* buffers reused for another block */
+	unsigned syncerwrites;	/* writes done by the syncer */
+	unsigned prefetches;	/* read-aheads started */
+	unsigned prefetchhits;	/* ...whose block was then used */
+	unsigned prefetchwasted;	/* ...evicted without being used */
+} buffer_stats;
+
+////////////////////////////////////////////////////////////
+//
+// Internal bookkeeping
+
+static
+unsigned
+buffer_hashfn(struct device *dev, daddr_t block)
+{
+	return (block ^ dev->d_devnumber * 31) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_unhash(struct buf *b)
+{
+	struct buf **pp;
+
+	pp = &buffer_hash[buffer_hashfn(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lru_append(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+/*
+ * Drop a reference to a buffer. The last reference puts it on the
+ * LRU list: at the end if it holds anything worth keeping, otherwise
+ * at the front so it is reused first. Otherwise, someone is waiting
+ * for it.
+ */
+static
+void
+buffer_unref(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount > 0) {
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+	else if (b->b_valid) {
+		buffer_lru_append(b);
+	}
+	else {
+		b->b_lruprev = NULL;
+		b->b_lrunext = buffer_lruhead;
+		if (buffer_lruhead != NULL) {
+			buffer_lruhead->b_lruprev = b;
+		}
+		else {
+			buffer_lrutail = b;
+		}
+		buffer_lruhead = b;
+	}
+}
+
+/*
+ * Put a buffer on, or take it off, the dirty list, setting b_dirty
+ * to match.
+ */
+static
+void
+buffer_set_dirty(struct buf *b)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	if (b->b_dirty) {
+		return;
+	}
+	gettime(&secs, &nsecs);
+	b->b_dirty = true;
+	b->b_dirtytime = secs;
+	b->b_dirtynext = NULL;
+	b->b_dirtyprev = buffer_dirtytail;
+	if (buffer_dirtytail != NULL) {
+		buffer_dirtytail->b_dirtynext = b;
+	}
+	else {
+		buffer_dirtyhead = b;
+	}
+	buffer_dirtytail = b;
+	buffer_ndirty++;
+}
+
+static
+void
+buffer_set_clean(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	if (!b->b_dirty) {
+		return;
+	}
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		buffer_dirtyhead = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	else {
+		buffer_dirtytail = b->b_dirtyprev;
+	}
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+	b->b_dirty = false;
+	KASSERT(buffer_ndirty > 0);
+	buffer_ndirty--;
+}
+
+/*
+ * Start the device I/O for a buffer. If the device can't queue
+ * requests, this does the whole transfer, and REQ just records the
+ * result.
+ */
+static
+void
+buffer_io_start(struct buf *b, struct blkreq *req, enum uio_rw rw)
+{
+	struct device *dev = b->b_dev;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	req->br_block = b->b_block;
+	req->br_nblocks = 1;
+	req->br_data = b->b_data;
+	req->br_write = (rw == UIO_WRITE);
+	req->br_callback = NULL;
+	req->br_arg = b;
+
+	if (dev->d_submit != NULL) {
+		result = dev->d_submit(dev, req);
+		if (result == 0) {
+			return;
+		}
+	}
+	else {
+		uio_kinit(&iov, &ku, b->b_data, b->b_size,
+			  ((off_t)b->b_block) * b->b_size, rw);
+		result = dev->d_io(dev, &ku);
+	}
+	req->br_result = result;
+	req->br_complete = true;
+}
+
+/*
+ * Wait for I/O started with buffer_io_start and return its result.
+ */
+static
+int
+buffer_io_wait(struct buf *b, struct blkreq *req)
+{
+	if (req->br_complete) {
+		return req->br_result;
+	}
+	return b->b_dev->d_wait(b->b_dev, req);
+}
+
+/*
+ * Do the device I/O for a buffer, retrying a few times on EIO.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct blkreq req;
+	unsigned tries;
+	int result;
+
+	for (tries = 0; ; tries++) {
+		buffer_io_start(b, &req, rw);
+		result = buffer_io_wait(b, &req);
+		if (result == EINVAL) {
+			/* Out of range or misaligned; that's our fault. */
+			panic("buffer: d_io returned EINVAL for block %u\n",
+			      b->b_block);
+		}
+		if (result != EIO || tries == BUFFER_RETRIES) {
+			break;
+		}
+		if (tries == 0) {
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+		}
+	}
+	if (result == EIO) {
+		kprintf("buffer: block %u I/O error, giving up after "
+			"%u retries\n", b->b_block, tries);
+	}
+	if (result == 0) {
+		if (rw == UIO_READ) {
+			buffer_stats.reads++;
+		}
+		else {
+			buffer_stats.writes++;
+		}
+	}
+	return result;
+}
+
+/*
+ * Write a dirty buffer back. Called with buffer_lock held, on a
+ * buffer that is either busy for the caller or unreferenced.
+ */
+static
+int
+buffer_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_valid);
+	KASSERT(!b->b_pinned);
+
+	result = buffer_io(b, UIO_WRITE);
+	if (result == 0) {
+		buffer_set_clean(b);
+	}
+	return result;
+}
+
+/*
+ * Write back N dirty buffers that nobody has busy, without holding
+ * buffer_lock during the I/O. The writes are all queued before
+ * waiting for any of them, so the disk can order and merge them.
+ * A buffer that fails to write goes to the back of the dirty list,
+ * so callers walking the list don't spin on it.
+ *
+ * Called with buffer_lock held; it is dropped and retaken, so the
+ * caller must not rely on anything it looked at before. Returns the
+ * number of buffers written, and the first error (if any) in
+ * *RESULT.
+ */
+static
+unsigned
+buffer_clean_batch(struct buf **bufs, unsigned n, int *result)
+{
+	struct blkreq reqs[BUFFER_BATCH];
+	int results[BUFFER_BATCH];
+	struct buf *b;
+	unsigned i, written = 0;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(n <= BUFFER_BATCH);
+
+	for (i=0; i<n; i++) {
+		b = bufs[i];
+		KASSERT(b->b_dirty && !b->b_busy && !b->b_pinned);
+		if (b->b_refcount == 0) {
+			buffer_lru_remove(b);
+		}
+		b->b_refcount++;
+		b->b_busy = true;
+	}
+	lock_release(buffer_lock);
+
+	for (i=0; i<n; i++) {
+		buffer_io_start(bufs[i], &reqs[i], UIO_WRITE);
+	}
+	for (i=0; i<n; i++) {
+		results[i] = buffer_io_wait(bufs[i], &reqs[i]);
+		if (results[i] == 0) {
+			buffer_stats.writes++;
+		}
+		else {
+			/* go through the retry logic */
+			results[i] = buffer_io(bufs[i], UIO_WRITE);
+		}
+	}
+
+	*result = 0;
+	lock_acquire(buffer_lock);
+	for (i=0; i<n; i++) {
+		b = bufs[i];
+		if (results[i] == 0) {
+			buffer_set_clean(b);
+			written++;
+		}
+		else {
+			/* requeue it with a fresh timestamp */
+			buffer_set_clean(b);
+			buffer_set_dirty(b);
+			if (*result == 0) {
+				*result = results[i];
+			}
+		}
+		b->b_busy = false;
+		buffer_unref(b);
+	}
+	return written;
+}
+
+/*
+ * Finish off a read-ahead whose I/O is complete: take the buffer off
+ * the in-flight list, and drop the reference the I/O held.
+ */
+static
+void
+buffer_prefetch_finish(struct buf *b)
+{
+	struct buf **pp;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_inflight && b->b_req.br_complete);
+
+	for (pp = &buffer_inflight; *pp != b; pp = &(*pp)->b_inflightnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = b->b_inflightnext;
+	b->b_inflightnext = NULL;
+	buffer_ninflight--;
+
+	b->b_inflight = false;
+	if (b->b_req.br_result == 0) {
+		b->b_valid = true;
+		b->b_prefetched = true;
+		buffer_stats.reads++;
+	}
+	buffer_unref(b);
+}
+
+/*
+ * Finish off the read-aheads that have completed. If DEV isn't NULL,
+ * first wait for all of DEV's to complete.
+ */
+static
+void
+buffer_reap(struct device *dev)
+{
+	struct buf *b, *next;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_inflight; b != NULL; b = next) {
+		next = b->b_inflightnext;
+		if (b->b_busy) {
+			/* someone is waiting on it; they'll finish it */
+			continue;
+		}
+		if (b->b_dev == dev && !b->b_req.br_complete) {
+			dev->d_wait(dev, &b->b_req);
+		}
+		if (b->b_req.br_complete) {
+			buffer_prefetch_finish(b);
+		}
+	}
+}
+
+/*
+ * Come up with a buffer structure with SIZE bytes of data, either a
+ * new one or the least recently used unreferenced one. Returns NULL
+ * if out of memory.
+ */
+static
+struct buf *
+buffer_alloc(size_t size)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	if (buffer_count >= buffer_max) {
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_pinned) {
+				continue;
+			}
+			if (!b->b_dirty || buffer_writeback(b) == 0) {
+				break;
+			}
+		}
+		if (b != NULL) {
+			buffer_lru_remove(b);
+			buffer_unhash(b);
+			if (b->b_valid) {
+				buffer_stats.evictions++;
+			}
+			if (b->b_prefetched) {
+				buffer_stats.prefetchwasted++;
+			}
+			if (b->b_size == size) {
+				return b;
+			}
+			kfree(b->b_data);
+			b->b_data = kmalloc(size);
+			if (b->b_data == NULL) {
+				kfree(b);
+				buffer_count--;
+				return NULL;
+			}
+			b->b_size = size;
+			return b;
+		}
+		/* Everything is in use or won't write; go over budget. */
+	}
+
+	b = kmalloc(sizeof(struct buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(size);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_size = size;
+	buffer_count++;
+	return b;
+}
+
+/*
+ * Initialize a buffer from buffer_alloc for BLOCK on DEV, with one
+ * reference, and hash it.
+ */
+static
+void
+buffer_setup(struct buf *b, struct device *dev, daddr_t block)
+{
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_refcount = 1;
+	b->b_busy = false;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_pinned = false;
+	b->b_inflight = false;
+	b->b_prefetched = false;
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+	b->b_inflightnext = NULL;
+	b->b_hashnext = buffer_hash[buffer_hashfn(dev, block)];
+	buffer_hash[buffer_hashfn(dev, block)] = b;
+}
+
+/*
+ * Get the buffer for BLOCK on DEV, busy, creating it (invalid) if it
+ * isn't cached.
+ */
+static
+int
+buffer_acquire(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+
+	KASSERT(dev->d_blocksize > 0);
+
+	lock_acquire(buffer_lock);
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		buffer_stats.hits++;
+		if (b->b_refcount == 0) {
+			buffer_lru_remove(b);
+		}
+		b->b_refcount++;
+		while (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		if (b->b_inflight) {
+			/* A read-ahead is on its way in; wait for it. */
+			b->b_busy = true;
+			lock_release(buffer_lock);
+			dev->d_wait(dev, &b->b_req);
+			lock_acquire(buffer_lock);
+			buffer_prefetch_finish(b);
+		}
+		if (b->b_prefetched) {
+			b->b_prefetched = false;
+			buffer_stats.prefetchhits++;
+		}
+	}
+	else {
+		buffer_stats.misses++;
+		b = buffer_alloc(dev->d_blocksize);
+		if (b == NULL) {
+			lock_release(buffer_lock);
+			return ENOMEM;
+		}
+		buffer_setup(b, dev, block);
+	}
+	b->b_busy = true;
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * The syncer thread. Once a second, write back buffers that have been
+ * dirty too long, and if too many are dirty, the oldest of the rest,
+ * BUFFER_BATCH at a time.
+ */
+static
+void
+buffer_syncer(void *unused1, unsigned long unused2)
+{
+	struct buf *batch[BUFFER_BATCH];
+	struct buf *b;
+	time_t now;
+	uint32_t nsecs;
+	unsigned ticks = 0, budget, n;
+	bool pressure;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(1);
+
+		lock_acquire(buffer_lock);
+		gettime(&now, &nsecs);
+		pressure = buffer_ndirty > BUFFER_DIRTYHIGH(buffer_max);
+		/* Don't go around forever if writes keep failing. */
+		budget = buffer_ndirty;
+		while (budget > 0) {
+			n = 0;
+			for (b = buffer_dirtyhead;
+			     b != NULL && n < BUFFER_BATCH && n < budget;
+			     b = b->b_dirtynext) {
+				if (now - b->b_dirtytime < BUFFER_DIRTYAGE &&
+				    (!pressure || buffer_ndirty - n <=
+				     BUFFER_DIRTYLOW(buffer_max))) {
+					break;
+				}
+				if (!b->b_busy && !b->b_pinned) {
+					batch[n++] = b;
+				}
+			}
+			if (n == 0) {
+				break;
+			}
+			budget -= n;
+			buffer_stats.syncerwrites +=
+				buffer_clean_batch(batch, n, &result);
+		}
+		lock_release(buffer_lock);
+
+		if (++ticks >= BUFFER_SYNCINTERVAL) {
+			ticks = 0;
+			vfs_sync();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+buffer_bootstrap(void)
+{
+	unsigned i;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer: Could not create cv\n");
+	}
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		buffer_hash[i] = NULL;
+	}
+	buffer_lruhead = buffer_lrutail = NULL;
+	buffer_dirtyhead = buffer_dirtytail = NULL;
+	buffer_ndirty = 0;
+	buffer_inflight = NULL;
+	buffer_ninflight = 0;
+	buffer_count = 0;
+	/* Budget in terms of the usual (512-byte) block. */
+	buffer_max = BUFFER_MAXMEM / 512;
+	bzero(&buffer_stats, sizeof(buffer_stats));
+
+	if (thread_fork("syncer", NULL, buffer_syncer, NULL, 0)) {
+		panic("buffer: Could not start syncer thread\n");
+	}
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_acquire(dev, block, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = buffer_io(b, UIO_READ);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_acquire(dev, block, ret);
+}
+
+/*
+ * Start reading a block into the cache in the background, if it isn't
+ * there already. This is only a hint: if the device can't queue I/O,
+ * too many read-aheads are outstanding, or the cache is full of
+ * buffers in use, nothing happens.
+ */
+void
+buffer_prefetch(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	if (dev->d_submit == NULL) {
+		return;
+	}
+
+	lock_acquire(buffer_lock);
+	buffer_reap(NULL);
+	if (buffer_find(dev, block) != NULL ||
+	    buffer_ninflight >= BUFFER_MAXPREFETCH(buffer_max) ||
+	    (buffer_count >= buffer_max && buffer_lruhead == NULL)) {
+		lock_release(buffer_lock);
+		return;
+	}
+	b = buffer_alloc(dev->d_blocksize);
+	if (b == NULL) {
+		lock_release(buffer_lock);
+		return;
+	}
+	/* The reference from buffer_setup belongs to the I/O. */
+	buffer_setup(b, dev, block);
+	b->b_inflight = true;
+	b->b_inflightnext = buffer_inflight;
+	buffer_inflight = b;
+	buffer_ninflight++;
+	buffer_stats.prefetches++;
+
+	/* This doesn't sleep; the result is collected by buffer_reap. */
+	buffer_io_start(b, &b->b_req, UIO_READ);
+	lock_release(buffer_lock);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		lock_acquire(buffer_lock);
+		buffer_set_dirty(b);
+		lock_release(buffer_lock);
+	}
+}
+
+/*
+ * Pin a buffer: mark it dirty, but keep it from being written back
+ * until buffer_unpin.
+ */
+void
+buffer_pin(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	lock_acquire(buffer_lock);
+	buffer_set_dirty(b);
+	b->b_pinned = true;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_unpin(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	lock_acquire(buffer_lock);
+	b->b_pinned = false;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	buffer_unref(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	b = buffer_find(dev, block);
+	if (b != NULL && b->b_refcount == 0) {
+		b->b_valid = false;
+		b->b_pinned = false;
+		buffer_set_clean(b);
+		buffer_lru_remove(b);
+		b->b_lrunext = buffer_lruhead;
+		if (buffer_lruhead != NULL) {
+			buffer_lruhead->b_lruprev = b;
+		}
+		else {
+			buffer_lrutail = b;
+		}
+		buffer_lruhead = b;
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back the dirty buffers of DEV. Buffers that are busy are
+ * skipped, since their holders may be in the middle of changing
+ * them; they will be picked up next time. So are pinned buffers.
+ * Stops at the first error.
+ */
+int
+buffer_sync_device(struct device *dev)
+{
+	struct buf *batch[BUFFER_BATCH];
+	struct buf *b;
+	unsigned n;
+	int result;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		n = 0;
+		for (b = buffer_dirtyhead; b != NULL && n < BUFFER_BATCH;
+		     b = b->b_dirtynext) {
+			if (b->b_dev == dev && !b->b_busy && !b->b_pinned) {
+				batch[n++] = b;
+			}
+		}
+		if (n == 0) {
+			break;
+		}
+		buffer_clean_batch(batch, n, &result);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Write back one block of DEV now, if it is cached and dirty, waiting
+ * for it if someone has it busy. For fsync. A pinned block is left
+ * alone.
+ */
+int
+buffer_sync_block(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	b = buffer_find(dev, block);
+	if (b == NULL || !b->b_dirty) {
+		lock_release(buffer_lock);
+		return 0;
+	}
+	/* hold a reference so it can't be evicted while we wait */
+	if (b->b_refcount == 0) {
+		buffer_lru_remove(b);
+	}
+	b->b_refcount++;
+	while (b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	result = 0;
+	if (b->b_dirty && !b->b_pinned) {
+		buffer_clean_batch(&b, 1, &result);
+	}
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		buffer_lru_append(b);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write back and free every buffer of DEV. Nobody may be holding any
+ * of them.
+ */
+int
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b, **pp;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+	buffer_reap(dev);
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		pp = &buffer_hash[i];
+		while ((b = *pp) != NULL) {
+			if (b->b_dev != dev) {
+				pp = &b->b_hashnext;
+				continue;
+			}
+			KASSERT(b->b_refcount == 0);
+			KASSERT(!b->b_pinned);
+			if (b->b_dirty) {
+				result = buffer_writeback(b);
+				if (result) {
+					lock_release(buffer_lock);
+					return result;
+				}
+			}
+			*pp = b->b_hashnext;
+			buffer_lru_remove(b);
+			kfree(b->b_data);
+			kfree(b);
+			buffer_count--;
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_printstats(void)
+{
+	unsigned lookups;
+
+	lock_acquire(buffer_lock);
+	lookups = buffer_stats.hits + buffer_stats.misses;
+	kprintf("Buffer cache: %u buffers (budget %u)\n",
+		buffer_count, buffer_max);
+	kprintf("  lookups %u: hits %u, misses %u (%u%% hit rate)\n",
+		lookups, buffer_stats.hits, buffer_stats.misses,
+		lookups ? buffer_stats.hits * 100 / lookups : 0);
+	kprintf("  disk reads %u, disk writes %u, evictions %u\n",
+		buffer_stats.reads, buffer_stats.writes,
+		buffer_stats.evictions);
+	kprintf("  dirty now %u, written back by syncer %u\n",
+		buffer_ndirty, buffer_stats.syncerwrites);
+	kprintf("  read-aheads %u: used %u (%u%%), wasted %u, "
+		"in flight %u\n",
+		buffer_stats.prefetches, buffer_stats.prefetchhits,
+		buffer_stats.prefetches ?
+		buffer_stats.prefetchhits * 100 / buffer_stats.prefetches : 0,
+		buffer_stats.prefetchwasted, buffer_ninflight);
+	lock_release(buffer_lock);
+}
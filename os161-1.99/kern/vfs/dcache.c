@@ -0,0 +1,353 @@
+/*
+ * Directory name lookup cache. See dcache.h for the interface.
+ *
+ * Entries live in a fixed table, hashed by (directory, name), and on
+ * an LRU list that also holds the unused entries (at the front, so
+ * they are used first). Everything is protected by dcache_lock, a
+ * spinlock, since nothing here needs to sleep. Vnode references are
+ * taken before the lock is acquired and dropped after it is released,
+ * because dropping the last reference to a vnode calls into its
+ * filesystem.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <dcache.h>
+
+#define DCACHE_HASHSIZE  64
+
+struct dcentry {
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lruprev;	/* LRU list links */
+	struct dcentry *dc_lrunext;
+	struct vnode *dc_dir;		/* directory, or NULL if unused */
+	struct vnode *dc_vn;		/* what NAME is, or NULL if nothing */
+	char dc_name[DCACHE_NAMELEN];
+};
+
+static struct spinlock dcache_lock;
+static struct dcentry dcache_table[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+
+static struct {
+	unsigned hits;		/* found a vnode */
+	unsigned neghits;	/* found that the name doesn't exist */
+	unsigned misses;	/* had to ask the filesystem */
+	unsigned skipped;	/* names we don't cache */
+	unsigned invalidations;	/* entries dropped because of a change */
+} dcache_stats;
+
+////////////////////////////////////////////////////////////
+//
+// Internal bookkeeping
+
+/*
+ * Names we cache: a single path component that fits in an entry, and
+ * not "." or "..", whose meaning depends on more than the directory.
+ * (vfs_lookup walks paths one component at a time, so the check for
+ * a slash is only a safeguard.)
+ */
+static
+bool
+dcache_cacheable(const char *name)
+{
+	if (strlen(name) >= DCACHE_NAMELEN || strchr(name, '/') != NULL) {
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	return true;
+}
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name != 0) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	for (dc = dcache_hash[dcache_hashfn(dir, name)]; dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lruprev = dc->dc_lrunext = NULL;
+}
+
+static
+void
+dcache_lru_append(struct dcentry *dc)
+{
+	dc->dc_lrunext = NULL;
+	dc->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = dc;
+	}
+	else {
+		dcache_lruhead = dc;
+	}
+	dcache_lrutail = dc;
+}
+
+static
+void
+dcache_lru_prepend(struct dcentry *dc)
+{
+	dc->dc_lruprev = NULL;
+	dc->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = dc;
+	}
+	else {
+		dcache_lrutail = dc;
+	}
+	dcache_lruhead = dc;
+}
+
+/*
+ * Take an entry out of use, handing back the references it held for
+ * the caller to drop once dcache_lock is released.
+ */
+static
+void
+dcache_clear(struct dcentry *dc, struct vnode **dirp, struct vnode **vnp)
+{
+	struct dcentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&dcache_lock));
+	KASSERT(dc->dc_dir != NULL);
+
+	pp = &dcache_hash[dcache_hashfn(dc->dc_dir, dc->dc_name)];
+	while (*pp != dc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->dc_hashnext;
+	}
+	*pp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+
+	*dirp = dc->dc_dir;
+	*vnp = dc->dc_vn;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+
+	dcache_lru_remove(dc);
+	dcache_lru_prepend(dc);
+}
+
+/*
+ * Drop the references dcache_clear handed back.
+ */
+static
+void
+dcache_putrefs(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_init(&dcache_lock);
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_table[i].dc_hashnext = NULL;
+		dcache_table[i].dc_dir = NULL;
+		dcache_table[i].dc_vn = NULL;
+		dcache_lru_append(&dcache_table[i]);
+	}
+	bzero(&dcache_stats, sizeof(dcache_stats));
+}
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+
+	if (!dcache_cacheable(name)) {
+		spinlock_acquire(&dcache_lock);
+		dcache_stats.skipped++;
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		dcache_stats.misses++;
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	dcache_lru_remove(dc);
+	dcache_lru_append(dc);
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+		dcache_stats.hits++;
+	}
+	else {
+		dcache_stats.neghits++;
+	}
+	*ret = dc->dc_vn;
+	spinlock_release(&dcache_lock);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned h;
+
+	if (!dcache_cacheable(name)) {
+		return;
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		dc = dcache_lruhead;
+	}
+	if (dc->dc_dir != NULL) {
+		dcache_clear(dc, &olddir, &oldvn);
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	strcpy(dc->dc_name, name);
+	h = dcache_hashfn(dir, name);
+	dc->dc_hashnext = dcache_hash[h];
+	dcache_hash[h] = dc;
+	dcache_lru_remove(dc);
+	dcache_lru_append(dc);
+	spinlock_release(&dcache_lock);
+
+	dcache_putrefs(olddir, oldvn);
+}
+
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (!dcache_cacheable(name)) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc != NULL) {
+		dcache_clear(dc, &olddir, &oldvn);
+		dcache_stats.invalidations++;
+	}
+	spinlock_release(&dcache_lock);
+
+	dcache_putrefs(olddir, oldvn);
+}
+
+/*
+ * Drop every entry whose directory is on FS. (The vnodes entries
+ * point to are always on the same filesystem as the directory.)
+ * Entries are cleared one at a time, since dropping a reference can
+ * call into the filesystem.
+ */
+void
+dcache_purge_fs(struct fs *fs)
+{
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	for (i=0; i<DCACHE_SIZE; i++) {
+		olddir = oldvn = NULL;
+		spinlock_acquire(&dcache_lock);
+		if (dcache_table[i].dc_dir != NULL &&
+		    dcache_table[i].dc_dir->vn_fs == fs) {
+			dcache_clear(&dcache_table[i], &olddir, &oldvn);
+		}
+		spinlock_release(&dcache_lock);
+		dcache_putrefs(olddir, oldvn);
+	}
+}
+
+void
+dcache_printstats(void)
+{
+	unsigned lookups, used = 0, negative = 0, i;
+
+	spinlock_acquire(&dcache_lock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache_table[i].dc_dir != NULL) {
+			used++;
+			if (dcache_table[i].dc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	spinlock_release(&dcache_lock);
+
+	/* (the counters may be a little inconsistent; never mind) */
+	lookups = dcache_stats.hits + dcache_stats.neghits +
+		dcache_stats.misses;
+	kprintf("Name cache: %u of %u entries in use (%u negative)\n",
+		used, DCACHE_SIZE, negative);
+	kprintf("  lookups %u: hits %u, negative hits %u, misses %u "
+		"(%u%% hit rate)\n", lookups, dcache_stats.hits,
+		dcache_stats.neghits, dcache_stats.misses,
+		lookups ? (dcache_stats.hits + dcache_stats.neghits) * 100 /
+		lookups : 0);
+	kprintf("  not cacheable %u, invalidations %u\n",
+		dcache_stats.skipped, dcache_stats.invalidations);
+}
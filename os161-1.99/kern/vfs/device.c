@@ -241,15 +241,16 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Devices can't be mapped: the VM system pages through
+ * vop_read and vop_write, which makes no sense for the console or
+ * the random device, and nobody needs to map a raw disk.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return ENODEV;
 }
 
 /*
@@ -421,6 +422,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_read,
 	null_io,      /* readlink */
 	null_io,      /* getdirentry */
+	null_io,      /* getdirentries */
 	dev_write,
 	dev_ioctl,
 	dev_stat,
@@ -0,0 +1,673 @@
+/*
+ * Anonymous pipes. See pipe.h.
+ *
+ * Data normally goes through a one-page ring buffer: the writer copies
+ * in, the reader copies out. A large blocking write from user space
+ * instead loans its own pages to the pipe: the writer pins them, posts
+ * their physical addresses, and sleeps until readers have copied the
+ * data straight out of them (through the direct-mapped kernel segment)
+ * into their own buffers. That is one copy instead of two, and the
+ * writer sleeps just as it would have waiting for buffer space. Only
+ * one loan is posted at a time.
+ *
+ * Locking: pp_lock protects the pipe's state and goes with the two
+ * condition variables. It is never held while copying to or from user
+ * space, since a fault there can lead into the file system (through a
+ * file mapping) while another thread is closing an end of this pipe
+ * from inside the VFS layer. Instead, pp_rlock lets only one reader
+ * and pp_wlock only one writer copy at a time; a reader only ever
+ * touches the filled part of the ring and a writer the empty part, so
+ * they can copy at the same time. Both are released while sleeping,
+ * so that a non-blocking caller is never held up by a blocked one.
+ * The order is pp_rlock or pp_wlock, then pp_lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ioctl.h>
+#include <stat.h>
+#include <lib.h>
+#include <limits.h>
+#include <uio.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <vnode.h>
+#include <pipe.h>
+#include "opt-A3.h"
+
+#define PIPE_SIZE	PAGE_SIZE	/* ring buffer size */
+#define PIPE_LOANPAGES	16		/* most pages loaned at once */
+
+#define PIPE_READ	0
+#define PIPE_WRITE	1
+
+struct pipe;
+
+struct pipeend {
+	struct vnode pe_vnode;
+	struct pipe *pe_pipe;
+	bool pe_open;			/* not closed yet */
+	bool pe_nonblock;		/* FIONBIO */
+};
+
+struct pipe {
+	struct lock *pp_lock;		/* protects the fields below */
+	struct cv *pp_datacv;		/* readers wait here for data */
+	struct cv *pp_spacecv;		/* writers wait here for space */
+	struct lock *pp_rlock;		/* one reader copying at a time */
+	struct lock *pp_wlock;		/* one writer copying at a time */
+
+	char *pp_buf;			/* ring buffer */
+	size_t pp_start;		/* offset of the first unread byte */
+	size_t pp_count;		/* bytes in the ring */
+
+	bool pp_loaned;			/* a loan is posted */
+	paddr_t pp_loanpages[PIPE_LOANPAGES];
+	size_t pp_loanpos;		/* next unread byte, from page 0 */
+	size_t pp_loanresid;		/* loaned bytes not yet read */
+
+	struct pipeend pp_ends[2];	/* PIPE_READ, PIPE_WRITE */
+	unsigned pp_nends;		/* ends not yet reclaimed */
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	if (pp->pp_buf != NULL) {
+		kfree(pp->pp_buf);
+	}
+	if (pp->pp_wlock != NULL) {
+		lock_destroy(pp->pp_wlock);
+	}
+	if (pp->pp_rlock != NULL) {
+		lock_destroy(pp->pp_rlock);
+	}
+	if (pp->pp_spacecv != NULL) {
+		cv_destroy(pp->pp_spacecv);
+	}
+	if (pp->pp_datacv != NULL) {
+		cv_destroy(pp->pp_datacv);
+	}
+	if (pp->pp_lock != NULL) {
+		lock_destroy(pp->pp_lock);
+	}
+	kfree(pp);
+}
+
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *pp;
+	int i;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_lock = lock_create("pipe");
+	pp->pp_datacv = cv_create("pipedata");
+	pp->pp_spacecv = cv_create("pipespace");
+	pp->pp_rlock = lock_create("piperead");
+	pp->pp_wlock = lock_create("pipewrite");
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	if (pp->pp_lock == NULL || pp->pp_datacv == NULL ||
+	    pp->pp_spacecv == NULL || pp->pp_rlock == NULL ||
+	    pp->pp_wlock == NULL || pp->pp_buf == NULL) {
+		pipe_destroy(pp);
+		return ENOMEM;
+	}
+	pp->pp_start = 0;
+	pp->pp_count = 0;
+	pp->pp_loaned = false;
+	pp->pp_loanpos = 0;
+	pp->pp_loanresid = 0;
+
+	for (i=0; i<2; i++) {
+		VOP_INIT(&pp->pp_ends[i].pe_vnode, &pipe_vnode_ops, NULL,
+			 &pp->pp_ends[i]);
+		VOP_INCOPEN(&pp->pp_ends[i].pe_vnode);
+		pp->pp_ends[i].pe_pipe = pp;
+		pp->pp_ends[i].pe_open = true;
+		pp->pp_ends[i].pe_nonblock = false;
+	}
+	pp->pp_nends = 2;
+
+	*readend = &pp->pp_ends[PIPE_READ].pe_vnode;
+	*writeend = &pp->pp_ends[PIPE_WRITE].pe_vnode;
+	return 0;
+}
+
+/*
+ * Sleep on CV, letting go of COPYLOCK (pp_rlock or pp_wlock) as well
+ * as pp_lock in the meantime. Returns with both held again.
+ */
+static
+void
+pipe_wait(struct pipe *pp, struct cv *cv, struct lock *copylock)
+{
+	lock_release(copylock);
+	cv_wait(cv, pp->pp_lock);
+	lock_release(pp->pp_lock);
+	lock_acquire(copylock);
+	lock_acquire(pp->pp_lock);
+}
+
+/*
+ * Called on the last close of an end.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+
+	lock_acquire(pp->pp_lock);
+	pe->pe_open = false;
+	cv_broadcast(pp->pp_datacv, pp->pp_lock);
+	cv_broadcast(pp->pp_spacecv, pp->pp_lock);
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+/*
+ * Called when the last reference to an end goes away. The pipe goes
+ * with the second end.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+	bool last;
+
+	lock_acquire(pp->pp_lock);
+	KASSERT(!pe->pe_open);
+	VOP_CLEANUP(v);
+	KASSERT(pp->pp_nends > 0);
+	pp->pp_nends--;
+	last = pp->pp_nends == 0;
+	lock_release(pp->pp_lock);
+
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+	size_t start, count, n, first, moved;
+	size_t loanpos, loanresid;
+	vaddr_t kva;
+	int result;
+
+	if (pe != &pp->pp_ends[PIPE_READ]) {
+		return EBADF;
+	}
+	KASSERT(uio->uio_rw == UIO_READ);
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	lock_acquire(pp->pp_rlock);
+	lock_acquire(pp->pp_lock);
+	while (pp->pp_count == 0 && pp->pp_loanresid == 0) {
+		if (!pp->pp_ends[PIPE_WRITE].pe_open) {
+			/* EOF */
+			lock_release(pp->pp_lock);
+			lock_release(pp->pp_rlock);
+			return 0;
+		}
+		if (pe->pe_nonblock) {
+			lock_release(pp->pp_lock);
+			lock_release(pp->pp_rlock);
+			return EAGAIN;
+		}
+		pipe_wait(pp, pp->pp_datacv, pp->pp_rlock);
+	}
+	start = pp->pp_start;
+	count = pp->pp_count;
+	loanpos = pp->pp_loanpos;
+	loanresid = pp->pp_loanresid;
+	lock_release(pp->pp_lock);
+
+	/* The ring first; anything in it was written before the loan. */
+	result = 0;
+	n = count < uio->uio_resid ? count : uio->uio_resid;
+	first = n < PIPE_SIZE - start ? n : PIPE_SIZE - start;
+	moved = uio->uio_resid;
+	if (first > 0) {
+		result = uiomove(pp->pp_buf + start, first, uio);
+	}
+	if (result == 0 && n > first) {
+		result = uiomove(pp->pp_buf, n - first, uio);
+	}
+	moved -= uio->uio_resid;
+
+	lock_acquire(pp->pp_lock);
+	pp->pp_start = (pp->pp_start + moved) % PIPE_SIZE;
+	pp->pp_count -= moved;
+	lock_release(pp->pp_lock);
+
+	/* Then straight out of the writer's pages. */
+	moved = 0;
+	while (result == 0 && n == count && uio->uio_resid > 0 &&
+	       moved < loanresid) {
+		kva = PADDR_TO_KVADDR(pp->pp_loanpages[loanpos / PAGE_SIZE]);
+		first = PAGE_SIZE - loanpos % PAGE_SIZE;
+		if (first > loanresid - moved) {
+			first = loanresid - moved;
+		}
+		if (first > uio->uio_resid) {
+			first = uio->uio_resid;
+		}
+		result = uiomove((char *)kva + loanpos % PAGE_SIZE, first, uio);
+		if (result == 0) {
+			loanpos += first;
+			moved += first;
+		}
+	}
+
+	lock_acquire(pp->pp_lock);
+	if (moved > 0) {
+		pp->pp_loanpos = loanpos;
+		pp->pp_loanresid -= moved;
+	}
+	cv_broadcast(pp->pp_spacecv, pp->pp_lock);
+	lock_release(pp->pp_lock);
+	lock_release(pp->pp_rlock);
+	return result;
+}
+
+#if OPT_A3
+/*
+ * Loan (part of) the next piece of UIO, which must be in user space,
+ * to readers and wait for them to take it; then advance UIO past
+ * whatever they took. Called with pp_wlock and pp_lock held and no
+ * loan posted; returns with them held. Clears *CANLOAN if the pages
+ * cannot be pinned, in which case the caller should copy instead.
+ */
+static
+int
+pipe_loan(struct pipe *pp, struct uio *uio, bool *canloan)
+{
+	struct iovec *iov;
+	vaddr_t base;
+	size_t off, len, moved;
+	unsigned npages, i, j;
+
+	KASSERT(!pp->pp_loaned);
+
+	while (uio->uio_iov->iov_len == 0) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+		KASSERT(uio->uio_iovcnt > 0);
+	}
+	iov = uio->uio_iov;
+	base = (vaddr_t)iov->iov_ubase;
+	off = base % PAGE_SIZE;
+	len = iov->iov_len;
+	if (len > PIPE_LOANPAGES * PAGE_SIZE - off) {
+		len = PIPE_LOANPAGES * PAGE_SIZE - off;
+	}
+	npages = DIVROUNDUP(off + len, PAGE_SIZE);
+
+	for (i=0; i<npages; i++) {
+		if (vm_pinpage(base - off + i * PAGE_SIZE,
+			       &pp->pp_loanpages[i])) {
+			break;
+		}
+	}
+	if (i == 0) {
+		*canloan = false;
+		return 0;
+	}
+	if (i < npages) {
+		len = i * PAGE_SIZE - off;
+	}
+
+	pp->pp_loaned = true;
+	pp->pp_loanpos = off;
+	pp->pp_loanresid = len;
+	cv_broadcast(pp->pp_datacv, pp->pp_lock);
+
+	/* Other writers can use the ring meanwhile. */
+	lock_release(pp->pp_wlock);
+	while (pp->pp_loanresid > 0 && pp->pp_ends[PIPE_READ].pe_open) {
+		cv_wait(pp->pp_spacecv, pp->pp_lock);
+	}
+	lock_release(pp->pp_lock);
+	lock_acquire(pp->pp_wlock);
+	lock_acquire(pp->pp_lock);
+
+	moved = len - pp->pp_loanresid;
+	for (j=0; j<i; j++) {
+		vm_unpinpage(pp->pp_loanpages[j]);
+	}
+	pp->pp_loaned = false;
+	pp->pp_loanresid = 0;
+	cv_broadcast(pp->pp_spacecv, pp->pp_lock);
+
+	iov->iov_ubase += moved;
+	iov->iov_len -= moved;
+	uio->uio_resid -= moved;
+	uio->uio_offset += moved;
+	return 0;
+}
+#endif
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+	size_t len, space, need, end, n, first, moved;
+	bool atomic, canloan;
+	int result;
+
+	if (pe != &pp->pp_ends[PIPE_WRITE]) {
+		return EBADF;
+	}
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	len = uio->uio_resid;
+	atomic = len <= PIPE_BUF;
+#if OPT_A3
+	canloan = uio->uio_segflg == UIO_USERSPACE;
+#else
+	canloan = false;
+#endif
+	result = 0;
+
+	lock_acquire(pp->pp_wlock);
+	lock_acquire(pp->pp_lock);
+	while (uio->uio_resid > 0) {
+		if (!pp->pp_ends[PIPE_READ].pe_open) {
+			result = EPIPE;
+			break;
+		}
+#if OPT_A3
+		if (canloan && !pe->pe_nonblock && uio->uio_resid > PAGE_SIZE) {
+			if (pp->pp_loaned) {
+				pipe_wait(pp, pp->pp_spacecv, pp->pp_wlock);
+				continue;
+			}
+			result = pipe_loan(pp, uio, &canloan);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+#endif
+
+		/* Small writes wait until they fit in one piece. */
+		space = PIPE_SIZE - pp->pp_count;
+		need = atomic ? uio->uio_resid : 1;
+		if (space < need) {
+			if (pe->pe_nonblock) {
+				result = EAGAIN;
+				break;
+			}
+			pipe_wait(pp, pp->pp_spacecv, pp->pp_wlock);
+			continue;
+		}
+		end = (pp->pp_start + pp->pp_count) % PIPE_SIZE;
+		lock_release(pp->pp_lock);
+
+		n = space < uio->uio_resid ? space : uio->uio_resid;
+		first = n < PIPE_SIZE - end ? n : PIPE_SIZE - end;
+		moved = uio->uio_resid;
+		result = uiomove(pp->pp_buf + end, first, uio);
+		if (result == 0 && n > first) {
+			result = uiomove(pp->pp_buf, n - first, uio);
+		}
+		moved -= uio->uio_resid;
+
+		lock_acquire(pp->pp_lock);
+		pp->pp_count += moved;
+		cv_broadcast(pp->pp_datacv, pp->pp_lock);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(pp->pp_lock);
+	lock_release(pp->pp_wlock);
+
+	/* A short write is a success. */
+	if ((result == EPIPE || result == EAGAIN) && uio->uio_resid < len) {
+		result = 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+	int on, result;
+
+	switch (op) {
+	    case FIONBIO:
+		result = copyin(data, &on, sizeof(on));
+		if (result) {
+			return result;
+		}
+		lock_acquire(pp->pp_lock);
+		pe->pe_nonblock = on != 0;
+		lock_release(pp->pp_lock);
+		return 0;
+	}
+	return EIOCTL;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipeend *pe = v->vn_data;
+	struct pipe *pp = pe->pe_pipe;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_SIZE;
+
+	lock_acquire(pp->pp_lock);
+	statbuf->st_size = pp->pp_count + pp->pp_loanresid;
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+/*
+ * Pipes are not opened by name and have no directory operations.
+ * These cover the rest of the table.
+ */
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	(void)v;
+	(void)flags;
+	return EINVAL;
+}
+
+static
+int
+pipe_io(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return EINVAL;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v, const char *n1, struct vnode *v2, const char *n2)
+{
+	(void)v;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *path, struct vnode **result)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *path, struct vnode **result,
+		char *buf, size_t len)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_io,      /* readlink */
+	pipe_io,      /* getdirentry */
+	pipe_io,      /* getdirentries */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_io,      /* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,  /* remove */
+	pipe_nameop,  /* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
@@ -35,10 +35,12 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <stat.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 static struct vnode *bootfs_vnode = NULL;
 
@@ -223,6 +225,84 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up one path component NAME in directory DIR, through the name
+ * cache.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **retval)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (dcache_lookup(dir, name, retval)) {
+		return (*retval == NULL) ? ENOENT : 0;
+	}
+	result = VOP_LOOKUP(dir, name, retval);
+	if (result == 0) {
+		dcache_enter(dir, name, *retval);
+	}
+	else if (result == ENOENT) {
+		dcache_enter(dir, name, NULL);
+	}
+	return result;
+}
+
+/*
+ * Translate relative PATH starting from STARTVN, one component at a
+ * time, so that every directory along the way gets a name cache
+ * entry and the invalidations in vfspath.c, which are per (directory,
+ * name), cover them all. PATH is chopped up in the process. Empty
+ * components (from doubled slashes) are skipped; a trailing slash
+ * requires the result to be a directory.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, struct vnode **retval)
+{
+	struct vnode *dir, *vn;
+	char *next;
+	mode_t type;
+	int result;
+
+	VOP_INCREF(startvn);
+	dir = startvn;
+	while (1) {
+		next = strchr(path, '/');
+		if (next != NULL) {
+			*next++ = 0;
+		}
+		if (*path != 0) {
+			result = lookup_component(dir, path, &vn);
+			VOP_DECREF(dir);
+			if (result) {
+				return result;
+			}
+			dir = vn;
+		}
+		if (next == NULL) {
+			break;
+		}
+		if (*next == 0) {
+			/* trailing slash */
+			result = VOP_GETTYPE(dir, &type);
+			if (result == 0 && type != S_IFDIR) {
+				result = ENOTDIR;
+			}
+			if (result) {
+				VOP_DECREF(dir);
+				return result;
+			}
+			break;
+		}
+		path = next;
+	}
+	*retval = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -232,7 +312,8 @@ int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *last;
 	int result;
 
 	vfs_biglock_acquire();
@@ -243,6 +324,7 @@ vfs_lookparent(char *path, struct vnode **retval,
 		return result;
 	}
 
+	last = strrchr(path, '/');
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -251,9 +333,20 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 */
 		result = EINVAL;
 	}
-	else {
+	else if (last == NULL || last[1] == 0) {
+		/* a bare name, or a trailing slash: leave it to the fs */
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
 	}
+	else {
+		/* walk the directory part through the cache */
+		*last++ = 0;
+		result = lookup_walk(startvn, path, &dir);
+		if (result == 0) {
+			result = VOP_LOOKPARENT(dir, last, retval,
+						buf, buflen);
+			VOP_DECREF(dir);
+		}
+	}
 
 	VOP_DECREF(startvn);
 
@@ -281,7 +374,7 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, path, retval);
 
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
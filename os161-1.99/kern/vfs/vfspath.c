@@ -38,6 +38,16 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <dcache.h>
+#include <vm.h>
+#include "opt-A3.h"
+
+/*
+ * Operations that change a name invalidate it in the name cache
+ * while still holding vfs_biglock, which vfs_lookup also holds from
+ * its cache miss until it has entered the result. Otherwise a lookup
+ * racing with, say, a create could cache a stale negative entry.
+ */
 
 
 /* Does most of the work for open(). */
@@ -73,7 +83,12 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 			return result;
 		}
 
+		vfs_biglock_acquire();
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			dcache_invalidate(dir, name);
+		}
+		vfs_biglock_release();
 
 		VOP_DECREF(dir);
 	}
@@ -101,6 +116,11 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 		else {
 			result = VOP_TRUNCATE(vn, 0);
+#if OPT_A3
+			if (result == 0) {
+				vm_filetruncate(vn, 0);
+			}
+#endif
 		}
 		if (result) {
 			VOP_DECOPEN(vn);
@@ -149,7 +169,12 @@ vfs_remove(char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		dcache_invalidate(dir, name);
+	}
+	vfs_biglock_release();
 	VOP_DECREF(dir);
 
 	return result;
@@ -182,7 +207,13 @@ vfs_rename(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		dcache_invalidate(olddir, oldname);
+		dcache_invalidate(newdir, newname);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -216,7 +247,12 @@ vfs_link(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		dcache_invalidate(newdir, newname);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -243,7 +279,12 @@ vfs_symlink(const char *contents, char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		dcache_invalidate(newdir, newname);
+	}
+	vfs_biglock_release();
 	VOP_DECREF(newdir);
 
 	return result;
@@ -289,7 +330,12 @@ vfs_mkdir(char *path, mode_t mode)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		dcache_invalidate(parent, name);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(parent);
 
@@ -311,7 +357,12 @@ vfs_rmdir(char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		dcache_invalidate(parent, name);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(parent);
 
@@ -34,6 +34,7 @@
 #include <thread.h>
 #include <current.h>
 #include <vm.h>
+#include <uio.h>
 #include <copyinout.h>
 
 /*
@@ -142,26 +143,61 @@ copycheck(const_userptr_t userptr, size_t len, size_t *stoplen)
 	return 0;
 }
 
+/*
+ * Largest object handled by the small-object fast path in copyin and
+ * copyout. This covers the ints, pointers, and small structs that
+ * make up most system call arguments.
+ */
+#define COPY_SMALL 64
+
+/*
+ * Copy a small object of length LEN. Word-sized, word-aligned objects
+ * (the common case: an int or a pointer) are moved with a single load
+ * and store; anything else goes through memcpy.
+ */
+static
+void
+copysmall(void *dest, const void *src, size_t len)
+{
+	if (len == sizeof(uint32_t) &&
+	    (((vaddr_t)dest | (vaddr_t)src) & (sizeof(uint32_t)-1)) == 0) {
+		*(uint32_t *)dest = *(const uint32_t *)src;
+	}
+	else {
+		memcpy(dest, src, len);
+	}
+}
+
 /*
  * copyin
  *
  * Copy a block of memory of length LEN from user-level address USERSRC 
  * to kernel address DEST. We can use memcpy because it's protected by
  * the tm_badfaultfunc/copyfail logic.
+ *
+ * Small objects lying entirely below USERSPACETOP - COPY_SMALL cannot
+ * wrap around or overlap the kernel, so for them the range check
+ * reduces to a single comparison and copycheck is skipped.
  */
 int
 copyin(const_userptr_t usersrc, void *dest, size_t len)
 {
 	int result;
 	size_t stoplen;
+	bool small;
 
-	result = copycheck(usersrc, len, &stoplen);
-	if (result) {
-		return result;
-	}
-	if (stoplen != len) {
-		/* Single block, can't legally truncate it. */
-		return EFAULT;
+	small = len <= COPY_SMALL &&
+		(vaddr_t)usersrc < USERSPACETOP - COPY_SMALL;
+
+	if (!small) {
+		result = copycheck(usersrc, len, &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != len) {
+			/* Single block, can't legally truncate it. */
+			return EFAULT;
+		}
 	}
 
 	curthread->t_machdep.tm_badfaultfunc = copyfail;
@@ -172,7 +208,12 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy(dest, (const void *)usersrc, len);
+	if (small) {
+		copysmall(dest, (const void *)usersrc, len);
+	}
+	else {
+		memcpy(dest, (const void *)usersrc, len);
+	}
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
@@ -184,20 +225,28 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
  * Copy a block of memory of length LEN from kernel address SRC to
  * user-level address USERDEST. We can use memcpy because it's
  * protected by the tm_badfaultfunc/copyfail logic.
+ *
+ * Uses the same small-object fast path as copyin.
  */
 int
 copyout(const void *src, userptr_t userdest, size_t len)
 {
 	int result;
 	size_t stoplen;
+	bool small;
 
-	result = copycheck(userdest, len, &stoplen);
-	if (result) {
-		return result;
-	}
-	if (stoplen != len) {
-		/* Single block, can't legally truncate it. */
-		return EFAULT;
+	small = len <= COPY_SMALL &&
+		(vaddr_t)userdest < USERSPACETOP - COPY_SMALL;
+
+	if (!small) {
+		result = copycheck(userdest, len, &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != len) {
+			/* Single block, can't legally truncate it. */
+			return EFAULT;
+		}
 	}
 
 	curthread->t_machdep.tm_badfaultfunc = copyfail;
@@ -208,7 +257,12 @@ copyout(const void *src, userptr_t userdest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy((void *)userdest, src, len);
+	if (small) {
+		copysmall((void *)userdest, src, len);
+	}
+	else {
+		memcpy((void *)userdest, src, len);
+	}
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
@@ -229,15 +283,45 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * hit STOPLEN it's because the string has run into the end of
  * userspace. Thus in the latter case we return EFAULT, not 
  * ENAMETOOLONG.
+ *
+ * When SRC and DEST have the same alignment the bulk of the string
+ * is moved a word at a time, stopping at the first word that contains
+ * a null byte. An aligned word never straddles a page, so this does
+ * not touch any page the byte-at-a-time loop would not also touch.
  */
+
+/* Nonzero if any byte of the 32-bit word W is zero. */
+#define WORD_HASZERO(w) (((w) - 0x01010101U) & ~(w) & 0x80808080U)
+#define WORD_MASK       (sizeof(uint32_t) - 1)
+
 static
 int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
-
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	size_t i, lim;
+	uint32_t w;
+	bool wordok;
+
+	lim = maxlen < stoplen ? maxlen : stoplen;
+	wordok = (((vaddr_t)dest ^ (vaddr_t)src) & WORD_MASK) == 0;
+
+	for (i=0; i<lim; i++) {
+		if (wordok && ((vaddr_t)(src+i) & WORD_MASK) == 0) {
+			while (i + sizeof(uint32_t) <= lim) {
+				w = *(const uint32_t *)(src+i);
+				if (WORD_HASZERO(w)) {
+					break;
+				}
+				*(uint32_t *)(dest+i) = w;
+				i += sizeof(uint32_t);
+			}
+			/* finish the terminating word a byte at a time */
+			wordok = false;
+			if (i >= lim) {
+				break;
+			}
+		}
 		dest[i] = src[i];
 		if (src[i] == 0) {
 			if (gotlen != NULL) {
@@ -319,3 +403,237 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return result;
 }
+
+/*
+ * copyinargv
+ *
+ * Copy a whole null-terminated user argument vector (an array of
+ * string pointers ending in NULL, as passed to execv) into the kernel
+ * buffer KBUF of BUFLEN bytes. The strings are packed back to back,
+ * each with its null terminator. The number of strings is returned in
+ * ARGC and the number of bytes of KBUF used in GOT.
+ *
+ * Unlike calling copyin and copyinstr once per argument, the whole
+ * vector is moved under a single setjmp, and each string is copied
+ * straight into its final place in KBUF with no separate length pass.
+ * KBUF need not be aligned: execv packs the arguments directly after
+ * the program name, and copystr falls back to byte copies whenever
+ * the user string and its destination are not mutually aligned.
+ *
+ * Returns E2BIG if the strings do not fit in BUFLEN bytes.
+ */
+int
+copyinargv(const_userptr_t uargv, char *kbuf, size_t buflen,
+	   int *argc, size_t *got)
+{
+	int result;
+	size_t stoplen, used, len;
+	const_userptr_t *slot;
+	const_userptr_t arg;
+	int n;
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	used = 0;
+	n = 0;
+	slot = (const_userptr_t *)uargv;
+	while (1) {
+		result = copycheck((const_userptr_t)slot, sizeof(*slot),
+				   &stoplen);
+		if (result == 0 && stoplen != sizeof(*slot)) {
+			result = EFAULT;
+		}
+		if (result) {
+			break;
+		}
+		arg = *slot;
+		if (arg == NULL) {
+			break;
+		}
+		if (used == buflen) {
+			result = E2BIG;
+			break;
+		}
+		result = copycheck(arg, buflen - used, &stoplen);
+		if (result) {
+			break;
+		}
+		result = copystr(kbuf + used, (const char *)arg,
+				 buflen - used, stoplen, &len);
+		if (result == ENAMETOOLONG) {
+			result = E2BIG;
+		}
+		if (result) {
+			break;
+		}
+		used += len;
+		n++;
+		slot++;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	if (result) {
+		return result;
+	}
+	*argc = n;
+	*got = used;
+	return 0;
+}
+
+/*
+ * copyoutargv
+ *
+ * Lay out an argument vector on a new user stack. KBUF holds ARGC
+ * packed null-terminated strings totalling LEN bytes, as produced by
+ * copyinargv. The strings are copied to the top of the stack below
+ * *STACKPTR, followed (downwards) by a NULL-terminated array of
+ * pointers to them, aligned to 8 bytes. On success *STACKPTR is
+ * updated to the address of the pointer array, which is both the new
+ * stack pointer and the user-level argv.
+ *
+ * The destination region is checked once and filled with one block
+ * copy for the strings plus one store per pointer.
+ */
+int
+copyoutargv(const char *kbuf, size_t len, int argc, vaddr_t *stackptr)
+{
+	int result, i;
+	size_t stoplen, off;
+	vaddr_t strbase, argvbase;
+	userptr_t *uargv;
+
+	KASSERT(argc >= 0);
+
+	strbase = (*stackptr - len) & ~(vaddr_t)WORD_MASK;
+	argvbase = (strbase - (argc+1) * sizeof(userptr_t)) & ~(vaddr_t)7;
+	if (argvbase > strbase || strbase > *stackptr) {
+		return E2BIG;
+	}
+
+	result = copycheck((userptr_t)argvbase, *stackptr - argvbase,
+			   &stoplen);
+	if (result) {
+		return result;
+	}
+	if (stoplen != *stackptr - argvbase) {
+		return EFAULT;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	memcpy((void *)strbase, kbuf, len);
+
+	uargv = (userptr_t *)argvbase;
+	off = 0;
+	for (i=0; i<argc; i++) {
+		KASSERT(off < len);
+		uargv[i] = (userptr_t)(strbase + off);
+		off += strlen(kbuf + off) + 1;
+	}
+	uargv[argc] = NULL;
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+
+	*stackptr = argvbase;
+	return 0;
+}
+
+/*
+ * copyuio
+ *
+ * The user-space half of uiomove: move up to N bytes between kernel
+ * address PTR and the user buffers of UIO, updating UIO exactly as
+ * uiomove describes.
+ *
+ * Rather than one copyin or copyout (and so one setjmp) per iovec,
+ * the whole transfer runs under a single setjmp, and small pieces use
+ * the small-object copy. A uio made of many small iovecs, as readv
+ * and writev produce, then costs little more than a single buffer.
+ * Each iovec is still range-checked as it is reached.
+ *
+ * On EFAULT, UIO reflects the pieces moved before the bad one.
+ */
+int
+copyuio(void *ptr, size_t n, struct uio *uio)
+{
+	int result;
+	size_t size, stoplen;
+	struct iovec *iov;
+
+	KASSERT(uio->uio_segflg == UIO_USERSPACE ||
+		uio->uio_segflg == UIO_USERISPACE);
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+		if (size > n) {
+			size = n;
+		}
+
+		if (size == 0) {
+			/* move to the next iovec and try again */
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			if (uio->uio_iovcnt == 0) {
+				/* uio_resid was more than the buffers hold */
+				panic("copyuio: ran out of buffers\n");
+			}
+			continue;
+		}
+
+		result = copycheck(iov->iov_ubase, size, &stoplen);
+		if (result == 0 && stoplen != size) {
+			result = EFAULT;
+		}
+		if (result) {
+			break;
+		}
+
+		if (uio->uio_rw == UIO_READ) {
+			if (size <= COPY_SMALL) {
+				copysmall((void *)iov->iov_ubase, ptr, size);
+			}
+			else {
+				memcpy((void *)iov->iov_ubase, ptr, size);
+			}
+		}
+		else {
+			if (size <= COPY_SMALL) {
+				copysmall(ptr, (const void *)iov->iov_ubase, size);
+			}
+			else {
+				memcpy(ptr, (const void *)iov->iov_ubase, size);
+			}
+		}
+
+		iov->iov_ubase += size;
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		ptr = (char *)ptr + size;
+		n -= size;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return result;
+}
@@ -33,6 +33,11 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Zero Frame Mappings",
+ /* 11 */ "Zero Pool Hits",
+ /* 12 */ "Zero Pool Misses",
+ /* 13 */ "Shared Text Attaches",
+ /* 14 */ "Mapped File Reads",
 };
 
 
@@ -47,12 +52,15 @@ vmstats_inc(unsigned int index)
 }
 
 /* ---------------------------------------------------------------------- */
+/* Called once at boot, before anything can be counting. */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
-   */
+  static bool initialized = false;
+
+  KASSERT(!initialized);
+  initialized = true;
+
   spinlock_init(&stats_lock);
 
   spinlock_acquire(&stats_lock);
@@ -60,6 +68,18 @@ vmstats_init(void)
   spinlock_release(&stats_lock);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Zero the counters without touching the lock: the VM system (faults, the
+ * zeroer thread) may be counting at the same time.
+ */
+void
+vmstats_reset(void)
+{
+  spinlock_acquire(&stats_lock);
+    _vmstats_init();
+  spinlock_release(&stats_lock);
+}
+
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_inc(unsigned int index)
@@ -129,6 +149,8 @@ vmstats_print(void)
   }
 
   kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT Zero Pool Hits + Zero Pool Misses = %d\n",
+    stats_counts[VMSTAT_ZERO_POOL_HIT] + stats_counts[VMSTAT_ZERO_POOL_MISS]);
   if (disk_reads != elf_plus_swap_reads) {
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
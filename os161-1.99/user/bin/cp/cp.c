@@ -28,6 +28,7 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -35,29 +36,21 @@
  * Usage: cp oldfile newfile
  */
 
+/* Bytes per copy_file_range call; more just means fewer calls. */
+#define CP_CHUNK	(1024*1024)
 
-/* Copy one file to another. */
+
+/*
+ * Copy the rest of FROMFD to TOFD through a buffer. Used when the
+ * kernel won't do it for us, e.g. when copying from a device.
+ */
 static
 void
-copy(const char *from, const char *to)
+copyloop(int fromfd, const char *from, int tofd, const char *to)
 {
-	int fromfd;
-	int tofd;
 	char buf[1024];
 	int len, wr, wrtot;
 
-	/*
-	 * Open the files, and give up if they won't open
-	 */
-	fromfd = open(from, O_RDONLY);
-	if (fromfd<0) {
-		err(1, "%s", from);
-	}
-	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
-	if (tofd<0) {
-		err(1, "%s", to);
-	}
-
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
 	 * Zero means EOF. Less than zero means an error occurred.
@@ -84,6 +77,45 @@ copy(const char *from, const char *to)
 	if (len<0) {
 		err(1, "%s", from);
 	}
+}
+
+/* Copy one file to another. */
+static
+void
+copy(const char *from, const char *to)
+{
+	int fromfd;
+	int tofd;
+	int len;
+
+	/*
+	 * Open the files, and give up if they won't open
+	 */
+	fromfd = open(from, O_RDONLY);
+	if (fromfd<0) {
+		err(1, "%s", from);
+	}
+	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
+	if (tofd<0) {
+		err(1, "%s", to);
+	}
+
+	/*
+	 * Have the kernel copy the data file to file, without it
+	 * passing through here; a short count just means go around
+	 * again, and zero means EOF. If the kernel can't do it for
+	 * these files (EINVAL), copy it ourselves.
+	 */
+	while ((len = copy_file_range(fromfd, NULL, tofd, NULL,
+				      CP_CHUNK, 0)) > 0) {
+		/* nothing */
+	}
+	if (len<0 && errno == EINVAL) {
+		copyloop(fromfd, from, tofd, to);
+	}
+	else if (len<0) {
+		err(1, "%s to %s", from, to);
+	}
 
 	if (close(fromfd) < 0) {
 		err(1, "%s: close", from);
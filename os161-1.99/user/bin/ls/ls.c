@@ -29,9 +29,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h>
 #include <errno.h>
 #include <err.h>
 
@@ -52,6 +54,9 @@ static int lopt=0;
 static int Ropt=0;
 static int sopt=0;
 
+/* Size of the buffer for getdents; a directory block or so per call. */
+#define DIRBUF 4096
+
 /* Process an option character. */
 static
 void
@@ -193,9 +198,10 @@ void
 listdir(const char *path, int showheader)
 {
 	int fd;
-	char buf[1024];
+	uint32_t buf[DIRBUF / sizeof(uint32_t)];	/* aligned for dirent */
 	char newpath[1024];
-	int len;
+	struct dirent *d;
+	int len, pos;
 
 	if (showheader) {
 		printheader(path);
@@ -210,21 +216,24 @@ listdir(const char *path, int showheader)
 	}
 
 	/*
-	 * List the directory.
+	 * List the directory, a bufferful of entries at a time.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+	while ((len = getdents(fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s", path,
+				 d->d_name);
 
-		if (aopt || buf[0]!='.') {
-			/* Print it */
-			print(newpath);
+			if (aopt || d->d_name[0]!='.') {
+				/* Print it */
+				print(newpath);
+			}
 		}
 	}
 	if (len<0) {
-		err(1, "%s: getdirentry", path);
+		err(1, "%s: getdents", path);
 	}
 
 	/* Done */
@@ -236,9 +245,10 @@ void
 recursedir(const char *path)
 {
 	int fd;
-	char buf[1024];
+	uint32_t buf[DIRBUF / sizeof(uint32_t)];	/* aligned for dirent */
 	char newpath[1024];
-	int len;
+	struct dirent *d;
+	int len, pos;
 
 	/*
 	 * Open it.
@@ -251,29 +261,35 @@ recursedir(const char *path)
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+	while ((len = getdents(fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s", path,
+				 d->d_name);
 
-		if (!aopt && buf[0]=='.') {
-			/* skip this one */
-			continue;
-		}
+			if (!aopt && d->d_name[0]=='.') {
+				/* skip this one */
+				continue;
+			}
 
-		if (!strcmp(buf, ".") || !strcmp(buf, "..")) {
-			/* always skip these */
-			continue;
-		}
+			if (!strcmp(d->d_name, ".") ||
+			    !strcmp(d->d_name, "..")) {
+				/* always skip these */
+				continue;
+			}
 
-		if (!isdir(newpath)) {
-			continue;
-		}
+			/* Only stat it if the file system didn't say */
+			if (d->d_type == DT_UNKNOWN ? !isdir(newpath) :
+			    d->d_type != DT_DIR) {
+				continue;
+			}
 
-		listdir(newpath, 1 /*showheader*/);
-		if (Ropt) {
-			recursedir(newpath);
+			listdir(newpath, 1 /*showheader*/);
+			if (Ropt) {
+				recursedir(newpath);
+			}
 		}
 	}
 	if (len<0) {
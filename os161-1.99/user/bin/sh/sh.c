@@ -292,12 +292,107 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * dopipeline
+ * runs "cmd1 | cmd2 | ...": each command's standard output is
+ * connected to the next one's standard input through a pipe. waits
+ * for all of them; the status is that of the last one.
+ */
+#define MAXPIPE 16
+
+static
+int
+dopipeline(char *args[], int nargs)
+{
+	char **cmds[MAXPIPE];
+	pid_t pids[MAXPIPE];
+	int ncmds, nstarted, i, infd, fds[2];
+	int status;
+
+	ncmds = 0;
+	cmds[ncmds++] = args;
+	for (i=0; i<nargs; i++) {
+		if (!strcmp(args[i], "|")) {
+			if (ncmds >= MAXPIPE) {
+				printf("Too many commands in pipeline\n");
+				return 1;
+			}
+			args[i] = NULL;
+			cmds[ncmds++] = &args[i+1];
+		}
+	}
+	for (i=0; i<ncmds; i++) {
+		if (cmds[i][0] == NULL) {
+			printf("Missing command in pipeline\n");
+			return 1;
+		}
+	}
+
+	infd = -1;
+	for (nstarted=0; nstarted<ncmds; nstarted++) {
+		i = nstarted;
+		if (i < ncmds-1 && pipe(fds) < 0) {
+			warn("pipe");
+			break;
+		}
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			warn("fork");
+			if (i < ncmds-1) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			break;
+		}
+		if (pids[i] == 0) {
+			/* child: hook up stdin and stdout, then run */
+			if (infd >= 0) {
+				dup2(infd, STDIN_FILENO);
+				close(infd);
+			}
+			if (i < ncmds-1) {
+				close(fds[0]);
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[1]);
+			}
+			execv(cmds[i][0], cmds[i]);
+			warn("%s", cmds[i][0]);
+			_exit(1);
+		}
+		/* parent: pass the read end on to the next command */
+		if (infd >= 0) {
+			close(infd);
+			infd = -1;
+		}
+		if (i < ncmds-1) {
+			close(fds[1]);
+			infd = fds[0];
+		}
+	}
+	if (infd >= 0) {
+		close(infd);
+	}
+
+	status = _MKWAIT_EXIT(255);
+	for (i=0; i<nstarted; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid");
+			status = -1;
+		}
+	}
+	if (nstarted < ncmds) {
+		status = _MKWAIT_EXIT(255);
+	}
+	return status;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
  * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * the job if possible, otherwise just run it and wait on it. a command
+ * containing '|' is a pipeline; see dopipeline.
  */
 static
 int
@@ -350,6 +445,17 @@ docommand(char *buf)
 		bg = 1;
 	}
 
+	for (i=0; i<nargs; i++) {
+		if (!strcmp(args[i], "|")) {
+			if (bg) {
+				printf("Pipelines cannot be run in the "
+				       "background\n");
+				return 1;
+			}
+			return dopipeline(args, nargs);
+		}
+	}
+
 	if (timing) {
 		__time(&startsecs, &startnsecs);
 	}
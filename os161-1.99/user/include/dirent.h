@@ -0,0 +1,18 @@
+#ifndef _DIRENT_H_
+#define _DIRENT_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct dirent and the DT_* types from the kernel.
+ */
+#include <kern/dirent.h>
+
+/*
+ * Read as many entries of directory FD as fit in BUF, starting at
+ * its seek position. Returns the number of bytes filled, 0 at the
+ * end of the directory, or -1 on error. Walk the buffer by d_reclen.
+ */
+int getdents(int fd, void *buf, size_t buflen);
+
+#endif /* _DIRENT_H_ */
@@ -30,8 +30,26 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
+ * Every block in the heap carries a boundary-tag header (struct
+ * mheader) giving the offsets to its physical neighbours, as in the
+ * original first-fit allocator. On top of that there are two kinds of
+ * free lists, so that malloc and free never walk the heap:
+ *
+ *  - Small blocks (at most SMALLMAX bytes of data) are kept, when
+ *    freed, on one of NSMALL exact-size free lists. Allocating or
+ *    freeing a small block is a list push or pop. Blocks on these
+ *    lists stay marked in-use as far as their neighbours are
+ *    concerned and are not coalesced.
+ *
+ *  - Larger free blocks are coalesced with free neighbours as before
+ *    and kept on doubly-linked lists binned by power of two of their
+ *    size, with a bitmap of nonempty bins.
+ *
+ * If neither kind of list can satisfy a request, the small lists are
+ * flushed into the coalescing bins (so that space held by freed small
+ * blocks is not lost) before the heap is expanded with sbrk.
+ *
+ * It still performs abysmally if the heap becomes larger than
  * physical memory. To get (much) better out-of-core performance, port
  * the kernel's malloc. :-)
  */
@@ -43,6 +61,20 @@
 
 #undef MALLOCDEBUG
 
+/*
+ * MALLOCCHECK enables the heap consistency checks: a walk of the whole
+ * heap verifying the header magic and neighbour offsets on every
+ * malloc, and filling freed memory with 0xdeadbeef. These make every
+ * call O(heap size) and are therefore off by default. (MALLOCDEBUG
+ * implies MALLOCCHECK.) The O(1) header magic check on free is always
+ * done.
+ */
+#undef MALLOCCHECK
+
+#ifdef MALLOCDEBUG
+#define MALLOCCHECK
+#endif
+
 #if defined(__mips__) || defined(__i386__)
 #define MALLOC32
 #elif defined(__alpha__)
@@ -59,7 +91,8 @@
  *
  * mh_nextblock is the upwards offset to the next header.
  *
- * mh_pad is unused.
+ * mh_pad is 1 if the block is on a small-block free list (in which
+ * case mh_inuse is also 1, so neighbours do not try to merge with it).
  * mh_inuse is 1 if the block is in use, 0 if it is free.
  * mh_magic* should always be a fixed value.
  *
@@ -133,12 +166,57 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Free list linkage, kept in the data area of a free block. The
+ * smallest block is MBLOCKSIZE bytes of data, which is exactly
+ * enough for the two pointers.
+ *
+ * M_FREE:		return the free list linkage of a header
+ * M_HDR:		return the header of a free list linkage
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define M_HDR(mf)	(((struct mheader *)(mf))-1)
+
+/*
+ * Size classes.
+ *
+ * NSMALL:		number of small (exact-size) classes
+ * SMALLMAX:		largest block size handled by the small classes
+ * NBINS:		number of power-of-two bins for larger blocks
+ *
+ * M_SMALLCLASS:	small class of a (rounded) data size
+ */
+#define NSMALL		32
+#define SMALLMAX	(NSMALL*MBLOCKSIZE)
+#define NBINS		(sizeof(size_t)*8)
+
+#define M_SMALLCLASS(sz)	(((sz)>>MBLOCKSHIFT)-1)
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, and
+ * the highest block in the heap (NULL if the heap is empty).
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__lastblock;
+
+/*
+ * Free lists. __smallfree[i] holds freed blocks of exactly
+ * (i+1)*MBLOCKSIZE bytes, singly linked. __bins[b] holds coalesced
+ * free blocks whose size has its highest set bit at position b,
+ * doubly linked; bit b of __binmap is set if __bins[b] is nonempty.
+ * __nsmallfree counts the blocks on all the small lists.
+ */
+static struct mfree *__smallfree[NSMALL];
+static struct mfree *__bins[NBINS];
+static size_t __binmap;
+static unsigned long __nsmallfree;
 
 /*
  * Setup function.
@@ -241,7 +319,7 @@ __malloc_dump(void)
 		      (unsigned long) i + MBLOCKSIZE,
 		      (unsigned long) M_SIZE(mh),
 		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		      mh->mh_pad ? "CACHED" : mh->mh_inuse ? "INUSE" : "FREE");
 	}
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
@@ -252,6 +330,115 @@ __malloc_dump(void)
 
 #endif /* MALLOCDEBUG */
 
+#ifdef MALLOCCHECK
+
+/*
+ * Walk the heap checking that the next/previous sizes all agree and
+ * that every header has the right magic bits.
+ */
+static
+void
+__malloc_check(void)
+{
+	struct mheader *mh;
+	uintptr_t i;
+	size_t rightprevblock;
+
+	rightprevblock = 0;
+	mh = NULL;
+	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+		mh = (struct mheader *) i;
+		if (!M_OK(mh)) {
+			errx(1, "malloc: Heap corrupt; header at 0x%lx"
+			     " has bad magic bits",
+			     (unsigned long) i);
+		}
+		if (mh->mh_prevblock != rightprevblock) {
+			errx(1, "malloc: Heap corrupt; header at 0x%lx"
+			     " has bad previous-block size %lu "
+			     "(should be %lu)",
+			     (unsigned long) i, 
+			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
+			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+		}
+		rightprevblock = mh->mh_nextblock;
+	}
+	if (i!=__heaptop) {
+		errx(1, "malloc: Heap corrupt; ran off end");
+	}
+	if (mh != __lastblock) {
+		errx(1, "malloc: Heap corrupt; last block is %p, not %p",
+		     mh, __lastblock);
+	}
+}
+
+#endif /* MALLOCCHECK */
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Bin number for a block of SIZE bytes: the position of the highest
+ * set bit.
+ */
+static
+unsigned
+__malloc_binof(size_t size)
+{
+	unsigned b = 0;
+
+	while (size >>= 1) {
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Put a free (coalesced) block on its bin.
+ */
+static
+void
+__malloc_binadd(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned b = __malloc_binof(M_SIZE(mh));
+
+	mf->mf_prev = NULL;
+	mf->mf_next = __bins[b];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__bins[b] = mf;
+	__binmap |= (size_t)1 << b;
+}
+
+/*
+ * Take a free (coalesced) block off its bin.
+ */
+static
+void
+__malloc_binremove(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned b = __malloc_binof(M_SIZE(mh));
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		if (__bins[b] != mf) {
+			errx(1, "malloc: Heap corrupt (free block %p "
+			     "not on its bin)", mh);
+		}
+		__bins[b] = mf->mf_next;
+		if (__bins[b] == NULL) {
+			__binmap &= ~((size_t)1 << b);
+		}
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -286,9 +473,12 @@ __malloc_sbrk(size_t size)
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
+ *
+ * Returns the new block, or NULL if there wasn't room to split. The
+ * new block is marked free but is not put on any list.
  */
 static
-void
+struct mheader *
 __malloc_split(struct mheader *mh, size_t size)
 {
 	struct mheader *mhnext, *mhnew;
@@ -301,7 +491,7 @@ __malloc_split(struct mheader *mh, size_t size)
 
 	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
 		/* no room */
-		return;
+		return NULL;
 	}
 
 	mhnext = M_NEXT(mh);
@@ -324,6 +514,170 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__lastblock = mhnew;
+	}
+	return mhnew;
+}
+
+/*
+ * Trim block mh (just taken off a bin or created) down to size bytes,
+ * returning any excess to the bins.
+ */
+static
+void
+__malloc_trim(struct mheader *mh, size_t size)
+{
+	struct mheader *mhnew;
+
+	mhnew = __malloc_split(mh, size);
+	if (mhnew != NULL) {
+		__malloc_binadd(mhnew);
+	}
+}
+
+/*
+ * Find a coalesced free block of at least size bytes, take it off its
+ * bin, and trim it to size. Returns NULL if there isn't one.
+ *
+ * Blocks in bin b have sizes in [2^b, 2^(b+1)), so the request's own
+ * bin is searched first-fit, and otherwise any block in the lowest
+ * higher nonempty bin will do.
+ */
+static
+struct mheader *
+__malloc_binfit(size_t size)
+{
+	struct mfree *mf;
+	struct mheader *mh;
+	unsigned b;
+	size_t map;
+
+	b = __malloc_binof(size);
+	for (mf = __bins[b]; mf != NULL; mf = mf->mf_next) {
+		mh = M_HDR(mf);
+		if (M_SIZE(mh) >= size) {
+			goto found;
+		}
+	}
+
+	map = (b+1 < NBINS) ? __binmap & ~(((size_t)2 << b) - 1) : 0;
+	if (map == 0) {
+		return NULL;
+	}
+	for (b++; (map & ((size_t)1 << b)) == 0; b++) {
+		/* nothing */
+	}
+	mh = M_HDR(__bins[b]);
+
+ found:
+	if (!M_OK(mh) || mh->mh_inuse) {
+		errx(1, "malloc: Heap corrupt (bad block %p on free list)",
+		     mh);
+	}
+	__malloc_binremove(mh);
+	__malloc_trim(mh, size);
+	return mh;
+}
+
+/*
+ * Merge block mh with its free neighbours, if any, and put the
+ * result on a bin. mh must be marked free and not be on any list.
+ */
+static void __malloc_trymerge(struct mheader *mh, struct mheader *mhnext);
+
+static
+void
+__malloc_coalesce(struct mheader *mh)
+{
+	struct mheader *mhnext, *mhprev;
+
+	/* Try merging with the block above (but not if we're at the top) */
+	if (mh != __lastblock) {
+		mhnext = M_NEXT(mh);
+		if (!mhnext->mh_inuse) {
+			__malloc_binremove(mhnext);
+			__malloc_trymerge(mh, mhnext);
+		}
+	}
+
+	/* Try merging with the block below (but not if we're at the bottom) */
+	if (mh != (struct mheader *)__heapbase) {
+		mhprev = M_PREV(mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_binremove(mhprev);
+			__malloc_trymerge(mhprev, mh);
+			mh = mhprev;
+		}
+	}
+
+	__malloc_binadd(mh);
+}
+
+/*
+ * Release every block on the small free lists into the coalescing
+ * bins. Called before growing the heap, so that memory tied up in
+ * freed small blocks can be reused for larger requests.
+ */
+static
+void
+__malloc_consolidate(void)
+{
+	struct mfree *mf, *mfnext;
+	struct mheader *mh;
+	unsigned i;
+
+	for (i=0; i<NSMALL; i++) {
+		mf = __smallfree[i];
+		__smallfree[i] = NULL;
+		for (; mf != NULL; mf = mfnext) {
+			mfnext = mf->mf_next;
+			mh = M_HDR(mf);
+			mh->mh_pad = 0;
+			mh->mh_inuse = 0;
+			__malloc_coalesce(mh);
+		}
+	}
+	__nsmallfree = 0;
+}
+
+/*
+ * Expand the heap to make a block of size bytes. If the highest block
+ * is free, it is extended in place; otherwise a new block is created
+ * at the top.
+ */
+static
+struct mheader *
+__malloc_grow(size_t size)
+{
+	struct mheader *mh;
+	size_t have;
+
+	if (__lastblock != NULL && !__lastblock->mh_inuse) {
+		mh = __lastblock;
+		have = M_SIZE(mh);
+		if (__malloc_sbrk(size - have) == NULL) {
+			return NULL;
+		}
+		__malloc_binremove(mh);
+		mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+		return mh;
+	}
+
+	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	if (mh == NULL) {
+		return NULL;
+	}
+
+	mh->mh_prevblock = __lastblock == NULL ? 0 :
+		M_MKFIELD((uintptr_t)mh - (uintptr_t)__lastblock);
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_magic2 = MMAGIC;
+	mh->mh_pad = 0;
+	mh->mh_inuse = 0;
+	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	__lastblock = mh;
+	return mh;
 }
 
 /*
@@ -333,8 +687,8 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mfree *mf;
+	unsigned c;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -350,76 +704,53 @@ malloc(size_t size)
 	      (unsigned long) size, (unsigned long) size);
 	__malloc_dump();
 #endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+#ifdef MALLOCCHECK
+	__malloc_check();
+#endif
 
 	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
+	 * Round size up to an integral number of blocks. Every block
+	 * has room for the free list linkage.
 	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
 
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+	/* Small request: take a block of exactly the right size. */
+	if (size <= SMALLMAX) {
+		c = M_SMALLCLASS(size);
+		mf = __smallfree[c];
+		if (mf != NULL) {
+			mh = M_HDR(mf);
+			if (!M_OK(mh) || !mh->mh_pad) {
+				errx(1, "malloc: Heap corrupt (bad block %p "
+				     "on small free list)", mh);
+			}
+			__smallfree[c] = mf->mf_next;
+			__nsmallfree--;
+			mh->mh_pad = 0;
+			goto done;
 		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
 
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	mh = __malloc_binfit(size);
+	if (mh == NULL && __nsmallfree > 0) {
+		__malloc_consolidate();
+		mh = __malloc_binfit(size);
+	}
 	if (mh == NULL) {
-		return NULL;
+		/*
+		 * Didn't find anything. Expand the heap.
+		 */
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
-
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
 	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
 
+ done:
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
 	__malloc_dump();
@@ -429,6 +760,7 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
+#ifdef MALLOCCHECK
 /*
  * Clear a range of memory with 0xdeadbeef.
  * ptr must be suitably aligned.
@@ -443,9 +775,11 @@ __malloc_deadbeef(void *ptr, size_t size)
 		x[i] = 0xdeadbeef;
 	}
 }
+#endif /* MALLOCCHECK */
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Attempt to merge two adjacent blocks (mh below mhnext). Neither
+ * may be on a free list.
  */
 static
 void
@@ -470,9 +804,14 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__lastblock = mh;
+	}
 
+#ifdef MALLOCCHECK
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
 }
 
 /*
@@ -481,7 +820,8 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 void
 free(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	struct mheader *mh;
+	unsigned c;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -510,26 +850,27 @@ free(void *x)
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
 
-	if (!mh->mh_inuse) {
+	if (!mh->mh_inuse || mh->mh_pad) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
+#ifdef MALLOCCHECK
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (M_SIZE(mh) <= SMALLMAX) {
+		/* small block: just put it on its size class's list */
+		c = M_SMALLCLASS(M_SIZE(mh));
+		mh->mh_pad = 1;
+		M_FREE(mh)->mf_next = __smallfree[c];
+		__smallfree[c] = M_FREE(mh);
+		__nsmallfree++;
 	}
-
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
-		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+	else {
+		/* mark it free, merge with free neighbours, and bin it */
+		mh->mh_inuse = 0;
+		__malloc_coalesce(mh);
 	}
 
 #ifdef MALLOCDEBUG
@@ -56,6 +56,8 @@
 
 #include "disk.h"
 
+static uint32_t jstart, jblocks;
+
 static
 uint32_t
 dumpsb(void)
@@ -69,12 +71,119 @@ dumpsb(void)
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
 
+	jstart = SWAPL(sp.sp_jstart);
+	jblocks = SWAPL(sp.sp_jblocks);
+
 	return SWAPL(sp.sp_nblocks);
 }
 
+/*
+ * List the transactions in the journal, without checking their
+ * checksums. (See kern/sfs.h.)
+ */
+static
+void
+dumpjournal(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct sfs_jcommit jc;
+	uint32_t pos, seq, i, n, nrevokes, entry;
+
+	if (jblocks == 0) {
+		printf("No journal\n");
+		return;
+	}
+	printf("Journal: %u blocks at %u\n", jblocks, jstart);
+
+	diskread(&jh, jstart);
+	if (SWAPL(jh.jh_magic) != SFS_JNL_MAGIC) {
+		printf("    [bad header magic 0x%x]\n", SWAPL(jh.jh_magic));
+		return;
+	}
+	seq = SWAPL(jh.jh_seq);
+	printf("    first sequence number %u\n", seq);
+
+	for (pos = 1; pos + 2 <= jblocks; pos += n + 2, seq++) {
+		diskread(&jd, jstart + pos);
+		if (SWAPL(jd.jd_magic) != SFS_JDESC_MAGIC ||
+		    SWAPL(jd.jd_seq) != seq ||
+		    SWAPL(jd.jd_nentries) > SFS_JDESC_MAX) {
+			break;
+		}
+		n = nrevokes = 0;
+		for (i=0; i<SWAPL(jd.jd_nentries); i++) {
+			if (SWAPL(jd.jd_entries[i]) & SFS_JNL_REVOKE) {
+				nrevokes++;
+			}
+			else {
+				n++;
+			}
+		}
+		if (pos + n + 2 > jblocks) {
+			break;
+		}
+		diskread(&jc, jstart + pos + 1 + n);
+		printf("    transaction %u at %u: %u blocks, %u revoked%s\n",
+		       seq, pos, n, nrevokes,
+		       (SWAPL(jc.jc_magic) == SFS_JCOMMIT_MAGIC &&
+			SWAPL(jc.jc_seq) == seq) ? "" : " [not committed]");
+		for (i=0; i<SWAPL(jd.jd_nentries); i++) {
+			entry = SWAPL(jd.jd_entries[i]);
+			if (entry & SFS_JNL_REVOKE) {
+				printf("        revoke %u\n",
+				       entry & ~SFS_JNL_REVOKE);
+			}
+			else {
+				printf("        %u\n", entry);
+			}
+		}
+	}
+	printf("    %u transactions in journal\n", seq - SWAPL(jh.jh_seq));
+}
+
+/*
+ * Print a short description of the object with inode INO: its type,
+ * its size, and how its data is stored.
+ */
+static
+void
+describe(uint32_t ino)
+{
+	struct sfs_inode sfi;
+	const char *type, *how;
+
+	diskread(&sfi, ino);
+	switch (SWAPS(sfi.sfi_type)) {
+	    case SFS_TYPE_FILE: type = "file"; break;
+	    case SFS_TYPE_DIR: type = "dir"; break;
+	    default: type = "invalid"; break;
+	}
+	if (SWAPL(sfi.sfi_flags) & SFS_IF_INLINE) {
+		how = ", inline";
+	}
+	else if (SWAPL(sfi.sfi_tindirect)) {
+		how = ", triple indirect";
+	}
+	else if (SWAPL(sfi.sfi_dindirect)) {
+		how = ", double indirect";
+	}
+	else if (SWAPL(sfi.sfi_indirect)) {
+		how = ", indirect";
+	}
+	else {
+		how = "";
+	}
+	printf(" (%s, %u bytes%s)", type, SWAPL(sfi.sfi_size), how);
+}
+
+/*
+ * Dump one directory block. FILEBLOCK is its block number within the
+ * directory, used to label the buckets of a hashed directory.
+ */
 static
 void
-dodirblock(uint32_t block)
+dodirblock(const struct sfs_inode *sfi, uint32_t fileblock, uint32_t block)
 {
 	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
 	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
@@ -82,7 +191,15 @@ dodirblock(uint32_t block)
 
 	diskread(&sds, block);
 
-	printf("    [block %u]\n", block);
+	if (SWAPL(sfi->sfi_dirbuckets) != 0 &&
+	    fileblock >= SWAPL(sfi->sfi_dirbase) &&
+	    fileblock - SWAPL(sfi->sfi_dirbase) < SWAPL(sfi->sfi_dirbuckets)) {
+		printf("    [block %u, bucket %u]\n", block,
+		       fileblock - SWAPL(sfi->sfi_dirbase));
+	}
+	else {
+		printf("    [block %u]\n", block);
+	}
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAPL(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
@@ -90,19 +207,55 @@ dodirblock(uint32_t block)
 		}
 		else {
 			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
-			printf("        %u %s\n", ino, sds[i].sfd_name);
+			printf("        %u %s", ino, sds[i].sfd_name);
+			describe(ino);
+			printf("\n");
 		}
 	}
 }
 
+/*
+ * Dump the directory blocks listed under indirect block IBLOCK, which
+ * is LEVELS levels above the data and covers directory blocks from
+ * FIRST. Returns how many there were.
+ */
+static
+uint32_t
+dodirindirect(const struct sfs_inode *sfi, uint32_t iblock,
+	      unsigned levels, uint32_t first)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t i, span, block, nblocks=0;
+
+	for (span=1, i=1; i<levels; i++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			nblocks += dodirindirect(sfi, block, levels-1,
+						 first + i*span);
+		}
+		else {
+			dodirblock(sfi, first + i, block);
+			nblocks++;
+		}
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
-	uint32_t block, nblocks=0;
+	uint32_t block, first, nblocks=0;
 
 	diskread(&sfi, ino);
 
@@ -111,23 +264,32 @@ dumpdir(uint32_t ino)
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
+	if (SWAPL(sfi.sfi_dirbuckets) != 0) {
+		printf("    hashed: %u buckets at directory block %u\n",
+		       SWAPL(sfi.sfi_dirbuckets), SWAPL(sfi.sfi_dirbase));
+	}
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
-			dodirblock(block);
+			dodirblock(&sfi, i, block);
 			nblocks++;
 		}
 	}
+	first = SFS_NDIRECT;
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		nblocks += dodirindirect(&sfi, SWAPL(sfi.sfi_indirect),
+					 1, first);
+	}
+	first += SFS_DBPERIDB;
+	if (SWAPL(sfi.sfi_dindirect)) {
+		nblocks += dodirindirect(&sfi, SWAPL(sfi.sfi_dindirect),
+					 2, first);
+	}
+	first += SFS_DBPERIDB * SFS_DBPERIDB;
+	if (SWAPL(sfi.sfi_tindirect)) {
+		nblocks += dodirindirect(&sfi, SWAPL(sfi.sfi_tindirect),
+					 3, first);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
@@ -169,6 +331,7 @@ main(int argc, char **argv)
 
 	opendisk(argv[1]);
 	nblocks = dumpsb();
+	dumpjournal();
 	dumpbits(nblocks);
 	dumpdir(SFS_ROOT_LOCATION);
 
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -68,7 +69,8 @@ check(void)
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks,
+	   uint32_t jstart, uint32_t jblocks)
 {
 	struct sfs_super sp;
 
@@ -81,13 +83,20 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_jstart = SWAPL(jstart);
+	sp.sp_jblocks = SWAPL(jblocks);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
 
+/*
+ * Write the root directory inode. If HASHED, the root directory is
+ * created hashed (see kern/sfs.h): its buckets are the whole
+ * directory, and are all holes to begin with.
+ */
 static
 void
-writerootdir(void)
+writerootdir(int hashed)
 {
 	struct sfs_inode sfi;
 
@@ -96,10 +105,40 @@ writerootdir(void)
 	sfi.sfi_size = SWAPL(0);
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	if (hashed) {
+		sfi.sfi_size = SWAPL(SFS_DIR_NBUCKETS * SFS_BLOCKSIZE);
+		sfi.sfi_dirbase = SWAPL(0);
+		sfi.sfi_dirbuckets = SWAPL(SFS_DIR_NBUCKETS);
+	}
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
 
+/*
+ * Write an empty journal (see kern/sfs.h). Blocks left over from
+ * whatever was on the disk before must not look like transactions,
+ * so the whole journal is zeroed.
+ */
+static
+void
+writejournal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jheader jh;
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t i;
+
+	assert(sizeof(jh) == SFS_BLOCKSIZE);
+	bzero(zeros, sizeof(zeros));
+	for (i=1; i<jblocks; i++) {
+		diskwrite(zeros, jstart+i);
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JNL_MAGIC);
+	jh.jh_seq = SWAPL(1);
+	diskwrite(&jh, jstart);
+}
+
 static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
 
 static
@@ -115,7 +154,7 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+writebitmap(uint32_t fsblocks, uint32_t jstart, uint32_t jblocks)
 {
 
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
@@ -133,6 +172,9 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(jstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
@@ -146,15 +188,37 @@ writebitmap(uint32_t fsblocks)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, jstart, jblocks;
 	char *volname, *s;
+	int hashed = 0, jsize = -1;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-H")) {
+			/* make the root directory hashed from the start */
+			hashed = 1;
+		}
+		else if (!strcmp(argv[1], "-j") && argc > 2) {
+			/* journal size in blocks; 0 for none */
+			jsize = atoi(argv[2]);
+			if (jsize < 0) {
+				errx(1, "Invalid journal size %s", argv[2]);
+			}
+			argc--;
+			argv++;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-H] [-j journalblocks] "
+		     "device/diskfile volume-name");
 	}
 
 	check();
@@ -185,9 +249,35 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
-	writerootdir();
-	writebitmap(size);
+	/*
+	 * The journal goes right after the bitmap. By default it gets
+	 * SFS_JNL_DEFBLOCKS blocks, plus two per bitmap block, since
+	 * each transaction may have to log the whole bitmap.
+	 */
+	jstart = SFS_MAP_LOCATION + SFS_BITBLOCKS(size);
+	if (jsize < 0) {
+		jblocks = SFS_JNL_DEFBLOCKS + 2 * SFS_BITBLOCKS(size);
+		if (jstart + jblocks > size / 2) {
+			/* Too small a volume to be worth it */
+			jblocks = 0;
+		}
+	}
+	else {
+		jblocks = jsize;
+		if (jblocks > 0 && jstart + jblocks > size) {
+			errx(1, "Journal of %u blocks does not fit", jblocks);
+		}
+	}
+	if (jblocks == 0) {
+		jstart = 0;
+	}
+
+	writesuper(volname, size, jstart, jblocks);
+	writerootdir(hashed);
+	writebitmap(size, jstart, jblocks);
+	if (jblocks > 0) {
+		writejournal(jstart, jblocks);
+	}
 
 	closedisk();
 
@@ -83,6 +83,8 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
 }
 
 static
@@ -106,6 +108,8 @@ swapinode(struct sfs_inode *sfi)
 #else
 	sfi->sfi_indirect = SWAPL(sfi->sfi_indirect);
 #endif
+	sfi->sfi_dirbase = SWAPL(sfi->sfi_dirbase);
+	sfi->sfi_dirbuckets = SWAPL(sfi->sfi_dirbuckets);
 
 #ifdef SFS_NDIDIRECT
 	for (i=0; i<SFS_NDIDIRECT; i++) {
@@ -126,6 +130,8 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 }
 
 static
@@ -172,6 +178,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -210,6 +217,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -508,6 +516,180 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Journal recovery; see kern/sfs.h. The kernel replays the journal
+ * when it mounts the volume, but it has to be done before checking
+ * too, or the check would see the volume as it was before the
+ * transactions in the journal and "fix" it, and then the kernel
+ * would replay them on top of that.
+ */
+
+struct jimage {
+	uint32_t block;		/* home of the image */
+	uint32_t seq;		/* transaction it's from */
+	uint32_t pos;		/* where it is in the journal */
+};
+
+static
+uint32_t
+jnl_sum(uint32_t sum, const void *data)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) + SWAPL(words[i]);
+	}
+	return sum;
+}
+
+/*
+ * Read the descriptor at journal block POS, and check that it is
+ * transaction SEQ and is complete. Returns the number of journal
+ * blocks it takes up, or 0.
+ */
+static
+uint32_t
+jnl_readtx(uint32_t jstart, uint32_t jblocks, uint32_t pos, uint32_t seq,
+	   struct sfs_jdesc *jd)
+{
+	struct sfs_jcommit jc;
+	char image[SFS_BLOCKSIZE];
+	uint32_t i, n, sum;
+
+	if (pos + 2 > jblocks) {
+		return 0;
+	}
+	diskread(jd, jstart + pos);
+	sum = jnl_sum(0, jd);
+	jd->jd_magic = SWAPL(jd->jd_magic);
+	jd->jd_seq = SWAPL(jd->jd_seq);
+	jd->jd_nentries = SWAPL(jd->jd_nentries);
+	if (jd->jd_magic != SFS_JDESC_MAGIC || jd->jd_seq != seq ||
+	    jd->jd_nentries > SFS_JDESC_MAX) {
+		return 0;
+	}
+	n = 0;
+	for (i=0; i<jd->jd_nentries; i++) {
+		jd->jd_entries[i] = SWAPL(jd->jd_entries[i]);
+		if ((jd->jd_entries[i] & SFS_JNL_REVOKE) == 0) {
+			n++;
+		}
+	}
+	if (pos + n + 2 > jblocks) {
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		diskread(image, jstart + pos + 1 + i);
+		sum = jnl_sum(sum, image);
+	}
+	diskread(&jc, jstart + pos + 1 + n);
+	if (SWAPL(jc.jc_magic) != SFS_JCOMMIT_MAGIC ||
+	    SWAPL(jc.jc_seq) != seq || SWAPL(jc.jc_sum) != sum) {
+		return 0;
+	}
+	return n + 2;
+}
+
+static
+void
+jnl_writeheader(uint32_t jstart, uint32_t seq)
+{
+	struct sfs_jheader jh;
+
+	bzero(&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JNL_MAGIC);
+	jh.jh_seq = SWAPL(seq);
+	diskwrite(&jh, jstart);
+}
+
+static
+void
+replay_journal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct jimage *images, *revokes;
+	unsigned nimages = 0, nrevokes = 0, ntx = 0, nreplayed = 0;
+	char image[SFS_BLOCKSIZE];
+	uint32_t pos, seq, n, i, j, block;
+
+	assert(sizeof(jh) == SFS_BLOCKSIZE);
+	assert(sizeof(jd) == SFS_BLOCKSIZE);
+
+	diskread(&jh, jstart);
+	if (SWAPL(jh.jh_magic) != SFS_JNL_MAGIC) {
+		warnx("Journal header is invalid (fixed)");
+		setbadness(EXIT_RECOV);
+		/* Make sure nothing left in it looks like a transaction */
+		bzero(image, sizeof(image));
+		diskwrite(image, jstart + 1);
+		jnl_writeheader(jstart, 1);
+		return;
+	}
+
+	/* Each transaction takes at least two blocks */
+	images = domalloc(jblocks * sizeof(struct jimage));
+	revokes = domalloc((jblocks / 2) * SFS_JDESC_MAX *
+			   sizeof(struct jimage));
+
+	pos = 1;
+	seq = SWAPL(jh.jh_seq);
+	while ((n = jnl_readtx(jstart, jblocks, pos, seq, &jd)) > 0) {
+		j = 0;
+		for (i=0; i<jd.jd_nentries; i++) {
+			block = jd.jd_entries[i];
+			if (block & SFS_JNL_REVOKE) {
+				revokes[nrevokes].block = block &
+					~SFS_JNL_REVOKE;
+				revokes[nrevokes].seq = seq;
+				nrevokes++;
+			}
+			else {
+				images[nimages].block = block;
+				images[nimages].seq = seq;
+				images[nimages].pos = pos + 1 + j;
+				nimages++;
+				j++;
+			}
+		}
+		ntx++;
+		pos += n;
+		seq++;
+	}
+
+	for (i=0; i<nimages; i++) {
+		if (images[i].block >= nblocks) {
+			warnx("Journal has an image of block %lu, past the "
+			      "end of the volume; skipped",
+			      (unsigned long) images[i].block);
+			continue;
+		}
+		for (j=0; j<nrevokes; j++) {
+			if (revokes[j].block == images[i].block &&
+			    revokes[j].seq >= images[i].seq) {
+				break;
+			}
+		}
+		if (j < nrevokes) {
+			continue;
+		}
+		diskread(image, jstart + images[i].pos);
+		diskwrite(image, images[i].block);
+		nreplayed++;
+	}
+
+	if (ntx > 0) {
+		warnx("Replayed %u journal transactions, %u blocks (fixed)",
+		      ntx, nreplayed);
+		setbadness(EXIT_RECOV);
+		jnl_writeheader(jstart, seq);
+	}
+
+	free(images);
+	free(revokes);
+}
+
 static
 void
 check_sb(void)
@@ -545,15 +727,42 @@ check_sb(void)
 		schanged = 1;
 	}
 
+	if (sp.sp_jblocks != 0 &&
+	    (sp.sp_jstart < SFS_MAP_LOCATION + bitblocks ||
+	     sp.sp_jblocks < 3 || sp.sp_jstart >= nblocks ||
+	     sp.sp_jblocks > nblocks - sp.sp_jstart)) {
+		warnx("Journal location %lu+%lu is invalid; "
+		      "removed journal (fixed)",
+		      (unsigned long) sp.sp_jstart,
+		      (unsigned long) sp.sp_jblocks);
+		setbadness(EXIT_RECOV);
+		sp.sp_jstart = sp.sp_jblocks = 0;
+		schanged = 1;
+	}
+	else if (sp.sp_jblocks == 0 && sp.sp_jstart != 0) {
+		warnx("Stray journal location (fixed)");
+		setbadness(EXIT_RECOV);
+		sp.sp_jstart = 0;
+		schanged = 1;
+	}
+
 	if (schanged) {
 		swapsb(&sp);
 		diskwrite(&sp, SFS_SB_LOCATION);
+		swapsb(&sp);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+
+	if (sp.sp_jblocks != 0) {
+		replay_journal(sp.sp_jstart, sp.sp_jblocks);
+		for (i=0; i<sp.sp_jblocks; i++) {
+			bitmap_mark(sp.sp_jstart+i, B_JOURNAL, 0);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -565,19 +774,21 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	uint32_t i, ct, span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing under here; just count the blocks it covers */
+		for (span=1, i=0; i<(uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -616,14 +827,11 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
-		if (*ientry != 0) {
-			(*badcountp)++;
-			bitmap_mark(*ientry, B_TOFREE, 0);
-			*ientry = 0;
-		}
+		(*badcountp)++;
+		bitmap_mark(*ientry, B_TOFREE, 0);
+		*ientry = 0;
 	}
 	else {
-		assert(*ientry != 0);
 		if (*badcountp > 0) {
 			swapindir(entries);
 			diskwrite(entries, *ientry);
@@ -631,18 +839,74 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 }
 
+/*
+ * Zero any bytes in an inline file's sfi_data past its size. Returns
+ * nonzero if there were any that weren't zero already.
+ */
+static
+int
+check_inline_tail(struct sfs_inode *sfi)
+{
+	uint32_t i;
+	int bad = 0;
+
+	for (i=sfi->sfi_size; i<SFS_INLINESIZE; i++) {
+		if (sfi->sfi_data[i] != 0) {
+			sfi->sfi_data[i] = 0;
+			bad = 1;
+		}
+	}
+	return bad;
+}
+
 /* returns nonzero if inode modified */
 static
 int
 check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
+	int changed = 0;
 
 	badcount = 0;
 
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 	nblocks = size/SFS_BLOCKSIZE;
 
+	if (sfi->sfi_flags & ~SFS_IF_INLINE) {
+		warnx("Inode %lu: unknown flags %lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IF_INLINE));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IF_INLINE;
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_IF_INLINE) && isdir) {
+		/* Directories are never inline; believe the blocks */
+		warnx("Inode %lu: inline directory (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IF_INLINE;
+		memset(sfi->sfi_data, 0, SFS_INLINESIZE);
+		changed = 1;
+	}
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		if (sfi->sfi_size > SFS_INLINESIZE) {
+			warnx("Inode %lu: inline file too large (truncated)",
+			      (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			sfi->sfi_size = SFS_INLINESIZE;
+			changed = 1;
+		}
+		if (check_inline_tail(sfi)) {
+			warnx("Inode %lu: garbage after inline data "
+			      "(cleared)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		/* It has no blocks; any it claims are after EOF */
+		nblocks = 0;
+	}
+
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
 			if (sfi->sfi_direct[block] != 0) {
@@ -655,6 +919,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 				badcount++;
 				bitmap_mark(sfi->sfi_direct[block],
 					    B_TOFREE, 0);
+				sfi->sfi_direct[block] = 0;
 			}			
 		}
 	}
@@ -700,7 +965,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 		return 1;
 	}
 
-	return 0;
+	return changed;
 }
 
 ////////////////////////////////////////////////////////////
@@ -820,7 +1085,12 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 			}
 		}
 		else {
-			warnx("Warning: sparse directory found");
+			/* unused buckets of a hashed dir are always holes */
+			if (sfi->sfi_dirbuckets == 0 ||
+			    i < sfi->sfi_dirbase ||
+			    i - sfi->sfi_dirbase >= sfi->sfi_dirbuckets) {
+				warnx("Warning: sparse directory found");
+			}
 			bzero(d + i*atonce, SFS_BLOCKSIZE);
 		}
 	}
@@ -901,13 +1171,21 @@ sortdir(int *vector, struct sfs_dir *d, int nd)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
-/* tries to add a directory entry; returns 0 on success */
+/*
+ * tries to add a directory entry; returns 0 on success. Slots
+ * SKIPSTART through SKIPEND-1 (the buckets of a hashed dir, which
+ * may be holes we can't write) are not used.
+ */
 static
 int
-dir_tryadd(struct sfs_dir *d, int nd, const char *name, uint32_t ino)
+dir_tryadd(struct sfs_dir *d, int nd, uint32_t skipstart, uint32_t skipend,
+	   const char *name, uint32_t ino)
 {
 	int i;
 	for (i=0; i<nd; i++) {
+		if ((uint32_t)i >= skipstart && (uint32_t)i < skipend) {
+			continue;
+		}
 		if (d[i].sfd_ino==SFS_NOINO) {
 			d[i].sfd_ino = ino;
 			assert(strlen(name) < sizeof(d[i].sfd_name));
@@ -964,6 +1242,51 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 	return dchanged;
 }
 
+/* the hashed directory name hash (FNV-1a; see kern/sfs.h) */
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_FNV_BASIS;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= SFS_FNV_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Check that every entry in the buckets of a hashed directory is in
+ * the right bucket; the kernel would never find one that isn't.
+ * Returns nonzero if one is misplaced.
+ */
+static
+int
+check_dir_buckets(const char *pathsofar, const struct sfs_inode *sfi,
+		  struct sfs_dir *d)
+{
+	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	uint32_t i, bucket;
+
+	for (i=0; i<sfi->sfi_dirbuckets*atonce; i++) {
+		const struct sfs_dir *sfd = &d[sfi->sfi_dirbase*atonce + i];
+
+		if (sfd->sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		bucket = dirhash(sfd->sfd_name) % sfi->sfi_dirbuckets;
+		if (bucket != i/atonce) {
+			warnx("Directory /%s: %s is in hash bucket %lu, "
+			      "should be %lu", pathsofar, sfd->sfd_name,
+			      (unsigned long) i/atonce,
+			      (unsigned long) bucket);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -974,6 +1297,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	struct sfs_dir *direntries;
 	int *sortvector;
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
+	uint32_t hstart, hend;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
 	diskread(&sfi, ino);
@@ -1003,6 +1327,24 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
 				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+
+	if (sfi.sfi_dirbuckets != 0 &&
+	    (uint64_t)sfi.sfi_dirbase + sfi.sfi_dirbuckets >
+	    maxdirentries / SFS_DIRPERBLOCK) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: hash buckets past end of directory "
+		      "(made linear)", pathsofar);
+		sfi.sfi_dirbase = sfi.sfi_dirbuckets = 0;
+		ichanged = 1;
+	}
+	else if (sfi.sfi_dirbuckets == 0 && sfi.sfi_dirbase != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: stray hash base (fixed)", pathsofar);
+		sfi.sfi_dirbase = 0;
+		ichanged = 1;
+	}
+	hstart = sfi.sfi_dirbase * SFS_DIRPERBLOCK;
+	hend = hstart + sfi.sfi_dirbuckets * SFS_DIRPERBLOCK;
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1081,13 +1423,15 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	if (!dotseen) {
-		if (dir_tryadd(direntries, ndirentries, ".", ino)==0) {
+		if (dir_tryadd(direntries, ndirentries, hstart, hend,
+			       ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `.' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (dir_tryadd(direntries, maxdirentries, ".", ino)==0) {
+		else if (dir_tryadd(direntries, maxdirentries, hstart, hend,
+				    ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `.' entry (added)",
 			      pathsofar);
@@ -1104,14 +1448,15 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	if (!dotdotseen) {
-		if (dir_tryadd(direntries, ndirentries, "..", parentino)==0) {
+		if (dir_tryadd(direntries, ndirentries, hstart, hend,
+			       "..", parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `..' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (dir_tryadd(direntries, maxdirentries, "..", 
-				    parentino)==0) {
+		else if (dir_tryadd(direntries, maxdirentries, hstart, hend,
+				    "..", parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `..' entry (added)",
 			      pathsofar);
@@ -1194,6 +1539,19 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Do this last, as renaming entries above can move them to
+	 * another bucket.
+	 */
+	if (sfi.sfi_dirbuckets != 0 &&
+	    check_dir_buckets(pathsofar, &sfi, direntries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: misplaced hash entries (made linear)",
+		      pathsofar);
+		sfi.sfi_dirbase = sfi.sfi_dirbuckets = 0;
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
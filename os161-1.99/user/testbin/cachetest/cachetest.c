@@ -0,0 +1,223 @@
+/*
+ * cachetest - check that file data survives a write-back cache.
+ *
+ * Meant for the emufs volume, whose pages are cached and written
+ * back later, but should pass on any file system. It checks that:
+ *   - small unaligned writes, which the cache coalesces, read back
+ *     right with reads of other sizes and with pread;
+ *   - rewriting part of a page keeps the rest of it;
+ *   - a write past EOF leaves zeros in the hole;
+ *   - what was written is there after close and reopen, and after
+ *     reopening with O_TRUNC it is gone;
+ *   - several files that together do not fit in the cache each read
+ *     back right, while open and after they are closed and reopened.
+ *
+ * usage: cachetest [file]
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define CHUNK		1000		/* not a divisor of the page size */
+#define FILESIZE	(40 * CHUNK)
+#define HOLE		8192		/* gap left by the write past EOF */
+#define NFILES		8		/* files for the sharing test */
+
+static char buf[3 * CHUNK];
+
+static
+char
+pattern(off_t pos)
+{
+	return 'a' + (pos * 5 + pos / 4096) % 26;
+}
+
+/* Each file in the sharing test gets the pattern from a different place. */
+#define FILEPOS(k, pos)	((pos) + (k) * 7)
+
+static
+void
+doopen(const char *file, int flags, int *fd)
+{
+	*fd = open(file, flags, 0664);
+	if (*fd < 0) {
+		err(1, "%s", file);
+	}
+}
+
+/*
+ * Check LEN bytes at POS with pread, against pattern() starting at
+ * PPOS, or zeros.
+ */
+static
+void
+checkat(int fd, off_t pos, int len, off_t ppos, int zeros)
+{
+	int r, i;
+
+	r = pread(fd, buf, len, pos);
+	if (r != len) {
+		errx(1, "pread at %d: got %d of %d bytes", (int)pos, r, len);
+	}
+	for (i = 0; i < len; i++) {
+		if (buf[i] != (zeros ? 0 : pattern(ppos + i))) {
+			errx(1, "byte %d: wrong contents", (int)(pos + i));
+		}
+	}
+}
+
+/* Check LEN bytes at POS with pread, against pattern() or zeros. */
+static
+void
+check(int fd, off_t pos, int len, int zeros)
+{
+	checkat(fd, pos, len, pos, zeros);
+}
+
+/*
+ * Write NFILES files at once, a chunk of each in turn, so the cache
+ * has to share itself out; then read them back, also in turn, while
+ * they are open and again after closing and reopening them.
+ */
+static
+void
+sharing(const char *file)
+{
+	char names[NFILES][64];
+	int fds[NFILES];
+	off_t pos;
+	int k, i, len;
+
+	for (k = 0; k < NFILES; k++) {
+		snprintf(names[k], sizeof(names[k]), "%s.%d", file, k);
+		doopen(names[k], O_RDWR | O_CREAT | O_TRUNC, &fds[k]);
+	}
+	for (pos = 0; pos < FILESIZE; pos += CHUNK) {
+		for (k = 0; k < NFILES; k++) {
+			for (i = 0; i < CHUNK; i++) {
+				buf[i] = pattern(FILEPOS(k, pos + i));
+			}
+			if (pwrite(fds[k], buf, CHUNK, pos) != CHUNK) {
+				err(1, "%s: pwrite", names[k]);
+			}
+		}
+	}
+	for (pos = 0; pos < FILESIZE; pos += CHUNK) {
+		for (k = 0; k < NFILES; k++) {
+			checkat(fds[k], pos, CHUNK, FILEPOS(k, pos), 0);
+		}
+	}
+	for (k = 0; k < NFILES; k++) {
+		close(fds[k]);
+	}
+
+	for (k = NFILES; k-- > 0; ) {
+		doopen(names[k], O_RDONLY, &fds[k]);
+		for (pos = 0; pos < FILESIZE; pos += 3 * CHUNK) {
+			len = FILESIZE - pos < 3 * CHUNK ? FILESIZE - pos :
+				3 * CHUNK;
+			checkat(fds[k], pos, len, FILEPOS(k, pos), 0);
+		}
+		if (pread(fds[k], buf, 1, FILESIZE) != 0) {
+			errx(1, "%s: wrong file size", names[k]);
+		}
+		close(fds[k]);
+		remove(names[k]);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "cachetest.dat";
+	off_t pos;
+	int fd, r, i;
+
+	doopen(file, O_RDWR | O_CREAT | O_TRUNC, &fd);
+	for (pos = 0; pos < FILESIZE; pos += CHUNK) {
+		for (i = 0; i < CHUNK; i++) {
+			buf[i] = pattern(pos + i);
+		}
+		r = write(fd, buf, CHUNK);
+		if (r != CHUNK) {
+			err(1, "write");
+		}
+	}
+
+	/* sequential reads of another size */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	for (pos = 0; pos < FILESIZE; pos += r) {
+		r = read(fd, buf, sizeof(buf));
+		if (r <= 0) {
+			err(1, "read at %d", (int)pos);
+		}
+		for (i = 0; i < r; i++) {
+			if (buf[i] != pattern(pos + i)) {
+				errx(1, "byte %d: wrong contents",
+				     (int)(pos + i));
+			}
+		}
+	}
+	if (read(fd, buf, sizeof(buf)) != 0) {
+		errx(1, "no EOF after %d bytes", FILESIZE);
+	}
+
+	/* scattered reads, backwards */
+	for (pos = FILESIZE - 777; pos > 0; pos -= 4321) {
+		check(fd, pos, 777, 0);
+	}
+	printf("cachetest: reads ok\n");
+
+	/* rewrite the middle of a page with the same pattern */
+	for (i = 0; i < 100; i++) {
+		buf[i] = pattern(5000 + i);
+	}
+	if (pwrite(fd, buf, 100, 5000) != 100) {
+		err(1, "pwrite");
+	}
+	check(fd, 4096, 4096, 0);
+
+	/* write past EOF */
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 10; i++) {
+		buf[i] = pattern(FILESIZE + HOLE + i);
+	}
+	if (pwrite(fd, buf, 10, FILESIZE + HOLE) != 10) {
+		err(1, "pwrite past EOF");
+	}
+	check(fd, FILESIZE, HOLE, 1);
+	check(fd, FILESIZE + HOLE, 10, 0);
+	printf("cachetest: writes ok\n");
+
+	/* after close, reopen and look again */
+	close(fd);
+	doopen(file, O_RDONLY, &fd);
+	check(fd, 0, 3 * CHUNK, 0);
+	check(fd, FILESIZE - 100, 100, 0);
+	check(fd, FILESIZE, HOLE, 1);
+	check(fd, FILESIZE + HOLE, 10, 0);
+	if (pread(fd, buf, 1, FILESIZE + HOLE + 10) != 0) {
+		errx(1, "wrong file size after reopen");
+	}
+	close(fd);
+
+	doopen(file, O_RDWR | O_TRUNC, &fd);
+	if (pread(fd, buf, 1, 0) != 0) {
+		errx(1, "O_TRUNC left data behind");
+	}
+	close(fd);
+	printf("cachetest: reopen ok\n");
+
+	sharing(file);
+	printf("cachetest: sharing ok\n");
+
+	remove(file);
+	printf("cachetest: passed\n");
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * copytest - check copy_file_range.
+ *
+ * Writes a file bigger than the kernel's copy buffer, then checks
+ * that:
+ *   - copying it with the seek positions reproduces it and leaves
+ *     both positions at the end;
+ *   - copying a range with explicit positions copies just that range,
+ *     updates the positions given, and leaves the seek positions
+ *     alone;
+ *   - copying past EOF returns a short count, then 0;
+ *   - overlapping ranges of one file and non-files are refused.
+ *
+ * usage: copytest [file]
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILESIZE	(100 * 1024 + 77)
+#define CHUNK		4096
+
+static char buf[CHUNK];
+static char name2[64];
+
+static
+char
+pattern(off_t pos)
+{
+	return 'a' + (pos * 7 + pos / 511) % 26;
+}
+
+/* Check that FD holds the pattern for [FROM, FROM+LEN) at POS. */
+static
+void
+check(int fd, off_t pos, off_t from, off_t len, const char *what)
+{
+	off_t i;
+	int r, j;
+
+	for (i = 0; i < len; i += r) {
+		r = pread(fd, buf, len - i < CHUNK ? len - i : CHUNK, pos + i);
+		if (r <= 0) {
+			errx(1, "%s: short read at %d", what, (int)(pos + i));
+		}
+		for (j = 0; j < r; j++) {
+			if (buf[j] != pattern(from + i + j)) {
+				errx(1, "%s: byte %d is wrong", what,
+				     (int)(pos + i + j));
+			}
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "copytest.dat";
+	off_t i, inpos, outpos;
+	int fd, fd2, r, j, total, fds[2];
+
+	snprintf(name2, sizeof(name2), "%s.2", file);
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	for (i = 0; i < FILESIZE; i += r) {
+		r = FILESIZE - i < CHUNK ? FILESIZE - i : CHUNK;
+		for (j = 0; j < r; j++) {
+			buf[j] = pattern(i + j);
+		}
+		if (write(fd, buf, r) != r) {
+			err(1, "write");
+		}
+	}
+
+	/* whole file, seek positions */
+	fd2 = open(name2, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd2 < 0) {
+		err(1, "%s", name2);
+	}
+	lseek(fd, 0, SEEK_SET);
+	total = 0;
+	while ((r = copy_file_range(fd, NULL, fd2, NULL, 1000000, 0)) > 0) {
+		total += r;
+	}
+	if (r < 0) {
+		err(1, "copy_file_range");
+	}
+	if (total != FILESIZE) {
+		errx(1, "copied %d bytes, expected %d", total, FILESIZE);
+	}
+	if (lseek(fd, 0, SEEK_CUR) != FILESIZE ||
+	    lseek(fd2, 0, SEEK_CUR) != FILESIZE) {
+		errx(1, "seek positions not at the end after copying");
+	}
+	check(fd2, 0, 0, FILESIZE, "whole-file copy");
+	printf("copytest: whole file ok\n");
+
+	/* a range, explicit positions */
+	inpos = 5000;
+	outpos = 70000;
+	lseek(fd, 123, SEEK_SET);
+	lseek(fd2, 456, SEEK_SET);
+	r = copy_file_range(fd, &inpos, fd2, &outpos, 20000, 0);
+	if (r != 20000) {
+		err(1, "copy_file_range of a range returned %d", r);
+	}
+	if (inpos != 25000 || outpos != 90000) {
+		errx(1, "positions not updated");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 123 || lseek(fd2, 0, SEEK_CUR) != 456) {
+		errx(1, "explicit positions moved the seek positions");
+	}
+	check(fd2, 70000, 5000, 20000, "range copy");
+	check(fd2, 0, 0, 70000, "before the range");
+	printf("copytest: range ok\n");
+
+	/* EOF */
+	inpos = FILESIZE - 10;
+	outpos = 0;
+	r = copy_file_range(fd, &inpos, fd2, &outpos, 100, 0);
+	if (r != 10) {
+		errx(1, "copy across EOF returned %d, expected 10", r);
+	}
+	r = copy_file_range(fd, &inpos, fd2, &outpos, 100, 0);
+	if (r != 0) {
+		errx(1, "copy at EOF returned %d, expected 0", r);
+	}
+	printf("copytest: EOF ok\n");
+
+	/* errors */
+	inpos = 0;
+	outpos = 100;
+	if (copy_file_range(fd, &inpos, fd, &outpos, 1000, 0) >= 0 ||
+	    errno != EINVAL) {
+		errx(1, "overlapping copy did not fail with EINVAL");
+	}
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	inpos = 0;
+	if (copy_file_range(fd, &inpos, fds[1], NULL, 10, 0) >= 0 ||
+	    errno != EINVAL) {
+		errx(1, "copy to a pipe did not fail with EINVAL");
+	}
+	close(fds[0]);
+	close(fds[1]);
+	printf("copytest: errors ok\n");
+
+	close(fd);
+	close(fd2);
+	remove(file);
+	remove(name2);
+	printf("copytest: passed\n");
+	return 0;
+}
@@ -31,7 +31,7 @@
  * dirtest.c
  *
  * 	Tests your hierarchical directory implementation by creating
- * 	and deleting directories.
+ * 	and deleting directories, and listing them with getdents.
  *
  *      Works in the current directory.
  *
@@ -44,10 +44,57 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <err.h>
 
 #define MAXLEVELS       5
 
+/*
+ * Read directory DIR with getdents, in a buffer small enough to need
+ * several calls, and check that it holds NAME as a directory.
+ */
+static
+void
+checklisting(const char *dir, const char *name)
+{
+	unsigned buf[64 / sizeof(unsigned)];	/* aligned for dirent */
+	struct dirent *d;
+	int fd, len, pos, found = 0, calls = 0;
+
+	fd = open(dir, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", dir);
+	}
+	while ((len = getdents(fd, buf, sizeof(buf))) > 0) {
+		calls++;
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
+			if (d->d_reclen < DIRENT_RECLEN(d->d_namlen) ||
+			    pos + d->d_reclen > len ||
+			    strlen(d->d_name) != d->d_namlen) {
+				errx(1, "%s: getdents: bad record", dir);
+			}
+			if (strcmp(d->d_name, name) != 0) {
+				continue;
+			}
+			if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) {
+				errx(1, "%s/%s: getdents: wrong type %d",
+				     dir, name, d->d_type);
+			}
+			found++;
+		}
+	}
+	if (len < 0) {
+		err(1, "%s: getdents", dir);
+	}
+	if (found != 1) {
+		errx(1, "%s: getdents: %s seen %d times", dir, name, found);
+	}
+	close(fd);
+	printf("Listed %s in %d calls\n", dir, calls);
+}
+
 int
 main(void)
 {
@@ -70,6 +117,10 @@ main(void)
 
 	printf("Passed directory creation test.\n");
 
+	checklisting(".", onename);
+	checklisting(onename, onename);
+	printf("Passed directory listing test.\n");
+
 	for (i=0; i<MAXLEVELS; i++) {
 		dirname[strlen(dirname) - strlen(onename) - 1] = 0;
 
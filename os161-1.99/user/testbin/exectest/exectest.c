@@ -0,0 +1,117 @@
+/*
+ * exectest - check execv argument passing with awkward path lengths.
+ *
+ * The kernel packs the program path and the argument strings into
+ * one buffer, so the arguments start wherever the path ends. This
+ * re-executes itself through path spellings of every length modulo
+ * 4 (each is the same file), with arguments of every length modulo
+ * 4, and checks that the child sees exactly the argv it was given.
+ *
+ * As in argbench, execv hands the new program the path as argv[0]
+ * and the argv it was given after that, so the child finds our
+ * argv[0] in argv[1], the child flag in argv[2], and the test
+ * arguments from argv[3] on.
+ *
+ * usage: exectest
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define CHILDARG	"-child"
+
+static const char *const paths[] = {
+	"/testbin/exectest",			/* 18 bytes with the null */
+	"/testbin/./exectest",			/* 20 */
+	"/testbin/../testbin/exectest",		/* 29 */
+	"/testbin/./../testbin/exectest",	/* 31 */
+};
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+static const char *const args[] = { "a", "bc", "def", "ghij", "", "klmno" };
+#define NARGS (sizeof(args) / sizeof(args[0]))
+
+/* In the child: check argv against what the parent passed. */
+static
+int
+child(int argc, char *argv[])
+{
+	unsigned i;
+
+	if (argc != (int)NARGS + 3) {
+		warnx("child: argc is %d, expected %d", argc, (int)NARGS + 3);
+		return 1;
+	}
+	if (strcmp(argv[0], argv[1]) != 0) {
+		warnx("child: argv[1] is \"%s\", expected \"%s\"",
+		      argv[1], argv[0]);
+		return 1;
+	}
+	for (i = 0; i < NARGS; i++) {
+		if (strcmp(argv[i + 3], args[i]) != 0) {
+			warnx("child: argv[%u] is \"%s\", expected \"%s\"",
+			      i + 3, argv[i + 3], args[i]);
+			return 1;
+		}
+	}
+	if (argv[argc] != NULL) {
+		warnx("child: argv[%d] is not NULL", argc);
+		return 1;
+	}
+	return 0;
+}
+
+static
+void
+tryexec(const char *path)
+{
+	char *argv[NARGS + 3];
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	argv[0] = (char *)path;
+	argv[1] = (char *)CHILDARG;
+	for (i = 0; i < NARGS; i++) {
+		argv[i + 2] = (char *)args[i];
+	}
+	argv[NARGS + 2] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(path, argv);
+		warn("execv %s", path);
+		_exit(1);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%s (path length %d): child failed", path,
+		     (int)strlen(path) + 1);
+	}
+	printf("%s: ok\n", path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned i;
+
+	if (argc > 2 && strcmp(argv[2], CHILDARG) == 0) {
+		return child(argc, argv);
+	}
+
+	for (i = 0; i < NPATHS; i++) {
+		tryexec(paths[i]);
+	}
+	printf("exectest: passed\n");
+	return 0;
+}
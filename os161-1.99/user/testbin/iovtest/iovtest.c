@@ -0,0 +1,136 @@
+/*
+ * iovtest - check scatter/gather I/O.
+ *
+ * Writes a file with writev() from many small buffers of differing
+ * sizes (including empty ones), then checks that:
+ *   - read() sees the bytes in order;
+ *   - readv() into a different split gets them back;
+ *   - preadv() and pwritev() work at an offset and leave the seek
+ *     position alone;
+ *   - bad iovec counts and bad buffers are refused.
+ *
+ * usage: iovtest [file]
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define NIOV	64
+#define TOTAL	(NIOV * (NIOV - 1) / 2)	/* iovec i holds i bytes */
+
+static char data[TOTAL];
+static char back[TOTAL];
+static struct iovec iov[NIOV];
+
+/* Split BUF so that iovec I holds I bytes, or NIOV-1-I if REVERSE. */
+static
+void
+split(char *buf, int reverse)
+{
+	int i, len;
+
+	for (i = 0; i < NIOV; i++) {
+		len = reverse ? NIOV - 1 - i : i;
+		iov[i].iov_base = buf;
+		iov[i].iov_len = len;
+		buf += len;
+	}
+}
+
+static
+void
+check(const char *what)
+{
+	int i;
+
+	for (i = 0; i < TOTAL; i++) {
+		if (back[i] != data[i]) {
+			errx(1, "%s: byte %d is wrong", what, i);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "iovtest.dat";
+	int fd, i, r;
+
+	for (i = 0; i < TOTAL; i++) {
+		data[i] = 'a' + (i * 7 + i / 13) % 26;
+	}
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+
+	split(data, 0);
+	r = writev(fd, iov, NIOV);
+	if (r != TOTAL) {
+		err(1, "writev: returned %d", r);
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	r = read(fd, back, TOTAL);
+	if (r != TOTAL) {
+		err(1, "read: returned %d", r);
+	}
+	check("writev");
+
+	memset(back, 0, TOTAL);
+	lseek(fd, 0, SEEK_SET);
+	split(back, 1);
+	r = readv(fd, iov, NIOV);
+	if (r != TOTAL) {
+		err(1, "readv: returned %d", r);
+	}
+	check("readv");
+	printf("iovtest: readv/writev ok\n");
+
+	/* p-variants at an offset; the seek position stays at TOTAL */
+	split(data + 100, 0);
+	r = pwritev(fd, iov, 20, TOTAL);
+	if (r != 190) {
+		err(1, "pwritev: returned %d", r);
+	}
+	memset(back, 0, TOTAL);
+	split(back, 1);
+	r = preadv(fd, iov + NIOV - 20, 20, TOTAL);
+	if (r != 190) {
+		err(1, "preadv: returned %d", r);
+	}
+	if (memcmp(iov[NIOV - 20].iov_base, data + 100, 190) != 0) {
+		errx(1, "preadv: wrong contents");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != TOTAL) {
+		errx(1, "pwritev/preadv moved the seek position");
+	}
+	printf("iovtest: preadv/pwritev ok\n");
+
+	/* errors */
+	if (readv(fd, iov, -1) >= 0 || errno != EINVAL) {
+		errx(1, "readv with a negative count did not fail with EINVAL");
+	}
+	if (readv(fd, (struct iovec *)0x40000000, 2) >= 0 ||
+	    errno != EFAULT) {
+		errx(1, "readv with a bad iovec array did not fail with EFAULT");
+	}
+	split(back, 0);
+	iov[1].iov_base = (void *)0x80000000;
+	if (writev(fd, iov, NIOV) >= 0 || errno != EFAULT) {
+		errx(1, "writev with a kernel buffer did not fail with EFAULT");
+	}
+	printf("iovtest: errors ok\n");
+
+	close(fd);
+	remove(file);
+	printf("iovtest: passed\n");
+	return 0;
+}
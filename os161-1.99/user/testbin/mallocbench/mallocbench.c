@@ -0,0 +1,168 @@
+/*
+ * mallocbench - malloc/free throughput and fragmentation benchmark.
+ *
+ * Keeps a pool of NSLOTS live allocations and repeatedly frees a
+ * randomly chosen one and replaces it with a new block of random
+ * size, so that the heap fills up with a realistic mix of holes.
+ * Three size mixes are run: small blocks only (the common case for
+ * programs like sort and hash), large blocks only, and a mix.
+ *
+ * Each phase runs in its own child process so that it starts with an
+ * empty heap. For each phase it reports the time per malloc/free
+ * pair, and the heap size (from sbrk) against the peak number of
+ * bytes actually requested; the ratio of the two is the space lost
+ * to headers and fragmentation.
+ *
+ * Run it against old and new versions of libc to compare allocators.
+ *
+ * usage: mallocbench [operations-per-phase]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define NSLOTS		1024
+#define DEFOPS		50000
+
+struct phase {
+	const char *name;
+	size_t minsize;
+	size_t maxsize;
+	int largepct;		/* percent of requests drawn from large sizes */
+};
+
+static const struct phase phases[] = {
+	{ "small",  8,   256, 0 },
+	{ "large",  512, 8192, 100 },
+	{ "mixed",  8,   8192, 10 },
+};
+#define NPHASES (sizeof(phases) / sizeof(phases[0]))
+
+static void *slots[NSLOTS];
+static size_t slotsize[NSLOTS];
+
+static
+size_t
+pick(const struct phase *ph)
+{
+	size_t lo, hi;
+
+	if ((int)(random() % 100) < ph->largepct) {
+		lo = 512;
+		hi = ph->maxsize;
+	}
+	else {
+		lo = ph->minsize;
+		hi = ph->largepct == 100 ? ph->maxsize : 256;
+	}
+	return lo + random() % (hi - lo + 1);
+}
+
+static
+unsigned long
+usecs(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	return (unsigned long)(s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+runphase(const struct phase *ph, unsigned long nops)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1, i, us;
+	size_t live, peak, sz;
+	char *heapbase, *heaptop;
+	unsigned j;
+
+	srandom(350);
+	heapbase = sbrk(0);
+
+	live = peak = 0;
+	for (j = 0; j < NSLOTS; j++) {
+		sz = pick(ph);
+		slots[j] = malloc(sz);
+		if (slots[j] == NULL) {
+			errx(1, "%s: malloc of %lu failed", ph->name,
+			     (unsigned long)sz);
+		}
+		slotsize[j] = sz;
+		live += sz;
+	}
+	peak = live;
+
+	__time(&s0, &ns0);
+	for (i = 0; i < nops; i++) {
+		j = random() % NSLOTS;
+		free(slots[j]);
+		live -= slotsize[j];
+
+		sz = pick(ph);
+		slots[j] = malloc(sz);
+		if (slots[j] == NULL) {
+			errx(1, "%s: malloc of %lu failed after %lu ops",
+			     ph->name, (unsigned long)sz, i);
+		}
+		/* touch the block so it's really there */
+		((char *)slots[j])[0] = 1;
+		((char *)slots[j])[sz - 1] = 1;
+		slotsize[j] = sz;
+		live += sz;
+		if (live > peak) {
+			peak = live;
+		}
+	}
+	__time(&s1, &ns1);
+
+	heaptop = sbrk(0);
+	us = usecs(s0, ns0, s1, ns1);
+
+	printf("%-6s %8lu ops %8lu us %6lu ns/op  heap %7lu  peak live %7lu"
+	       "  overhead %3lu%%\n",
+	       ph->name, nops, us, nops ? us * 1000 / nops : 0,
+	       (unsigned long)(heaptop - heapbase), (unsigned long)peak,
+	       peak ? (unsigned long)(heaptop - heapbase) * 100 / peak - 100
+	       : 0);
+
+	for (j = 0; j < NSLOTS; j++) {
+		free(slots[j]);
+		slots[j] = NULL;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long nops;
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	nops = DEFOPS;
+	if (argc > 1 && atoi(argv[1]) > 0) {
+		nops = atoi(argv[1]);
+	}
+
+	for (i = 0; i < NPHASES; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			runphase(&phases[i], nops);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "%s phase failed", phases[i].name);
+		}
+	}
+	printf("mallocbench: done\n");
+	return 0;
+}
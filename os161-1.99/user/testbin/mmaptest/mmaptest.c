@@ -0,0 +1,263 @@
+/*
+ * mmaptest - check file mappings.
+ *
+ * Writes a test file with write(), then checks that:
+ *   - a shared mapping sees the file's contents, and stores through
+ *     it reach the file (as seen by read()) after msync;
+ *   - stores through a private mapping do not reach the file, and
+ *     do not show up in a shared mapping of the same file;
+ *   - a forked child shares the parent's shared mapping;
+ *   - unmapping the middle of a mapping leaves both ends usable;
+ *   - the part of the last page past EOF reads as zeros and is not
+ *     written back;
+ *   - read() and write() of a file into and out of its own mapping,
+ *     at pages not yet touched, work (and don't hang or panic);
+ *   - write() to a mapped file shows up in the mapping at once,
+ *     without losing stores to the rest of a dirty page, and
+ *     truncating the file zeroes the mapping.
+ *
+ * usage: mmaptest [file]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		8
+#define FILESIZE	(NPAGES * PAGE - 100)	/* last page is partial */
+
+static char buf[PAGE];
+
+static
+char
+pattern(off_t pos)
+{
+	return 'a' + (pos * 7 + pos / PAGE) % 26;
+}
+
+/* Read page PAGENUM of the file with read() into buf. */
+static
+int
+readpage(int fd, int pagenum)
+{
+	int r;
+
+	if (lseek(fd, (off_t)pagenum * PAGE, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	r = read(fd, buf, PAGE);
+	if (r < 0) {
+		err(1, "read");
+	}
+	return r;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "mmaptest.dat";
+	char *shared, *private;
+	off_t i;
+	int fd, status, r;
+	pid_t pid;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	for (i = 0; i < FILESIZE; i++) {
+		buf[i % PAGE] = pattern(i);
+		if (i % PAGE == PAGE - 1 || i == FILESIZE - 1) {
+			r = write(fd, buf, i % PAGE + 1);
+			if (r != i % PAGE + 1) {
+				err(1, "write");
+			}
+		}
+	}
+
+	shared = mmap(NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	private = mmap(NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE, fd, 0);
+	if (private == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+
+	/* contents, and zeros past EOF */
+	for (i = 0; i < NPAGES * PAGE; i++) {
+		char want = i < FILESIZE ? pattern(i) : 0;
+		if (shared[i] != want || private[i] != want) {
+			errx(1, "byte %d: wrong contents", (int)i);
+		}
+	}
+	printf("mmaptest: contents ok\n");
+
+	/* private stores stay private */
+	memset(private, 'P', PAGE);
+	if (shared[0] != pattern(0)) {
+		errx(1, "private store visible in shared mapping");
+	}
+	if (msync(private, PAGE, MS_SYNC) < 0) {
+		err(1, "msync private");
+	}
+	readpage(fd, 0);
+	if (buf[0] != pattern(0)) {
+		errx(1, "private store reached the file");
+	}
+
+	/* shared stores reach the file, but not past EOF */
+	memset(shared + PAGE, 'S', PAGE);
+	memset(shared + (NPAGES - 1) * PAGE, 'T', PAGE);
+	if (msync(shared, NPAGES * PAGE, MS_SYNC) < 0) {
+		err(1, "msync shared");
+	}
+	readpage(fd, 1);
+	if (buf[0] != 'S' || buf[PAGE - 1] != 'S') {
+		errx(1, "shared store did not reach the file");
+	}
+	r = readpage(fd, NPAGES - 1);
+	if (r != PAGE - 100) {
+		errx(1, "file size changed: last page has %d bytes", r);
+	}
+	printf("mmaptest: private and shared stores ok\n");
+
+	/* a child shares the shared mapping */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		shared[2 * PAGE] = 'C';
+		private[2 * PAGE] = 'c';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (shared[2 * PAGE] != 'C') {
+		errx(1, "child's shared store not seen by parent");
+	}
+	if (private[2 * PAGE] == 'c') {
+		errx(1, "child's private store seen by parent");
+	}
+	printf("mmaptest: fork ok\n");
+
+	/* punch a hole in the middle */
+	shared[3 * PAGE] = 'H';
+	if (munmap(shared + 3 * PAGE, 2 * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	if (shared[2 * PAGE] != 'C' || shared[5 * PAGE] != pattern(5 * PAGE)) {
+		errx(1, "partial munmap lost the ends");
+	}
+	readpage(fd, 3);
+	if (buf[0] != 'H') {
+		errx(1, "munmap did not write back");
+	}
+	if (munmap(shared, NPAGES * PAGE) < 0 ||
+	    munmap(private, NPAGES * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	printf("mmaptest: munmap ok\n");
+
+	/*
+	 * read() and write() to and from the file's own mapping. The
+	 * mapping is new, so none of these pages have been touched.
+	 */
+	shared = mmap(NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	if (pwrite(fd, shared + 4 * PAGE, PAGE, 5 * PAGE) != PAGE) {
+		err(1, "pwrite from own mapping");
+	}
+	if (pread(fd, shared + 6 * PAGE, PAGE, 5 * PAGE) != PAGE) {
+		err(1, "pread into own mapping");
+	}
+	if (pread(fd, shared + 2 * PAGE, PAGE, 2 * PAGE) != PAGE) {
+		err(1, "pread of a page onto itself");
+	}
+	for (i = 0; i < PAGE; i++) {
+		if (shared[5 * PAGE + i] != pattern(4 * PAGE + i) ||
+		    shared[6 * PAGE + i] != pattern(4 * PAGE + i)) {
+			errx(1, "byte %d: wrong contents after read()/write() "
+			     "through own mapping", (int)i);
+		}
+	}
+	if (shared[2 * PAGE] != 'C' ||
+	    shared[2 * PAGE + 1] != pattern(2 * PAGE + 1)) {
+		errx(1, "pread of a page onto itself changed it");
+	}
+	if (msync(shared, NPAGES * PAGE, MS_SYNC) < 0) {
+		err(1, "msync shared");
+	}
+	readpage(fd, 6);
+	if (buf[0] != pattern(4 * PAGE) ||
+	    buf[PAGE - 1] != pattern(5 * PAGE - 1)) {
+		errx(1, "read() into own mapping not written back");
+	}
+	if (munmap(shared, NPAGES * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	printf("mmaptest: read and write through own mapping ok\n");
+
+	/* write() and truncation are seen through a mapping */
+	shared = mmap(NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	if (shared[100] != pattern(100)) {
+		errx(1, "remapped file has wrong contents");
+	}
+	shared[6 * PAGE + 10] = 'D';
+	if (pwrite(fd, "write", 5, 100) != 5 ||
+	    pwrite(fd, "XY", 2, 6 * PAGE + 20) != 2) {
+		err(1, "pwrite");
+	}
+	if (memcmp(shared + 100, "write", 5) != 0 ||
+	    memcmp(shared + 6 * PAGE + 20, "XY", 2) != 0) {
+		errx(1, "write() not seen through the mapping");
+	}
+	if (shared[6 * PAGE + 10] != 'D') {
+		errx(1, "write() lost a store to the mapping");
+	}
+	if (msync(shared, NPAGES * PAGE, MS_SYNC) < 0) {
+		err(1, "msync shared");
+	}
+	readpage(fd, 6);
+	if (buf[10] != 'D' || buf[20] != 'X' || buf[21] != 'Y') {
+		errx(1, "writeback after write() lost data");
+	}
+	r = open(file, O_RDWR | O_TRUNC);
+	if (r < 0) {
+		err(1, "%s: truncate", file);
+	}
+	close(r);
+	if (shared[100] != 0 || shared[6 * PAGE + 10] != 0) {
+		errx(1, "truncation not seen through the mapping");
+	}
+	shared[PAGE] = 'Z';
+	if (munmap(shared, NPAGES * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	if (lseek(fd, 0, SEEK_END) != 0) {
+		errx(1, "store past EOF after truncation grew the file");
+	}
+	printf("mmaptest: write and truncate ok\n");
+
+	close(fd);
+	remove(file);
+	printf("mmaptest: passed\n");
+	return 0;
+}
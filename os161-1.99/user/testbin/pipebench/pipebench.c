@@ -0,0 +1,190 @@
+/*
+ * pipebench - pipe semantics and throughput.
+ *
+ * First checks the basics: a read on an empty non-blocking pipe fails
+ * with EAGAIN, a read returns 0 once the write end is closed and the
+ * pipe is drained, and a write fails with EPIPE once the read end is
+ * closed.
+ *
+ * Then, for each of several write sizes, a child process writes
+ * MBYTES megabytes through a pipe in writes of that size and the
+ * parent reads them back in 64k reads, checking every byte. Writes of
+ * up to a page go through the pipe's buffer; larger ones are loaned
+ * to the reader directly, so the large sizes should be noticeably
+ * faster.
+ *
+ * usage: pipebench [megabytes]
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define DEFMBYTES	4
+#define READSIZE	65536
+#define MAXWRITE	65536
+
+static const size_t writesizes[] = { 64, 512, 4096, 16384, 65536 };
+#define NSIZES (sizeof(writesizes) / sizeof(writesizes[0]))
+
+static char wbuf[MAXWRITE];
+static char rbuf[READSIZE];
+
+static
+char
+pattern(unsigned long pos)
+{
+	return 'a' + (pos * 7 + pos / 4093) % 26;
+}
+
+static
+unsigned long
+usecs(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	return (unsigned long)(s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+checkbasics(void)
+{
+	int fds[2], on;
+	char c;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	on = 1;
+	if (ioctl(fds[0], FIONBIO, &on) < 0) {
+		err(1, "ioctl FIONBIO");
+	}
+	if (read(fds[0], &c, 1) >= 0 || errno != EAGAIN) {
+		errx(1, "read on an empty non-blocking pipe did not fail "
+		     "with EAGAIN");
+	}
+	if (write(fds[1], "x", 1) != 1) {
+		err(1, "write");
+	}
+	close(fds[1]);
+	if (read(fds[0], &c, 1) != 1 || c != 'x') {
+		errx(1, "read did not get the byte written");
+	}
+	if (read(fds[0], &c, 1) != 0) {
+		errx(1, "read after the write end closed did not return 0");
+	}
+	close(fds[0]);
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	if (write(fds[1], "x", 1) >= 0 || errno != EPIPE) {
+		errx(1, "write with the read end closed did not fail "
+		     "with EPIPE");
+	}
+	close(fds[1]);
+	printf("pipebench: semantics ok\n");
+}
+
+static
+void
+writer(int fd, size_t wsize, unsigned long total)
+{
+	unsigned long pos;
+	size_t len, i;
+	ssize_t r;
+
+	for (pos = 0; pos < total; pos += len) {
+		len = total - pos < wsize ? total - pos : wsize;
+		for (i = 0; i < len; i++) {
+			wbuf[i] = pattern(pos + i);
+		}
+		r = write(fd, wbuf, len);
+		if (r != (ssize_t)len) {
+			err(1, "write of %lu at %lu returned %ld",
+			    (unsigned long)len, pos, (long)r);
+		}
+	}
+}
+
+static
+void
+runsize(size_t wsize, unsigned long total)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1, pos, us;
+	int fds[2], status;
+	ssize_t r, i;
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		writer(fds[1], wsize, total);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	pos = 0;
+	while ((r = read(fds[0], rbuf, READSIZE)) > 0) {
+		for (i = 0; i < r; i++) {
+			if (rbuf[i] != pattern(pos + i)) {
+				errx(1, "%lu-byte writes: byte %lu is wrong",
+				     (unsigned long)wsize, pos + i);
+			}
+		}
+		pos += r;
+	}
+	if (r < 0) {
+		err(1, "read");
+	}
+	__time(&s1, &ns1);
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%lu-byte writes: writer failed",
+		     (unsigned long)wsize);
+	}
+	if (pos != total) {
+		errx(1, "%lu-byte writes: read %lu bytes, expected %lu",
+		     (unsigned long)wsize, pos, total);
+	}
+
+	us = usecs(s0, ns0, s1, ns1);
+	printf("pipebench: %6lu-byte writes: %lu.%03lu s, %lu KB/s\n",
+	       (unsigned long)wsize, us / 1000000, (us / 1000) % 1000,
+	       us > 0 ? (unsigned long)((total / 1024) * 1000000ULL / us) : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long total;
+	unsigned i;
+
+	total = (argc > 1 ? atoi(argv[1]) : DEFMBYTES) * 1024UL * 1024UL;
+
+	checkbasics();
+	for (i = 0; i < NSIZES; i++) {
+		runsize(writesizes[i], total);
+	}
+	printf("pipebench: passed\n");
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * argbench - time execv with a large argument vector.
+ *
+ *  relies on fork, execv, waitpid, __time
+ *
+ *  The parent repeatedly forks a child that execs this same program
+ *  with NARGS arguments of ARGLEN bytes each; the exec'd copy checks
+ *  that every argument arrived intact and exits. The parent reports
+ *  the average time per fork+exec+wait.
+ *
+ *  usage: argbench [iterations]
+ *
+ *  Run /uw-testbin/argtest alongside this to check argument layout
+ *  on the user stack.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#define NARGS   256
+#define ARGLEN  100
+#define DEFITER 20
+
+static char argstore[NARGS][ARGLEN];
+static char *xargv[NARGS + 2];
+
+static
+void
+fillargs(void)
+{
+  int i, j;
+
+  xargv[0] = (char *)"argbench";
+  for (i = 0; i < NARGS; i++) {
+    for (j = 0; j < ARGLEN - 1; j++) {
+      argstore[i][j] = 'a' + (i + j) % 26;
+    }
+    argstore[i][ARGLEN - 1] = 0;
+    xargv[i + 1] = argstore[i];
+  }
+  xargv[NARGS + 1] = NULL;
+}
+
+/*
+ * argv[0] is the program name from execv, argv[1] is our own
+ * "argbench", and the generated arguments follow.
+ */
+static
+int
+checkargs(int argc, char **argv)
+{
+  int i;
+
+  if (argc != NARGS + 2) {
+    return 1;
+  }
+  for (i = 0; i < NARGS; i++) {
+    if (strcmp(argv[i + 2], argstore[i]) != 0) {
+      return 2;
+    }
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  time_t s0, s1;
+  unsigned long ns0, ns1;
+  unsigned long long elapsed;
+  int i, iters, status, bad;
+  pid_t pid;
+
+  fillargs();
+
+  if (argc > 1 && strcmp(argv[1], "argbench") == 0) {
+    /* exec'd child */
+    _exit(checkargs(argc, argv));
+  }
+
+  iters = (argc > 1) ? atoi(argv[1]) : DEFITER;
+  if (iters <= 0) {
+    iters = DEFITER;
+  }
+
+  bad = 0;
+  __time(&s0, &ns0);
+  for (i = 0; i < iters; i++) {
+    pid = fork();
+    if (pid < 0) {
+      err(1, "fork");
+    }
+    if (pid == 0) {
+      execv("/uw-testbin/argbench", xargv);
+      err(1, "/uw-testbin/argbench");
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+      err(1, "waitpid");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      bad++;
+    }
+  }
+  __time(&s1, &ns1);
+
+  elapsed = (unsigned long long)(s1 - s0) * 1000000000ULL + ns1 - ns0;
+  printf("argbench: %d execs, %d args x %d bytes\n", iters, NARGS, ARGLEN);
+  printf("argbench: %lu us per exec\n",
+	 (unsigned long)(elapsed / 1000 / iters));
+  if (bad) {
+    printf("argbench: %d execs saw corrupted arguments\n", bad);
+    return 1;
+  }
+  printf("argbench: passed\n");
+  return 0;
+}